@@ -0,0 +1,292 @@
+#include "kperfdata/kperfdata.h"
+#include "kperfdata/kperfdata_synth.h"
+
+#include <benchmark/benchmark.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <tuple>
+#include <vector>
+
+using namespace kperfdata;
+
+#ifndef TEST_DIR
+#define TEST_DIR "../../test/data/"
+#endif
+
+// The synthetic traces by (version, is64bit, thread_count, megabytes of kd_buf[]), generated once
+struct Trace {
+  std::unique_ptr<char, decltype(&free)> bytes{nullptr, &free};
+  size_t size = 0;
+  uint64_t kd_buf_count = 0;
+};
+
+static const Trace& GetTrace(int version, int is64bit, uint32_t thread_count, int64_t megabytes) {
+  static std::map<std::tuple<int, int, uint32_t, int64_t>, Trace> traces;
+  Trace& trace = traces[std::make_tuple(version, is64bit, thread_count, megabytes)];
+  if (!trace.bytes) {
+    kpdecode_synth_options options;
+    kpdecode_synth_default_options(&options);
+    options.version = version;
+    options.is64bit = is64bit;
+    options.thread_count = thread_count;
+    options.kd_buf_count =
+        (uint64_t)megabytes * 1024 * 1024 / (is64bit ? sizeof(kd_buf_64) : sizeof(kd_buf_32));
+    trace.bytes.reset(kpdecode_synth_generate(&options, &trace.size));
+    trace.kd_buf_count = options.kd_buf_count;
+  }
+  return trace;
+}
+
+static void SetCounters(benchmark::State& state, size_t bytes, uint64_t kevents) {
+  state.SetBytesProcessed((int64_t)(state.iterations() * bytes));
+  state.SetItemsProcessed((int64_t)(state.iterations() * kevents));  // kevents per second
+}
+
+// Decode the records through kpdecode_cursor_next_records()
+static size_t DecodeRecords(const char* bytes, size_t size, int option) {
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  kpdecode_cursor_set_option(cursor, 1, option);
+  kpdecode_cursor_setchunk(cursor, bytes, size);
+  kpdecode_record* records[256];
+  size_t record_count = 0;
+  while (true) {
+    size_t count = 0;
+    long ret = kpdecode_cursor_next_records(cursor, records, 256, &count);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != KPERFDATA_RET_OK) {
+      break;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      kpdecode_record_free(records[i]);
+    }
+    record_count += count;
+  }
+  kpdecode_cursor_free(cursor);
+  return record_count;
+}
+
+// Read the kevents through kpdecode_cursor_next_kevents(), without decoding records
+static uint64_t ReadKevents(const char* bytes, size_t size) {
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  kpdecode_cursor_setchunk(cursor, bytes, size);
+  const kd_buf* kevents = NULL;
+  size_t count = 0;
+  uint64_t checksum = 0;
+  while (kpdecode_cursor_next_kevents(cursor, &kevents, SIZE_MAX, &count) == KPERFDATA_RET_OK) {
+    for (size_t i = 0; i < count; ++i) {
+      checksum += kevents[i].debugid;
+    }
+  }
+  kpdecode_cursor_free(cursor);
+  return checksum;
+}
+
+// args: version, is64bit, option, megabytes
+static void BM_NextRecords(benchmark::State& state) {
+  const Trace& trace = GetTrace((int)state.range(0), (int)state.range(1), 256, state.range(3));
+  if (!trace.bytes) {
+    state.SkipWithError("can not generate the trace");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DecodeRecords(trace.bytes.get(), trace.size, (int)state.range(2)));
+  }
+  SetCounters(state, trace.size, trace.kd_buf_count);
+}
+BENCHMARK(BM_NextRecords)
+    ->ArgNames({"version", "is64bit", "option", "MB"})
+    ->Args({2, 1, 0, 64})
+    ->Args({2, 1, 1, 64})
+    ->Args({2, 0, 0, 64})
+    ->Args({2, 0, 1, 64})
+    ->Args({1, 1, 0, 64})
+    ->Unit(benchmark::kMillisecond);
+
+// args: version, is64bit, megabytes
+static void BM_NextKevents(benchmark::State& state) {
+  const Trace& trace = GetTrace((int)state.range(0), (int)state.range(1), 256, state.range(2));
+  if (!trace.bytes) {
+    state.SkipWithError("can not generate the trace");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(ReadKevents(trace.bytes.get(), trace.size));
+  }
+  SetCounters(state, trace.size, trace.kd_buf_count);
+}
+BENCHMARK(BM_NextKevents)
+    ->ArgNames({"version", "is64bit", "MB"})
+    ->Args({2, 1, 256})
+    ->Args({2, 0, 256})
+    ->Args({1, 1, 256})
+    ->Unit(benchmark::kMillisecond);
+
+// The pending records ring of the cursor holds pointers to the records. Holding the records inline
+// would save the pointer hop, but the records are handed out to the caller, who owns them, so each
+// one would be copied out of the ring; and the handlers keep pointers to the pending ones, e.g. the
+// pending sample of a cpu, which a growing ring would move. This compares the two on the decoder
+// pattern: fill the hot fields of KPERFDATA_RECORD_RING_SIZE records, then hand them out in order.
+template <typename Record, bool kInline>
+static void BM_PendingRing(benchmark::State& state) {
+  const size_t count = KPERFDATA_RECORD_RING_SIZE;
+  std::vector<Record> records(count);  // the record pool, or the inline ring
+  std::vector<Record*> ring(count);
+  Record out;
+  memset(&out, 0, sizeof(out));
+  memset(records.data(), 0, sizeof(Record) * count);
+  uint64_t checksum = 0;
+  for (auto _ : state) {
+    for (size_t i = 0; i < count; ++i) {
+      Record* record = &records[i];
+      record->timestamp = i;
+      record->ready = true;
+      if (!kInline) {
+        ring[i] = record;
+      }
+    }
+    for (size_t i = 0; i < count; ++i) {
+      const Record* record = kInline ? &records[i] : ring[i];
+      if (kInline) {
+        memcpy(&out, record, sizeof(Record));  // handed out to the caller
+        record = &out;
+      }
+      checksum += record->ready ? record->timestamp : 0;
+    }
+    benchmark::DoNotOptimize(checksum);
+  }
+  state.SetItemsProcessed((int64_t)(state.iterations() * count));
+}
+BENCHMARK_TEMPLATE(BM_PendingRing, kpdecode_record, false);
+BENCHMARK_TEMPLATE(BM_PendingRing, kpdecode_record, true);
+BENCHMARK_TEMPLATE(BM_PendingRing, kpdecode_slim_record, false);
+BENCHMARK_TEMPLATE(BM_PendingRing, kpdecode_slim_record, true);
+
+// A large kd_threadmap[] and few kevents, the header and threadmap dominate. args: thread_count
+static void BM_Threadmap(benchmark::State& state) {
+  const Trace& trace = GetTrace(2, 1, (uint32_t)state.range(0), 1);
+  if (!trace.bytes) {
+    state.SkipWithError("can not generate the trace");
+    return;
+  }
+  for (auto _ : state) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_TASK_NAMES, 1);
+    kpdecode_cursor_setchunk(cursor, trace.bytes.get(), trace.size);
+    // every threadmap entry is a record, then the task names are looked up by the samples
+    kpdecode_record* record = NULL;
+    long ret;
+    while ((ret = kpdecode_cursor_next_record(cursor, &record)) == KPERFDATA_RET_OK ||
+           ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      if (ret == KPERFDATA_RET_OK) {
+        kpdecode_record_free(record);
+      }
+    }
+    kpdecode_cursor_free(cursor);
+  }
+  SetCounters(state, trace.size, trace.kd_buf_count + (uint64_t)state.range(0));
+}
+BENCHMARK(BM_Threadmap)
+    ->ArgName("threads")
+    ->Arg(1024)
+    ->Arg(65536)
+    ->Arg(1048576)
+    ->Unit(benchmark::kMillisecond);
+
+// Samples with the kernel and user callstacks of args frames each, 64MB of kd_buf_64[]
+static void BM_Callstacks(benchmark::State& state) {
+  static std::map<int64_t, Trace> traces;
+  Trace& trace = traces[state.range(0)];
+  if (!trace.bytes) {
+    kpdecode_synth_options options;
+    kpdecode_synth_default_options(&options);
+    options.callstack_frames = (uint32_t)state.range(0);
+    options.kd_buf_count = (uint64_t)64 * 1024 * 1024 / sizeof(kd_buf_64);
+    trace.bytes.reset(kpdecode_synth_generate(&options, &trace.size));
+    trace.kd_buf_count = options.kd_buf_count;
+  }
+  if (!trace.bytes) {
+    state.SkipWithError("can not generate the trace");
+    return;
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DecodeRecords(trace.bytes.get(), trace.size, 0));
+  }
+  SetCounters(state, trace.size, trace.kd_buf_count);
+}
+BENCHMARK(BM_Callstacks)
+    ->ArgName("frames")
+    ->Arg(0)
+    ->Arg(16)
+    ->Arg(128)
+    ->Unit(benchmark::kMillisecond);
+
+// The records of the RAW file of the tests
+static void BM_TestData(benchmark::State& state) {
+  FILE* file = fopen(TEST_DIR "coreprofilesessiontap.bin", "rb");
+  if (!file) {
+    state.SkipWithError("can not open the test data");
+    return;
+  }
+  fseek(file, 0, SEEK_END);
+  size_t size = (size_t)ftell(file);
+  fseek(file, 0, SEEK_SET);
+  std::unique_ptr<char, decltype(&free)> bytes((char*)malloc(size), &free);
+  size = fread(bytes.get(), 1, size, file);
+  fclose(file);
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(DecodeRecords(bytes.get(), size, (int)state.range(0)));
+  }
+  state.SetBytesProcessed((int64_t)(state.iterations() * size));
+}
+BENCHMARK(BM_TestData)->ArgName("option")->Arg(0)->Arg(1);
+
+// A RAW file on disk, e.g. written by kperfdata_synth at GB scale, set by KPERFDATA_BENCH_FILE.
+// args: the flags of kpdecode_cursor_open_file()
+static void BM_File(benchmark::State& state) {
+  const char* path = getenv("KPERFDATA_BENCH_FILE");
+  if (!path) {
+    state.SkipWithError("KPERFDATA_BENCH_FILE is not set");
+    return;
+  }
+  size_t size = 0;
+  for (auto _ : state) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    if (kpdecode_cursor_open_file(cursor, path, (int)state.range(0)) != KPERFDATA_RET_OK) {
+      kpdecode_cursor_free(cursor);
+      state.SkipWithError("can not open KPERFDATA_BENCH_FILE");
+      return;
+    }
+    kpdecode_record* records[256];
+    while (true) {
+      size_t count = 0;
+      long ret = kpdecode_cursor_next_records(cursor, records, 256, &count);
+      if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+        continue;
+      }
+      if (ret != KPERFDATA_RET_OK) {
+        break;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        kpdecode_record_free(records[i]);
+      }
+    }
+    size = (size_t)(cursor->stream_offset);
+    kpdecode_cursor_free(cursor);
+  }
+  state.SetBytesProcessed((int64_t)(state.iterations() * size));
+}
+BENCHMARK(BM_File)
+    ->ArgName("flags")
+    ->Arg(0)
+    ->Arg(KPERFDATA_OPEN_FILE_READ_AHEAD)
+    ->Arg(KPERFDATA_OPEN_FILE_READ_AHEAD | KPERFDATA_OPEN_FILE_NO_IO_URING)
+    ->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
@@ -76,6 +76,15 @@ typedef struct {
   char command[20];                                   // +0x0c, size=0x14, process name
 } kd_threadmap_64;                                    // size=0x20, align=0x08
 
+/**
+ * thread of the kd_threadmap[], see kpdecode_cursor_lookup_thread()
+ */
+typedef struct {
+  uint64_t tid;                                       // +0x00, size=0x08, the thread ID
+  int pid;                                            // +0x08, size=0x04, 1: kernel_task, otherwise the PID
+  char command[20];                                   // +0x0c, size=0x14, process name, not NUL-terminated if 20 chars
+} kpdecode_thread;                                    // size=0x20, align=0x08
+
 /**
  * kd_buf (32-bit)
  */
@@ -162,7 +171,7 @@ typedef struct {
   unsigned long long counterv[32];                    // +0x08, size=0x100, #define KPC_MAX_COUNTERS 32
 } kpdecode_pmc;                                       // size=0x108, kpcdata
 
-typedef struct {
+typedef struct kpdecode_record {
   unsigned long long flags;                           // +0x00, size=0x08
   unsigned long long timestamp;                       // +0x08, size=0x08
   unsigned long long tid;                             // +0x10, size=0x08
@@ -324,15 +333,207 @@ typedef struct {
 
   uint32_t ready;                                     // +0x1498, size=?, whether this record is ready(1) or not(0)
   // ...
-  struct kpdecode_record* next;                       // +0x14A0, size=0x08, the next item of linked list
+  struct kpdecode_record* next;                       // +0x14A0, size=0x08, the next item of the free list of kpdecode_record_pool
   // +0x14A8, size=0x04, current_kernel_callstack_count
   // +0x14AC, size=0x04, current_user_callstack_count
   // +0x14B0, pmc_counters_count
   // +0x14B4, TODO:
   unsigned long long total_size_of_kevents;           // +0x14B8, cursor.size_of_kd_buf * cursor.kevent_count
 
+  // libkperfdata extensions:
+  struct kpdecode_record_pool* pool;                  // the pool which owns this record, NULL if allocated by calloc()
+  struct kpdecode_slim_record* slim;                  // the slim record waiting for this record, slim mode only
+  uint32_t ucallstack_id;                             // the ucallstack in the stack table, 0 for none, KPERFDATA_OPTION_INTERN_STACKS
+  uint32_t kcallstack_id;                             // the kcallstack in the stack table, 0 for none, KPERFDATA_OPTION_INTERN_STACKS
+
 } kpdecode_record; // size= 0x14C0
 
+/**
+ * kpdecode_slim_record
+ *
+ * The compact form of kpdecode_record, used when KPERFDATA_OPTION_SLIM_RECORDS is set.
+ * The hot fields fit in two cache lines, callstacks and pmc counters point into a side buffer
+ * owned by the cursor and only take `nframes` and `counterc` entries. With
+ * KPERFDATA_OPTION_INTERN_STACKS, the callstacks point into the stack table of the cursor instead.
+ */
+typedef struct kpdecode_slim_record {
+  unsigned long long flags;                           // +0x00, size=0x08, kpdecode_record.flags
+  unsigned long long timestamp;                       // +0x08, size=0x08, kpdecode_record.timestamp
+  unsigned long long tid;                             // +0x10, size=0x08, kpdecode_record.tid
+  int cpuid;                                          // +0x18, size=0x04, kpdecode_record.cpuid
+  unsigned int debugid;                               // +0x1C, size=0x04, kpdecode_record.kd_buf.debugid
+  unsigned long long args[4];                         // +0x20, size=0x20, kpdecode_record.kd_buf.args
+  unsigned int actionid;                              // +0x40, size=0x04, kpdecode_record.kperf_sample_args.actionid
+  int pid;                                            // +0x44, size=0x04, kpdecode_record.kperf_thread_info.kpthi_pid
+  unsigned int ucallstack_flags;                      // +0x48, size=0x04, kpdecode_record.ucallstack.flags
+  unsigned int ucallstack_nframes;                    // +0x4C, size=0x04, kpdecode_record.ucallstack.nframes
+  unsigned int kcallstack_flags;                      // +0x50, size=0x04, kpdecode_record.kcallstack.flags
+  unsigned int kcallstack_nframes;                    // +0x54, size=0x04, kpdecode_record.kcallstack.nframes
+  const unsigned long long* ucallstack_frames;        // +0x58, size=0x08, ucallstack_nframes entries
+  const unsigned long long* kcallstack_frames;        // +0x60, size=0x08, kcallstack_nframes entries
+  const unsigned long long* pmc_counterv;             // +0x68, size=0x08, pmc_counterc entries
+  int pmc_counterc;                                   // +0x70, size=0x04, kpdecode_record.pmc_counters.counterc
+  uint32_t ready;                                     // +0x74, size=0x04, whether this record is ready(1) or not(0)
+  unsigned long long last_timestamp;                  // +0x78, size=0x08, kpdecode_record.unknown_field20.unknown_field1
+  // end of the hot fields
+
+  kpdecode_record* pending;                           // +0x80, size=0x08, the record still being decoded, or NULL
+  struct kpdecode_slim_chunk* chunk;                  // +0x88, size=0x08, the side buffer chunk of this header
+  struct kpdecode_slim_chunk* side_chunk;             // +0x90, size=0x08, the side buffer chunk of the frames and counters
+  unsigned long long total_size_of_kevents;           // +0x98, size=0x08, kpdecode_record.total_size_of_kevents
+  uint32_t ucallstack_id;                             // +0xA0, size=0x04, kpdecode_record.ucallstack_id
+  uint32_t kcallstack_id;                             // +0xA4, size=0x04, kpdecode_record.kcallstack_id
+} kpdecode_slim_record;                               // size=0xA8
+
+/**
+ * kpdecode_record_slot
+ *
+ * A slot of the pending records ring, holds a kpdecode_slim_record in slim mode.
+ */
+typedef union {
+  kpdecode_record* record;
+  kpdecode_slim_record* slim_record;
+} kpdecode_record_slot;
+
+/**
+ * kpdecode_columns
+ *
+ * A block of records or kevents in columns, see kpdecode_cursor_next_columns(). The columns are
+ * allocated by kpdecode_columns_create(), or by the caller, who zeroes the struct first. A NULL
+ * column is not filled. The frames of the row `i` are frames[offsets[i]] to
+ * frames[offsets[i + 1] - 1].
+ */
+typedef struct {
+  size_t capacity;                                    // the rows of each column
+  size_t count;                                       // the rows filled
+  uint64_t* timestamps;
+  uint64_t* tids;
+  uint32_t* cpuids;
+  uint32_t* debugids;
+  uint64_t* flags;                                    // 0 for the kevents
+  uint64_t* args[4];                                  // arg1 to arg4
+  uint32_t* ucallstack_offsets;                       // capacity + 1 entries, records only
+  uint64_t* ucallstack_frames;                        // frames_capacity entries
+  uint32_t* kcallstack_offsets;                       // capacity + 1 entries, records only
+  uint64_t* kcallstack_frames;                        // frames_capacity entries
+  size_t frames_capacity;
+  size_t ucallstack_frame_count;                      // the frames filled
+  size_t kcallstack_frame_count;
+  kpdecode_record_slot carry;                         // the record which did not fit in the frames
+  uint32_t carry_slim;                                // value=0/1, whether carry is a slim record
+  uint32_t owned;                                     // value=0/1, allocated by kpdecode_columns_create()
+  long deferred_ret;                                  // a failure after the rows filled, returned by the next block
+} kpdecode_columns;
+
+/**
+ * kpdecode_record_pool
+ *
+ * A slab allocator of kpdecode_record, shared by one or more cursors.
+ */
+typedef struct kpdecode_record_pool kpdecode_record_pool;
+
+/**
+ * kpdecode_cpu
+ *
+ * The per-cpu state of the cursor, the entries of the per-cpu arrays of kperfdata.framework
+ * gathered in one cache line.
+ */
+typedef struct {
+  kpdecode_record* unknown_c8;                        // +0x00, size=0x08, the pending sample, last_record_pre_cpu? (thread info sched map?)
+  kpdecode_record* unknown_2c8;                       // +0x08, size=0x08, last_record_pre_cpu? (cpuid string1 map, global string(TRACE_STRING_GLOBAL)?)
+  kpdecode_record* unknown_4c8;                       // +0x10, size=0x08, cpuid string2 map
+  uint64_t unknown_6c8;                               // +0x18, size=0x08, cpuid string3 map, thread name?
+  uint64_t unknown_8c8;                               // +0x20, size=0x08, last_timestamp_pre_cpu?
+  uint64_t unknown_ac8;                               // +0x28, size=0x08, kevent_count_pre_cpu?
+  uint32_t kcallstack_left;                           // +0x30, size=0x04, the frames of the kcallstack of unknown_c8 still expected
+  uint32_t ucallstack_left;                           // +0x34, size=0x04, the frames of the ucallstack of unknown_c8 still expected
+  uint64_t padding;                                   // +0x38, size=0x08
+} kpdecode_cpu;                                       // size=0x40, one cache line
+
+/**
+ * kpdecode_chunk
+ *
+ * A chunk given to kpdecode_cursor_setchunk(), attached, queued or fully decoded.
+ */
+typedef struct kpdecode_chunk kpdecode_chunk;
+
+/**
+ * kpdecode_reorder
+ *
+ * The per-cpu runs of ready records merged by timestamp, see KPERFDATA_OPTION_REORDER_WINDOW.
+ */
+typedef struct kpdecode_reorder kpdecode_reorder;
+
+/**
+ * kpdecode_threadmap
+ *
+ * The kd_threadmap[] hashed by thread ID, built once with the header.
+ */
+typedef struct kpdecode_threadmap kpdecode_threadmap;
+
+/**
+ * kpdecode_compact_writer, kpdecode_compact_reader
+ *
+ * The compact record format, see kpdecode_compact_writer_create().
+ */
+typedef struct kpdecode_compact_writer kpdecode_compact_writer;
+typedef struct kpdecode_compact_reader kpdecode_compact_reader;
+
+/**
+ * kpdecode_stack_table
+ *
+ * The unique callstacks by stack ID, see KPERFDATA_OPTION_INTERN_STACKS.
+ */
+typedef struct kpdecode_stack_table kpdecode_stack_table;
+
+/**
+ * kpdecode_file_source
+ *
+ * The buffers of a RAW file read ahead of the decoding, see KPERFDATA_OPEN_FILE_READ_AHEAD.
+ */
+typedef struct kpdecode_file_source kpdecode_file_source;
+
+/**
+ * kpdecode_decompressor
+ *
+ * The frames of a compressed RAW file decompressed ahead of the decoding.
+ */
+typedef struct kpdecode_decompressor kpdecode_decompressor;
+
+/**
+ * kpdecode_dispatch
+ *
+ * The kevent handlers of a cursor, by class and subclass, see kpdecode_cursor_add_kevent_handler().
+ */
+typedef struct kpdecode_dispatch kpdecode_dispatch;
+
+/**
+ * kpdecode_pipeline
+ *
+ * A thread decoding the records of a cursor ahead of the threads consuming them.
+ */
+typedef struct kpdecode_pipeline kpdecode_pipeline;
+
+/**
+ * kpdecode_aggregate
+ *
+ * The sample counts and pmc sums by thread, cpu and callstack, see kpdecode_aggregate_create().
+ */
+typedef struct kpdecode_aggregate kpdecode_aggregate;
+
+/**
+ * kpdecode_aggregate_entry
+ *
+ * The samples of a thread, a cpu or a callstack.
+ */
+typedef struct kpdecode_aggregate_entry {
+  uint64_t key;                                       // the tid, the cpuid, or KPERFDATA_AGGREGATE_STACK_KEY()
+  uint64_t samples;                                   // the number of samples
+  uint64_t lost_samples;                              // the samples with KPERFDATA_RECORD_FLAG_LOST
+  int pmc_counterc;                                   // the max pmc_counters.counterc of the samples
+  unsigned long long pmc_sums[KPERFDATA_AGGREGATE_MAX_COUNTERS];  // the sums of pmc_counters.counterv
+} kpdecode_aggregate_entry;
+
 /**
  * kpdecode_cursor
  */
@@ -365,25 +566,85 @@ typedef struct {
   //  uint64_t unused;                                // +0xa0(160), size=0x08
   //}
   uint64_t threadmap_decoded;                         // +0xA8(168),   size=0x08,  value=0/1, , whether the threadmap has been decoded(1) or not(0)
-  kpdecode_record* kpdeocde_record_head;              // +0xB0(176),   size=0x08,  pointer to the first kpdecode_record
-  kpdecode_record* kpdecode_record_tail;              // +0xB8(184),   size=0x08,  pointer to the last  kpdecode_record
+  kpdecode_record_slot* record_ring;                  // +0xB0(176),   size=0x08,  the pending records, a linked list in kperfdata.framework
+  uint32_t record_ring_head;                          // +0xB8(184),   size=0x04,  index of the first pending record
+  uint32_t record_ring_mask;                          // +0xBC(188),   size=0x04,  capacity of record_ring - 1
   uint32_t kevent_count;                              // +0xC0(192),   size=0x04,  count of the kevents
   uint32_t kpdecode_record_count;                     // +0xC4(196),   size=0x04,  size of kpdecode_records
-  kpdecode_record* unknown_c8[64];                    // +0xC8(200),   size=0x200, last_record_pre_cpu? (thread info sched map?)
-  kpdecode_record* unknown_2c8[64];                   // +0x2C8(712),  size=0x200, last_record_pre_cpu? (cpuid string1 map, global string(TRACE_STRING_GLOBAL)?)
-  kpdecode_record* unknown_4c8[64];                   // +0x4C8(1224), size=0x200, cpuid string2 map
-  uint64_t unknown_6c8[64];                           // +0x6C8(1736), size=0x200, cpuid string3 map, thread name?
-  uint64_t unknown_8c8[64];                           // +0x8C8(2248), size=0x200, last_timestamp_pre_cpu?
-  uint64_t unknown_ac8[64];                           // +0xAC8(2760), size=0x200, kevent_count_pre_cpu?
+  kpdecode_cpu* cpus;                                 // +0xC8(200),   the per-cpu arrays +0xC8 to +0xCC8 of kperfdata.framework, one kpdecode_cpu per cpu
+  uint32_t cpu_count;                                 // the entries of cpus, grown with the max cpuid of the kevents, up to KPERFDATA_MAX_CPUS
+  void* cpus_allocation;                              // the allocation holding the cache line aligned cpus
   // ...
   // ...
   uint32_t unknown_cc8;                               // +0xCC8(3272), size=0x04?, the max number of kevent_count_pre_cpu?
   // ...
   uint32_t unknown_option;                            // +0xCDC(3292), size=0x04, value=0/1
+
+  // libkperfdata extensions:
+  kpdecode_record_pool* record_pool;                  // the pool to allocate records from, NULL to use calloc()
+  uint32_t slim_records;                              // value=0/1, KPERFDATA_OPTION_SLIM_RECORDS
+  struct kpdecode_slim_chunk* slim_chunk;             // the current side buffer chunk, slim mode only
+  kpdecode_chunk* attached_chunk;                     // the node of the attached chunk, NULL if none
+  kpdecode_chunk* chunk_queue_head;                   // the chunks received after the attached one
+  kpdecode_chunk* chunk_queue_tail;
+  kpdecode_chunk* consumed_chunk_head;                // the chunks fully decoded, see kpdecode_cursor_popchunk()
+  kpdecode_chunk* consumed_chunk_tail;
+  char* header_buffer;                                // the copy of RAW_header and kd_threadmap[]
+  uint64_t skip_size;                                 // bytes of padding still to skip before the first kd_buf
+  uint64_t stream_offset;                             // bytes decoded since the beginning of the RAW file
+  kd_buf_64 kd_buf_carry;                             // the kd_buf which straddles two chunks
+  void* file_map;                                     // the file mapped by kpdecode_cursor_open_file()
+  uint64_t file_map_size;                             // size of the file mapping
+  void* file_map_handle;                              // the file mapping object on Windows
+  kd_buf_64* kd_buf_staging;                          // the widened kd_buf_32 block, 32-bit only
+  uint32_t staging_index;                             // the next kd_buf in kd_buf_staging
+  uint32_t staging_count;                             // the number of kd_buf in kd_buf_staging
+  void (*widen_kd_buf_32)(kd_buf_64*, const kd_buf_32*, size_t);  // SIMD kernel chosen at runtime
+  kpdecode_record* seek_pending;                      // the samples started before kpdecode_cursor_seek_time()
+  kpdecode_threadmap* threadmap;                      // the kd_threadmap[] by thread ID, see kpdecode_cursor_lookup_thread()
+  uint32_t threadmap_thread_count;                     // the valid entries of the kd_threadmap[]
+  uint32_t skip_threadmap;                            // value=0/1, KPERFDATA_OPTION_SKIP_THREADMAP
+  uint32_t fill_task_names;                           // value=0/1, KPERFDATA_OPTION_TASK_NAMES
+  kpdecode_reorder* reorder;                          // NULL unless KPERFDATA_OPTION_REORDER_WINDOW
+  uint64_t reorder_window;                            // KPERFDATA_OPTION_REORDER_WINDOW
+  uint32_t input_finished;                            // value=0/1, see kpdecode_cursor_finish()
+  uint32_t debugid_filter_masks[KPERFDATA_MAX_DEBUGID_FILTERS];
+  uint32_t debugid_filter_values[KPERFDATA_MAX_DEBUGID_FILTERS];
+  uint32_t debugid_filter_count;                      // 0: no filter, every kevent is decoded
+  size_t (*scan_debugids)(const kd_buf_64*, size_t, const uint32_t*, const uint32_t*, uint32_t,
+                          int);                       // SIMD kernel chosen at runtime
+  kpdecode_stack_table* stacks;                       // NULL until KPERFDATA_OPTION_INTERN_STACKS is first set
+  uint32_t intern_stacks;                             // value=0/1, KPERFDATA_OPTION_INTERN_STACKS
+  kpdecode_file_source* source;                       // NULL unless KPERFDATA_OPEN_FILE_READ_AHEAD
+  kpdecode_decompressor* decompressor;                // NULL unless the file opened is compressed
+  kpdecode_dispatch* dispatch;                        // NULL for the built-in kevent handlers only
+  long deferred_ret;                                  // a failure after a partial batch, returned by the next batch
 } kpdecode_cursor;                                    // sizeof=0xce0(3296)
 
 // clang-format on
 
+/**
+ * kpdecode_kevent_handler
+ *
+ * Decode a kevent into the record allocated for it, see kpdecode_cursor_add_kevent_handler(). The
+ * timestamp of the record is set, and its debugid, args, tid and cpuid too with option 1. While
+ * the handler runs, `cpu->unknown_8c8` is still the timestamp of the previous kevent of the cpu.
+ *
+ * Once the handler returns, the record is appended to the pending records if its flags are set,
+ * and released otherwise. It's returned once `record->ready` is set, possibly by a later kevent.
+ *
+ * @param cursor the cursor
+ * @param cpu the per-cpu state of the kevent
+ * @param record the record of the kevent
+ * @param kevent the kevent
+ * @param context the context given to kpdecode_cursor_add_kevent_handler()
+ * @return ret: 0 for success, KPERFDATA_RET_SAMPLE_PENDING to stop decoding before the next kevent
+ * (a sample starts while another one is pending), otherwise for failure
+ */
+typedef long (*kpdecode_kevent_handler)(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                        kpdecode_record* record, const kd_buf* kevent,
+                                        void* context);
+
 /**
  * Create a new cursor to decode kperf data
  *
@@ -401,10 +662,15 @@ KPERFDATA_EXPORT void kpdecode_cursor_free(kpdecode_cursor* cursor);
 /**
  * Set a chunk buffer to the cursor
  *
+ * The RAW file can be split into chunks of any size, if a chunk is already attached, the new one
+ * is queued after it. The header, a kd_threadmap or a kd_buf can straddle two chunks.
+ * The chunk must stay valid until it's returned by kpdecode_cursor_popchunk() or
+ * kpdecode_cursor_clearchunk(). It still belongs to the caller, who releases it once returned.
+ *
  * @param cursor the cursor
  * @param bytes chunk buffer
  * @param size size of buffer
- * @return ret: 0 for success, -1 for failure
+ * @return ret: 0 for success, 2 for OOM when the chunk can not be queued
  */
 KPERFDATA_EXPORT long kpdecode_cursor_setchunk(kpdecode_cursor* cursor, const char* bytes,
                                                size_t size);
@@ -412,11 +678,81 @@ KPERFDATA_EXPORT long kpdecode_cursor_setchunk(kpdecode_cursor* cursor, const ch
 /**
  * Clear the chunk buffer of the cursor
  *
+ * Detach the chunk being decoded, the next queued chunk (if any) takes its place.
+ * If no chunk is attached, this is the same as kpdecode_cursor_popchunk(), so that a caller which
+ * never queues a chunk gets it back once, whether it has been fully decoded or not.
+ * The chunks of a file opened by kpdecode_cursor_open_file() are never cleared: they belong to the
+ * cursor until kpdecode_cursor_close_file().
+ *
  * @param cursor the cursor
  * @return the pointer of the chunk that was just cleared, or NULL
  */
 KPERFDATA_EXPORT char* kpdecode_cursor_clearchunk(kpdecode_cursor* cursor);
 
+/**
+ * Pop the oldest chunk which has been fully decoded
+ *
+ * The records, even the samples still pending, keep copies of the kevents they need, not pointers
+ * into the chunks, so the chunk can be released while they are decoded.
+ *
+ * Only the chunks set by kpdecode_cursor_setchunk() are returned. The chunks of a file opened by
+ * kpdecode_cursor_open_file(), its mapping or its buffers, belong to the cursor and are skipped:
+ * they must not be freed by the caller.
+ *
+ * @param cursor the cursor
+ * @return the pointer of the chunk, which can be released by the caller now, or NULL
+ */
+KPERFDATA_EXPORT char* kpdecode_cursor_popchunk(kpdecode_cursor* cursor);
+
+/**
+ * Tell the cursor that no more chunk will be set
+ *
+ * With KPERFDATA_OPTION_REORDER_WINDOW, the records buffered are then returned once the chunks are
+ * decoded, instead of waiting for newer records.
+ *
+ * @param cursor the cursor
+ */
+KPERFDATA_EXPORT void kpdecode_cursor_finish(kpdecode_cursor* cursor);
+
+/**
+ * Map a RAW file into memory and set it as the chunk of the cursor
+ *
+ * The file is mapped read-only and decoded in place from the page cache, with a sequential
+ * access hint. It stays mapped until kpdecode_cursor_close_file() or kpdecode_cursor_free(). The
+ * chunks of the file belong to the cursor, in every mode: they are never returned by
+ * kpdecode_cursor_popchunk() or kpdecode_cursor_clearchunk(), and must not be freed.
+ *
+ * With KPERFDATA_OPEN_FILE_READ_AHEAD, the file is read instead into a ring of
+ * KPERFDATA_READ_AHEAD_BUFFERS page-aligned buffers, with io_uring where available or with one
+ * reading thread otherwise. The buffers are set as chunks of the cursor in file order once read,
+ * and read again with the next bytes once decoded, so that the reads overlap with the decoding.
+ * kpdecode_cursor_finish() is called at the end of the file. The whole RAW file is never a single
+ * chunk, so the parallel decoding and the time index are not available.
+ *
+ * A RAW file compressed as zstd or LZ4 frames (`zstd trace.bin` or `lz4 trace.bin`) is recognized
+ * by its magic number, if the library was built with libzstd or liblz4. Its frames are
+ * decompressed by a pool of threads, at most one per online processor, into a bounded ring of
+ * buffers, which are set as chunks of the cursor in order as for KPERFDATA_OPEN_FILE_READ_AHEAD. The frames of a file of several
+ * frames, e.g. written by `pzstd` or by concatenating compressed parts, are decompressed in
+ * parallel. A large frame, or one of unknown size, is decompressed a piece at a time, one piece
+ * ahead of the decoding.
+ *
+ * @param cursor the cursor, no chunk should be attached
+ * @param path path of the RAW file
+ * @param flags 0, or KPERFDATA_OPEN_FILE_HUGEPAGES, KPERFDATA_OPEN_FILE_READ_AHEAD and
+ * KPERFDATA_OPEN_FILE_NO_IO_URING combined
+ * @return ret: 0 for success, -1 for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_open_file(kpdecode_cursor* cursor, const char* path,
+                                                int flags);
+
+/**
+ * Unmap the file mapped by kpdecode_cursor_open_file(), or stop reading it ahead
+ *
+ * @param cursor the cursor
+ */
+KPERFDATA_EXPORT void kpdecode_cursor_close_file(kpdecode_cursor* cursor);
+
 /**
  * Get the stats of the cursor
  *
@@ -429,23 +765,211 @@ KPERFDATA_EXPORT long kpdecode_cursor_get_stats(kpdecode_cursor* cursor, int arg
 /**
  * Set the option of the cursor
  *
+ * KPERFDATA_OPTION_SLIM_RECORDS can only be changed while no record is pending, when it is set,
+ * the records must be read by kpdecode_cursor_next_slim_record().
+ *
+ * KPERFDATA_OPTION_REORDER_WINDOW, a number of mach ticks, 0 by default, returns the records in
+ * timestamp order. The records of each cpu are mostly in order, so the ready records are kept in
+ * per-cpu runs, and the oldest head is returned once it is older than the newest record by the
+ * window, or once KPERFDATA_REORDER_MAX_RECORDS records are buffered. A record decoded later but
+ * older than the window is returned late. It can only be turned off while no record is buffered.
+ *
+ * KPERFDATA_OPTION_SKIP_THREADMAP, 0 by default, does not return the kd_threadmap[] as kevents
+ * and records, see kpdecode_cursor_lookup_thread() instead. They still count in
+ * total_size_of_kevents. It must be set before the first kevent is read.
+ *
+ * KPERFDATA_OPTION_TASK_NAMES, 0 by default, fills the task_info.task_name of the records with the
+ * command of their thread in the kd_threadmap[], when the record has none.
+ *
+ * KPERFDATA_OPTION_INTERN_STACKS, 0 by default, interns the callstacks of the records into the
+ * stack table of the cursor and sets their ucallstack_id and kcallstack_id. The frames of the slim
+ * records then point into the table instead of the side buffer, so that each unique stack is only
+ * stored once. Turning it off keeps the table, the IDs given stay valid until the cursor is freed.
+ * When a callstack can not be interned, KPERFDATA_RET_OOM is returned and the record is kept for
+ * the next call.
+ *
  * @param cursor the cursor
- * @param arg2 unknown, value=0/1, 0: do nothing, 1: set option
+ * @param arg2 unknown, value=0/1, 0: do nothing, 1: set option, or one of KPERFDATA_OPTION_*
  * @param arg3 unknown, value=0/1
  * @return the old value of this option
  */
 KPERFDATA_EXPORT long kpdecode_cursor_set_option(kpdecode_cursor* cursor, int arg2, long arg3);
 
+/**
+ * Add a debugid filter to the cursor
+ *
+ * Once a filter is added, only the kevents with `(debugid & debugid_mask) == debugid` for any of
+ * the filters are decoded, the others are skipped in bulk before any record is allocated. e.g.
+ * KPERFDATA_DEBUGID_CLASS_MASK with KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0) keeps the
+ * kperf samples. The skipped kevents still count in the decoded size of
+ * kpdecode_cursor_get_stats().
+ *
+ * @param cursor the cursor
+ * @param debugid_mask the bits of the debugid to compare, see KPERFDATA_DEBUGID_CLASS_MASK
+ * @param debugid the expected value of the bits
+ * @return ret: 0 for success, -1 if there are KPERFDATA_MAX_DEBUGID_FILTERS filters already
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_add_debugid_filter(kpdecode_cursor* cursor,
+                                                         uint32_t debugid_mask, uint32_t debugid);
+
+/**
+ * Remove all the debugid filters of the cursor
+ *
+ * @param cursor the cursor
+ */
+KPERFDATA_EXPORT void kpdecode_cursor_clear_debugid_filters(kpdecode_cursor* cursor);
+
+/**
+ * Add a kevent handler to the cursor
+ *
+ * The kevents are dispatched through a table indexed by their class and subclass, to the last
+ * handler added with `(debugid & debugid_mask) == debugid`, so that the cost of a kevent does not
+ * grow with the number of debugids handled. The handler replaces the built-in one of the same
+ * debugids, e.g. the callstacks of KPERFDATA_PERF_CALLSTACK. KPERFDATA_PERF_GEN_EVENT_START,
+ * KPERFDATA_PERF_GEN_EVENT_END and KPERFDATA_TRACE_LOST_EVENTS delimit the samples, which the
+ * parallel decoding and the index find without the handlers, so they can not be handled, and a
+ * mask covering one of them is rejected. The kevents without a handler are only returned as
+ * records with option 1. With kpdecode_cursor_decode_parallel(), the handler is called from
+ * several threads at once.
+ *
+ * @param cursor the cursor
+ * @param debugid_mask the bits of the debugid to compare, at least KPERFDATA_DEBUGID_CLASS_MASK
+ * @param debugid the expected value of the bits
+ * @param handler the handler
+ * @param context passed to the handler
+ * @return ret: 0 for success, -1 for an invalid mask or a sample kevent, 2 for OOM
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_add_kevent_handler(kpdecode_cursor* cursor,
+                                                         uint32_t debugid_mask, uint32_t debugid,
+                                                         kpdecode_kevent_handler handler,
+                                                         void* context);
+
+/**
+ * Remove the kevent handlers added to the cursor, back to the built-in ones
+ *
+ * @param cursor the cursor
+ */
+KPERFDATA_EXPORT void kpdecode_cursor_clear_kevent_handlers(kpdecode_cursor* cursor);
+
+/**
+ * Decode the whole RAW file of the cursor with several threads
+ *
+ * The cursor must have the whole RAW file as its only chunk, see kpdecode_cursor_open_file(), and
+ * nothing decoded yet. The kd_buf[] is split into one shard per thread, at least
+ * KPERFDATA_PARALLEL_MIN_KD_BUFS each, and the shards are decoded in parallel then merged. After
+ * that, kpdecode_cursor_next_record() returns the same records in the same order as a serial
+ * decoding, all of them being kept in memory until returned. The shards allocate the records from
+ * their own pools, not from the one of kpdecode_cursor_set_record_pool(). Slim records are not
+ * supported. The cursor is finished, see kpdecode_cursor_finish().
+ *
+ * @param cursor the cursor
+ * @param thread_count the number of threads, 0 for the number of online processors
+ * @return ret: 0 for success, otherwise for failure, the cursor can only be freed then
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_decode_parallel(kpdecode_cursor* cursor, int thread_count);
+
+/**
+ * Write the time index of the RAW file of the cursor
+ *
+ * The cursor must have the whole RAW file as its only chunk, which is not decoded by this
+ * function. The index has a checkpoint every `interval` kd_bufs, with the timestamp range of the
+ * kd_bufs up to the next checkpoint, and the per-cpu state of a cursor at this kd_buf. It is only
+ * valid for this RAW file, and the debugid filters of the cursor.
+ *
+ * @param cursor the cursor
+ * @param index_path the path of the index file
+ * @param interval the number of kd_bufs between two checkpoints, 0 for KPERFDATA_INDEX_INTERVAL
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_write_index(kpdecode_cursor* cursor, const char* index_path,
+                                                  uint64_t interval);
+
+/**
+ * Move the cursor to the last checkpoint before a timestamp, with the time index of its RAW file
+ *
+ * The cursor must have nothing decoded yet, and its chunks must hold the RAW file up to the
+ * checkpoint at least. The records decoded from the checkpoint are the same as when decoding from
+ * the beginning, except the samples started before the checkpoint which are not returned. The
+ * records older than `timestamp` after the checkpoint are returned too.
+ *
+ * @param cursor the cursor
+ * @param index_path the path of the index file, see kpdecode_cursor_write_index()
+ * @param timestamp the timestamp to seek to
+ * @return ret: 0 for success, otherwise for failure, the cursor decodes from the beginning then
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_seek_time(kpdecode_cursor* cursor, const char* index_path,
+                                                uint64_t timestamp);
+
+/**
+ * Look up a thread in the kd_threadmap[] of the RAW file
+ *
+ * @param cursor the cursor, whose header has been decoded
+ * @param tid the thread ID
+ * @return the thread, NULL if the thread is not in the kd_threadmap[], or the header has not been
+ * decoded yet. It is valid until the cursor is freed.
+ */
+KPERFDATA_EXPORT const kpdecode_thread* kpdecode_cursor_lookup_thread(kpdecode_cursor* cursor,
+                                                                     uint64_t tid);
+
+/**
+ * Get the next raw kevent of the cursor
+ *
+ * The valid entries of the threadmap come first, as kevents with the debugid
+ * KPERFDATA_DEBUGID(7, 1, 2, 0) and the command in `arg1`..`arg3`. The kevents read by this
+ * function are not seen by kpdecode_cursor_next_record(), use one or the other on a cursor.
+ *
+ * @param cursor the cursor
+ * @param next_kevent the next kevent, valid until the next call or until its chunk is released
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_kevent(kpdecode_cursor* cursor,
+                                                  const kd_buf** next_kevent);
+
+/**
+ * Get the next run of raw kevents of the cursor
+ *
+ * On 64-bit traces, this returns a pointer to the contiguous kd_buf_64 run inside the chunk, with
+ * no copy. On 32-bit traces, the run is a block of kd_buf_32 widened at once by a SIMD kernel
+ * (AVX2 or SSE2, chosen at runtime). The threadmap entries and the kd_buf_64 straddling two chunks
+ * are returned as runs of one kevent.
+ *
+ * @param cursor the cursor
+ * @param next_kevents the first kevent of the run
+ * @param max_kevents the max number of kevents in the run
+ * @param kevent_count number of kevents in the run
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_kevents(kpdecode_cursor* cursor,
+                                                   const kd_buf** next_kevents,
+                                                   size_t max_kevents, size_t* kevent_count);
+
 /**
  * Get the next record of the cursor
  *
  * @param cursor the cursor
  * @param record the next record
- * @return ret: 0 for success, otherwise for failure
+ * @return ret: 0 for success, 1 if no record is ready yet, KPERFDATA_RET_SAMPLE_PENDING if a sample
+ * starts while another one is pending (call it again), otherwise for failure
  */
 KPERFDATA_EXPORT long kpdecode_cursor_next_record(kpdecode_cursor* cursor,
                                                   kpdecode_record** next_record);
 
+/**
+ * Get the next records of the cursor in one call
+ *
+ * Same as calling kpdecode_cursor_next_record() up to `max_records` times, stops early when no
+ * more record is ready. A failure after some records were stored is returned by the next call.
+ *
+ * @param cursor the cursor
+ * @param next_records the array to store the next records
+ * @param max_records capacity of `next_records`
+ * @param record_count number of records stored into `next_records`
+ * @return ret: 0 for success (at least one record), otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_records(kpdecode_cursor* cursor,
+                                                   kpdecode_record** next_records,
+                                                   size_t max_records, size_t* record_count);
+
 /**
  * Release the record
  *
@@ -453,11 +977,469 @@ KPERFDATA_EXPORT long kpdecode_cursor_next_record(kpdecode_cursor* cursor,
  */
 KPERFDATA_EXPORT void kpdecode_record_free(kpdecode_record* record);
 
+/**
+ * Get the next slim record of the cursor
+ *
+ * @param cursor the cursor, KPERFDATA_OPTION_SLIM_RECORDS must be set
+ * @param record the next slim record
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_slim_record(kpdecode_cursor* cursor,
+                                                       kpdecode_slim_record** next_record);
+
+/**
+ * Get the next slim records of the cursor in one call
+ *
+ * A failure after some records were stored is returned by the next call.
+ *
+ * @param cursor the cursor, KPERFDATA_OPTION_SLIM_RECORDS must be set
+ * @param next_records the array to store the next slim records
+ * @param max_records capacity of `next_records`
+ * @param record_count number of records stored into `next_records`
+ * @return ret: 0 for success (at least one record), otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_slim_records(kpdecode_cursor* cursor,
+                                                        kpdecode_slim_record** next_records,
+                                                        size_t max_records, size_t* record_count);
+
+/**
+ * Release the slim record
+ *
+ * @param record the slim record
+ */
+KPERFDATA_EXPORT void kpdecode_slim_record_free(kpdecode_slim_record* record);
+
+/**
+ * Create the columns of a block of records or kevents
+ *
+ * @param capacity the number of rows
+ * @param frames_capacity the number of frames of each callstack column, 0 for no callstacks
+ * @return the columns, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_columns* kpdecode_columns_create(size_t capacity,
+                                                           size_t frames_capacity);
+
+/**
+ * Release the columns
+ *
+ * The record carried to the next block is released, the columns of the caller are left alone.
+ *
+ * @param columns the columns
+ */
+KPERFDATA_EXPORT void kpdecode_columns_free(kpdecode_columns* columns);
+
+/**
+ * Get the next block of records of the cursor in columns
+ *
+ * The columns are refilled from the first row, up to `capacity` records, stops early when no more
+ * record is ready, or when the callstacks of the next record do not fit in the frames columns. That
+ * record is carried to the next block, or dropped if it does not even fit in empty columns. The
+ * records are released once copied. A failure after some rows were filled is returned by the next
+ * call.
+ *
+ * @param cursor the cursor, full or slim records
+ * @param columns the columns
+ * @return ret: 0 for success (at least one record), KPERFDATA_RET_TOO_LARGE if the callstacks of
+ * the next record exceed `frames_capacity`, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_columns(kpdecode_cursor* cursor,
+                                                   kpdecode_columns* columns);
+
+/**
+ * Get the next block of raw kevents of the cursor in columns
+ *
+ * Same as kpdecode_cursor_next_kevents(), without decoding records. A kevent has no record flags
+ * and no callstacks: the flags column is filled with 0, and the callstacks of every row are
+ * empty, the frames columns are left as is.
+ *
+ * @param cursor the cursor
+ * @param columns the columns
+ * @return ret: 0 for success (at least one kevent), otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_next_kevent_columns(kpdecode_cursor* cursor,
+                                                          kpdecode_columns* columns);
+
+/**
+ * Create a file of records in the compact format
+ *
+ * The records are written in blocks of KPERFDATA_COMPACT_BLOCK_RECORDS, each with a dictionary of
+ * its tids and debugids. The timestamps are varint deltas, the callstacks only take their frames,
+ * as varint deltas too, and the other fixed fields of the record only take the non-zero words.
+ * The file is read by kpdecode_compact_reader_open() on a host of the same byte order.
+ *
+ * @param path the path of the file
+ * @return the writer, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_compact_writer* kpdecode_compact_writer_create(const char* path);
+
+/**
+ * Append a record to the compact file
+ *
+ * @param writer the writer
+ * @param record the record, left to the caller
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_compact_writer_write_record(kpdecode_compact_writer* writer,
+                                                           const kpdecode_record* record);
+
+/**
+ * Append a slim record to the compact file, as the full record with the fields of the slim one
+ *
+ * @param writer the writer
+ * @param record the slim record, left to the caller
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_compact_writer_write_slim_record(kpdecode_compact_writer* writer,
+                                                                const kpdecode_slim_record* record);
+
+/**
+ * Write the last block of the compact file, and release the writer
+ *
+ * @param writer the writer
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_compact_writer_close(kpdecode_compact_writer* writer);
+
+/**
+ * Open a file of records in the compact format
+ *
+ * @param path the path of the file, see kpdecode_compact_writer_create()
+ * @return the reader, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_compact_reader* kpdecode_compact_reader_open(const char* path);
+
+/**
+ * Read the next record of the compact file
+ *
+ * @param reader the reader
+ * @param next_record the record, release it by kpdecode_record_free(), it may outlive the reader
+ * @return ret: 0 for success, 1 at the end of the file, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_compact_reader_next_record(kpdecode_compact_reader* reader,
+                                                          kpdecode_record** next_record);
+
+/**
+ * Read the next record of the compact file as a slim record, without allocating it
+ *
+ * @param reader the reader
+ * @param next_record the slim record owned by the reader, valid until the next call, do not release
+ * it by kpdecode_slim_record_free()
+ * @return ret: 0 for success, 1 at the end of the file, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_compact_reader_next_slim_record(
+    kpdecode_compact_reader* reader, const kpdecode_slim_record** next_record);
+
+/**
+ * Close the compact file
+ *
+ * @param reader the reader
+ */
+KPERFDATA_EXPORT void kpdecode_compact_reader_close(kpdecode_compact_reader* reader);
+
+/**
+ * Create an empty stack table
+ *
+ * The cursor creates its own with KPERFDATA_OPTION_INTERN_STACKS, see
+ * kpdecode_cursor_get_stack_table().
+ *
+ * @return the stack table, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_stack_table* kpdecode_stack_table_create(void);
+
+/**
+ * Release the stack table, the frames it returned are no longer valid
+ *
+ * @param table the stack table, not one of a cursor
+ */
+KPERFDATA_EXPORT void kpdecode_stack_table_free(kpdecode_stack_table* table);
+
+/**
+ * Intern a callstack
+ *
+ * Equal callstacks get the same stack ID, the IDs are given from 1 in order, an empty callstack
+ * gets 0.
+ *
+ * @param table the stack table
+ * @param frames the frames of the callstack, copied into the table
+ * @param nframes the number of frames, up to KPERFDATA_STACK_CHUNK_FRAMES
+ * @param stack_id the stack ID of the callstack
+ * @return ret: 0 for success, -1 for too many frames or stacks, 2 for OOM, also when the table is
+ * full and its slots can not grow, or past kpdecode_stack_table_set_max_stacks()
+ */
+KPERFDATA_EXPORT long kpdecode_stack_table_intern(kpdecode_stack_table* table,
+                                                  const unsigned long long* frames,
+                                                  uint32_t nframes, uint32_t* stack_id);
+
+/**
+ * Get the frames of an interned callstack
+ *
+ * @param table the stack table
+ * @param stack_id the stack ID, 0 for the empty callstack
+ * @param frames the frames, valid until the table is freed
+ * @param nframes the number of frames
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_stack_table_get(const kpdecode_stack_table* table,
+                                               uint32_t stack_id,
+                                               const unsigned long long** frames,
+                                               uint32_t* nframes);
+
+/**
+ * Get the number of unique non-empty callstacks, the largest stack ID
+ *
+ * @param table the stack table
+ * @return the number of callstacks
+ */
+KPERFDATA_EXPORT uint32_t kpdecode_stack_table_count(const kpdecode_stack_table* table);
+
+/**
+ * Bound the memory of the stack table, e.g. for a long session with many unique callstacks
+ *
+ * Past the limit, a new callstack fails with KPERFDATA_RET_OOM as when the table can not grow, the
+ * callstacks already interned are still found. The records of a cursor are then returned as soon
+ * as the limit is raised.
+ *
+ * @param table the stack table
+ * @param max_stacks the number of unique callstacks, 0 for no limit, the default
+ */
+KPERFDATA_EXPORT void kpdecode_stack_table_set_max_stacks(kpdecode_stack_table* table,
+                                                          uint32_t max_stacks);
+
+/**
+ * Get the stack table of the cursor
+ *
+ * @param cursor the cursor
+ * @return the stack table owned by the cursor, or NULL if KPERFDATA_OPTION_INTERN_STACKS was never
+ * set
+ */
+KPERFDATA_EXPORT kpdecode_stack_table* kpdecode_cursor_get_stack_table(kpdecode_cursor* cursor);
+
+/**
+ * Create an empty aggregate
+ *
+ * @return the aggregate, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_aggregate* kpdecode_aggregate_create(void);
+
+/**
+ * Release the aggregate
+ *
+ * @param aggregate the aggregate
+ */
+KPERFDATA_EXPORT void kpdecode_aggregate_free(kpdecode_aggregate* aggregate);
+
+/**
+ * Count a record in the entries of its thread, its cpu and its callstacks
+ *
+ * Only the samples, the records with KPERFDATA_RECORD_FLAG_SAMPLE, are counted, the other records
+ * are ignored.
+ *
+ * @param aggregate the aggregate
+ * @param record the record, left to the caller
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_aggregate_add_record(kpdecode_aggregate* aggregate,
+                                                    const kpdecode_record* record);
+
+/**
+ * Count a slim record, see kpdecode_aggregate_add_record()
+ *
+ * @param aggregate the aggregate
+ * @param record the slim record, left to the caller
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_aggregate_add_slim_record(kpdecode_aggregate* aggregate,
+                                                         const kpdecode_slim_record* record);
+
+/**
+ * Add the entries of an aggregate to another one
+ *
+ * Each decoding thread can fill its own aggregate without any lock, then they are merged once.
+ *
+ * @param aggregate the aggregate
+ * @param from the aggregate to add, left unchanged
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_aggregate_merge(kpdecode_aggregate* aggregate,
+                                               const kpdecode_aggregate* from);
+
+/**
+ * Get the number of entries of a table of the aggregate
+ *
+ * @param aggregate the aggregate
+ * @param table one of KPERFDATA_AGGREGATE_*
+ * @return the number of entries
+ */
+KPERFDATA_EXPORT size_t kpdecode_aggregate_count(const kpdecode_aggregate* aggregate, int table);
+
+/**
+ * Get the entries with the most samples of a table of the aggregate
+ *
+ * @param aggregate the aggregate
+ * @param table one of KPERFDATA_AGGREGATE_*
+ * @param entries the array to store the entries, by samples then key
+ * @param max_entries the size of the array
+ * @return the number of entries stored
+ */
+KPERFDATA_EXPORT size_t kpdecode_aggregate_top(const kpdecode_aggregate* aggregate, int table,
+                                               kpdecode_aggregate_entry* entries,
+                                               size_t max_entries);
+
+/**
+ * Get the stack table of the aggregate, which resolves the stack IDs of the stack keys
+ *
+ * @param aggregate the aggregate
+ * @return the stack table owned by the aggregate
+ */
+KPERFDATA_EXPORT const kpdecode_stack_table* kpdecode_aggregate_get_stack_table(
+    const kpdecode_aggregate* aggregate);
+
+/**
+ * Aggregate the records of the cursor in one pass
+ *
+ * The samples are counted and released as soon as they are complete, and the other records right
+ * away, without waiting for the records before them. With more than one thread, the cursor must
+ * have nothing decoded yet and the whole RAW file as its only chunk, as for
+ * kpdecode_cursor_decode_parallel(), and each thread counts into its own aggregate. Slim records
+ * and KPERFDATA_OPTION_REORDER_WINDOW are aggregated on the calling thread, as they are returned
+ * by kpdecode_cursor_next_records().
+ *
+ * @param cursor the cursor
+ * @param aggregate the aggregate
+ * @param thread_count the number of threads, 0 for the number of online cpus
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_aggregate(kpdecode_cursor* cursor,
+                                                kpdecode_aggregate* aggregate, int thread_count);
+
 /**
  * Flush the cursor
  */
 KPERFDATA_EXPORT void kpdecode_cursor_flush();
 
+/**
+ * Create a new record pool
+ *
+ * Records are carved out of slabs of `records_per_slab` records and recycled by
+ * kpdecode_record_free(). Only the fixed fields of a recycled record are cleared, the entries of
+ * `frames[]` and `counterv[]` beyond `nframes` and `counterc` are undefined.
+ *
+ * The pool is not thread-safe, all the cursors sharing a pool must be driven from the same thread.
+ *
+ * @param records_per_slab number of records per slab, 0 for the default value
+ * @return the new pool, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_record_pool* kpdecode_record_pool_create(size_t records_per_slab);
+
+/**
+ * Release the record pool
+ *
+ * The memory is released once all the cursors using this pool have been released and all the
+ * records allocated from it have been returned by kpdecode_record_free().
+ *
+ * @param pool the pool
+ */
+KPERFDATA_EXPORT void kpdecode_record_pool_free(kpdecode_record_pool* pool);
+
+/**
+ * Get the stats of the record pool
+ *
+ * @param pool the pool
+ * @param key one of KPERFDATA_POOL_STATS_*
+ * @return the stats, or -1 for failure
+ */
+KPERFDATA_EXPORT long kpdecode_record_pool_get_stats(kpdecode_record_pool* pool, int key);
+
+/**
+ * Set the record pool of the cursor
+ *
+ * A cursor created by kpdecode_cursor_create() owns a private pool, call this to share one pool
+ * between several cursors. The records already allocated stay with their original pool.
+ *
+ * @param cursor the cursor
+ * @param pool the pool, NULL to allocate every record by calloc()
+ * @return ret: 0 for success, -1 for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_set_record_pool(kpdecode_cursor* cursor,
+                                                      kpdecode_record_pool* pool);
+
+/**
+ * Start decoding the records of the cursor on a dedicated thread
+ *
+ * The cursor must hold all of its input (see kpdecode_cursor_open_file()), it's driven by the
+ * decoding thread, which calls kpdecode_cursor_finish() once no more record is ready, until
+ * kpdecode_pipeline_stop(). The records are handed to the consumers through a bounded lock-free
+ * ring, without any lock: the decoding thread waits while the ring is full, and the consumers
+ * while it's empty. The records are returned to the decoding thread by kpdecode_pipeline_release(),
+ * which recycles them into the record pool of the cursor.
+ *
+ * With KPERFDATA_PIPELINE_SINGLE_CONSUMER, popping the records without waiting is wait-free, but
+ * only one thread at a time may pop and release them. Otherwise any number of threads may. In
+ * both modes kpdecode_pipeline_release() may block: it spins with a backoff while the ring of the
+ * released records is full, until the decoding thread drains it.
+ *
+ * @param cursor the cursor, full records only
+ * @param capacity the records in flight, rounded up to a power of two, 0 for
+ * KPERFDATA_PIPELINE_CAPACITY
+ * @param flags 0 or KPERFDATA_PIPELINE_SINGLE_CONSUMER
+ * @return the pipeline, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_pipeline* kpdecode_pipeline_start(kpdecode_cursor* cursor,
+                                                            size_t capacity, int flags);
+
+/**
+ * Pop the next record decoded
+ *
+ * @param pipeline the pipeline
+ * @param record the record, to return by kpdecode_pipeline_release()
+ * @param wait 0: return at once if no record is decoded yet, 1: wait for the next record
+ * @return ret: 0 for success, 1 if no record is decoded yet, -1 once all the records are popped
+ */
+KPERFDATA_EXPORT long kpdecode_pipeline_pop(kpdecode_pipeline* pipeline, kpdecode_record** record,
+                                            int wait);
+
+/**
+ * Pop the next records decoded in one call
+ *
+ * Same as kpdecode_pipeline_pop() for the first record, then pops up to `max_records` records
+ * without waiting.
+ *
+ * @param pipeline the pipeline
+ * @param records the array to store the records
+ * @param max_records capacity of `records`
+ * @param record_count number of records stored into `records`
+ * @param wait 0: return at once if no record is decoded yet, 1: wait for the next record
+ * @return ret: 0 for success, 1 if no record is decoded yet, -1 once all the records are popped
+ */
+KPERFDATA_EXPORT long kpdecode_pipeline_pop_records(kpdecode_pipeline* pipeline,
+                                                    kpdecode_record** records, size_t max_records,
+                                                    size_t* record_count, int wait);
+
+/**
+ * Return a record popped from the pipeline, instead of kpdecode_record_free()
+ *
+ * Not wait-free: while the ring of the released records is full, this spins with a backoff until
+ * the decoding thread recycles them.
+ *
+ * @param pipeline the pipeline
+ * @param record the record
+ */
+KPERFDATA_EXPORT void kpdecode_pipeline_release(kpdecode_pipeline* pipeline,
+                                                kpdecode_record* record);
+
+/**
+ * Stop the decoding thread, and release the pipeline
+ *
+ * The records not popped yet are released. The records popped and not returned yet must be
+ * released by kpdecode_record_free() once the consumers are done, and the cursor belongs to the
+ * calling thread again.
+ *
+ * @param pipeline the pipeline
+ * @return ret: 0 if the records were decoded, or stopped early, otherwise the failure of the
+ * decoding, e.g. 2 for OOM
+ */
+KPERFDATA_EXPORT long kpdecode_pipeline_stop(kpdecode_pipeline* pipeline);
+
 KPERFDATA_END_CPP_NAMESPACE
 
 #endif  // KPERFDATA_INCLUDE_KPERFDATA_H_
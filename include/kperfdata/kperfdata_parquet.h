@@ -0,0 +1,98 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KPERFDATA_INCLUDE_KPERFDATA_PARQUET_H_
+#define KPERFDATA_INCLUDE_KPERFDATA_PARQUET_H_
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+
+#include "kperfdata/kperfdata.h"
+#include "kperfdata/macros.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+/**
+ * kpdecode_parquet_writer
+ *
+ * Writes records to a Parquet file, uncompressed, one row group every `row_group_size` records:
+ *
+ *   message kperfdata_record {
+ *     required int64 timestamp;                       // DELTA_BINARY_PACKED
+ *     required int64 tid;
+ *     required int32 cpuid;
+ *     required int32 debugid;                         // dictionary of the row group
+ *     required int64 flags;
+ *     required int64 arg1;                            // up to arg4
+ *     required group ucallstack (LIST) {
+ *       repeated group list { required int64 element; }
+ *     }
+ *     required group kcallstack (LIST) { ... }
+ *   }
+ *
+ * The unsigned values are stored as they are, in the signed physical types. A full row group is
+ * encoded on a background thread, while the next one is filled.
+ */
+typedef struct kpdecode_parquet_writer kpdecode_parquet_writer;
+
+/**
+ * Create a Parquet file
+ *
+ * @param path the path of the Parquet file
+ * @param row_group_size the records of each row group, 0 for KPERFDATA_PARQUET_ROW_GROUP_SIZE
+ * @return the writer, or NULL for failure
+ */
+KPERFDATA_EXPORT kpdecode_parquet_writer* kpdecode_parquet_writer_create(const char* path,
+                                                                         size_t row_group_size);
+
+/**
+ * Append a block of records to the Parquet file
+ *
+ * The columns are copied, the NULL ones are written as zeroes or empty callstacks.
+ *
+ * @param writer the writer
+ * @param columns the columns, see kpdecode_cursor_next_columns()
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_parquet_writer_write_columns(kpdecode_parquet_writer* writer,
+                                                            const kpdecode_columns* columns);
+
+/**
+ * Write the last row group and the footer of the Parquet file, and release the writer
+ *
+ * @param writer the writer
+ * @param row_count the number of records written, may be NULL
+ * @return ret: 0 for success, otherwise for failure, the file is not valid then
+ */
+KPERFDATA_EXPORT long kpdecode_parquet_writer_close(kpdecode_parquet_writer* writer,
+                                                    uint64_t* row_count);
+
+/**
+ * Convert the records of the cursor to a Parquet file
+ *
+ * The records are read by kpdecode_cursor_next_columns() until none is ready, the cursor is then
+ * finished, see kpdecode_cursor_finish(), and drained.
+ *
+ * @param cursor the cursor, full or slim records
+ * @param path the path of the Parquet file
+ * @param row_group_size the records of each row group, 0 for KPERFDATA_PARQUET_ROW_GROUP_SIZE
+ * @param row_count the number of records written, may be NULL
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_cursor_write_parquet(kpdecode_cursor* cursor, const char* path,
+                                                    size_t row_group_size, uint64_t* row_count);
+
+KPERFDATA_END_CPP_NAMESPACE
+
+#endif  // KPERFDATA_INCLUDE_KPERFDATA_PARQUET_H_
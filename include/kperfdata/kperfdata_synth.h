@@ -0,0 +1,148 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KPERFDATA_INCLUDE_KPERFDATA_SYNTH_H_
+#define KPERFDATA_INCLUDE_KPERFDATA_SYNTH_H_
+
+#include <stddef.h>  // size_t
+#include <stdint.h>  // uint64_t
+
+#include "kperfdata/kperfdata.h"
+#include "kperfdata/macros.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// the frames of the callstacks, 16 callstacks per frame count
+#define KPERFDATA_SYNTH_KERNEL_FRAME(tid, i) \
+  (0xfffffe0000100000ULL + (((tid) & 0xf) << 20) + (uint64_t)(i) * 0x10)
+#define KPERFDATA_SYNTH_USER_FRAME(tid, i) \
+  (0x0000000100100000ULL + (((tid) & 0xf) << 20) + (uint64_t)(i) * 0x10)
+
+/**
+ * kpdecode_synth_options
+ *
+ * A synthetic RAW file, for benchmarks:
+ *
+ *   RAW_header_v1 or RAW_header_v2
+ *   kd_threadmap_32[thread_count] or kd_threadmap_64[thread_count]
+ *   padding to the next page boundary
+ *   kd_buf_32[kd_buf_count] or kd_buf_64[kd_buf_count]
+ *
+ * The kevents are spread over the cpus in timestamp order per cpu. Each cpu runs samples, a
+ * PERF_GEN_EVENT_START, `sample_kevents` kperf kevents and a PERF_GEN_EVENT_END, between runs of
+ * scheduler kevents. With `callstack_frames`, a sample starts with a kernel and a user callstack of
+ * that many frames, a header and a data kevent per 4 frames each, frame `i` of the thread `tid` at
+ * `KPERFDATA_SYNTH_KERNEL_FRAME(tid, i)` and `KPERFDATA_SYNTH_USER_FRAME(tid, i)`. Every thread of
+ * the kevents is in the threadmap. The same options and seed always give the same bytes.
+ */
+typedef struct {
+  int version;                                        // 1 or 2, a version 1 file is 64-bit
+  int is64bit;                                        // 0/1, version 2 only
+  uint32_t thread_count;                              // the kd_threadmap[] entries, at least 1
+  uint32_t cpu_count;                                 // 1 to KPERFDATA_MAX_CPUS
+  uint64_t kd_buf_count;                              // the number of kevents
+  uint32_t sample_percent;                            // the kevents in samples, 0 to 100
+  uint32_t sample_kevents;                            // the kperf kevents between START and END
+  uint32_t callstack_frames;                          // the frames of each callstack, 0 for none
+  uint64_t seed;
+} kpdecode_synth_options;
+
+/**
+ * kpdecode_synth
+ *
+ * The generator of the kd_buf[], so that a file of any size is written block by block.
+ */
+typedef struct kpdecode_synth kpdecode_synth;
+
+/**
+ * Fill the options with the defaults: version 2, 64-bit, 256 threads, 8 cpus, 1M kevents, 50% of
+ * them in samples of 6 kperf kevents, without callstacks
+ *
+ * @param options the options
+ */
+KPERFDATA_EXPORT void kpdecode_synth_default_options(kpdecode_synth_options* options);
+
+/**
+ * Create a generator
+ *
+ * @param options the options, copied
+ * @return the generator, or NULL for failure (invalid options or OOM)
+ */
+KPERFDATA_EXPORT kpdecode_synth* kpdecode_synth_create(const kpdecode_synth_options* options);
+
+/**
+ * Release the generator
+ *
+ * @param synth the generator
+ */
+KPERFDATA_EXPORT void kpdecode_synth_free(kpdecode_synth* synth);
+
+/**
+ * Get the size of the RAW header, the kd_threadmap[] and the padding
+ *
+ * @param synth the generator
+ * @return the offset of the kd_buf[]
+ */
+KPERFDATA_EXPORT size_t kpdecode_synth_header_size(const kpdecode_synth* synth);
+
+/**
+ * Get the size of the whole RAW file
+ *
+ * @param synth the generator
+ * @return the size in bytes
+ */
+KPERFDATA_EXPORT uint64_t kpdecode_synth_file_size(const kpdecode_synth* synth);
+
+/**
+ * Write the RAW header, the kd_threadmap[] and the padding
+ *
+ * @param synth the generator
+ * @param buffer kpdecode_synth_header_size() bytes
+ */
+KPERFDATA_EXPORT void kpdecode_synth_write_header(const kpdecode_synth* synth, char* buffer);
+
+/**
+ * Write the next kevents of the kd_buf[]
+ *
+ * @param synth the generator
+ * @param buffer the buffer, `max_kd_bufs` kd_buf_32 or kd_buf_64
+ * @param max_kd_bufs the size of the buffer in kd_bufs
+ * @return the number of kd_bufs written, 0 once kd_buf_count have been written
+ */
+KPERFDATA_EXPORT size_t kpdecode_synth_write_kd_bufs(kpdecode_synth* synth, char* buffer,
+                                                     size_t max_kd_bufs);
+
+/**
+ * Generate a whole RAW file in memory
+ *
+ * @param options the options
+ * @param size the size of the RAW file
+ * @return the RAW file, to release by free(), or NULL for failure
+ */
+KPERFDATA_EXPORT char* kpdecode_synth_generate(const kpdecode_synth_options* options,
+                                               size_t* size);
+
+/**
+ * Generate a RAW file on disk, block by block
+ *
+ * @param options the options
+ * @param path the path of the RAW file, overwritten
+ * @return ret: 0 for success, otherwise for failure
+ */
+KPERFDATA_EXPORT long kpdecode_synth_write_file(const kpdecode_synth_options* options,
+                                                const char* path);
+
+KPERFDATA_END_CPP_NAMESPACE
+
+#endif  // KPERFDATA_INCLUDE_KPERFDATA_SYNTH_H_
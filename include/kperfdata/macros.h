@@ -41,6 +41,8 @@
 #define KPERFDATA_RET_FAIL -1
 #define KPERFDATA_RET_NOT_READY 1
 #define KPERFDATA_RET_OOM 2
+#define KPERFDATA_RET_SAMPLE_PENDING 3  // a sample starts while another one is pending, keep going
+#define KPERFDATA_RET_TOO_LARGE 4  // a record does not fit in the buffers given, it is dropped
 
 #define KPERFDATA_MAX_RECORDS 10000
 #define KPERFDATA_MAX_RECORDS_PRE_CPU 2048
@@ -69,28 +71,115 @@
   (((unsigned)((class) & 0xff) << 24) | ((unsigned)((subclass)&0xff) << 16) | \
    ((unsigned)((code)&0x3fff) << 2) | func)
 
+#define KPERFDATA_DEBUGID_CLASS(debugid) (((debugid) >> 24) & 0xff)
+#define KPERFDATA_DEBUGID_SUBCLASS(debugid) (((debugid) >> 16) & 0xff)
+
 #define KPERFDATA_DBG_PERF 37
 #define KPERFDATA_DBG_TRACE 7
 
 #define KPERFDATA_TRACE_LOST_EVENTS KPERFDATA_DEBUGID(KPERFDATA_DBG_TRACE, 2, 2, 0)
 #define KPERFDATA_PERF_GEN_EVENT_START KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 1)
+#define KPERFDATA_PERF_GEN_EVENT_END KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 2)
+
+// the callstacks of a sample: a header with the flags and the number of frames, then the frames 4
+// by 4 in the args of the data kevents
+#define KPERFDATA_PERF_CALLSTACK 2
+#define KPERFDATA_PERF_CS_KDATA KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 2, 3, 0)
+#define KPERFDATA_PERF_CS_UDATA KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 2, 4, 0)
+#define KPERFDATA_PERF_CS_KHDR KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 2, 5, 0)
+#define KPERFDATA_PERF_CS_UHDR KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 2, 6, 0)
+#define KPERFDATA_MAX_CALLSTACK_FRAMES 256  // kpdecode_callstack.frames, the others are dropped
+
+// the min number of kd_buf decoded by each thread of kpdecode_cursor_decode_parallel()
+#define KPERFDATA_PARALLEL_MIN_KD_BUFS 1024
+
+#define KPERFDATA_INDEX_MAGIC 0x5849504b  // "KPIX"
+#define KPERFDATA_INDEX_VERSION 3
+#define KPERFDATA_INDEX_INTERVAL 65536  // kd_bufs between two checkpoints
+
+// masks for kpdecode_cursor_add_debugid_filter()
+#define KPERFDATA_DEBUGID_CLASS_MASK 0xff000000
+#define KPERFDATA_DEBUGID_SUBCLASS_MASK 0xffff0000
+#define KPERFDATA_DEBUGID_CODE_MASK 0xfffffffc  // all but DBG_FUNC_START/DBG_FUNC_END
+#define KPERFDATA_DEBUGID_MASK 0xffffffff
+#define KPERFDATA_MAX_DEBUGID_FILTERS 8
 
 #define KPERFDATA_TIMESTAMP_MASK 0x00ffffffffffffffULL
 #define KPERFDATA_CPU_MASK 0xff00000000000000ULL
 #define KPERFDATA_CPU_SHIFT 56
 
-#define KPERFDATA_MAX_CPUS 64
-
-#define KPERFDATA_LINKED_LIST_APPEND_ITEM(cursor, record)      \
-  ++cursor->kpdecode_record_count;                             \
-  record->next = NULL;                                         \
-  kpdecode_record* last_record = cursor->kpdecode_record_tail; \
-  if (last_record != NULL) {                                   \
-    last_record->next = (struct kpdecode_record*)record;       \
-  }                                                            \
-  cursor->kpdecode_record_tail = record;                       \
-  if (cursor->kpdeocde_record_head == NULL) {                  \
-    cursor->kpdeocde_record_head = record;                     \
-  }
+#define KPERFDATA_MAX_CPUS 256  // KPERFDATA_CPU_MASK has 8 bits
+#define KPERFDATA_CACHE_LINE_SIZE 64
+
+#define KPERFDATA_POOL_RECORDS_PRE_SLAB 64
+#define KPERFDATA_POOL_STATS_HITS 0
+#define KPERFDATA_POOL_STATS_MISSES 1
+#define KPERFDATA_POOL_STATS_LIVE 2
+
+#define KPERFDATA_OPTION_SLIM_RECORDS 2
+#define KPERFDATA_SLIM_CHUNK_SIZE (256 * 1024)
+
+#define KPERFDATA_OPTION_REORDER_WINDOW 3
+#define KPERFDATA_REORDER_RUN_SIZE 64
+#define KPERFDATA_REORDER_MAX_RECORDS 65536
+
+#define KPERFDATA_OPTION_SKIP_THREADMAP 4
+#define KPERFDATA_OPTION_TASK_NAMES 5
+
+#define KPERFDATA_OPTION_INTERN_STACKS 6
+#define KPERFDATA_STACK_CHUNK_FRAMES 65536  // frames of a chunk of the stack table, 512KB
+
+// kpdecode_record.flags
+#define KPERFDATA_RECORD_FLAG_SAMPLE 0x0000000000002000ULL  // started by PERF_GEN_EVENT_START
+#define KPERFDATA_RECORD_FLAG_LOST 0x8000000000000000ULL  // incomplete, some kevents were lost
+
+// the tables of kpdecode_aggregate
+#define KPERFDATA_AGGREGATE_THREADS 0
+#define KPERFDATA_AGGREGATE_CPUS 1
+#define KPERFDATA_AGGREGATE_STACKS 2
+#define KPERFDATA_AGGREGATE_MAX_COUNTERS 32
+#define KPERFDATA_AGGREGATE_STACK_KEY(ucallstack_id, kcallstack_id) \
+  (((uint64_t)(kcallstack_id) << 32) | (uint32_t)(ucallstack_id))
+
+#define KPERFDATA_OPEN_FILE_HUGEPAGES 0x1
+#define KPERFDATA_OPEN_FILE_READ_AHEAD 0x2  // read into buffers instead of mapping the file
+#define KPERFDATA_OPEN_FILE_NO_IO_URING 0x4  // read ahead with threads even if io_uring works
+#define KPERFDATA_READ_AHEAD_BUFFERS 4
+#define KPERFDATA_READ_AHEAD_BUFFER_SIZE (4 * 1024 * 1024)
+
+// the compressed RAW files, see kpdecode_cursor_open_file()
+#define KPERFDATA_ZSTD_MAGIC 0xFD2FB528
+#define KPERFDATA_LZ4_MAGIC 0x184D2204
+#define KPERFDATA_SKIPPABLE_MAGIC 0x184D2A50  // the skippable frames of both formats
+#define KPERFDATA_SKIPPABLE_MAGIC_MASK 0xFFFFFFF0
+#define KPERFDATA_DECOMPRESS_MAX_SLOTS 16  // the frames decompressed ahead, at most
+#define KPERFDATA_DECOMPRESS_FRAME_SIZE (16 * 1024 * 1024)  // larger frames are streamed
+#define KPERFDATA_DECOMPRESS_CHUNK_SIZE (4 * 1024 * 1024)  // the pieces of a streamed frame
+#define KPERFDATA_FILE_WILLNEED_SIZE (4 * 1024 * 1024)
+
+// the smallest power of two which can hold KPERFDATA_MAX_RECORDS + 1 pending records
+#define KPERFDATA_RECORD_RING_SIZE 16384
+
+// the number of kd_buf_32 widened to kd_buf_64 at once, 16KB of staging
+#define KPERFDATA_WIDEN_BLOCK_SIZE 256
+
+#define KPERFDATA_COMPACT_MAGIC 0x4352504b  // "KPRC"
+#define KPERFDATA_COMPACT_VERSION 1
+#define KPERFDATA_COMPACT_BLOCK_RECORDS 4096  // records of a block, which has its own dictionaries
+
+#define KPERFDATA_PARQUET_ROW_GROUP_SIZE 65536
+#define KPERFDATA_PARQUET_BLOCK_SIZE 4096  // the records of a kpdecode_cursor_next_columns() call
+
+// kpdecode_pipeline
+#define KPERFDATA_PIPELINE_SINGLE_CONSUMER 0x1  // only one thread pops the records
+#define KPERFDATA_PIPELINE_CAPACITY 4096  // the records in flight, by default
+#define KPERFDATA_PIPELINE_BATCH_SIZE 256  // the records decoded at once
+#define KPERFDATA_PIPELINE_SPINS 64  // the retries of a full or empty ring before yielding
+
+#if defined(__GNUC__) || defined(__clang__)
+#define KPERFDATA_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define KPERFDATA_PREFETCH(addr)
+#endif
 
 #endif  // KPERFDATA_INCLUDE_MACROS_H_
@@ -16,39 +16,490 @@
 
 #include <assert.h>  // assert
 #include <stdbool.h>  // bool
+#include <stddef.h>  // offsetof
 #include <stdlib.h>  // malloc
+#include <string.h>  // memcpy
+
+#include "kperfdata_internal.h"
 
 KPERFDATA_START_CPP_NAMESPACE
 
-kpdecode_cursor* kpdecode_cursor_create() { return calloc(1, sizeof(kpdecode_cursor)); }
+struct kpdecode_record_pool {
+  kpdecode_record* free_list;  // the recycled records, linked by kpdecode_record.next
+  char* slabs;                 // the slabs, linked by the first pointer of each slab
+  char* slab_ptr;              // pointer to the next unused record in the current slab
+  char* slab_end;              // pointer to the end of the current slab
+  size_t records_per_slab;
+  uint32_t refcount;  // the creator and the cursors using this pool
+  uint64_t live;      // records allocated and not yet returned
+  uint64_t hits;      // allocations served by a recycled record
+  uint64_t misses;    // allocations served by a never used record
+};
 
-void kpdecode_cursor_free(kpdecode_cursor* cursor) { free(cursor); }
+// the records start at the second cache line of the slab, after the `next slab` pointer
+#define KPERFDATA_POOL_SLAB_HEADER_SIZE 64
 
-long kpdecode_cursor_setchunk(kpdecode_cursor* cursor, const char* bytes, size_t size) {
+static void kpdecode_record_pool_retain(kpdecode_record_pool* pool) { ++pool->refcount; }
+
+static void kpdecode_record_pool_try_destroy(kpdecode_record_pool* pool) {
+  if (pool->refcount != 0 || pool->live != 0) {
+    return;
+  }
+  char* slab = pool->slabs;
+  while (slab != NULL) {
+    char* next_slab = *(char**)slab;
+    free(slab);
+    slab = next_slab;
+  }
+  free(pool);
+}
+
+static void kpdecode_record_pool_release(kpdecode_record_pool* pool) {
+  --pool->refcount;
+  kpdecode_record_pool_try_destroy(pool);
+}
+
+kpdecode_record_pool* kpdecode_record_pool_create(size_t records_per_slab) {
+  kpdecode_record_pool* pool = calloc(1, sizeof(kpdecode_record_pool));
+  if (pool) {
+    pool->records_per_slab = records_per_slab ? records_per_slab : KPERFDATA_POOL_RECORDS_PRE_SLAB;
+    pool->refcount = 1;
+  }
+  return pool;
+}
+
+void kpdecode_record_pool_free(kpdecode_record_pool* pool) {
+  if (pool) {
+    kpdecode_record_pool_release(pool);
+  }
+}
+
+long kpdecode_record_pool_get_stats(kpdecode_record_pool* pool, int key) {
+  if (pool == NULL) {
+    return KPERFDATA_RET_FAIL;
+  }
+  switch (key) {
+    case KPERFDATA_POOL_STATS_HITS:
+      return pool->hits;
+    case KPERFDATA_POOL_STATS_MISSES:
+      return pool->misses;
+    case KPERFDATA_POOL_STATS_LIVE:
+      return pool->live;
+    default:
+      return KPERFDATA_RET_FAIL;
+  }
+}
+
+static void kpdecode_record_reset(kpdecode_record* record) {
+  // clear everything except the payload of frames[] and counterv[], which are only valid up to
+  // `nframes` and `counterc`, this saves 4KB+ of memset per record.
+  char* base = (char*)record;
+  size_t ucallstack_frames = offsetof(kpdecode_record, ucallstack.frames);
+  size_t kcallstack = offsetof(kpdecode_record, kcallstack);
+  size_t kcallstack_frames = offsetof(kpdecode_record, kcallstack.frames);
+  size_t pmc_counters = offsetof(kpdecode_record, pmc_counters);
+  size_t pmc_counterv = offsetof(kpdecode_record, pmc_counters.counterv);
+  size_t pmc_config = offsetof(kpdecode_record, pmc_config);
+  memset(base, 0, ucallstack_frames);
+  memset(base + kcallstack, 0, kcallstack_frames - kcallstack);
+  memset(base + pmc_counters, 0, pmc_counterv - pmc_counters);
+  memset(base + pmc_config, 0, sizeof(kpdecode_record) - pmc_config);
+}
+
+kpdecode_record* kpdecode_record_pool_alloc(kpdecode_record_pool* pool) {
+  kpdecode_record* record = pool->free_list;
+  if (record != NULL) {
+    pool->free_list = (kpdecode_record*)record->next;
+    ++pool->hits;
+  } else {
+    if (pool->slab_ptr == pool->slab_end) {
+      size_t slab_size =
+          KPERFDATA_POOL_SLAB_HEADER_SIZE + pool->records_per_slab * sizeof(kpdecode_record);
+      char* slab = malloc(slab_size);
+      if (!slab) {
+        return NULL;
+      }
+      *(char**)slab = pool->slabs;
+      pool->slabs = slab;
+      pool->slab_ptr = slab + KPERFDATA_POOL_SLAB_HEADER_SIZE;
+      pool->slab_end = slab + slab_size;
+    }
+    record = (kpdecode_record*)pool->slab_ptr;
+    pool->slab_ptr += sizeof(kpdecode_record);
+    ++pool->misses;
+  }
+  ++pool->live;
+  kpdecode_record_reset(record);
+  record->pool = pool;
+  return record;
+}
+
+static void kpdecode_record_pool_recycle(kpdecode_record_pool* pool, kpdecode_record* record) {
+  record->next = (struct kpdecode_record*)pool->free_list;
+  pool->free_list = record;
+  --pool->live;
+  kpdecode_record_pool_try_destroy(pool);
+}
+
+typedef struct kpdecode_slim_chunk kpdecode_slim_chunk;
+
+struct kpdecode_slim_chunk {
+  uint32_t refcount;  // slim records (headers or side buffers) allocated from this chunk
+  uint32_t retired;   // whether the cursor has moved on to another chunk
+  size_t used;
+  size_t capacity;
+  char* data;  // aligned to the cache line
+};
+
+#define KPERFDATA_SLIM_ALIGN(s, a) (((s) + ((a)-1)) & ~(size_t)((a)-1))
+
+static void kpdecode_slim_chunk_release(kpdecode_slim_chunk* chunk) {
+  if (--chunk->refcount == 0) {
+    if (chunk->retired) {
+      free(chunk);
+    } else {
+      chunk->used = 0;  // rewind the current chunk, every record allocated from it has been freed
+    }
+  }
+}
+
+static void kpdecode_slim_chunk_retire(kpdecode_slim_chunk* chunk) {
+  chunk->retired = 1;
+  if (chunk->refcount == 0) {
+    free(chunk);
+  }
+}
+
+static void* kpdecode_slim_alloc(kpdecode_cursor* cursor, size_t size, size_t align,
+                                 kpdecode_slim_chunk** out_chunk) {
+  kpdecode_slim_chunk* chunk = cursor->slim_chunk;
+  size_t offset = chunk ? KPERFDATA_SLIM_ALIGN(chunk->used, align) : 0;
+  if (chunk == NULL || offset > chunk->capacity || chunk->capacity - offset < size) {
+    size_t capacity = size > KPERFDATA_SLIM_CHUNK_SIZE ? size : KPERFDATA_SLIM_CHUNK_SIZE;
+    kpdecode_slim_chunk* new_chunk = malloc(sizeof(kpdecode_slim_chunk) + 63 + capacity);
+    if (!new_chunk) {
+      return NULL;
+    }
+    new_chunk->data = (char*)(((uintptr_t)(new_chunk + 1) + 63) & ~(uintptr_t)63);
+    new_chunk->refcount = 0;
+    new_chunk->retired = 0;
+    new_chunk->used = 0;
+    new_chunk->capacity = capacity;
+    if (chunk != NULL) {
+      kpdecode_slim_chunk_retire(chunk);
+    }
+    cursor->slim_chunk = chunk = new_chunk;
+    offset = 0;
+  }
+  void* ptr = chunk->data + offset;
+  chunk->used = offset + size;
+  ++chunk->refcount;
+  *out_chunk = chunk;
+  return ptr;
+}
+
+struct kpdecode_chunk {
+  const char* bytes;
+  size_t size;
+  bool owned;  // a buffer of the file opened by the cursor, never returned to the caller
+  kpdecode_chunk* next;
+};
+
+// Get the i-th pending record slot, 0 is the first one
+#define KPERFDATA_RECORD_RING_SLOT(cursor, i) \
+  (&(cursor)->record_ring[((cursor)->record_ring_head + (i)) & (cursor)->record_ring_mask])
+
+// Append a slot to the end of the pending records ring
+static kpdecode_record_slot* kpdecode_cursor_push_slot(kpdecode_cursor* cursor) {
+  uint32_t capacity = cursor->record_ring ? cursor->record_ring_mask + 1 : 0;
+  if (cursor->kpdecode_record_count == capacity) {
+    // the ring is sized to hold KPERFDATA_MAX_RECORDS + 1 records, only grows if a caller keeps
+    // appending records without popping any
+    uint32_t new_capacity = capacity ? capacity * 2 : KPERFDATA_RECORD_RING_SIZE;
+    kpdecode_record_slot* ring = malloc(sizeof(kpdecode_record_slot) * new_capacity);
+    if (!ring) {
+      return NULL;
+    }
+    for (uint32_t i = 0; i < capacity; ++i) {
+      ring[i] = *KPERFDATA_RECORD_RING_SLOT(cursor, i);
+    }
+    free(cursor->record_ring);
+    cursor->record_ring = ring;
+    cursor->record_ring_head = 0;
+    cursor->record_ring_mask = new_capacity - 1;
+  }
+  return KPERFDATA_RECORD_RING_SLOT(cursor, cursor->kpdecode_record_count++);
+}
+
+// Remove the first slot of the pending records ring
+static kpdecode_record_slot kpdecode_cursor_shift_slot(kpdecode_cursor* cursor) {
+  kpdecode_record_slot slot = cursor->record_ring[cursor->record_ring_head];
+  cursor->record_ring_head = (cursor->record_ring_head + 1) & cursor->record_ring_mask;
+  --cursor->kpdecode_record_count;
+  return slot;
+}
+
+static kpdecode_record* kpdecode_record_alloc(kpdecode_cursor* cursor) {
+  if (cursor->record_pool != NULL) {
+    return kpdecode_record_pool_alloc(cursor->record_pool);
+  }
+  return (kpdecode_record*)calloc(1, sizeof(kpdecode_record));
+}
+
+kpdecode_cursor* kpdecode_cursor_create() {
+  kpdecode_cursor* cursor = calloc(1, sizeof(kpdecode_cursor));
+  if (cursor) {
+    cursor->record_pool = kpdecode_record_pool_create(0);  // owned by this cursor
+    if (!cursor->record_pool) {
+      free(cursor);
+      return NULL;
+    }
+  }
+  return cursor;
+}
+
+long kpdecode_cursor_reserve_cpus(kpdecode_cursor* cursor, uint32_t cpu_count) {
+  if (cpu_count <= cursor->cpu_count) {
+    return KPERFDATA_RET_OK;
+  }
+  if (cpu_count > KPERFDATA_MAX_CPUS) {
+    return KPERFDATA_RET_FAIL;
+  }
+  assert(sizeof(kpdecode_cpu) == KPERFDATA_CACHE_LINE_SIZE);
+  // grow by powers of two, most traces stay within the first allocation
+  uint32_t new_count = cursor->cpu_count ? cursor->cpu_count : 8;
+  while (new_count < cpu_count) {
+    new_count <<= 1;
+  }
+  size_t size = sizeof(kpdecode_cpu) * new_count;
+  void* allocation = malloc(size + KPERFDATA_CACHE_LINE_SIZE - 1);
+  if (!allocation) {
+    return KPERFDATA_RET_OOM;
+  }
+  kpdecode_cpu* cpus = (kpdecode_cpu*)(((uintptr_t)allocation + KPERFDATA_CACHE_LINE_SIZE - 1) &
+                                       ~(uintptr_t)(KPERFDATA_CACHE_LINE_SIZE - 1));
+  memset(cpus, 0, size);
+  if (cursor->cpu_count) {
+    memcpy(cpus, cursor->cpus, sizeof(kpdecode_cpu) * cursor->cpu_count);
+  }
+  free(cursor->cpus_allocation);
+  cursor->cpus_allocation = allocation;
+  cursor->cpus = cpus;
+  cursor->cpu_count = new_count;
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_cursor_free(kpdecode_cursor* cursor) {
+  kpdecode_cursor_close_file(cursor);
+
+  // release the pending records
+  for (uint32_t i = 0; i < cursor->kpdecode_record_count; ++i) {
+    kpdecode_record_slot* slot = KPERFDATA_RECORD_RING_SLOT(cursor, i);
+    if (cursor->slim_records) {
+      kpdecode_slim_record_free(slot->slim_record);
+    } else {
+      kpdecode_record_free(slot->record);
+    }
+  }
+  free(cursor->record_ring);
+  if (cursor->reorder) {
+    kpdecode_record_slot slot;
+    while (kpdecode_reorder_pop(cursor->reorder, true, &slot)) {
+      if (cursor->slim_records) {
+        kpdecode_slim_record_free(slot.slim_record);
+      } else {
+        kpdecode_record_free(slot.record);
+      }
+    }
+    kpdecode_reorder_free(cursor->reorder);
+  }
+  if (cursor->slim_chunk) {
+    kpdecode_slim_chunk_retire(cursor->slim_chunk);
+  }
+  if (cursor->record_pool) {
+    kpdecode_record_pool_release(cursor->record_pool);
+  }
+  free(cursor->attached_chunk);
+  while (cursor->chunk_queue_head != NULL) {
+    kpdecode_chunk* chunk = cursor->chunk_queue_head;
+    cursor->chunk_queue_head = chunk->next;
+    free(chunk);
+  }
+  while (cursor->consumed_chunk_head != NULL) {
+    kpdecode_chunk* chunk = cursor->consumed_chunk_head;
+    cursor->consumed_chunk_head = chunk->next;
+    free(chunk);
+  }
+  free(cursor->header_buffer);
+  kpdecode_threadmap_free(cursor->threadmap);
+  kpdecode_stack_table_free(cursor->stacks);
+  kpdecode_dispatch_free(cursor->dispatch);
+  free(cursor->kd_buf_staging);
+  free(cursor->seek_pending);
+  free(cursor->cpus_allocation);
+  free(cursor);
+}
+
+long kpdecode_cursor_set_record_pool(kpdecode_cursor* cursor, kpdecode_record_pool* pool) {
+  if (pool) {
+    kpdecode_record_pool_retain(pool);
+  }
+  if (cursor->record_pool) {
+    kpdecode_record_pool_release(cursor->record_pool);
+  }
+  cursor->record_pool = pool;
+  return KPERFDATA_RET_OK;
+}
+
+// Attach the chunk to decode next
+static void kpdecode_cursor_attachchunk(kpdecode_cursor* cursor, kpdecode_chunk* chunk) {
+  chunk->next = NULL;
+  cursor->attached_chunk = chunk;
+  cursor->buffer = chunk->bytes;
+  cursor->unknown_28 = 0;
+  cursor->buffer_size = chunk->size;
+  cursor->buffer_size1 = chunk->size;
+  cursor->cur_kd_buf_ptr = (char*)chunk->bytes;
+}
+
+static long kpdecode_cursor_queuechunk(kpdecode_cursor* cursor, const char* bytes, size_t size,
+                                       bool owned) {
+  // the node is allocated up front, so that retiring the chunk once decoded can not fail
+  kpdecode_chunk* chunk = malloc(sizeof(kpdecode_chunk));
+  if (!chunk) {
+    return KPERFDATA_RET_OOM;
+  }
+  chunk->bytes = bytes;
+  chunk->size = size;
+  chunk->owned = owned;
+  chunk->next = NULL;
   if (cursor->buffer == NULL) {
-    cursor->buffer = bytes;
-    cursor->unknown_28 = 0;
-    cursor->buffer_size = size;
-    cursor->buffer_size1 = size;
-    cursor->cur_kd_buf_ptr = (char*)bytes;
+    kpdecode_cursor_attachchunk(cursor, chunk);
     return KPERFDATA_RET_OK;
   }
-  return KPERFDATA_RET_FAIL;
+
+  // queue it after the attached chunk
+  if (cursor->chunk_queue_tail != NULL) {
+    cursor->chunk_queue_tail->next = chunk;
+  } else {
+    cursor->chunk_queue_head = chunk;
+  }
+  cursor->chunk_queue_tail = chunk;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_setchunk(kpdecode_cursor* cursor, const char* bytes, size_t size) {
+  return kpdecode_cursor_queuechunk(cursor, bytes, size, false);
+}
+
+long kpdecode_cursor_set_owned_chunk(kpdecode_cursor* cursor, const char* bytes, size_t size) {
+  return kpdecode_cursor_queuechunk(cursor, bytes, size, true);
+}
+
+// Detach the attached chunk and attach the next queued chunk, if any, return the node of the
+// detached chunk
+static kpdecode_chunk* kpdecode_cursor_shiftchunk(kpdecode_cursor* cursor) {
+  kpdecode_chunk* detached = cursor->attached_chunk;
+  cursor->attached_chunk = NULL;
+  cursor->buffer = NULL;
+  cursor->cur_kd_buf_ptr = NULL;
+  kpdecode_chunk* chunk = cursor->chunk_queue_head;
+  if (chunk != NULL) {
+    cursor->chunk_queue_head = chunk->next;
+    if (cursor->chunk_queue_head == NULL) {
+      cursor->chunk_queue_tail = NULL;
+    }
+    kpdecode_cursor_attachchunk(cursor, chunk);
+  }
+  return detached;
+}
+
+// Move the attached chunk, which has been fully decoded, to the consumed list
+static void kpdecode_cursor_retirechunk(kpdecode_cursor* cursor) {
+  kpdecode_chunk* chunk = kpdecode_cursor_shiftchunk(cursor);
+  if (cursor->consumed_chunk_tail != NULL) {
+    cursor->consumed_chunk_tail->next = chunk;
+  } else {
+    cursor->consumed_chunk_head = chunk;
+  }
+  cursor->consumed_chunk_tail = chunk;
 }
 
 char* kpdecode_cursor_clearchunk(kpdecode_cursor* cursor) {
   char* chunk = NULL;
+  if (cursor->buffer && cursor->attached_chunk->owned) {
+    return NULL;  // decoded until kpdecode_cursor_close_file()
+  }
   if (cursor->buffer) {
     chunk = (char*)cursor->buffer;
-    cursor->cur_kd_buf_ptr = NULL;
-    cursor->end_kd_threadmap_ptr = NULL;
     cursor->unknown_28 = 0;
-    cursor->buffer = NULL;
-    cursor->threadmap_decoded = 1;
+    free(kpdecode_cursor_shiftchunk(cursor));
+  } else {
+    chunk = kpdecode_cursor_popchunk(cursor);
   }
   return chunk;
 }
 
+static void kpdecode_chunk_list_remove(kpdecode_chunk** head, kpdecode_chunk** tail,
+                                       const char* bytes) {
+  kpdecode_chunk* prev = NULL;
+  for (kpdecode_chunk* chunk = *head; chunk != NULL; prev = chunk, chunk = chunk->next) {
+    if (chunk->bytes == bytes) {
+      if (prev != NULL) {
+        prev->next = chunk->next;
+      } else {
+        *head = chunk->next;
+      }
+      if (*tail == chunk) {
+        *tail = prev;
+      }
+      free(chunk);
+      return;
+    }
+  }
+}
+
+void kpdecode_cursor_dropchunk(kpdecode_cursor* cursor, const char* bytes) {
+  if (cursor->buffer == bytes) {
+    free(kpdecode_cursor_shiftchunk(cursor));
+    return;
+  }
+  kpdecode_chunk_list_remove(&cursor->chunk_queue_head, &cursor->chunk_queue_tail, bytes);
+  kpdecode_chunk_list_remove(&cursor->consumed_chunk_head, &cursor->consumed_chunk_tail, bytes);
+}
+
+// Pop the oldest consumed chunk owned, or not owned, by the cursor
+static char* kpdecode_cursor_pop_consumed(kpdecode_cursor* cursor, bool owned) {
+  kpdecode_chunk* prev = NULL;
+  kpdecode_chunk* chunk = cursor->consumed_chunk_head;
+  while (chunk != NULL && chunk->owned != owned) {
+    prev = chunk;
+    chunk = chunk->next;
+  }
+  if (chunk == NULL) {
+    return NULL;
+  }
+  char* bytes = (char*)chunk->bytes;
+  if (prev != NULL) {
+    prev->next = chunk->next;
+  } else {
+    cursor->consumed_chunk_head = chunk->next;
+  }
+  if (cursor->consumed_chunk_tail == chunk) {
+    cursor->consumed_chunk_tail = prev;
+  }
+  free(chunk);
+  return bytes;
+}
+
+char* kpdecode_cursor_popchunk(kpdecode_cursor* cursor) {
+  return kpdecode_cursor_pop_consumed(cursor, false);
+}
+
+char* kpdecode_cursor_pop_owned_chunk(kpdecode_cursor* cursor) {
+  return kpdecode_cursor_pop_consumed(cursor, true);
+}
+
 long kpdecode_cursor_get_stats(kpdecode_cursor* cursor, int arg2) {
   if (arg2 == 1) {
     if (cursor->header_decoded) {
@@ -56,9 +507,14 @@ long kpdecode_cursor_get_stats(kpdecode_cursor* cursor, int arg2) {
     }
   } else if (arg2 == 0) {
     if (cursor->header_decoded) {
-      kpdecode_record* first_record = cursor->kpdeocde_record_head;
-      if (first_record) {
-        return first_record->total_size_of_kevents;
+      if (cursor->kpdecode_record_count != 0) {
+        kpdecode_record_slot* first_slot = KPERFDATA_RECORD_RING_SLOT(cursor, 0);
+        if (!cursor->slim_records) {
+          return first_slot->record->total_size_of_kevents;
+        }
+        kpdecode_slim_record* first_slim_record = first_slot->slim_record;
+        return first_slim_record->pending ? first_slim_record->pending->total_size_of_kevents
+                                          : first_slim_record->total_size_of_kevents;
       } else {
         return cursor->size_of_kd_buf * cursor->kevent_count;
       }
@@ -68,6 +524,54 @@ long kpdecode_cursor_get_stats(kpdecode_cursor* cursor, int arg2) {
 }
 
 long kpdecode_cursor_set_option(kpdecode_cursor* cursor, int arg2, long arg3) {
+  if (arg2 == KPERFDATA_OPTION_SLIM_RECORDS) {
+    if (cursor->kpdecode_record_count != 0) {
+      return KPERFDATA_RET_FAIL;  // can not switch the mode with pending records
+    }
+    long old_value = cursor->slim_records;
+    cursor->slim_records = arg3 != 0;
+    return old_value;
+  }
+  if (arg2 == KPERFDATA_OPTION_REORDER_WINDOW) {
+    if (arg3 < 0 || (cursor->reorder && kpdecode_reorder_count(cursor->reorder) != 0)) {
+      return KPERFDATA_RET_FAIL;  // can not change the window with buffered records
+    }
+    long old_value = (long)cursor->reorder_window;
+    if (cursor->reorder) {
+      kpdecode_reorder_free(cursor->reorder);
+      cursor->reorder = NULL;
+    }
+    cursor->reorder_window = 0;
+    if (arg3 != 0) {
+      cursor->reorder = kpdecode_reorder_create((uint64_t)arg3);
+      if (!cursor->reorder) {
+        return KPERFDATA_RET_FAIL;
+      }
+      cursor->reorder_window = (uint64_t)arg3;
+    }
+    return old_value;
+  }
+  if (arg2 == KPERFDATA_OPTION_SKIP_THREADMAP) {
+    long old_value = cursor->skip_threadmap;
+    cursor->skip_threadmap = arg3 != 0;
+    return old_value;
+  }
+  if (arg2 == KPERFDATA_OPTION_TASK_NAMES) {
+    long old_value = cursor->fill_task_names;
+    cursor->fill_task_names = arg3 != 0;
+    return old_value;
+  }
+  if (arg2 == KPERFDATA_OPTION_INTERN_STACKS) {
+    long old_value = cursor->intern_stacks;
+    if (arg3 != 0 && !cursor->stacks) {
+      cursor->stacks = kpdecode_stack_table_create();
+      if (!cursor->stacks) {
+        return KPERFDATA_RET_FAIL;
+      }
+    }
+    cursor->intern_stacks = arg3 != 0;
+    return old_value;
+  }
   if (arg2 != 0) {
     long old_value = cursor->unknown_option;
     cursor->unknown_option = arg3 != 0;
@@ -81,40 +585,492 @@ void kpdecode_record_free(kpdecode_record* record) {
   if (unknown_field2) {
     free(unknown_field2);
   }
-  free(record);
+  if (record->pool) {
+    kpdecode_record_pool_recycle(record->pool, record);
+  } else {
+    free(record);
+  }
 }
 
 void kpdecode_cursor_flush() {
   // pass
 }
 
+// Move the fields of the full record into the slim record, and release the full record
+static long kpdecode_slim_record_compact(kpdecode_cursor* cursor, kpdecode_slim_record* slim) {
+  kpdecode_record* record = slim->pending;
+  uint32_t unframes = record->ucallstack.nframes;
+  uint32_t knframes = record->kcallstack.nframes;
+  uint32_t counterc = record->pmc_counters.counterc > 0 ? record->pmc_counters.counterc : 0;
+  if (unframes > 256) unframes = 256;
+  if (knframes > 256) knframes = 256;
+  if (counterc > 32) counterc = 32;
+
+  slim->flags = record->flags;
+  slim->timestamp = record->timestamp;
+  slim->tid = record->tid;
+  slim->cpuid = record->cpuid;
+  slim->debugid = record->kd_buf.debugid;
+  memcpy(slim->args, record->kd_buf.args, sizeof(slim->args));
+  slim->actionid = record->kperf_sample_args.actionid;
+  slim->pid = record->kperf_thread_info.kpthi_pid;
+  slim->ucallstack_flags = record->ucallstack.flags;
+  slim->ucallstack_nframes = unframes;
+  slim->kcallstack_flags = record->kcallstack.flags;
+  slim->kcallstack_nframes = knframes;
+  slim->pmc_counterc = counterc;
+  slim->ready = record->ready;
+  slim->last_timestamp = record->unknown_field20.unknown_field1;
+  slim->total_size_of_kevents = record->total_size_of_kevents;
+
+  // the interned callstacks are shared with the stack table, only the counters are copied
+  if (cursor->intern_stacks) {
+    uint32_t nframes;
+    if (kpdecode_stack_table_intern(cursor->stacks, record->ucallstack.frames, unframes,
+                                    &slim->ucallstack_id) != KPERFDATA_RET_OK ||
+        kpdecode_stack_table_intern(cursor->stacks, record->kcallstack.frames, knframes,
+                                    &slim->kcallstack_id) != KPERFDATA_RET_OK) {
+      return KPERFDATA_RET_OOM;
+    }
+    kpdecode_stack_table_get(cursor->stacks, slim->ucallstack_id, &slim->ucallstack_frames,
+                             &nframes);
+    kpdecode_stack_table_get(cursor->stacks, slim->kcallstack_id, &slim->kcallstack_frames,
+                             &nframes);
+    unframes = 0;
+    knframes = 0;
+  }
+
+  size_t side_size = sizeof(unsigned long long) * (unframes + knframes + counterc);
+  if (side_size != 0) {
+    unsigned long long* side = kpdecode_slim_alloc(cursor, side_size, 8, &slim->side_chunk);
+    if (!side) {
+      return KPERFDATA_RET_OOM;
+    }
+    if (!cursor->intern_stacks) {
+      memcpy(side, record->ucallstack.frames, sizeof(unsigned long long) * unframes);
+      slim->ucallstack_frames = side;
+      side += unframes;
+      memcpy(side, record->kcallstack.frames, sizeof(unsigned long long) * knframes);
+      slim->kcallstack_frames = side;
+      side += knframes;
+    }
+    memcpy(side, record->pmc_counters.counterv, sizeof(unsigned long long) * counterc);
+    slim->pmc_counterv = side;
+  }
+
+  slim->pending = NULL;
+  record->slim = NULL;
+  kpdecode_record_free(record);
+  return KPERFDATA_RET_OK;
+}
+
+// Called when a record is no longer referenced by the per-cpu state, no more kevents will be
+// merged into it.
+static void kpdecode_cursor_release_record(kpdecode_cursor* cursor, kpdecode_record* record) {
+  if (record->slim != NULL) {
+    kpdecode_slim_record_compact(cursor, record->slim);  // on OOM, retried by the pop
+  }
+}
+
+// Remove the references to a record from the per-cpu state
+static void kpdecode_cursor_forget_record(kpdecode_cursor* cursor, kpdecode_record* record,
+                                          uint32_t cpuid) {
+  if (cpuid < cursor->cpu_count) {
+    kpdecode_cpu* cpu = &cursor->cpus[cpuid];
+    if (cpu->unknown_c8 == record) cpu->unknown_c8 = NULL;
+    if (cpu->unknown_2c8 == record) cpu->unknown_2c8 = NULL;
+    if (cpu->unknown_4c8 == record) cpu->unknown_4c8 = NULL;
+  }
+}
+
+// Remove the references to the records from the per-cpu state of a cpu
+static void kpdecode_cursor_forget_cpu(kpdecode_cursor* cursor, uint32_t cpuid) {
+  if (cpuid < cursor->cpu_count) {
+    kpdecode_cpu* cpu = &cursor->cpus[cpuid];
+    cpu->unknown_c8 = NULL;
+    cpu->unknown_2c8 = NULL;
+    cpu->unknown_4c8 = NULL;
+  }
+}
+
+static long kpdecode_cursor_append_slim_record(kpdecode_cursor* cursor, kpdecode_record* record,
+                                               uint32_t cpuid) {
+  kpdecode_slim_chunk* chunk;
+  kpdecode_slim_record* slim =
+      kpdecode_slim_alloc(cursor, sizeof(kpdecode_slim_record), 64, &chunk);
+  kpdecode_record_slot* slot = slim ? kpdecode_cursor_push_slot(cursor) : NULL;
+  if (!slot) {
+    if (slim) {
+      kpdecode_slim_chunk_release(chunk);
+    }
+    kpdecode_cursor_forget_record(cursor, record, cpuid);
+    kpdecode_record_free(record);
+    return KPERFDATA_RET_OOM;
+  }
+  memset(slim, 0, sizeof(kpdecode_slim_record));
+  slim->chunk = chunk;
+  slim->pending = record;
+  record->slim = slim;
+  slot->slim_record = slim;
+
+  // compact it right now unless the per-cpu state still refers to it
+  kpdecode_cpu* cpu = cpuid < cursor->cpu_count ? &cursor->cpus[cpuid] : NULL;
+  if (cpu == NULL ||
+      (cpu->unknown_c8 != record && cpu->unknown_2c8 != record && cpu->unknown_4c8 != record)) {
+    kpdecode_slim_record_compact(cursor, slim);
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static bool slim_record_ready(kpdecode_cursor* cursor) {
+  if (cursor->kpdecode_record_count == 0) {
+    return false;
+  }
+  kpdecode_slim_record* first_record = KPERFDATA_RECORD_RING_SLOT(cursor, 0)->slim_record;
+  kpdecode_record* pending = first_record->pending;
+  if (pending ? pending->ready : first_record->ready) {
+    return true;
+  }
+
+  if (cursor->kpdecode_record_count <= KPERFDATA_MAX_RECORDS) {
+    return false;
+  } else {
+    first_record->flags |= 0x8000000000000000;
+    first_record->ready = true;
+    if (pending != NULL) {
+      pending->flags |= 0x8000000000000000;
+      pending->ready = true;
+      kpdecode_cursor_forget_cpu(cursor, pending->cpuid);
+    }
+    return true;
+  }
+}
+
+void kpdecode_slim_record_free(kpdecode_slim_record* record) {
+  if (record->pending) {
+    kpdecode_record_free(record->pending);
+  }
+  if (record->side_chunk) {
+    kpdecode_slim_chunk_release(record->side_chunk);
+  }
+  kpdecode_slim_chunk_release(record->chunk);
+}
+
 static bool record_ready(kpdecode_cursor* cursor) {
   if (!cursor->header_decoded) {
     return false;
   }
 
-  kpdecode_record* first_record = cursor->kpdeocde_record_head;
-  if (first_record == NULL) {
-    return false;
+  if (cursor->slim_records) {
+    return slim_record_ready(cursor);
+  }
+
+  if (cursor->kpdecode_record_count == 0) {
+    return false;
+  }
+  kpdecode_record* first_record = KPERFDATA_RECORD_RING_SLOT(cursor, 0)->record;
+  if (first_record->ready) {
+    return true;
+  }
+
+  if (cursor->kpdecode_record_count <= KPERFDATA_MAX_RECORDS) {
+    return false;
+  } else {
+    first_record->flags |= 0x8000000000000000;
+    first_record->ready = true;
+    kpdecode_cursor_forget_cpu(cursor, first_record->cpuid);
+    return true;
+  }
+}
+
+// Check whether `size` bytes have been received after the read position, reading ahead if needed
+static bool kpdecode_cursor_available(kpdecode_cursor* cursor, uint64_t size) {
+  while (true) {
+    uint64_t available = 0;
+    if (cursor->buffer != NULL) {
+      available = cursor->buffer + cursor->buffer_size - cursor->cur_kd_buf_ptr;
+      for (kpdecode_chunk* chunk = cursor->chunk_queue_head; chunk != NULL && available < size;
+           chunk = chunk->next) {
+        available += chunk->size;
+      }
+    }
+    if (available >= size || !kpdecode_cursor_read_ahead(cursor)) {
+      return available >= size;
+    }
+  }
+}
+
+// Get `size` contiguous bytes at the read position, they are copied into `scratch` if they
+// straddle several chunks. Return NULL if not enough bytes have been received yet.
+static const char* kpdecode_cursor_peek(kpdecode_cursor* cursor, uint64_t size, char* scratch) {
+  if (cursor->buffer == NULL && !kpdecode_cursor_available(cursor, size)) {
+    return NULL;
+  }
+  const char* ptr = cursor->cur_kd_buf_ptr;
+  uint64_t remaining = cursor->buffer + cursor->buffer_size - ptr;
+  if (remaining >= size) {
+    return ptr;  // in place
+  }
+  if (!kpdecode_cursor_available(cursor, size)) {
+    return NULL;
+  }
+  uint64_t copied = 0;
+  kpdecode_chunk* chunk = cursor->chunk_queue_head;
+  while (true) {
+    uint64_t n = remaining < size - copied ? remaining : size - copied;
+    memcpy(scratch + copied, ptr, n);
+    copied += n;
+    if (copied == size) {
+      break;
+    }
+    ptr = chunk->bytes;
+    remaining = chunk->size;
+    chunk = chunk->next;
+  }
+  return scratch;
+}
+
+// Consume up to `size` bytes at the read position, return the number of bytes consumed
+static uint64_t kpdecode_cursor_skip(kpdecode_cursor* cursor, uint64_t size) {
+  uint64_t skipped = 0;
+  while (cursor->buffer != NULL || (skipped < size && kpdecode_cursor_read_ahead(cursor))) {
+    uint64_t remaining = cursor->buffer + cursor->buffer_size - cursor->cur_kd_buf_ptr;
+    if (size - skipped < remaining) {
+      cursor->cur_kd_buf_ptr += size - skipped;
+      skipped = size;
+      break;
+    }
+    skipped += remaining;
+    kpdecode_cursor_retirechunk(cursor);  // this chunk has been fully decoded
+  }
+  cursor->stream_offset += skipped;
+  return skipped;
+}
+
+// Decode the RAW_header, and copy it along with the kd_threadmap[] into the cursor, so that the
+// chunks holding them can be released. KPERFDATA_RET_NOT_READY until the whole threadmap is there.
+static long kpdecode_cursor_decode_header(kpdecode_cursor* cursor) {
+  char header_bytes[KPERFDATA_SIZEOF_RAW_HEADER_V2];
+  const char* buffer = kpdecode_cursor_peek(cursor, sizeof(uint32_t), header_bytes);
+  if (buffer == NULL) {
+    return KPERFDATA_RET_NOT_READY;
+  }
+  uint32_t version = *(uint32_t*)buffer;
+
+  uint32_t header_size;
+  if (version == KPERFDATA_RAW_VERSION2) {
+    header_size = KPERFDATA_SIZEOF_RAW_HEADER_V2;
+  } else if (version == KPERFDATA_RAW_VERSION1) {
+    header_size = KPERFDATA_SIZEOF_RAW_HEADER_V1;
+  } else {
+    return KPERFDATA_RET_NOT_READY;  // unknown version
+  }
+  buffer = kpdecode_cursor_peek(cursor, header_size, header_bytes);
+  if (buffer == NULL) {
+    return KPERFDATA_RET_NOT_READY;
+  }
+
+  int thread_count;
+  uint32_t size_of_kd_threadmap;
+  uint32_t size_of_kd_buf;
+  int state;
+  if (version == KPERFDATA_RAW_VERSION2) {
+    RAW_header_v2* header = (RAW_header_v2*)buffer;
+    thread_count = header->thread_count;
+    bool is64bit = (header->flags & KPERFDATA_IS_64BIT) == KPERFDATA_IS_64BIT;
+    if (is64bit) {
+      state = KPERFDATA_STATE_64_BIT_HEADER;
+      size_of_kd_threadmap = sizeof(kd_threadmap_64);
+      size_of_kd_buf = sizeof(kd_buf_64);
+    } else {
+      state = KPERFDATA_STATE_32_BIT_HEADER;
+      size_of_kd_threadmap = sizeof(kd_threadmap_32);
+      size_of_kd_buf = sizeof(kd_buf_32);
+    }
+  } else {  // KPERFDATA_RAW_VERSION1
+    RAW_header_v1* header = (RAW_header_v1*)buffer;
+    thread_count = header->thread_count;
+    state = KPERFDATA_STATE_64_BIT_HEADER;
+    size_of_kd_threadmap = sizeof(kd_threadmap_64);
+    size_of_kd_buf = sizeof(kd_buf_64);
+  }
+  if (thread_count < 0) {
+    thread_count = 0;
+  }
+
+  uint64_t threadmap_size = (uint64_t)size_of_kd_threadmap * thread_count;
+  uint64_t header_and_threadmap_size = header_size + threadmap_size;
+  if (!kpdecode_cursor_available(cursor, header_and_threadmap_size)) {
+    return KPERFDATA_RET_NOT_READY;  // wait for the whole threadmap
+  }
+  char* header_buffer = malloc(header_and_threadmap_size);
+  if (!header_buffer) {
+    return KPERFDATA_RET_OOM;
+  }
+  if (state == KPERFDATA_STATE_32_BIT_HEADER) {
+    cursor->kd_buf_staging = malloc(sizeof(kd_buf_64) * KPERFDATA_WIDEN_BLOCK_SIZE);
+    if (!cursor->kd_buf_staging) {
+      free(header_buffer);
+      return KPERFDATA_RET_OOM;
+    }
+    cursor->widen_kd_buf_32 = kpdecode_select_widen_kd_buf_32();
+  }
+  buffer = kpdecode_cursor_peek(cursor, header_and_threadmap_size, header_buffer);
+  if (buffer != header_buffer) {
+    memcpy(header_buffer, buffer, header_and_threadmap_size);
+  }
+  kpdecode_threadmap* threadmap =
+      kpdecode_threadmap_create(header_buffer + header_size, size_of_kd_threadmap, thread_count);
+  if (!threadmap) {
+    free(header_buffer);
+    free(cursor->kd_buf_staging);
+    cursor->kd_buf_staging = NULL;
+    return KPERFDATA_RET_OOM;
+  }
+  kpdecode_cursor_skip(cursor, header_and_threadmap_size);
+
+  cursor->state = state;
+  cursor->size_of_kd_threadmap = size_of_kd_threadmap;
+  cursor->size_of_kd_buf = size_of_kd_buf;
+  cursor->header_decoded = 1;
+  cursor->buffer_ptr = (char**)&cursor->buffer;
+  cursor->header_buffer = header_buffer;
+  cursor->threadmap = threadmap;
+  cursor->threadmap_thread_count = kpdecode_threadmap_entry_count(threadmap);
+
+  // the kd_buf[] starts at the next page boundary
+  uint64_t RAW_file_offset = KPERFDATA_PAGE_ALIGN(header_and_threadmap_size);
+  cursor->skip_size = RAW_file_offset - header_and_threadmap_size;
+
+  char* threadmap_ptr = header_buffer + header_size;
+  cursor->cur_kd_threadmap_ptr = threadmap_ptr;
+  cursor->end_kd_threadmap_ptr = threadmap_ptr + threadmap_size;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_take_kd_bufs(kpdecode_cursor* cursor, const char** kd_bufs,
+                                  uint64_t* kd_bufs_size) {
+  if (cursor->state != KPERFDATA_STATE_HEADER_NOT_DECODED || cursor->buffer == NULL ||
+      cursor->chunk_queue_head != NULL) {
+    return KPERFDATA_RET_FAIL;
+  }
+  long ret = kpdecode_cursor_decode_header(cursor);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret == KPERFDATA_RET_OOM ? ret : KPERFDATA_RET_FAIL;  // or truncated
+  }
+  uint64_t remaining = cursor->buffer + cursor->buffer_size - cursor->cur_kd_buf_ptr;
+  if (cursor->skip_size > remaining) {
+    return KPERFDATA_RET_FAIL;
+  }
+  *kd_bufs = cursor->cur_kd_buf_ptr + cursor->skip_size;
+  *kd_bufs_size = remaining - cursor->skip_size;
+  kpdecode_cursor_skip(cursor, remaining);  // the shards decode the chunk instead
+  cursor->skip_size = 0;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_seek_kd_buf(kpdecode_cursor* cursor, uint64_t kd_buf_index) {
+  if (cursor->state != KPERFDATA_STATE_HEADER_NOT_DECODED) {
+    return KPERFDATA_RET_FAIL;
+  }
+  long ret = kpdecode_cursor_decode_header(cursor);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret == KPERFDATA_RET_OOM ? ret : KPERFDATA_RET_FAIL;
+  }
+  uint64_t size = cursor->skip_size + kd_buf_index * cursor->size_of_kd_buf;
+  if (!kpdecode_cursor_available(cursor, size)) {
+    return KPERFDATA_RET_FAIL;
+  }
+  kpdecode_cursor_skip(cursor, size);
+  cursor->skip_size = 0;
+  cursor->threadmap_decoded = true;
+  return KPERFDATA_RET_OK;
+}
+
+kpdecode_cursor* kpdecode_cursor_create_shard(const kpdecode_cursor* cursor,
+                                              bool replay_threadmap) {
+  kpdecode_cursor* shard = kpdecode_cursor_create();
+  if (!shard) {
+    return NULL;
+  }
+  if (cursor->state == KPERFDATA_STATE_32_BIT_HEADER) {
+    shard->kd_buf_staging = malloc(sizeof(kd_buf_64) * KPERFDATA_WIDEN_BLOCK_SIZE);
+    if (!shard->kd_buf_staging) {
+      kpdecode_cursor_free(shard);
+      return NULL;
+    }
+    shard->widen_kd_buf_32 = cursor->widen_kd_buf_32;
+  }
+  shard->state = cursor->state;
+  shard->size_of_kd_threadmap = cursor->size_of_kd_threadmap;
+  shard->size_of_kd_buf = cursor->size_of_kd_buf;
+  shard->header_decoded = 1;
+  shard->buffer_ptr = (char**)&shard->buffer;
+  if (replay_threadmap) {
+    // the kd_threadmap[] stays in the header_buffer of `cursor`
+    shard->cur_kd_threadmap_ptr = cursor->cur_kd_threadmap_ptr;
+    shard->end_kd_threadmap_ptr = cursor->end_kd_threadmap_ptr;
+  } else {
+    shard->threadmap_decoded = true;
+  }
+  shard->threadmap_thread_count = cursor->threadmap_thread_count;
+  shard->skip_threadmap = cursor->skip_threadmap;
+  shard->unknown_option = cursor->unknown_option;
+  memcpy(shard->debugid_filter_masks, cursor->debugid_filter_masks,
+         sizeof(cursor->debugid_filter_masks));
+  memcpy(shard->debugid_filter_values, cursor->debugid_filter_values,
+         sizeof(cursor->debugid_filter_values));
+  shard->debugid_filter_count = cursor->debugid_filter_count;
+  shard->scan_debugids = cursor->scan_debugids;
+  if (cursor->dispatch != NULL) {
+    shard->dispatch = kpdecode_dispatch_copy(cursor->dispatch);
+    if (!shard->dispatch) {
+      kpdecode_cursor_free(shard);
+      return NULL;
+    }
+  }
+  return shard;
+}
+
+// Widen the next block of kd_buf_32 into the kd_buf_64 staging. The block is copied out of the
+// chunk, so the chunk can be retired as soon as its last kd_buf_32 is widened.
+static bool kpdecode_cursor_fill_staging(kpdecode_cursor* cursor) {
+  const kd_buf_32* kd_buf;
+  size_t count = 0;
+  if (cursor->buffer != NULL) {
+    count = (cursor->buffer + cursor->buffer_size - cursor->cur_kd_buf_ptr) / sizeof(kd_buf_32);
   }
-  if (first_record->ready) {
-    return true;
+  if (count != 0) {
+    if (count > KPERFDATA_WIDEN_BLOCK_SIZE) {
+      count = KPERFDATA_WIDEN_BLOCK_SIZE;
+    }
+    kd_buf = (const kd_buf_32*)cursor->cur_kd_buf_ptr;
+  } else {
+    // the kd_buf_32 straddles two chunks
+    kd_buf = (const kd_buf_32*)kpdecode_cursor_peek(cursor, sizeof(kd_buf_32),
+                                                    (char*)&cursor->kd_buf_carry);
+    if (kd_buf == NULL) {
+      return false;
+    }
+    count = 1;
   }
+  cursor->widen_kd_buf_32(cursor->kd_buf_staging, kd_buf, count);
+  kpdecode_cursor_skip(cursor, count * sizeof(kd_buf_32));
+  cursor->staging_index = 0;
+  cursor->staging_count = (uint32_t)count;
+  return true;
+}
 
-  if (cursor->kpdecode_record_count <= KPERFDATA_MAX_RECORDS) {
-    return false;
-  } else {
-    first_record->flags |= 0x8000000000000000;
-    first_record->ready = true;
-    uint32_t cpuid = first_record->cpuid;
-    cursor->unknown_c8[cpuid] = 0;
-    cursor->unknown_2c8[cpuid] = 0;
-    cursor->unknown_4c8[cpuid] = 0;
-    return true;
+// Decode the header once it is available, the kevents are read after it
+static long kpdecode_cursor_read_header(kpdecode_cursor* cursor) {
+  if (cursor->state != KPERFDATA_STATE_HEADER_NOT_DECODED) {
+    return KPERFDATA_RET_OK;
   }
+  long ret = kpdecode_cursor_decode_header(cursor);
+  return ret == KPERFDATA_RET_OOM ? ret : KPERFDATA_RET_OK;  // otherwise wait for more bytes
 }
 
-static kd_buf* kpdecode_cursor_next_kevent(kpdecode_cursor* cursor) {
+static kd_buf* kpdecode_cursor_read_any_kevent(kpdecode_cursor* cursor) {
   assert(sizeof(RAW_header_v1) == KPERFDATA_SIZEOF_RAW_HEADER_V1);
   assert(sizeof(RAW_header_v2) + 0x100 == KPERFDATA_SIZEOF_RAW_HEADER_V2);
   assert(sizeof(kd_threadmap_32) == KPERFDATA_SIZEOF_KD_THREADMAP_32);
@@ -122,80 +1078,19 @@ static kd_buf* kpdecode_cursor_next_kevent(kpdecode_cursor* cursor) {
   assert(sizeof(kd_buf_32) == KPERFDATA_SIZEOF_KD_BUF_32);
   assert(sizeof(kd_buf_64) == KPERFDATA_SIZEOF_KD_BUF_64);
 
-  char* buffer = (char*)cursor->buffer;
-  if (buffer == NULL) {
-    return NULL;
-  }
-
-  // decode header
-  if (cursor->state == KPERFDATA_STATE_HEADER_NOT_DECODED) {
-    uint64_t size = cursor->buffer_size;
-    if (size >= sizeof(RAW_header_v2)) {
-      uint32_t version = *(uint32_t*)buffer;
-
-      uint32_t header_size;
-      int thread_count;
-      uint32_t size_of_kd_threadmap;
-      uint32_t size_of_kd_buf;
-      int state;
-      if (version == KPERFDATA_RAW_VERSION2) {
-        RAW_header_v2* header = (RAW_header_v2*)buffer;
-        thread_count = header->thread_count;
-        header_size = sizeof(RAW_header_v2);
-        bool is64bit = (header->flags & KPERFDATA_IS_64BIT) == KPERFDATA_IS_64BIT;
-        if (is64bit) {
-          state = KPERFDATA_STATE_64_BIT_HEADER;
-          size_of_kd_threadmap = sizeof(kd_threadmap_64);
-          size_of_kd_buf = sizeof(kd_buf_64);
-        } else {
-          state = KPERFDATA_STATE_32_BIT_HEADER;
-          size_of_kd_threadmap = sizeof(kd_threadmap_32);
-          size_of_kd_buf = sizeof(kd_buf_32);
-        }
-      } else if (version == KPERFDATA_RAW_VERSION1) {
-        RAW_header_v1* header = (RAW_header_v1*)buffer;
-        thread_count = header->thread_count;
-        header_size = sizeof(RAW_header_v1);
-        state = KPERFDATA_STATE_64_BIT_HEADER;
-        size_of_kd_threadmap = sizeof(kd_threadmap_64);
-        size_of_kd_buf = sizeof(kd_buf_64);
-      } else {
-        state = KPERFDATA_STATE_HEADER_NOT_DECODED;  // unknown version
-      }
-
-      if (state > KPERFDATA_STATE_HEADER_NOT_DECODED) {
-        cursor->state = state;
-        cursor->size_of_kd_threadmap = size_of_kd_threadmap;
-        cursor->size_of_kd_buf = size_of_kd_buf;
-
-        uint32_t threadmap_size = size_of_kd_threadmap * thread_count;
-        uint32_t RAW_file_offset =
-            KPERFDATA_PAGE_ALIGN(header_size + threadmap_size);  // TODO: test it
-
-        cursor->header_decoded = 1;
-        cursor->buffer_ptr = *((char*)cursor->buffer);
-
-        char* RAW_file_ptr = buffer + RAW_file_offset;
-        char* kd_buf_ptr = NULL;
-        if (size >= RAW_file_offset + size_of_kd_buf) {  // includes at least one complete kd_buf
-          kd_buf_ptr = RAW_file_ptr;
-        }
-        cursor->cur_kd_buf_ptr = kd_buf_ptr;
-
-        char* threadmap_ptr = buffer + header_size;
-        cursor->cur_kd_threadmap_ptr = threadmap_ptr;
-        cursor->end_kd_threadmap_ptr = threadmap_ptr + threadmap_size;
-      }  // endif (state > 0)
-    }  // endif (size >= KPERFDATA_SIZEOF_RAW_HEADER_V2)
-  }  // endif (cursor->state == 0)
-
-  // The header has already been decoded
+  // The header is decoded by the callers, see kpdecode_cursor_read_header()
   if (!cursor->header_decoded) {
     return NULL;
   }
 
   // decode threadmap
   bool is32bit = cursor->state == KPERFDATA_STATE_32_BIT_HEADER;
+  if (!cursor->threadmap_decoded && cursor->cur_kd_threadmap_ptr != NULL &&
+      cursor->skip_threadmap) {
+    // the valid entries are counted as if they had been read
+    cursor->kevent_count += cursor->threadmap_thread_count;
+    cursor->threadmap_decoded = true;
+  }
   if (!cursor->threadmap_decoded && cursor->cur_kd_threadmap_ptr != NULL) {
     char* cur_threadmap_ptr;
     while (true) {
@@ -220,6 +1115,9 @@ static kd_buf* kpdecode_cursor_next_kevent(kpdecode_cursor* cursor) {
         command = threadmap->command;
       }
 
+      // step to the next item in the threadmap
+      cursor->cur_kd_threadmap_ptr = cur_threadmap_ptr + cursor->size_of_kd_threadmap;
+
       if (valid) {
         kd_buf* kevent = &cursor->kd_buf;
         kevent->timestamp = 0;
@@ -236,56 +1134,447 @@ static kd_buf* kpdecode_cursor_next_kevent(kpdecode_cursor* cursor) {
         // |     kd_buf.arg1        |      kd_buf.arg2      |       kd_buf.arg3     |       kd_buf.arg4      |
         // |-------------------------------------------------------------------------------------------------|
         // clang-format on
-        kevent->arg1 = *(uint64_t*)(command);
-        kevent->arg2 = *(uint64_t*)(command + 8);
-        kevent->arg3 = *(uint64_t*)(command + 16);
+        kevent->arg1 = 0;
+        kevent->arg2 = 0;
+        kevent->arg3 = 0;
+        kevent->arg4 = 0;
+        memcpy(&kevent->arg1, command, sizeof(((kd_threadmap_64*)0)->command));
         return kevent;  // return this threadmap as a kevent
-      }  // else (invalid):
-      // step to the next item in the threadmap
-      cursor->cur_kd_threadmap_ptr = cur_threadmap_ptr + cursor->size_of_kd_threadmap;
+      }  // else (invalid): continue
     }  // end of while
   }  // endif (!cursor->threadmap_decoded && cursor->cur_kd_threadmap_ptr != NULL)
 
+  // skip the padding between the threadmap and the first kd_buf
+  if (cursor->skip_size != 0) {
+    cursor->skip_size -= kpdecode_cursor_skip(cursor, cursor->skip_size);
+    if (cursor->skip_size != 0) {
+      return NULL;  // wait for the next chunk
+    }
+  }
+
   // decode kd_buf
-  char* cur_kd_buf_ptr = cursor->cur_kd_buf_ptr;
-  if (cur_kd_buf_ptr != NULL) {
-    kd_buf* kevent;
-    if (is32bit) {
-      // on 32-bit, we need copy the data from kd_buf_32 in buffer to the kd_buf_64 in cursor
-      kd_buf_32* kd_buf = (kd_buf_32*)kd_buf;
-      kevent = &cursor->kd_buf;
-      kevent->timestamp = kd_buf->timestamp & KPERFDATA_TIMESTAMP_MASK;
-      kevent->arg1 = (uint64_t)kd_buf->arg1;
-      kevent->arg2 = (uint64_t)kd_buf->arg2;
-      kevent->arg3 = (uint64_t)kd_buf->arg3;
-      kevent->arg4 = (uint64_t)kd_buf->arg4;
-      kevent->arg5 = (uint64_t)kd_buf->arg5;
-      kevent->debugid = kd_buf->debugid;
-      kevent->cpuid = (uint32_t)((kd_buf->timestamp & KPERFDATA_CPU_MASK) >> KPERFDATA_CPU_SHIFT);
-    } else {  // is64Bit
-      // on 64-bit, we just return the pointer to kd_buf in buffer, no need to copy it
-      kd_buf_64* kd_buf = (kd_buf_64*)kd_buf;
-      kevent = kd_buf;
-    }
-
-    char* next_kd_buf_ptr = cur_kd_buf_ptr + cursor->size_of_kd_buf;
-    char* end_of_buffer = *cursor->buffer_ptr + cursor->buffer_size1;
-    if (next_kd_buf_ptr >= end_of_buffer) {
-      cursor->cur_kd_buf_ptr = NULL;  // EOF
-    } else {
-      cursor->cur_kd_buf_ptr = next_kd_buf_ptr;  // step to the next item in the kd_buf
+  if (is32bit) {
+    // on 32-bit, the kd_buf_32 are widened a block at a time into the kd_buf_64 staging
+    if (cursor->staging_index == cursor->staging_count && !kpdecode_cursor_fill_staging(cursor)) {
+      return NULL;  // wait for the next chunk
     }
+    return &cursor->kd_buf_staging[cursor->staging_index++];
+  }
 
-    return kevent;
-  }  // endif (cur_kd_buf_ptr != NULL)
-  return NULL;
+  // on 64-bit, we just return the pointer to kd_buf in buffer, no need to copy it
+  const char* cur_kd_buf_ptr = cursor->cur_kd_buf_ptr;
+  if (cursor->buffer != NULL &&
+      (size_t)(cursor->buffer + cursor->buffer_size - cur_kd_buf_ptr) > sizeof(kd_buf_64)) {
+    // fast path: the kd_buf is inside the chunk, and it's not the last one
+    cursor->cur_kd_buf_ptr += sizeof(kd_buf_64);  // step to the next item in the kd_buf
+    cursor->stream_offset += sizeof(kd_buf_64);
+  } else {
+    // slow path: the kd_buf may straddle two chunks, or it's the last one of this chunk
+    cur_kd_buf_ptr = kpdecode_cursor_peek(cursor, sizeof(kd_buf_64), (char*)&cursor->kd_buf_carry);
+    if (cur_kd_buf_ptr == NULL) {
+      return NULL;  // wait for the next chunk
+    }
+    kpdecode_cursor_skip(cursor, sizeof(kd_buf_64));
+  }
+  return (kd_buf*)cur_kd_buf_ptr;
 }
 
-long kpdecode_cursor_next_record(kpdecode_cursor* cursor, kpdecode_record** next_record) {
-  int ret;
+// Skip the kevents rejected by the debugid filters in bulk, inside the chunk or the staging, so
+// that the next kevent read is either accepted or straddles two chunks
+static void kpdecode_cursor_skip_rejected(kpdecode_cursor* cursor) {
+  if (!cursor->threadmap_decoded || cursor->skip_size != 0) {
+    return;
+  }
+  const uint32_t* masks = cursor->debugid_filter_masks;
+  const uint32_t* values = cursor->debugid_filter_values;
+  uint32_t filter_count = cursor->debugid_filter_count;
+  if (cursor->state == KPERFDATA_STATE_32_BIT_HEADER) {
+    while (true) {
+      if (cursor->staging_index == cursor->staging_count &&
+          !kpdecode_cursor_fill_staging(cursor)) {
+        return;
+      }
+      size_t count = cursor->staging_count - cursor->staging_index;
+      size_t index = cursor->scan_debugids(&cursor->kd_buf_staging[cursor->staging_index], count,
+                                           masks, values, filter_count, 1);
+      cursor->staging_index += (uint32_t)index;
+      cursor->kevent_count += index;
+      if (index < count) {
+        return;
+      }
+    }
+  }
+  while (cursor->buffer != NULL) {
+    size_t count =
+        (cursor->buffer + cursor->buffer_size - cursor->cur_kd_buf_ptr) / sizeof(kd_buf_64);
+    if (count == 0) {
+      return;  // the next kd_buf straddles two chunks
+    }
+    size_t index = cursor->scan_debugids((const kd_buf_64*)cursor->cur_kd_buf_ptr, count, masks,
+                                         values, filter_count, 1);
+    kpdecode_cursor_skip(cursor, index * sizeof(kd_buf_64));  // retires the chunk at its end
+    cursor->kevent_count += index;
+    if (index < count) {
+      return;
+    }
+  }
+}
+
+// The number of leading kevents of kevents[count] accepted by the debugid filters
+static size_t kpdecode_cursor_accepted_run(kpdecode_cursor* cursor, const kd_buf_64* kevents,
+                                           size_t count) {
+  return cursor->scan_debugids(kevents, count, cursor->debugid_filter_masks,
+                               cursor->debugid_filter_values, cursor->debugid_filter_count, 0);
+}
+
+// Read the next kevent accepted by the debugid filters
+static kd_buf* kpdecode_cursor_read_kevent(kpdecode_cursor* cursor) {
+  if (cursor->debugid_filter_count == 0) {
+    return kpdecode_cursor_read_any_kevent(cursor);
+  }
+  while (true) {
+    kpdecode_cursor_skip_rejected(cursor);
+    kd_buf* kevent = kpdecode_cursor_read_any_kevent(cursor);
+    if (kevent == NULL ||
+        kpdecode_debugid_filter_match(cursor->debugid_filter_masks, cursor->debugid_filter_values,
+                                      cursor->debugid_filter_count, kevent->debugid)) {
+      return kevent;
+    }
+    cursor->kevent_count += 1;  // a threadmap entry, or a kd_buf straddling two chunks
+  }
+}
+
+long kpdecode_cursor_add_debugid_filter(kpdecode_cursor* cursor, uint32_t debugid_mask,
+                                        uint32_t debugid) {
+  if (cursor->debugid_filter_count == KPERFDATA_MAX_DEBUGID_FILTERS) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (cursor->scan_debugids == NULL) {
+    cursor->scan_debugids = kpdecode_select_scan_debugids();
+  }
+  cursor->debugid_filter_masks[cursor->debugid_filter_count] = debugid_mask;
+  cursor->debugid_filter_values[cursor->debugid_filter_count] = debugid & debugid_mask;
+  cursor->debugid_filter_count += 1;
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_cursor_clear_debugid_filters(kpdecode_cursor* cursor) {
+  cursor->debugid_filter_count = 0;
+}
+
+static long kpdecode_cursor_append_record(kpdecode_cursor* cursor, kpdecode_record* record,
+                                          uint32_t cpuid) {
+  if (cursor->slim_records) {
+    return kpdecode_cursor_append_slim_record(cursor, record, cpuid);
+  }
+  kpdecode_record_slot* slot = kpdecode_cursor_push_slot(cursor);
+  if (!slot) {
+    kpdecode_cursor_forget_record(cursor, record, cpuid);
+    kpdecode_record_free(record);
+    return KPERFDATA_RET_OOM;
+  }
+  slot->record = record;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_next_kevent(kpdecode_cursor* cursor, const kd_buf** next_kevent) {
+  if (kpdecode_cursor_read_header(cursor) != KPERFDATA_RET_OK) {
+    return KPERFDATA_RET_OOM;
+  }
+  kd_buf* kevent = kpdecode_cursor_read_kevent(cursor);
+  if (kevent == NULL) {
+    return KPERFDATA_RET_NOT_READY;
+  }
+  cursor->kevent_count += 1;
+  *next_kevent = kevent;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_next_kevents(kpdecode_cursor* cursor, const kd_buf** next_kevents,
+                                  size_t max_kevents, size_t* kevent_count) {
+  *kevent_count = 0;
+  if (max_kevents == 0) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (cursor->debugid_filter_count != 0) {
+    kpdecode_cursor_skip_rejected(cursor);
+  }
+
+  // fast path: a run of kd_buf_64 inside the chunk
+  if (cursor->state == KPERFDATA_STATE_64_BIT_HEADER && cursor->threadmap_decoded &&
+      cursor->skip_size == 0 && cursor->buffer != NULL) {
+    const char* cur_kd_buf_ptr = cursor->cur_kd_buf_ptr;
+    size_t count = (cursor->buffer + cursor->buffer_size - cur_kd_buf_ptr) / sizeof(kd_buf_64);
+    if (count != 0) {
+      if (count > max_kevents) {
+        count = max_kevents;
+      }
+      if (cursor->debugid_filter_count != 0) {
+        count = kpdecode_cursor_accepted_run(cursor, (const kd_buf_64*)cur_kd_buf_ptr, count);
+      }
+    }
+    if (count != 0) {
+      kpdecode_cursor_skip(cursor, count * sizeof(kd_buf_64));  // retires the chunk at its end
+      cursor->kevent_count += count;
+      *next_kevents = (const kd_buf*)cur_kd_buf_ptr;
+      *kevent_count = count;
+      return KPERFDATA_RET_OK;
+    }
+  }
+
+  // a run of widened kd_buf_32 from the staging
+  if (cursor->state == KPERFDATA_STATE_32_BIT_HEADER && cursor->threadmap_decoded &&
+      cursor->skip_size == 0) {
+    if (cursor->staging_index == cursor->staging_count && !kpdecode_cursor_fill_staging(cursor)) {
+      return KPERFDATA_RET_NOT_READY;
+    }
+    const kd_buf_64* kevents = &cursor->kd_buf_staging[cursor->staging_index];
+    size_t count = cursor->staging_count - cursor->staging_index;
+    if (count > max_kevents) {
+      count = max_kevents;
+    }
+    if (cursor->debugid_filter_count != 0) {
+      count = kpdecode_cursor_accepted_run(cursor, kevents, count);
+    }
+    if (count != 0) {
+      cursor->staging_index += (uint32_t)count;
+      cursor->kevent_count += count;
+      *next_kevents = kevents;
+      *kevent_count = count;
+      return KPERFDATA_RET_OK;
+    }
+  }
+
+  // slow path: a threadmap entry, or a kd_buf straddling two chunks
+  long ret = kpdecode_cursor_next_kevent(cursor, next_kevents);
+  if (ret == KPERFDATA_RET_OK) {
+    *kevent_count = 1;
+  }
+  return ret;
+}
+
+void kpdecode_cursor_complete_sample(kpdecode_cursor* cursor, uint32_t cpuid, bool lost) {
+  if (cpuid >= cursor->cpu_count) {
+    return;
+  }
+  kpdecode_record* cpu_record = cursor->cpus[cpuid].unknown_c8;
+  if (cpu_record != NULL) {
+    if (lost) {
+      cpu_record->flags |= 0x8000000000000000;
+    }
+    cpu_record->ready = true;
+    cursor->cpus[cpuid].unknown_c8 = NULL;
+    kpdecode_cursor_release_record(cursor, cpu_record);
+  }
+}
+
+int kpdecode_sample_event(uint32_t debugid) {
+  switch (debugid) {
+    case KPERFDATA_PERF_GEN_EVENT_START:
+      return KPERFDATA_SAMPLE_EVENT_START;
+    case KPERFDATA_PERF_GEN_EVENT_END:
+      return KPERFDATA_SAMPLE_EVENT_END;
+    case KPERFDATA_TRACE_LOST_EVENTS:
+      return KPERFDATA_SAMPLE_EVENT_LOST;
+    default:
+      return KPERFDATA_SAMPLE_EVENT_NONE;
+  }
+}
+
+bool kpdecode_kevent_counted(const kd_buf* kevent) {
+  return kevent->timestamp != 0 &&
+         kevent->debugid != KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 153, 0, 0);
+}
+
+static long kpdecode_handle_lost_events(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                        kpdecode_record* record, const kd_buf* kevent,
+                                        void* context) {
+  (void)context;
+  // clang-format off
+  // |---------------------------------------------------------------------------------------------|
+  // | Class: DBG_TRACE | SubClass: DBG_TRACE_INFO | Code: TRACE_LOST_EVENTS | Func: DBG_FUNC_NONE |
+  // | Arg1: -          | Arg2: -                  | Arg3: -                 | Arg4: -             |
+  // |---------------------------------------------------------------------------------------------|
+  // clang-format on
+  //
+  // Emit a lost events tracepoint to indicate that previous events were lost -- the thread map
+  // cannot be trusted.
+  record->flags |= 0x0000000000010003;
+  record->cpuid = kevent->cpuid;
+  record->unknown_field20.unknown_field1 = cpu->unknown_8c8;
+  record->ready = true;
+  kpdecode_cursor_complete_sample(cursor, kevent->cpuid, true);
+
+  kpdecode_record* cpu_record1 = cpu->unknown_2c8;
+  if (cpu_record1 != NULL) {
+    cpu_record1->flags |= 0x8000000000000000;
+    cpu_record1->ready = true;
+    cpu->unknown_2c8 = NULL;
+    kpdecode_cursor_release_record(cursor, cpu_record1);
+
+    kpdecode_record* cpu_record2 = cpu->unknown_4c8;
+    if (cpu_record2 != NULL) {
+      cpu_record2->flags |= 0x8000000000000000;
+      cpu->unknown_4c8 = NULL;
+      kpdecode_cursor_release_record(cursor, cpu_record2);
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static long kpdecode_handle_sample_start(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                         kpdecode_record* record, const kd_buf* kevent,
+                                         void* context) {
+  (void)cursor;
+  (void)context;
+  // clang-format off
+  // |---------------------------------------------------------------------------------------------|
+  // | Class: PERF_GENERIC | SubClass: PERF_GENERIC | Code: PERF_GEN_EVENT | Func: DBG_FUNC_START  |
+  // | Arg1: sample_what   | Arg2: actionid         | Arg3: userdata       | Arg4: sample_flags    |
+  // |---------------------------------------------------------------------------------------------|
+  // clang-format on
+  //
+  // Before calling kperf_sample_internal() and kperf_sample_user_internal()
+  if (cpu->unknown_c8 != NULL) {
+    return KPERFDATA_RET_SAMPLE_PENDING;
+  }
+  cpu->unknown_c8 = record;  // save the first record of this cpu
+  cpu->kcallstack_left = 0;
+  cpu->ucallstack_left = 0;
+  record->flags |= 0x0000000000002007;
+  record->cpuid = kevent->cpuid;
+  record->kperf_sample_args.actionid = kevent->arg2;
+  record->tid = kevent->arg5;
+  return KPERFDATA_RET_OK;
+}
+
+static long kpdecode_handle_sample_end(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                       kpdecode_record* record, const kd_buf* kevent,
+                                       void* context) {
+  (void)cpu;
+  (void)record;
+  (void)context;
+  // clang-format off
+  // |---------------------------------------------------------------------------------------------|
+  // | Class: PERF_GENERIC | SubClass: PERF_GENERIC | Code: PERF_GEN_EVENT | Func: DBG_FUNC_END    |
+  // | Arg1: sample_what   | Arg2: -                | Arg3: -              | Arg4: -               |
+  // |---------------------------------------------------------------------------------------------|
+  // clang-format on
+  //
+  // After kperf_sample_internal(), the sample of this cpu is complete
+  kpdecode_cursor_complete_sample(cursor, kevent->cpuid, false);
+  return KPERFDATA_RET_OK;
+}
+
+// Start a callstack of the sample, its frames are expected in the next data kevents
+static void kpdecode_callstack_start(kpdecode_callstack* callstack, uint32_t* left,
+                                     kpdecode_record* sample, const kd_buf* kevent) {
+  uint64_t nframes = kevent->arg2;
+  callstack->flags = (unsigned int)kevent->arg1;
+  callstack->nframes = 0;
+  *left = nframes < KPERFDATA_MAX_CALLSTACK_FRAMES ? (uint32_t)nframes
+                                                   : KPERFDATA_MAX_CALLSTACK_FRAMES;
+  sample->xcallstack_hdr.callstack_nframes = (unsigned int)nframes;
+  sample->xcallstack_hdr.unknown_field2 = (unsigned int)kevent->arg3;
+  sample->xcallstack_hdr.unknown_field3 = (unsigned int)kevent->arg4;
+}
+
+// Append the frames of a data kevent, up to the frames announced by the header and the room left
+static void kpdecode_callstack_append(kpdecode_callstack* callstack, uint32_t* left,
+                                      const kd_buf* kevent) {
+  const unsigned long long frames[4] = {kevent->arg1, kevent->arg2, kevent->arg3, kevent->arg4};
+  uint32_t room = KPERFDATA_MAX_CALLSTACK_FRAMES - callstack->nframes;
+  uint32_t count = *left < room ? *left : room;
+  unsigned long long* end = &callstack->frames[callstack->nframes];
+  if (count >= 4) {
+    memcpy(end, frames, sizeof(frames));
+    callstack->nframes += 4;
+    *left -= 4;
+  } else if (count != 0) {
+    memcpy(end, frames, sizeof(unsigned long long) * count);  // the padding of the last kevent
+    callstack->nframes += count;
+    *left -= count;
+  }
+}
+
+long kpdecode_cursor_decode_callstack(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                      kpdecode_record* record, const kd_buf* kevent,
+                                      void* context) {
+  (void)cursor;
+  (void)record;
+  (void)context;
+  // clang-format off
+  // |---------------------------------------------------------------------------------------------|
+  // | Class: PERF_CALLSTACK | SubClass: PERF_CALLSTACK | Code: PERF_CS_KHDR/UHDR | Func: -        |
+  // | Arg1: flags           | Arg2: nframes           | Arg3: -                 | Arg4: -        |
+  // |---------------------------------------------------------------------------------------------|
+  // | Class: PERF_CALLSTACK | SubClass: PERF_CALLSTACK | Code: PERF_CS_KDATA/UDATA | Func: -      |
+  // | Arg1: frames[i]       | Arg2: frames[i + 1]     | Arg3: frames[i + 2]       | Arg4: ...    |
+  // |---------------------------------------------------------------------------------------------|
+  // clang-format on
+  //
+  // Logged by kperf_kcallstack_log() and kperf_ucallstack_log(), inside the pending sample
+  kpdecode_record* sample = cpu->unknown_c8;
+  if (sample == NULL) {
+    return KPERFDATA_RET_OK;
+  }
+  switch (kevent->debugid) {
+    case KPERFDATA_PERF_CS_KHDR:
+      kpdecode_callstack_start(&sample->kcallstack, &cpu->kcallstack_left, sample, kevent);
+      break;
+    case KPERFDATA_PERF_CS_UHDR:
+      kpdecode_callstack_start(&sample->ucallstack, &cpu->ucallstack_left, sample, kevent);
+      break;
+    case KPERFDATA_PERF_CS_KDATA:
+      kpdecode_callstack_append(&sample->kcallstack, &cpu->kcallstack_left, kevent);
+      break;
+    case KPERFDATA_PERF_CS_UDATA:
+      kpdecode_callstack_append(&sample->ucallstack, &cpu->ucallstack_left, kevent);
+      break;
+    default:
+      break;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static const kpdecode_dispatch_entry kpdecode_trace_info_handlers[] = {
+    {KPERFDATA_DEBUGID_MASK, KPERFDATA_TRACE_LOST_EVENTS, kpdecode_handle_lost_events, NULL},
+};
+
+static const kpdecode_dispatch_entry kpdecode_perf_generic_handlers[] = {
+    {KPERFDATA_DEBUGID_MASK, KPERFDATA_PERF_GEN_EVENT_START, kpdecode_handle_sample_start, NULL},
+    {KPERFDATA_DEBUGID_MASK, KPERFDATA_PERF_GEN_EVENT_END, kpdecode_handle_sample_end, NULL},
+};
+
+static const kpdecode_dispatch_entry kpdecode_perf_callstack_handlers[] = {
+    {KPERFDATA_DEBUGID_SUBCLASS_MASK,
+     KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, KPERFDATA_PERF_CALLSTACK, 0, 0),
+     kpdecode_cursor_decode_callstack, NULL},
+};
+
+static const kpdecode_dispatch_slot kpdecode_trace_handlers[256] = {
+    [KPERFDATA_DEBUGID_SUBCLASS(KPERFDATA_TRACE_LOST_EVENTS)] = {kpdecode_trace_info_handlers, 1},
+};
+
+static const kpdecode_dispatch_slot kpdecode_perf_handlers[256] = {
+    [KPERFDATA_DEBUGID_SUBCLASS(KPERFDATA_PERF_GEN_EVENT_START)] = {kpdecode_perf_generic_handlers,
+                                                                    2},
+    [KPERFDATA_PERF_CALLSTACK] = {kpdecode_perf_callstack_handlers, 1},
+};
+
+const kpdecode_dispatch kpdecode_builtin_dispatch = {{
+    [KPERFDATA_DBG_TRACE] = kpdecode_trace_handlers,
+    [KPERFDATA_DBG_PERF] = kpdecode_perf_handlers,
+}};
+
+// Decode the kevents until the first record is ready
+long kpdecode_cursor_decode_records(kpdecode_cursor* cursor) {
+  if (kpdecode_cursor_read_header(cursor) != KPERFDATA_RET_OK) {
+    return KPERFDATA_RET_OOM;
+  }
   kd_buf* kevent = NULL;
   while (!record_ready(cursor)) {
-    kevent = kpdecode_cursor_next_kevent(cursor);
+    kevent = kpdecode_cursor_read_kevent(cursor);
     if (kevent == NULL) {
       break;
     }
@@ -293,8 +1582,7 @@ long kpdecode_cursor_next_record(kpdecode_cursor* cursor, kpdecode_record** next
     // Got a new kevent
     cursor->kevent_count += 1;
 
-    kpdecode_record* record =
-        (kpdecode_record*)calloc(1, sizeof(kpdecode_cursor));  // malloc(sizeof(kpdecode_record));
+    kpdecode_record* record = kpdecode_record_alloc(cursor);
     if (!record) {
       return KPERFDATA_RET_OOM;
     }
@@ -314,29 +1602,32 @@ long kpdecode_cursor_next_record(kpdecode_cursor* cursor, kpdecode_record** next
       record->tid = kevent->arg5;
       record->cpuid = cpuid;
       record->ready = true;
-      // append a new record to the end of the linked list
-      KPERFDATA_LINKED_LIST_APPEND_ITEM(cursor, record);
+      // append a new record to the end of the pending records ring
+      if (kpdecode_cursor_append_record(cursor, record, cpuid) != KPERFDATA_RET_OK) {
+        return KPERFDATA_RET_OOM;
+      }
 
-      ret = 0;
-      goto SWITCH_CTRL;  // continue;
+      continue;
     }  // endif (cpuid >= KPERFDATA_MAX_CPUS)
 
-    if (timestamp) {
-      if (kevent->debugid != KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 153, 0, 0)) {
-        uint64_t kevent_count_pre_count = cursor->unknown_ac8[cpuid] + 1;
-        cursor->unknown_ac8[cpuid] = kevent_count_pre_count;
-        if (kevent_count_pre_count > cursor->unknown_cc8) {
-          cursor->unknown_cc8 = kevent_count_pre_count;
-        }
+    if (cpuid >= cursor->cpu_count &&
+        kpdecode_cursor_reserve_cpus(cursor, cpuid + 1) != KPERFDATA_RET_OK) {
+      kpdecode_record_free(record);
+      return KPERFDATA_RET_OOM;
+    }
+    kpdecode_cpu* cpu = &cursor->cpus[cpuid];
+
+    if (kpdecode_kevent_counted(kevent)) {
+      uint64_t kevent_count_pre_count = cpu->unknown_ac8 + 1;
+      cpu->unknown_ac8 = kevent_count_pre_count;
+      if (kevent_count_pre_count > cursor->unknown_cc8) {
+        cursor->unknown_cc8 = kevent_count_pre_count;
       }
     }
 
-    uint64_t flags;
-    uint32_t debugid;
+    uint32_t debugid = kevent->debugid;
     if (cursor->unknown_option != 0) {
-      flags = 0x0000000000000017;
-      record->flags = flags;
-      debugid = kevent->debugid;
+      record->flags = 0x0000000000000017;
       record->kd_buf.debugid = debugid;
       record->kd_buf.args[0] = kevent->arg1;
       record->kd_buf.args[1] = kevent->arg2;
@@ -344,111 +1635,337 @@ long kpdecode_cursor_next_record(kpdecode_cursor* cursor, kpdecode_record** next
       record->kd_buf.args[3] = kevent->arg4;
       record->tid = kevent->arg5;
       record->cpuid = cpuid;
-    } else {
-      flags = 0x0000000000000000;
-      debugid = kevent->debugid;
-    }
-
-    // the begin of the switch statement:
-
-    if (debugid == KPERFDATA_TRACE_LOST_EVENTS) {
-      // clang-format off
-      // |---------------------------------------------------------------------------------------------|
-      // | Class: DBG_TRACE | SubClass: DBG_TRACE_INFO | Code: TRACE_LOST_EVENTS | Func: DBG_FUNC_NONE |
-      // | Arg1: -          | Arg2: -                  | Arg3: -                 | Arg4: -             |
-      // |---------------------------------------------------------------------------------------------|
-      // clang-format on
-      //
-      // Emit a lost events tracepoint to indicate that previous events were lost -- the thread map
-      // cannot be trusted.
-      record->flags = flags | 0x0000000000010003;
-      record->cpuid = kevent->cpuid;
-      record->timestamp = timestamp;
-      record->unknown_field20.unknown_field1 = cursor->unknown_8c8[cpuid];
-      record->ready = true;
-      cursor->unknown_8c8[cpuid] = timestamp;
-      kpdecode_record* cpu_record = cursor->unknown_c8[cpuid];
-      if (cpu_record != NULL) {
-        cpu_record->flags |= 0x8000000000000000;
-        cpu_record->ready = true;
-        cursor->unknown_c8[cpuid] = NULL;
-      }
-
-      kpdecode_record* cpu_record1 = cursor->unknown_2c8[cpuid];
-      if (cpu_record1 != NULL) {
-        cpu_record->flags |= 0x8000000000000000;
-        cpu_record->ready = true;
-        cursor->unknown_2c8[cpuid] = NULL;
+    }
 
-        cursor->unknown_4c8[cpuid]->flags |= 0x8000000000000000;
-        cursor->unknown_2c8[cpuid] = NULL;
-        ret = 0;  // continue
-        goto NEXT_RECORD;
-      }
-      ret = 0;
-      goto SWITCH_CTRL;
-    }
-
-    cursor->unknown_8c8[cpuid] = timestamp;
-    if (debugid == KPERFDATA_PERF_GEN_EVENT_START) {
-      // clang-format off
-      // |---------------------------------------------------------------------------------------------|
-      // | Class: PERF_GENERIC | SubClass: PERF_GENERIC | Code: PERF_GEN_EVENT | Func: DBG_FUNC_START  |
-      // | Arg1: sample_what   | Arg2: actionid         | Arg3: userdata       | Arg4: sample_flags    |
-      // |---------------------------------------------------------------------------------------------|
-      // clang-format on
-      //
-      // Before calling kperf_sample_internal() and kperf_sample_user_internal()
-      if (cursor->unknown_c8[cpuid] != NULL) {
-        ret = 2;  // return
-        goto NEXT_RECORD;
+    // the last handler added for the debugid, in the slot of its class/subclass
+    const kpdecode_dispatch* dispatch =
+        cursor->dispatch != NULL ? cursor->dispatch : &kpdecode_builtin_dispatch;
+    const kpdecode_dispatch_slot* slots = dispatch->classes[KPERFDATA_DEBUGID_CLASS(debugid)];
+    long ret = KPERFDATA_RET_OK;
+    if (slots != NULL) {
+      const kpdecode_dispatch_slot* slot = &slots[KPERFDATA_DEBUGID_SUBCLASS(debugid)];
+      for (uint32_t i = slot->count; i-- > 0;) {
+        const kpdecode_dispatch_entry* entry = &slot->entries[i];
+        if ((debugid & entry->debugid_mask) == entry->debugid) {
+          ret = entry->handler(cursor, cpu, record, kevent, entry->context);
+          break;
+        }
       }
-      cursor->unknown_c8[cpuid] = record;  // save the first record of this cpu
-      record->flags = flags | 0x0000000000002007;
-      record->cpuid = kevent->cpuid;
-      record->kperf_sample_args.actionid = kevent->arg2;
-      record->tid = kevent->arg5;
-      ret = 0;  // continue
-      goto NEXT_RECORD;
     }
+    cpu->unknown_8c8 = timestamp;
 
-    // TODO: other cases
-
-  NEXT_RECORD:  // LABEL_113:
     if (record->flags != 0) {
       if (cursor->unknown_cc8 < KPERFDATA_MAX_RECORDS_PRE_CPU) {
         record->flags |= 0x0000000000020000;
       }
 
-      KPERFDATA_LINKED_LIST_APPEND_ITEM(cursor, record);
+      if (kpdecode_cursor_append_record(cursor, record, cpuid) != KPERFDATA_RET_OK) {
+        return KPERFDATA_RET_OOM;
+      }
     } else {
       kpdecode_record_free(record);
     }
-
-    // TODO: use a `switch` statement to get rid of the ugly `goto`.
-  SWITCH_CTRL:  // LABEL_122:
-    if (ret == 2) {
+    if (ret != KPERFDATA_RET_OK) {
       return ret;
-    } else if (ret == 1) {
-      break;
-    } else {  // ret == 0
-      continue;
     }
   }  // end while
+  return KPERFDATA_RET_OK;
+}
+
+kpdecode_record* kpdecode_cursor_first_record(kpdecode_cursor* cursor) {
+  return cursor->kpdecode_record_count ? KPERFDATA_RECORD_RING_SLOT(cursor, 0)->record : NULL;
+}
+
+kpdecode_record* kpdecode_cursor_shift_record(kpdecode_cursor* cursor) {
+  return kpdecode_cursor_shift_slot(cursor).record;
+}
+
+long kpdecode_cursor_move_records(kpdecode_cursor* cursor, kpdecode_cursor* from) {
+  while (from->kpdecode_record_count != 0) {
+    kpdecode_record_slot* slot = kpdecode_cursor_push_slot(cursor);
+    if (!slot) {
+      return KPERFDATA_RET_OOM;
+    }
+    *slot = kpdecode_cursor_shift_slot(from);
+  }
+  return KPERFDATA_RET_OK;
+}
+
+// Pop the first pending record, which must be ready, NULL on OOM
+static kpdecode_record* kpdecode_cursor_pop_record(kpdecode_cursor* cursor) {
+  kpdecode_record* record = KPERFDATA_RECORD_RING_SLOT(cursor, 0)->record;
+  if (cursor->fill_task_names && cursor->threadmap && record->task_info._field1.task_name[0] == 0) {
+    const kpdecode_thread* thread = kpdecode_threadmap_lookup(cursor->threadmap, record->tid);
+    if (thread) {
+      memcpy(record->task_info._field1.task_name, thread->command, sizeof(thread->command));
+    }
+  }
+  if (cursor->intern_stacks) {
+    // on failure the record stays first, as for kpdecode_cursor_pop_slim_record()
+    uint32_t unframes = record->ucallstack.nframes < 256 ? record->ucallstack.nframes : 256;
+    uint32_t knframes = record->kcallstack.nframes < 256 ? record->kcallstack.nframes : 256;
+    if (kpdecode_stack_table_intern(cursor->stacks, record->ucallstack.frames, unframes,
+                                    &record->ucallstack_id) != KPERFDATA_RET_OK ||
+        kpdecode_stack_table_intern(cursor->stacks, record->kcallstack.frames, knframes,
+                                    &record->kcallstack_id) != KPERFDATA_RET_OK) {
+      return NULL;
+    }
+  }
+  return kpdecode_cursor_shift_slot(cursor).record;
+}
+
+// Pop the first pending slim record, which must be ready
+static kpdecode_slim_record* kpdecode_cursor_pop_slim_record(kpdecode_cursor* cursor) {
+  kpdecode_slim_record* first_record = KPERFDATA_RECORD_RING_SLOT(cursor, 0)->slim_record;
+  if (first_record->pending != NULL) {
+    kpdecode_record* pending = first_record->pending;
+    kpdecode_cursor_forget_record(cursor, pending, pending->cpuid);
+    if (kpdecode_slim_record_compact(cursor, first_record) != KPERFDATA_RET_OK) {
+      return NULL;
+    }
+  }
+  return kpdecode_cursor_shift_slot(cursor).slim_record;
+}
+
+// Pop the next ready record in timestamp order, through the reorder buffer
+static long kpdecode_cursor_next_ordered_slot(kpdecode_cursor* cursor,
+                                              kpdecode_record_slot* next_slot) {
+  kpdecode_reorder* reorder = cursor->reorder;
+  while (!kpdecode_reorder_pop(reorder, false, next_slot)) {
+    long ret = kpdecode_cursor_decode_records(cursor);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+    if (!record_ready(cursor)) {
+      if (cursor->input_finished && kpdecode_reorder_pop(reorder, true, next_slot)) {
+        return KPERFDATA_RET_OK;
+      }
+      return KPERFDATA_RET_NOT_READY;
+    }
+
+    kpdecode_record_slot slot;
+    uint64_t timestamp;
+    uint32_t cpuid;
+    if (cursor->slim_records) {
+      slot.slim_record = kpdecode_cursor_pop_slim_record(cursor);
+      if (slot.slim_record == NULL) {
+        return KPERFDATA_RET_OOM;
+      }
+      timestamp = slot.slim_record->timestamp;
+      cpuid = slot.slim_record->cpuid;
+    } else {
+      slot.record = kpdecode_cursor_pop_record(cursor);
+      if (slot.record == NULL) {
+        return KPERFDATA_RET_OOM;
+      }
+      timestamp = slot.record->timestamp;
+      cpuid = (uint32_t)slot.record->cpuid;
+    }
+    if (kpdecode_reorder_push(reorder, slot, timestamp, cpuid) != KPERFDATA_RET_OK) {
+      if (cursor->slim_records) {
+        kpdecode_slim_record_free(slot.slim_record);
+      } else {
+        kpdecode_record_free(slot.record);
+      }
+      return KPERFDATA_RET_OOM;
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_cursor_finish(kpdecode_cursor* cursor) {
+  cursor->input_finished = 1;
+}
+
+long kpdecode_cursor_next_record(kpdecode_cursor* cursor, kpdecode_record** next_record) {
+  if (cursor->slim_records) {
+    return KPERFDATA_RET_FAIL;  // use kpdecode_cursor_next_slim_record()
+  }
+  if (cursor->reorder) {
+    kpdecode_record_slot slot;
+    long ret = kpdecode_cursor_next_ordered_slot(cursor, &slot);
+    if (ret == KPERFDATA_RET_OK) {
+      *next_record = slot.record;
+    }
+    return ret;
+  }
+  long ret = kpdecode_cursor_decode_records(cursor);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
 
   if (record_ready(cursor)) {
-    // pop the first record of the linked list
-    kpdecode_record* first_record = cursor->kpdeocde_record_head;
+    kpdecode_record* first_record = kpdecode_cursor_pop_record(cursor);
+    if (first_record == NULL) {
+      return KPERFDATA_RET_OOM;
+    }
     *next_record = first_record;
-    --cursor->kpdecode_record_count;
-    cursor->kpdeocde_record_head = (kpdecode_record*)first_record->next;
-    if (cursor->kpdecode_record_tail == first_record) {
-      cursor->kpdecode_record_tail = NULL;
+    return KPERFDATA_RET_OK;
+  }
+  return KPERFDATA_RET_NOT_READY;
+}
+
+long kpdecode_cursor_next_records(kpdecode_cursor* cursor, kpdecode_record** next_records,
+                                  size_t max_records, size_t* record_count) {
+  *record_count = 0;
+  if (cursor->slim_records) {
+    return KPERFDATA_RET_FAIL;  // use kpdecode_cursor_next_slim_records()
+  }
+  if (cursor->deferred_ret != KPERFDATA_RET_OK) {
+    long ret = cursor->deferred_ret;
+    cursor->deferred_ret = KPERFDATA_RET_OK;
+    return ret;
+  }
+
+  size_t count = 0;
+  if (cursor->reorder) {
+    long ret = KPERFDATA_RET_OK;
+    kpdecode_record_slot slot;
+    while (count < max_records &&
+           (ret = kpdecode_cursor_next_ordered_slot(cursor, &slot)) == KPERFDATA_RET_OK) {
+      next_records[count++] = slot.record;
+    }
+    *record_count = count;
+    if (count == 0) {
+      return ret;
+    }
+    if (ret != KPERFDATA_RET_OK && ret != KPERFDATA_RET_NOT_READY &&
+        ret != KPERFDATA_RET_SAMPLE_PENDING) {
+      cursor->deferred_ret = ret;  // once the records of this batch are handled
+    }
+    return KPERFDATA_RET_OK;
+  }
+  while (count < max_records) {
+    long ret = kpdecode_cursor_decode_records(cursor);
+    if (ret != KPERFDATA_RET_OK) {
+      if (count == 0) {
+        return ret;
+      }
+      if (ret != KPERFDATA_RET_SAMPLE_PENDING) {
+        cursor->deferred_ret = ret;  // once the records of this batch are handled
+      }
+      break;
+    }
+    if (!record_ready(cursor)) {
+      break;
+    }
+    // pop the whole run of ready records at the head of the ring
+    do {
+      kpdecode_record* first_record = kpdecode_cursor_pop_record(cursor);
+      if (first_record == NULL) {
+        *record_count = count;
+        if (count == 0) {
+          return KPERFDATA_RET_OOM;
+        }
+        cursor->deferred_ret = KPERFDATA_RET_OOM;  // once the records of this batch are handled
+        return KPERFDATA_RET_OK;
+      }
+      next_records[count++] = first_record;
+      if (cursor->kpdecode_record_count > 1) {
+        KPERFDATA_PREFETCH(KPERFDATA_RECORD_RING_SLOT(cursor, 1)->record);
+      }
+    } while (count < max_records && cursor->kpdecode_record_count != 0 &&
+             KPERFDATA_RECORD_RING_SLOT(cursor, 0)->record->ready);
+  }
+  *record_count = count;
+  return count ? KPERFDATA_RET_OK : KPERFDATA_RET_NOT_READY;
+}
+
+long kpdecode_cursor_next_slim_record(kpdecode_cursor* cursor,
+                                      kpdecode_slim_record** next_record) {
+  if (!cursor->slim_records) {
+    return KPERFDATA_RET_FAIL;  // use kpdecode_cursor_next_record()
+  }
+  if (cursor->reorder) {
+    kpdecode_record_slot slot;
+    long ret = kpdecode_cursor_next_ordered_slot(cursor, &slot);
+    if (ret == KPERFDATA_RET_OK) {
+      *next_record = slot.slim_record;
+    }
+    return ret;
+  }
+  long ret = kpdecode_cursor_decode_records(cursor);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
+
+  if (record_ready(cursor)) {
+    kpdecode_slim_record* first_record = kpdecode_cursor_pop_slim_record(cursor);
+    if (first_record == NULL) {
+      return KPERFDATA_RET_OOM;
     }
-    first_record->next = NULL;
+    *next_record = first_record;
     return KPERFDATA_RET_OK;
   }
   return KPERFDATA_RET_NOT_READY;
 }
 
+long kpdecode_cursor_next_slim_records(kpdecode_cursor* cursor,
+                                       kpdecode_slim_record** next_records, size_t max_records,
+                                       size_t* record_count) {
+  *record_count = 0;
+  if (!cursor->slim_records) {
+    return KPERFDATA_RET_FAIL;  // use kpdecode_cursor_next_records()
+  }
+  if (cursor->deferred_ret != KPERFDATA_RET_OK) {
+    long ret = cursor->deferred_ret;
+    cursor->deferred_ret = KPERFDATA_RET_OK;
+    return ret;
+  }
+
+  size_t count = 0;
+  if (cursor->reorder) {
+    long ret = KPERFDATA_RET_OK;
+    kpdecode_record_slot slot;
+    while (count < max_records &&
+           (ret = kpdecode_cursor_next_ordered_slot(cursor, &slot)) == KPERFDATA_RET_OK) {
+      next_records[count++] = slot.slim_record;
+    }
+    *record_count = count;
+    if (count == 0) {
+      return ret;
+    }
+    if (ret != KPERFDATA_RET_OK && ret != KPERFDATA_RET_NOT_READY &&
+        ret != KPERFDATA_RET_SAMPLE_PENDING) {
+      cursor->deferred_ret = ret;  // once the records of this batch are handled
+    }
+    return KPERFDATA_RET_OK;
+  }
+  while (count < max_records) {
+    long ret = kpdecode_cursor_decode_records(cursor);
+    if (ret != KPERFDATA_RET_OK) {
+      if (count == 0) {
+        return ret;
+      }
+      if (ret != KPERFDATA_RET_SAMPLE_PENDING) {
+        cursor->deferred_ret = ret;  // once the records of this batch are handled
+      }
+      break;
+    }
+    if (!record_ready(cursor)) {
+      break;
+    }
+    // pop the whole run of ready records at the head of the ring
+    kpdecode_slim_record* first_record;
+    do {
+      first_record = kpdecode_cursor_pop_slim_record(cursor);
+      if (first_record == NULL) {
+        *record_count = count;
+        if (count == 0) {
+          return KPERFDATA_RET_OOM;
+        }
+        cursor->deferred_ret = KPERFDATA_RET_OOM;  // once the records of this batch are handled
+        return KPERFDATA_RET_OK;
+      }
+      next_records[count++] = first_record;
+      first_record = cursor->kpdecode_record_count != 0
+                         ? KPERFDATA_RECORD_RING_SLOT(cursor, 0)->slim_record
+                         : NULL;
+    } while (count < max_records && first_record != NULL &&
+             (first_record->pending ? first_record->pending->ready : first_record->ready));
+  }
+  *record_count = count;
+  return count ? KPERFDATA_RET_OK : KPERFDATA_RET_NOT_READY;
+}
+
 KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,395 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc, qsort
+#include <string.h>  // memcpy
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+#define KPERFDATA_AGGREGATE_TABLE_COUNT 3
+
+// The entries by key, hashed by an open addressing table with linear probing, at most half full.
+// The slots hold an entry index + 1, 0 for empty.
+typedef struct {
+  kpdecode_aggregate_entry* entries;
+  size_t count;
+  size_t capacity;
+  size_t* slots;
+  size_t mask;                                        // the number of slots - 1, a power of two
+} kpdecode_aggregate_table;
+
+struct kpdecode_aggregate {
+  kpdecode_aggregate_table tables[KPERFDATA_AGGREGATE_TABLE_COUNT];
+  kpdecode_stack_table* stacks;                       // the stack IDs of the stack keys
+};
+
+// The fields of a full or slim record counted by the aggregate
+typedef struct {
+  uint64_t tid;
+  uint64_t cpuid;
+  bool lost;
+  const unsigned long long* uframes;
+  uint32_t unframes;
+  const unsigned long long* kframes;
+  uint32_t knframes;
+  int counterc;
+  const unsigned long long* counterv;
+} kpdecode_aggregate_sample;
+
+static size_t kpdecode_aggregate_hash(uint64_t key) {
+  return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+static long kpdecode_aggregate_table_grow(kpdecode_aggregate_table* table) {
+  size_t slot_count = table->slots ? 2 * (table->mask + 1) : 64;
+  size_t* slots = calloc(slot_count, sizeof(size_t));
+  if (!slots) {
+    return KPERFDATA_RET_OOM;
+  }
+  for (size_t i = 0; i < table->count; ++i) {
+    size_t slot = kpdecode_aggregate_hash(table->entries[i].key) & (slot_count - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (slot_count - 1);
+    }
+    slots[slot] = i + 1;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->mask = slot_count - 1;
+  return KPERFDATA_RET_OK;
+}
+
+// Make room for one more entry, so that the next find can not fail
+static long kpdecode_aggregate_table_reserve(kpdecode_aggregate_table* table) {
+  if (2 * (table->count + 1) > table->mask + 1 &&
+      kpdecode_aggregate_table_grow(table) != KPERFDATA_RET_OK) {
+    return KPERFDATA_RET_OOM;
+  }
+  if (table->count == table->capacity) {
+    size_t capacity = table->capacity ? 2 * table->capacity : 16;
+    kpdecode_aggregate_entry* entries =
+        realloc(table->entries, sizeof(kpdecode_aggregate_entry) * capacity);
+    if (!entries) {
+      return KPERFDATA_RET_OOM;
+    }
+    table->entries = entries;
+    table->capacity = capacity;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+// Find the entry of a key, a new one is zeroed. The table must have been reserved.
+static kpdecode_aggregate_entry* kpdecode_aggregate_table_find(kpdecode_aggregate_table* table,
+                                                               uint64_t key) {
+  size_t slot = kpdecode_aggregate_hash(key) & table->mask;
+  for (size_t index; (index = table->slots[slot]) != 0; slot = (slot + 1) & table->mask) {
+    if (table->entries[index - 1].key == key) {
+      return &table->entries[index - 1];
+    }
+  }
+  kpdecode_aggregate_entry* entry = &table->entries[table->count++];
+  memset(entry, 0, sizeof(kpdecode_aggregate_entry));
+  entry->key = key;
+  table->slots[slot] = table->count;
+  return entry;
+}
+
+static void kpdecode_aggregate_entry_add(kpdecode_aggregate_entry* entry,
+                                         const kpdecode_aggregate_entry* from) {
+  entry->samples += from->samples;
+  entry->lost_samples += from->lost_samples;
+  if (from->pmc_counterc > entry->pmc_counterc) {
+    entry->pmc_counterc = from->pmc_counterc;
+  }
+  for (int i = 0; i < from->pmc_counterc; ++i) {
+    entry->pmc_sums[i] += from->pmc_sums[i];
+  }
+}
+
+kpdecode_aggregate* kpdecode_aggregate_create(void) {
+  kpdecode_aggregate* aggregate = calloc(1, sizeof(kpdecode_aggregate));
+  if (!aggregate) {
+    return NULL;
+  }
+  aggregate->stacks = kpdecode_stack_table_create();
+  if (!aggregate->stacks) {
+    free(aggregate);
+    return NULL;
+  }
+  return aggregate;
+}
+
+void kpdecode_aggregate_free(kpdecode_aggregate* aggregate) {
+  for (int i = 0; i < KPERFDATA_AGGREGATE_TABLE_COUNT; ++i) {
+    free(aggregate->tables[i].entries);
+    free(aggregate->tables[i].slots);
+  }
+  kpdecode_stack_table_free(aggregate->stacks);
+  free(aggregate);
+}
+
+static long kpdecode_aggregate_add_sample(kpdecode_aggregate* aggregate,
+                                          const kpdecode_aggregate_sample* sample) {
+  uint32_t ucallstack_id;
+  uint32_t kcallstack_id;
+  long ret = kpdecode_stack_table_intern(aggregate->stacks, sample->uframes, sample->unframes,
+                                         &ucallstack_id);
+  if (ret == KPERFDATA_RET_OK) {
+    ret = kpdecode_stack_table_intern(aggregate->stacks, sample->kframes, sample->knframes,
+                                      &kcallstack_id);
+  }
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
+
+  kpdecode_aggregate_entry one;
+  one.samples = 1;
+  one.lost_samples = sample->lost;
+  one.pmc_counterc = sample->counterc;
+  if (sample->counterc > 0) {
+    memcpy(one.pmc_sums, sample->counterv, sizeof(unsigned long long) * sample->counterc);
+  }
+  // reserve all the tables first, a sample is counted by all of them or by none
+  for (int i = 0; i < KPERFDATA_AGGREGATE_TABLE_COUNT; ++i) {
+    ret = kpdecode_aggregate_table_reserve(&aggregate->tables[i]);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+  const uint64_t keys[KPERFDATA_AGGREGATE_TABLE_COUNT] = {
+      sample->tid, sample->cpuid, KPERFDATA_AGGREGATE_STACK_KEY(ucallstack_id, kcallstack_id)};
+  for (int i = 0; i < KPERFDATA_AGGREGATE_TABLE_COUNT; ++i) {
+    kpdecode_aggregate_entry_add(kpdecode_aggregate_table_find(&aggregate->tables[i], keys[i]),
+                                 &one);
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static int kpdecode_aggregate_counterc(int counterc) {
+  if (counterc < 0) return 0;
+  if (counterc > KPERFDATA_AGGREGATE_MAX_COUNTERS) return KPERFDATA_AGGREGATE_MAX_COUNTERS;
+  return counterc;
+}
+
+long kpdecode_aggregate_add_record(kpdecode_aggregate* aggregate, const kpdecode_record* record) {
+  if (!(record->flags & KPERFDATA_RECORD_FLAG_SAMPLE)) {
+    return KPERFDATA_RET_OK;
+  }
+  kpdecode_aggregate_sample sample;
+  sample.tid = record->tid;
+  sample.cpuid = (uint32_t)record->cpuid;
+  sample.lost = (record->flags & KPERFDATA_RECORD_FLAG_LOST) != 0;
+  sample.uframes = record->ucallstack.frames;
+  sample.unframes = record->ucallstack.nframes < 256 ? record->ucallstack.nframes : 256;
+  sample.kframes = record->kcallstack.frames;
+  sample.knframes = record->kcallstack.nframes < 256 ? record->kcallstack.nframes : 256;
+  sample.counterc = kpdecode_aggregate_counterc(record->pmc_counters.counterc);
+  sample.counterv = record->pmc_counters.counterv;
+  return kpdecode_aggregate_add_sample(aggregate, &sample);
+}
+
+long kpdecode_aggregate_add_slim_record(kpdecode_aggregate* aggregate,
+                                        const kpdecode_slim_record* record) {
+  if (!(record->flags & KPERFDATA_RECORD_FLAG_SAMPLE)) {
+    return KPERFDATA_RET_OK;
+  }
+  kpdecode_aggregate_sample sample;
+  sample.tid = record->tid;
+  sample.cpuid = (uint32_t)record->cpuid;
+  sample.lost = (record->flags & KPERFDATA_RECORD_FLAG_LOST) != 0;
+  sample.uframes = record->ucallstack_frames;
+  sample.unframes = record->ucallstack_nframes;
+  sample.kframes = record->kcallstack_frames;
+  sample.knframes = record->kcallstack_nframes;
+  sample.counterc = kpdecode_aggregate_counterc(record->pmc_counterc);
+  sample.counterv = record->pmc_counterv;
+  return kpdecode_aggregate_add_sample(aggregate, &sample);
+}
+
+// Map a stack key of an aggregate to the stack key of the same callstacks in another one
+static long kpdecode_aggregate_remap_stack_key(kpdecode_aggregate* aggregate,
+                                               const kpdecode_aggregate* from, uint64_t* key) {
+  uint32_t ids[2] = {(uint32_t)*key, (uint32_t)(*key >> 32)};
+  for (int i = 0; i < 2; ++i) {
+    const unsigned long long* frames;
+    uint32_t nframes;
+    long ret = kpdecode_stack_table_get(from->stacks, ids[i], &frames, &nframes);
+    if (ret == KPERFDATA_RET_OK) {
+      ret = kpdecode_stack_table_intern(aggregate->stacks, frames, nframes, &ids[i]);
+    }
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+  *key = KPERFDATA_AGGREGATE_STACK_KEY(ids[0], ids[1]);
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_aggregate_merge(kpdecode_aggregate* aggregate, const kpdecode_aggregate* from) {
+  for (int i = 0; i < KPERFDATA_AGGREGATE_TABLE_COUNT; ++i) {
+    const kpdecode_aggregate_table* table = &from->tables[i];
+    for (size_t j = 0; j < table->count; ++j) {
+      uint64_t key = table->entries[j].key;
+      if (i == KPERFDATA_AGGREGATE_STACKS) {
+        long ret = kpdecode_aggregate_remap_stack_key(aggregate, from, &key);
+        if (ret != KPERFDATA_RET_OK) {
+          return ret;
+        }
+      }
+      long ret = kpdecode_aggregate_table_reserve(&aggregate->tables[i]);
+      if (ret != KPERFDATA_RET_OK) {
+        return ret;
+      }
+      kpdecode_aggregate_entry_add(kpdecode_aggregate_table_find(&aggregate->tables[i], key),
+                                   &table->entries[j]);
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+size_t kpdecode_aggregate_count(const kpdecode_aggregate* aggregate, int table) {
+  if (table < 0 || table >= KPERFDATA_AGGREGATE_TABLE_COUNT) {
+    return 0;
+  }
+  return aggregate->tables[table].count;
+}
+
+// The most samples first, then the smallest key
+static int kpdecode_aggregate_compare(const void* a, const void* b) {
+  const kpdecode_aggregate_entry* ea = *(const kpdecode_aggregate_entry* const*)a;
+  const kpdecode_aggregate_entry* eb = *(const kpdecode_aggregate_entry* const*)b;
+  if (ea->samples != eb->samples) {
+    return ea->samples > eb->samples ? -1 : 1;
+  }
+  return ea->key < eb->key ? -1 : ea->key > eb->key;
+}
+
+size_t kpdecode_aggregate_top(const kpdecode_aggregate* aggregate, int table,
+                              kpdecode_aggregate_entry* entries, size_t max_entries) {
+  size_t count = kpdecode_aggregate_count(aggregate, table);
+  if (count == 0 || max_entries == 0) {
+    return 0;
+  }
+  const kpdecode_aggregate_entry** sorted = malloc(sizeof(kpdecode_aggregate_entry*) * count);
+  if (!sorted) {
+    return 0;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    sorted[i] = &aggregate->tables[table].entries[i];
+  }
+  qsort(sorted, count, sizeof(kpdecode_aggregate_entry*), kpdecode_aggregate_compare);
+  if (count > max_entries) {
+    count = max_entries;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    entries[i] = *sorted[i];
+  }
+  free(sorted);
+  return count;
+}
+
+const kpdecode_stack_table* kpdecode_aggregate_get_stack_table(
+    const kpdecode_aggregate* aggregate) {
+  return aggregate->stacks;
+}
+
+long kpdecode_aggregate_drain(kpdecode_aggregate* aggregate, kpdecode_cursor* cursor,
+                              size_t* drained) {
+  size_t count = 0;
+  long ret = KPERFDATA_RET_OK;
+  kpdecode_record* record;
+  while (ret == KPERFDATA_RET_OK && (record = kpdecode_cursor_first_record(cursor)) != NULL &&
+         (record->ready || !(record->flags & KPERFDATA_RECORD_FLAG_SAMPLE))) {
+    kpdecode_cursor_shift_record(cursor);
+    ret = kpdecode_aggregate_add_record(aggregate, record);
+    kpdecode_record_free(record);
+    count += 1;
+  }
+  if (drained) {
+    *drained = count;
+  }
+  return ret;
+}
+
+#define KPERFDATA_AGGREGATE_BATCH_SIZE 256
+
+// Aggregate the records in the order they are returned, slim or reordered
+static long kpdecode_cursor_aggregate_next_records(kpdecode_cursor* cursor,
+                                                   kpdecode_aggregate* aggregate) {
+  bool slim = cursor->slim_records != 0;
+  void* batch[KPERFDATA_AGGREGATE_BATCH_SIZE];
+  while (true) {
+    size_t count = 0;
+    long ret = slim ? kpdecode_cursor_next_slim_records(cursor, (kpdecode_slim_record**)batch,
+                                                        KPERFDATA_AGGREGATE_BATCH_SIZE, &count)
+                    : kpdecode_cursor_next_records(cursor, (kpdecode_record**)batch,
+                                                   KPERFDATA_AGGREGATE_BATCH_SIZE, &count);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != KPERFDATA_RET_OK) {
+      return ret == KPERFDATA_RET_NOT_READY ? KPERFDATA_RET_OK : ret;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      if (ret == KPERFDATA_RET_OK) {
+        ret = slim ? kpdecode_aggregate_add_slim_record(aggregate, batch[i])
+                   : kpdecode_aggregate_add_record(aggregate, batch[i]);
+      }
+      if (slim) {
+        kpdecode_slim_record_free(batch[i]);
+      } else {
+        kpdecode_record_free(batch[i]);
+      }
+    }
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+}
+
+long kpdecode_cursor_aggregate(kpdecode_cursor* cursor, kpdecode_aggregate* aggregate,
+                               int thread_count) {
+  if (cursor->slim_records || cursor->reorder) {
+    return kpdecode_cursor_aggregate_next_records(cursor, aggregate);
+  }
+  if (thread_count != 1) {
+    long ret = kpdecode_cursor_decode_shards(cursor, thread_count, aggregate);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+
+  // the records left on the cursor, or all of them with one thread. As with the shards, the
+  // records which are not samples are released without waiting for them to be ready.
+  while (true) {
+    long ret = kpdecode_cursor_decode_records(cursor);
+    if (ret != KPERFDATA_RET_OK && ret != KPERFDATA_RET_SAMPLE_PENDING) {
+      return ret;
+    }
+    size_t drained = 0;
+    long drain_ret = kpdecode_aggregate_drain(aggregate, cursor, &drained);
+    if (drain_ret != KPERFDATA_RET_OK) {
+      return drain_ret;
+    }
+    if (ret == KPERFDATA_RET_OK && drained == 0) {
+      return KPERFDATA_RET_OK;
+    }
+  }
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,296 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdbool.h>  // bool
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcpy, memset
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// The fields of a full or slim record copied into the columns
+typedef struct {
+  uint64_t timestamp;
+  uint64_t tid;
+  uint32_t cpuid;
+  uint32_t debugid;
+  uint64_t flags;
+  const unsigned long long* args;
+  const unsigned long long* ucallstack_frames;
+  uint32_t ucallstack_nframes;
+  const unsigned long long* kcallstack_frames;
+  uint32_t kcallstack_nframes;
+} kpdecode_columns_row;
+
+kpdecode_columns* kpdecode_columns_create(size_t capacity, size_t frames_capacity) {
+  kpdecode_columns* columns = calloc(1, sizeof(kpdecode_columns));
+  if (!columns) {
+    return NULL;
+  }
+  columns->owned = 1;
+  columns->capacity = capacity;
+  columns->timestamps = malloc(sizeof(uint64_t) * capacity);
+  columns->tids = malloc(sizeof(uint64_t) * capacity);
+  columns->cpuids = malloc(sizeof(uint32_t) * capacity);
+  columns->debugids = malloc(sizeof(uint32_t) * capacity);
+  columns->flags = malloc(sizeof(uint64_t) * capacity);
+  bool allocated = columns->timestamps && columns->tids && columns->cpuids && columns->debugids &&
+                   columns->flags;
+  for (int i = 0; i < 4; ++i) {
+    columns->args[i] = malloc(sizeof(uint64_t) * capacity);
+    allocated = allocated && columns->args[i];
+  }
+  if (frames_capacity != 0) {
+    columns->frames_capacity = frames_capacity;
+    columns->ucallstack_offsets = malloc(sizeof(uint32_t) * (capacity + 1));
+    columns->ucallstack_frames = malloc(sizeof(uint64_t) * frames_capacity);
+    columns->kcallstack_offsets = malloc(sizeof(uint32_t) * (capacity + 1));
+    columns->kcallstack_frames = malloc(sizeof(uint64_t) * frames_capacity);
+    allocated = allocated && columns->ucallstack_offsets && columns->ucallstack_frames &&
+                columns->kcallstack_offsets && columns->kcallstack_frames;
+  }
+  if (!allocated) {
+    kpdecode_columns_free(columns);
+    return NULL;
+  }
+  return columns;
+}
+
+static void kpdecode_columns_release(kpdecode_record_slot slot, bool slim) {
+  if (slim) {
+    kpdecode_slim_record_free(slot.slim_record);
+  } else {
+    kpdecode_record_free(slot.record);
+  }
+}
+
+// Release the record carried to the next block, if any
+static void kpdecode_columns_drop_carry(kpdecode_columns* columns) {
+  if (columns->carry.record == NULL) {
+    return;
+  }
+  kpdecode_columns_release(columns->carry, columns->carry_slim != 0);
+  columns->carry.record = NULL;
+}
+
+void kpdecode_columns_free(kpdecode_columns* columns) {
+  kpdecode_columns_drop_carry(columns);
+  if (!columns->owned) {
+    return;  // the columns of the caller
+  }
+  free(columns->timestamps);
+  free(columns->tids);
+  free(columns->cpuids);
+  free(columns->debugids);
+  free(columns->flags);
+  for (int i = 0; i < 4; ++i) {
+    free(columns->args[i]);
+  }
+  free(columns->ucallstack_offsets);
+  free(columns->ucallstack_frames);
+  free(columns->kcallstack_offsets);
+  free(columns->kcallstack_frames);
+  free(columns);
+}
+
+static void kpdecode_columns_rewind(kpdecode_columns* columns) {
+  columns->count = 0;
+  columns->ucallstack_frame_count = 0;
+  columns->kcallstack_frame_count = 0;
+  if (columns->ucallstack_offsets) {
+    columns->ucallstack_offsets[0] = 0;
+  }
+  if (columns->kcallstack_offsets) {
+    columns->kcallstack_offsets[0] = 0;
+  }
+}
+
+static void kpdecode_columns_fill_row(const kpdecode_record_slot slot, bool slim,
+                                      kpdecode_columns_row* row) {
+  if (slim) {
+    const kpdecode_slim_record* record = slot.slim_record;
+    row->timestamp = record->timestamp;
+    row->tid = record->tid;
+    row->cpuid = (uint32_t)record->cpuid;
+    row->debugid = record->debugid;
+    row->flags = record->flags;
+    row->args = record->args;
+    row->ucallstack_frames = record->ucallstack_frames;
+    row->ucallstack_nframes = record->ucallstack_nframes;
+    row->kcallstack_frames = record->kcallstack_frames;
+    row->kcallstack_nframes = record->kcallstack_nframes;
+  } else {
+    const kpdecode_record* record = slot.record;
+    row->timestamp = record->timestamp;
+    row->tid = record->tid;
+    row->cpuid = (uint32_t)record->cpuid;
+    row->debugid = record->kd_buf.debugid;
+    row->flags = record->flags;
+    row->args = record->kd_buf.args;
+    row->ucallstack_frames = record->ucallstack.frames;
+    row->ucallstack_nframes = record->ucallstack.nframes;
+    row->kcallstack_frames = record->kcallstack.frames;
+    row->kcallstack_nframes = record->kcallstack.nframes;
+    // the frames beyond the 256 of a kpdecode_callstack are lost
+    if (row->ucallstack_nframes > 256) row->ucallstack_nframes = 256;
+    if (row->kcallstack_nframes > 256) row->kcallstack_nframes = 256;
+  }
+}
+
+// Check whether the callstacks of the row fit in the remaining frames
+static bool kpdecode_columns_fit(const kpdecode_columns* columns, const kpdecode_columns_row* row) {
+  if (columns->ucallstack_frames &&
+      row->ucallstack_nframes > columns->frames_capacity - columns->ucallstack_frame_count) {
+    return false;
+  }
+  if (columns->kcallstack_frames &&
+      row->kcallstack_nframes > columns->frames_capacity - columns->kcallstack_frame_count) {
+    return false;
+  }
+  return true;
+}
+
+static void kpdecode_columns_append(kpdecode_columns* columns, const kpdecode_columns_row* row) {
+  size_t i = columns->count++;
+  if (columns->timestamps) columns->timestamps[i] = row->timestamp;
+  if (columns->tids) columns->tids[i] = row->tid;
+  if (columns->cpuids) columns->cpuids[i] = row->cpuid;
+  if (columns->debugids) columns->debugids[i] = row->debugid;
+  if (columns->flags) columns->flags[i] = row->flags;
+  for (int j = 0; j < 4; ++j) {
+    if (columns->args[j]) columns->args[j][i] = row->args[j];
+  }
+  if (columns->ucallstack_frames) {
+    memcpy(columns->ucallstack_frames + columns->ucallstack_frame_count, row->ucallstack_frames,
+           sizeof(uint64_t) * row->ucallstack_nframes);
+    columns->ucallstack_frame_count += row->ucallstack_nframes;
+  }
+  if (columns->kcallstack_frames) {
+    memcpy(columns->kcallstack_frames + columns->kcallstack_frame_count, row->kcallstack_frames,
+           sizeof(uint64_t) * row->kcallstack_nframes);
+    columns->kcallstack_frame_count += row->kcallstack_nframes;
+  }
+  if (columns->ucallstack_offsets) {
+    columns->ucallstack_offsets[i + 1] = (uint32_t)columns->ucallstack_frame_count;
+  }
+  if (columns->kcallstack_offsets) {
+    columns->kcallstack_offsets[i + 1] = (uint32_t)columns->kcallstack_frame_count;
+  }
+}
+
+long kpdecode_cursor_next_columns(kpdecode_cursor* cursor, kpdecode_columns* columns) {
+  kpdecode_columns_rewind(columns);
+  bool slim = cursor->slim_records != 0;
+  if (columns->carry.record != NULL && columns->carry_slim != slim) {
+    return KPERFDATA_RET_FAIL;  // the mode has been switched
+  }
+  if (columns->deferred_ret != KPERFDATA_RET_OK) {
+    long ret = columns->deferred_ret;
+    columns->deferred_ret = KPERFDATA_RET_OK;
+    return ret;
+  }
+  long ret = KPERFDATA_RET_OK;
+  while (columns->count < columns->capacity) {
+    kpdecode_record_slot slot = columns->carry;
+    columns->carry.record = NULL;
+    if (slot.record == NULL) {
+      ret = slim ? kpdecode_cursor_next_slim_record(cursor, &slot.slim_record)
+                 : kpdecode_cursor_next_record(cursor, &slot.record);
+      if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+        continue;
+      }
+      if (ret != KPERFDATA_RET_OK) {
+        break;
+      }
+    }
+    kpdecode_columns_row row;
+    kpdecode_columns_fill_row(slot, slim, &row);
+    if (!kpdecode_columns_fit(columns, &row)) {
+      if (columns->count == 0) {
+        // the frames columns are too small for this record, it would never fit
+        kpdecode_columns_release(slot, slim);
+        return KPERFDATA_RET_TOO_LARGE;
+      }
+      columns->carry = slot;
+      columns->carry_slim = slim;
+      break;
+    }
+    kpdecode_columns_append(columns, &row);
+    kpdecode_columns_release(slot, slim);
+  }
+  if (columns->count == 0) {
+    return ret;
+  }
+  if (ret != KPERFDATA_RET_OK && ret != KPERFDATA_RET_NOT_READY) {
+    columns->deferred_ret = ret;  // once the rows of this block are handled
+  }
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_next_kevent_columns(kpdecode_cursor* cursor, kpdecode_columns* columns) {
+  kpdecode_columns_rewind(columns);
+  long ret = KPERFDATA_RET_OK;
+  while (columns->count < columns->capacity) {
+    const kd_buf* kevents = NULL;
+    size_t count = 0;
+    ret = kpdecode_cursor_next_kevents(cursor, &kevents, columns->capacity - columns->count,
+                                       &count);
+    if (ret != KPERFDATA_RET_OK) {
+      break;
+    }
+    // one pass per column, so that each loop is a plain strided gather
+    size_t first = columns->count;
+    if (columns->timestamps) {
+      for (size_t i = 0; i < count; ++i) columns->timestamps[first + i] = kevents[i].timestamp;
+    }
+    if (columns->tids) {
+      for (size_t i = 0; i < count; ++i) columns->tids[first + i] = kevents[i].arg5;
+    }
+    if (columns->cpuids) {
+      for (size_t i = 0; i < count; ++i) columns->cpuids[first + i] = kevents[i].cpuid;
+    }
+    if (columns->debugids) {
+      for (size_t i = 0; i < count; ++i) columns->debugids[first + i] = kevents[i].debugid;
+    }
+    if (columns->args[0]) {
+      for (size_t i = 0; i < count; ++i) columns->args[0][first + i] = kevents[i].arg1;
+    }
+    if (columns->args[1]) {
+      for (size_t i = 0; i < count; ++i) columns->args[1][first + i] = kevents[i].arg2;
+    }
+    if (columns->args[2]) {
+      for (size_t i = 0; i < count; ++i) columns->args[2][first + i] = kevents[i].arg3;
+    }
+    if (columns->args[3]) {
+      for (size_t i = 0; i < count; ++i) columns->args[3][first + i] = kevents[i].arg4;
+    }
+    // a kevent has no record flags and no callstacks, so that no row keeps those of a record
+    if (columns->flags) {
+      memset(columns->flags + first, 0, sizeof(uint64_t) * count);
+    }
+    if (columns->ucallstack_offsets) {
+      memset(columns->ucallstack_offsets + first + 1, 0, sizeof(uint32_t) * count);
+    }
+    if (columns->kcallstack_offsets) {
+      memset(columns->kcallstack_offsets + first + 1, 0, sizeof(uint32_t) * count);
+    }
+    columns->count += count;
+  }
+  return columns->count ? KPERFDATA_RET_OK : ret;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,702 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdbool.h>  // bool
+#include <stddef.h>  // offsetof
+#include <stdio.h>  // fopen
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcpy
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// The compact file:
+//
+//   uint32_t magic, version;                         // KPERFDATA_COMPACT_MAGIC/VERSION
+//   blocks, until the end of the file:
+//     varint record_count, payload_size;
+//     varint tid_count, tids[];                      // the dictionaries of the block
+//     varint debugid_count, debugids[];
+//     records, all varints:
+//       zigzag timestamp delta from the previous record of the block
+//       tid index, debugid index, flags, zigzag cpuid, args[4], total_size_of_kevents
+//       sections, KPERFDATA_COMPACT_SECTION_*
+//       [task_name size, task_name]
+//       [ucallstack flags, nframes, zigzag frame deltas]
+//       [kcallstack flags, nframes, zigzag frame deltas]
+//       [pmc counterc, counterv[]]
+//       [non-zero word count, (index gap, word)[]]   // the other fixed fields
+#define KPERFDATA_COMPACT_SECTION_TASK_NAME 0x01
+#define KPERFDATA_COMPACT_SECTION_UCALLSTACK 0x02
+#define KPERFDATA_COMPACT_SECTION_KCALLSTACK 0x04
+#define KPERFDATA_COMPACT_SECTION_PMC 0x08
+#define KPERFDATA_COMPACT_SECTION_WORDS 0x10
+
+// the dictionary slots of a block, at most half full
+#define KPERFDATA_COMPACT_SLOT_COUNT (2 * KPERFDATA_COMPACT_BLOCK_RECORDS)
+
+// The fixed fields of kpdecode_record stored as 64-bit words, all but the callstacks and the pmc
+// counters, up to `ready`. unknown_field19.unknown_field2 is a pointer, always stored as 0.
+typedef struct {
+  size_t begin;
+  size_t end;
+} kpdecode_compact_region;
+
+static const kpdecode_compact_region kpdecode_compact_regions[] = {
+    {offsetof(kpdecode_record, kperf_thread_info), offsetof(kpdecode_record, ucallstack)},
+    {offsetof(kpdecode_record, pmc_config), offsetof(kpdecode_record, ready)},
+};
+
+// the words of a region, the last one may be partial
+#define KPERFDATA_COMPACT_REGION_WORDS(begin, end) \
+  ((offsetof(kpdecode_record, end) - offsetof(kpdecode_record, begin) + 7) / 8)
+#define KPERFDATA_COMPACT_WORD_COUNT                                  \
+  (KPERFDATA_COMPACT_REGION_WORDS(kperf_thread_info, ucallstack) + \
+   KPERFDATA_COMPACT_REGION_WORDS(pmc_config, ready))
+
+// A record being encoded or decoded
+typedef struct {
+  uint64_t flags;
+  uint64_t timestamp;
+  uint64_t tid;
+  int cpuid;
+  uint32_t debugid;
+  uint64_t args[4];
+  uint64_t total_size_of_kevents;
+  char task_name[20];
+  uint32_t callstack_flags[2];                        // ucallstack, kcallstack
+  uint32_t nframes[2];
+  unsigned long long* frames[2];                      // 256 entries
+  int counterc;
+  unsigned long long* counterv;                       // 32 entries
+  uint64_t words[KPERFDATA_COMPACT_WORD_COUNT];
+} kpdecode_compact_row;
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+} kpdecode_compact_buffer;
+
+struct kpdecode_compact_writer {
+  FILE* file;
+  uint32_t record_count;                              // in the current block
+  uint64_t last_timestamp;
+  kpdecode_compact_buffer records;
+  kpdecode_compact_buffer block;
+  uint64_t tids[KPERFDATA_COMPACT_BLOCK_RECORDS];
+  uint64_t debugids[KPERFDATA_COMPACT_BLOCK_RECORDS];
+  uint32_t tid_count;
+  uint32_t debugid_count;
+  uint32_t tid_slots[KPERFDATA_COMPACT_SLOT_COUNT];   // an index + 1, 0 for empty
+  uint32_t debugid_slots[KPERFDATA_COMPACT_SLOT_COUNT];
+};
+
+struct kpdecode_compact_reader {
+  FILE* file;
+  kpdecode_record_pool* pool;
+  uint8_t* block;                                     // the payload of the current block
+  size_t block_capacity;
+  const uint8_t* next;                                // the next record in the block
+  const uint8_t* end;
+  uint32_t record_count;                              // left in the block
+  uint64_t last_timestamp;
+  uint64_t* tids;
+  uint32_t* debugids;
+  uint32_t tid_count;
+  uint32_t debugid_count;
+  kpdecode_slim_record slim;
+  unsigned long long frames[2][256];
+  unsigned long long counterv[32];
+};
+
+static bool kpdecode_compact_reserve(kpdecode_compact_buffer* buffer, size_t size) {
+  if (buffer->capacity - buffer->size >= size) {
+    return true;
+  }
+  size_t capacity = buffer->capacity ? buffer->capacity : 64 * 1024;
+  while (capacity - buffer->size < size) {
+    capacity *= 2;
+  }
+  uint8_t* data = realloc(buffer->data, capacity);
+  if (!data) {
+    return false;
+  }
+  buffer->data = data;
+  buffer->capacity = capacity;
+  return true;
+}
+
+// The caller reserves 10 bytes
+static void kpdecode_compact_put_varint(kpdecode_compact_buffer* buffer, uint64_t value) {
+  uint8_t* out = buffer->data + buffer->size;
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  buffer->size = out - buffer->data;
+}
+
+static uint64_t kpdecode_compact_zigzag(int64_t value) {
+  uint64_t bits = (uint64_t)value;
+  return (bits << 1) ^ (0 - (bits >> 63));
+}
+
+static int64_t kpdecode_compact_unzigzag(uint64_t value) {
+  return (int64_t)((value >> 1) ^ (0 - (value & 1)));
+}
+
+// Look up a value in a dictionary of the block, adding it if needed
+static uint32_t kpdecode_compact_intern(uint32_t* slots, uint64_t* values, uint32_t* count,
+                                        uint64_t value) {
+  uint32_t slot = (uint32_t)((value * 0x9e3779b97f4a7c15ULL) >> 32) &
+                  (KPERFDATA_COMPACT_SLOT_COUNT - 1);
+  while (slots[slot] != 0 && values[slots[slot] - 1] != value) {
+    slot = (slot + 1) & (KPERFDATA_COMPACT_SLOT_COUNT - 1);
+  }
+  if (slots[slot] == 0) {
+    values[*count] = value;
+    *count += 1;
+    slots[slot] = *count;
+  }
+  return slots[slot] - 1;
+}
+
+static void kpdecode_compact_row_from_record(kpdecode_compact_row* row,
+                                             const kpdecode_record* record) {
+  row->flags = record->flags;
+  row->timestamp = record->timestamp;
+  row->tid = record->tid;
+  row->cpuid = record->cpuid;
+  row->debugid = record->kd_buf.debugid;
+  memcpy(row->args, record->kd_buf.args, sizeof(row->args));
+  row->total_size_of_kevents = record->total_size_of_kevents;
+  memcpy(row->task_name, record->task_info._field1.task_name, sizeof(row->task_name));
+  const kpdecode_callstack* callstacks[2] = {&record->ucallstack, &record->kcallstack};
+  for (int k = 0; k < 2; ++k) {
+    row->callstack_flags[k] = callstacks[k]->flags;
+    row->nframes[k] = callstacks[k]->nframes > 256 ? 256 : callstacks[k]->nframes;
+    row->frames[k] = (unsigned long long*)callstacks[k]->frames;
+  }
+  row->counterc = record->pmc_counters.counterc;
+  if (row->counterc < 0) row->counterc = 0;
+  if (row->counterc > 32) row->counterc = 32;
+  row->counterv = (unsigned long long*)record->pmc_counters.counterv;
+  memset(row->words, 0, sizeof(row->words));
+  size_t word = 0;
+  for (size_t r = 0; r < sizeof(kpdecode_compact_regions) / sizeof(kpdecode_compact_region); ++r) {
+    size_t size = kpdecode_compact_regions[r].end - kpdecode_compact_regions[r].begin;
+    memcpy(&row->words[word], (const char*)record + kpdecode_compact_regions[r].begin, size);
+    word += (size + 7) / 8;
+  }
+}
+
+// The byte offset of a field of kpdecode_record in kpdecode_compact_row.words
+static size_t kpdecode_compact_word_offset(size_t offset) {
+  size_t word = 0;
+  for (size_t r = 0; r < sizeof(kpdecode_compact_regions) / sizeof(kpdecode_compact_region); ++r) {
+    const kpdecode_compact_region* region = &kpdecode_compact_regions[r];
+    if (offset >= region->begin && offset < region->end) {
+      return 8 * word + (offset - region->begin);
+    }
+    word += (region->end - region->begin + 7) / 8;
+  }
+  return 8 * word;
+}
+
+#define KPERFDATA_COMPACT_FIELD(words, field) \
+  ((char*)(words) + kpdecode_compact_word_offset(offsetof(kpdecode_record, field)))
+
+static long kpdecode_compact_writer_put_row(kpdecode_compact_writer* writer,
+                                            kpdecode_compact_row* row) {
+  memset(KPERFDATA_COMPACT_FIELD(row->words, unknown_field19.unknown_field2), 0, sizeof(void*));
+
+  // the worst case: 10 bytes per varint
+  size_t max_size = 10 * (11 + 1 + 2 * (2 + 256) + 1 + 32 + 1 + 2 * KPERFDATA_COMPACT_WORD_COUNT) +
+                    1 + sizeof(row->task_name);
+  if (!kpdecode_compact_reserve(&writer->records, max_size)) {
+    return KPERFDATA_RET_OOM;
+  }
+  kpdecode_compact_buffer* out = &writer->records;
+  uint64_t delta = row->timestamp - writer->last_timestamp;
+  kpdecode_compact_put_varint(out, kpdecode_compact_zigzag((int64_t)delta));
+  writer->last_timestamp = row->timestamp;
+  kpdecode_compact_put_varint(out, kpdecode_compact_intern(writer->tid_slots, writer->tids,
+                                                           &writer->tid_count, row->tid));
+  kpdecode_compact_put_varint(out, kpdecode_compact_intern(writer->debugid_slots, writer->debugids,
+                                                           &writer->debugid_count, row->debugid));
+  kpdecode_compact_put_varint(out, row->flags);
+  kpdecode_compact_put_varint(out, kpdecode_compact_zigzag(row->cpuid));
+  for (int i = 0; i < 4; ++i) {
+    kpdecode_compact_put_varint(out, row->args[i]);
+  }
+  kpdecode_compact_put_varint(out, row->total_size_of_kevents);
+
+  size_t task_name_size = strnlen(row->task_name, sizeof(row->task_name));
+  uint32_t word_count = 0;
+  for (size_t i = 0; i < KPERFDATA_COMPACT_WORD_COUNT; ++i) {
+    word_count += row->words[i] != 0;
+  }
+  uint32_t sections = 0;
+  if (task_name_size) sections |= KPERFDATA_COMPACT_SECTION_TASK_NAME;
+  if (row->callstack_flags[0] || row->nframes[0]) sections |= KPERFDATA_COMPACT_SECTION_UCALLSTACK;
+  if (row->callstack_flags[1] || row->nframes[1]) sections |= KPERFDATA_COMPACT_SECTION_KCALLSTACK;
+  if (row->counterc) sections |= KPERFDATA_COMPACT_SECTION_PMC;
+  if (word_count) sections |= KPERFDATA_COMPACT_SECTION_WORDS;
+  kpdecode_compact_put_varint(out, sections);
+
+  if (sections & KPERFDATA_COMPACT_SECTION_TASK_NAME) {
+    kpdecode_compact_put_varint(out, task_name_size);
+    memcpy(out->data + out->size, row->task_name, task_name_size);
+    out->size += task_name_size;
+  }
+  for (int k = 0; k < 2; ++k) {
+    if (sections & (KPERFDATA_COMPACT_SECTION_UCALLSTACK << k)) {
+      kpdecode_compact_put_varint(out, row->callstack_flags[k]);
+      kpdecode_compact_put_varint(out, row->nframes[k]);
+      uint64_t previous = 0;  // the frames of a callstack are mostly close to each other
+      for (uint32_t i = 0; i < row->nframes[k]; ++i) {
+        kpdecode_compact_put_varint(out, kpdecode_compact_zigzag(row->frames[k][i] - previous));
+        previous = row->frames[k][i];
+      }
+    }
+  }
+  if (sections & KPERFDATA_COMPACT_SECTION_PMC) {
+    kpdecode_compact_put_varint(out, kpdecode_compact_zigzag(row->counterc));
+    for (int i = 0; i < row->counterc; ++i) {
+      kpdecode_compact_put_varint(out, row->counterv[i]);
+    }
+  }
+  if (sections & KPERFDATA_COMPACT_SECTION_WORDS) {
+    kpdecode_compact_put_varint(out, word_count);
+    size_t next = 0;
+    for (size_t i = 0; i < KPERFDATA_COMPACT_WORD_COUNT; ++i) {
+      if (row->words[i] != 0) {
+        kpdecode_compact_put_varint(out, i - next);
+        kpdecode_compact_put_varint(out, row->words[i]);
+        next = i + 1;
+      }
+    }
+  }
+  writer->record_count += 1;
+  return KPERFDATA_RET_OK;
+}
+
+static long kpdecode_compact_writer_flush(kpdecode_compact_writer* writer) {
+  if (writer->record_count == 0) {
+    return KPERFDATA_RET_OK;
+  }
+  kpdecode_compact_buffer* block = &writer->block;
+  block->size = 0;
+  size_t dictionary_size = 10 * (2 + writer->tid_count + writer->debugid_count);
+  if (!kpdecode_compact_reserve(block, 20 + dictionary_size + writer->records.size)) {
+    return KPERFDATA_RET_OOM;
+  }
+  // the dictionaries go first, the payload size is only known once they are encoded
+  size_t payload = 20;
+  block->size = payload;
+  kpdecode_compact_put_varint(block, writer->tid_count);
+  for (uint32_t i = 0; i < writer->tid_count; ++i) {
+    kpdecode_compact_put_varint(block, writer->tids[i]);
+  }
+  kpdecode_compact_put_varint(block, writer->debugid_count);
+  for (uint32_t i = 0; i < writer->debugid_count; ++i) {
+    kpdecode_compact_put_varint(block, writer->debugids[i]);
+  }
+  memcpy(block->data + block->size, writer->records.data, writer->records.size);
+  block->size += writer->records.size;
+  size_t payload_size = block->size - payload;
+
+  kpdecode_compact_buffer header = {block->data, 0, 20};
+  kpdecode_compact_put_varint(&header, writer->record_count);
+  kpdecode_compact_put_varint(&header, payload_size);
+  if (fwrite(header.data, 1, header.size, writer->file) != header.size ||
+      fwrite(block->data + payload, 1, payload_size, writer->file) != payload_size) {
+    return KPERFDATA_RET_FAIL;
+  }
+
+  writer->record_count = 0;
+  writer->last_timestamp = 0;
+  writer->records.size = 0;
+  writer->tid_count = 0;
+  writer->debugid_count = 0;
+  memset(writer->tid_slots, 0, sizeof(writer->tid_slots));
+  memset(writer->debugid_slots, 0, sizeof(writer->debugid_slots));
+  return KPERFDATA_RET_OK;
+}
+
+kpdecode_compact_writer* kpdecode_compact_writer_create(const char* path) {
+  kpdecode_compact_writer* writer = calloc(1, sizeof(kpdecode_compact_writer));
+  if (!writer) {
+    return NULL;
+  }
+  writer->file = fopen(path, "wb");
+  uint32_t header[2] = {KPERFDATA_COMPACT_MAGIC, KPERFDATA_COMPACT_VERSION};
+  if (!writer->file || fwrite(header, 1, sizeof(header), writer->file) != sizeof(header)) {
+    if (writer->file) {
+      fclose(writer->file);
+    }
+    free(writer);
+    return NULL;
+  }
+  return writer;
+}
+
+static long kpdecode_compact_writer_write_row(kpdecode_compact_writer* writer,
+                                              kpdecode_compact_row* row) {
+  if (writer->record_count == KPERFDATA_COMPACT_BLOCK_RECORDS) {
+    long ret = kpdecode_compact_writer_flush(writer);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+  return kpdecode_compact_writer_put_row(writer, row);
+}
+
+long kpdecode_compact_writer_write_record(kpdecode_compact_writer* writer,
+                                          const kpdecode_record* record) {
+  kpdecode_compact_row row;
+  kpdecode_compact_row_from_record(&row, record);
+  return kpdecode_compact_writer_write_row(writer, &row);
+}
+
+long kpdecode_compact_writer_write_slim_record(kpdecode_compact_writer* writer,
+                                               const kpdecode_slim_record* record) {
+  kpdecode_compact_row row;
+  memset(&row, 0, sizeof(row));
+  row.flags = record->flags;
+  row.timestamp = record->timestamp;
+  row.tid = record->tid;
+  row.cpuid = record->cpuid;
+  row.debugid = record->debugid;
+  memcpy(row.args, record->args, sizeof(row.args));
+  row.total_size_of_kevents = record->total_size_of_kevents;
+  row.callstack_flags[0] = record->ucallstack_flags;
+  row.nframes[0] = record->ucallstack_nframes;
+  row.frames[0] = (unsigned long long*)record->ucallstack_frames;
+  row.callstack_flags[1] = record->kcallstack_flags;
+  row.nframes[1] = record->kcallstack_nframes;
+  row.frames[1] = (unsigned long long*)record->kcallstack_frames;
+  row.counterc = record->pmc_counterc;
+  row.counterv = (unsigned long long*)record->pmc_counterv;
+  memcpy(KPERFDATA_COMPACT_FIELD(row.words, kperf_sample_args.actionid), &record->actionid,
+         sizeof(record->actionid));
+  memcpy(KPERFDATA_COMPACT_FIELD(row.words, kperf_thread_info.kpthi_pid), &record->pid,
+         sizeof(record->pid));
+  memcpy(KPERFDATA_COMPACT_FIELD(row.words, unknown_field20.unknown_field1),
+         &record->last_timestamp, sizeof(record->last_timestamp));
+  return kpdecode_compact_writer_write_row(writer, &row);
+}
+
+long kpdecode_compact_writer_close(kpdecode_compact_writer* writer) {
+  long ret = kpdecode_compact_writer_flush(writer);
+  if (fclose(writer->file) != 0 && ret == KPERFDATA_RET_OK) {
+    ret = KPERFDATA_RET_FAIL;
+  }
+  free(writer->records.data);
+  free(writer->block.data);
+  free(writer);
+  return ret;
+}
+
+// Bounds checked varints of a block
+typedef struct {
+  const uint8_t* next;
+  const uint8_t* end;
+  bool failed;
+} kpdecode_compact_input;
+
+static uint64_t kpdecode_compact_get_varint(kpdecode_compact_input* input) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (input->next == input->end) {
+      break;
+    }
+    uint8_t byte = *input->next++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+  input->failed = true;
+  return 0;
+}
+
+// Read the header and the dictionaries of the next block
+static long kpdecode_compact_reader_next_block(kpdecode_compact_reader* reader) {
+  uint8_t header[20];
+  size_t header_size = 0;
+  uint64_t values[2];
+  for (int i = 0; i < 2; ++i) {
+    values[i] = 0;
+    for (int shift = 0;; shift += 7) {
+      int c = fgetc(reader->file);
+      if (c == EOF) {
+        return i == 0 && shift == 0 && feof(reader->file) ? KPERFDATA_RET_NOT_READY
+                                                          : KPERFDATA_RET_FAIL;
+      }
+      if (shift >= 64 || header_size == sizeof(header)) {
+        return KPERFDATA_RET_FAIL;
+      }
+      header[header_size++] = (uint8_t)c;
+      values[i] |= (uint64_t)(c & 0x7f) << shift;
+      if (!(c & 0x80)) {
+        break;
+      }
+    }
+  }
+  uint64_t record_count = values[0];
+  uint64_t payload_size = values[1];
+  if (record_count == 0 || record_count > KPERFDATA_COMPACT_BLOCK_RECORDS ||
+      payload_size > SIZE_MAX / 2) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (reader->block_capacity < payload_size) {
+    uint8_t* block = realloc(reader->block, payload_size);
+    if (!block) {
+      return KPERFDATA_RET_OOM;
+    }
+    reader->block = block;
+    reader->block_capacity = payload_size;
+  }
+  if (fread(reader->block, 1, payload_size, reader->file) != payload_size) {
+    return KPERFDATA_RET_FAIL;
+  }
+
+  kpdecode_compact_input input = {reader->block, reader->block + payload_size, false};
+  uint64_t tid_count = kpdecode_compact_get_varint(&input);
+  if (tid_count > record_count) {
+    return KPERFDATA_RET_FAIL;
+  }
+  for (uint64_t i = 0; i < tid_count; ++i) {
+    reader->tids[i] = kpdecode_compact_get_varint(&input);
+  }
+  uint64_t debugid_count = kpdecode_compact_get_varint(&input);
+  if (debugid_count > record_count) {
+    return KPERFDATA_RET_FAIL;
+  }
+  for (uint64_t i = 0; i < debugid_count; ++i) {
+    reader->debugids[i] = (uint32_t)kpdecode_compact_get_varint(&input);
+  }
+  if (input.failed) {
+    return KPERFDATA_RET_FAIL;
+  }
+  reader->tid_count = (uint32_t)tid_count;
+  reader->debugid_count = (uint32_t)debugid_count;
+  reader->record_count = (uint32_t)record_count;
+  reader->next = input.next;
+  reader->end = input.end;
+  reader->last_timestamp = 0;
+  return KPERFDATA_RET_OK;
+}
+
+// Decode the next record, into the frames and counterv of the row
+static long kpdecode_compact_reader_get_row(kpdecode_compact_reader* reader,
+                                            kpdecode_compact_row* row) {
+  if (reader->record_count == 0) {
+    long ret = kpdecode_compact_reader_next_block(reader);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+  }
+  kpdecode_compact_input input = {reader->next, reader->end, false};
+  reader->last_timestamp += (uint64_t)kpdecode_compact_unzigzag(
+      kpdecode_compact_get_varint(&input));
+  row->timestamp = reader->last_timestamp;
+  uint64_t tid = kpdecode_compact_get_varint(&input);
+  uint64_t debugid = kpdecode_compact_get_varint(&input);
+  if (tid >= reader->tid_count || debugid >= reader->debugid_count) {
+    return KPERFDATA_RET_FAIL;
+  }
+  row->tid = reader->tids[tid];
+  row->debugid = reader->debugids[debugid];
+  row->flags = kpdecode_compact_get_varint(&input);
+  row->cpuid = (int)kpdecode_compact_unzigzag(kpdecode_compact_get_varint(&input));
+  for (int i = 0; i < 4; ++i) {
+    row->args[i] = kpdecode_compact_get_varint(&input);
+  }
+  row->total_size_of_kevents = kpdecode_compact_get_varint(&input);
+
+  uint64_t sections = kpdecode_compact_get_varint(&input);
+  memset(row->task_name, 0, sizeof(row->task_name));
+  if (sections & KPERFDATA_COMPACT_SECTION_TASK_NAME) {
+    uint64_t size = kpdecode_compact_get_varint(&input);
+    if (size > sizeof(row->task_name) || size > (uint64_t)(input.end - input.next)) {
+      return KPERFDATA_RET_FAIL;
+    }
+    memcpy(row->task_name, input.next, size);
+    input.next += size;
+  }
+  for (int k = 0; k < 2; ++k) {
+    row->callstack_flags[k] = 0;
+    row->nframes[k] = 0;
+    if (sections & (KPERFDATA_COMPACT_SECTION_UCALLSTACK << k)) {
+      row->callstack_flags[k] = (uint32_t)kpdecode_compact_get_varint(&input);
+      uint64_t nframes = kpdecode_compact_get_varint(&input);
+      if (nframes > 256) {
+        return KPERFDATA_RET_FAIL;
+      }
+      row->nframes[k] = (uint32_t)nframes;
+      uint64_t frame = 0;
+      for (uint32_t i = 0; i < row->nframes[k]; ++i) {
+        frame += (uint64_t)kpdecode_compact_unzigzag(kpdecode_compact_get_varint(&input));
+        row->frames[k][i] = frame;
+      }
+    }
+  }
+  row->counterc = 0;
+  if (sections & KPERFDATA_COMPACT_SECTION_PMC) {
+    int64_t counterc = kpdecode_compact_unzigzag(kpdecode_compact_get_varint(&input));
+    if (counterc < 0 || counterc > 32) {
+      return KPERFDATA_RET_FAIL;
+    }
+    row->counterc = (int)counterc;
+    for (int i = 0; i < row->counterc; ++i) {
+      row->counterv[i] = kpdecode_compact_get_varint(&input);
+    }
+  }
+  memset(row->words, 0, sizeof(row->words));
+  if (sections & KPERFDATA_COMPACT_SECTION_WORDS) {
+    uint64_t word_count = kpdecode_compact_get_varint(&input);
+    uint64_t next = 0;
+    for (uint64_t i = 0; i < word_count && !input.failed; ++i) {
+      next += kpdecode_compact_get_varint(&input);
+      if (next >= KPERFDATA_COMPACT_WORD_COUNT) {
+        return KPERFDATA_RET_FAIL;
+      }
+      row->words[next++] = kpdecode_compact_get_varint(&input);
+    }
+  }
+  if (input.failed) {
+    return KPERFDATA_RET_FAIL;
+  }
+  reader->next = input.next;
+  reader->record_count -= 1;
+  return KPERFDATA_RET_OK;
+}
+
+kpdecode_compact_reader* kpdecode_compact_reader_open(const char* path) {
+  kpdecode_compact_reader* reader = calloc(1, sizeof(kpdecode_compact_reader));
+  if (!reader) {
+    return NULL;
+  }
+  reader->file = fopen(path, "rb");
+  reader->pool = kpdecode_record_pool_create(0);
+  reader->tids = malloc(sizeof(uint64_t) * KPERFDATA_COMPACT_BLOCK_RECORDS);
+  reader->debugids = malloc(sizeof(uint32_t) * KPERFDATA_COMPACT_BLOCK_RECORDS);
+  uint32_t header[2] = {0, 0};
+  if (!reader->file || !reader->pool || !reader->tids || !reader->debugids ||
+      fread(header, 1, sizeof(header), reader->file) != sizeof(header) ||
+      header[0] != KPERFDATA_COMPACT_MAGIC || header[1] != KPERFDATA_COMPACT_VERSION) {
+    kpdecode_compact_reader_close(reader);
+    return NULL;
+  }
+  return reader;
+}
+
+long kpdecode_compact_reader_next_record(kpdecode_compact_reader* reader,
+                                         kpdecode_record** next_record) {
+  *next_record = NULL;
+  kpdecode_record* record = kpdecode_record_pool_alloc(reader->pool);
+  if (!record) {
+    return KPERFDATA_RET_OOM;
+  }
+  kpdecode_compact_row row;
+  row.frames[0] = record->ucallstack.frames;
+  row.frames[1] = record->kcallstack.frames;
+  row.counterv = record->pmc_counters.counterv;
+  long ret = kpdecode_compact_reader_get_row(reader, &row);
+  if (ret != KPERFDATA_RET_OK) {
+    kpdecode_record_free(record);
+    return ret;
+  }
+  size_t word = 0;
+  for (size_t r = 0; r < sizeof(kpdecode_compact_regions) / sizeof(kpdecode_compact_region); ++r) {
+    size_t size = kpdecode_compact_regions[r].end - kpdecode_compact_regions[r].begin;
+    memcpy((char*)record + kpdecode_compact_regions[r].begin, &row.words[word], size);
+    word += (size + 7) / 8;
+  }
+  record->flags = row.flags;
+  record->timestamp = row.timestamp;
+  record->tid = row.tid;
+  record->cpuid = row.cpuid;
+  memcpy(record->task_info._field1.task_name, row.task_name, sizeof(row.task_name));
+  record->kd_buf.debugid = row.debugid;
+  memcpy(record->kd_buf.args, row.args, sizeof(row.args));
+  record->ucallstack.flags = row.callstack_flags[0];
+  record->ucallstack.nframes = row.nframes[0];
+  record->kcallstack.flags = row.callstack_flags[1];
+  record->kcallstack.nframes = row.nframes[1];
+  record->pmc_counters.counterc = row.counterc;
+  record->ready = 1;
+  record->total_size_of_kevents = row.total_size_of_kevents;
+  *next_record = record;
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_compact_reader_next_slim_record(kpdecode_compact_reader* reader,
+                                              const kpdecode_slim_record** next_record) {
+  *next_record = NULL;
+  kpdecode_compact_row row;
+  row.frames[0] = reader->frames[0];
+  row.frames[1] = reader->frames[1];
+  row.counterv = reader->counterv;
+  long ret = kpdecode_compact_reader_get_row(reader, &row);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
+  kpdecode_slim_record* slim = &reader->slim;
+  memset(slim, 0, sizeof(kpdecode_slim_record));
+  slim->flags = row.flags;
+  slim->timestamp = row.timestamp;
+  slim->tid = row.tid;
+  slim->cpuid = row.cpuid;
+  slim->debugid = row.debugid;
+  memcpy(slim->args, row.args, sizeof(slim->args));
+  memcpy(&slim->actionid, KPERFDATA_COMPACT_FIELD(row.words, kperf_sample_args.actionid),
+         sizeof(slim->actionid));
+  memcpy(&slim->pid, KPERFDATA_COMPACT_FIELD(row.words, kperf_thread_info.kpthi_pid),
+         sizeof(slim->pid));
+  slim->ucallstack_flags = row.callstack_flags[0];
+  slim->ucallstack_nframes = row.nframes[0];
+  slim->kcallstack_flags = row.callstack_flags[1];
+  slim->kcallstack_nframes = row.nframes[1];
+  slim->ucallstack_frames = reader->frames[0];
+  slim->kcallstack_frames = reader->frames[1];
+  slim->pmc_counterv = reader->counterv;
+  slim->pmc_counterc = row.counterc;
+  slim->ready = 1;
+  memcpy(&slim->last_timestamp, KPERFDATA_COMPACT_FIELD(row.words, unknown_field20.unknown_field1),
+         sizeof(slim->last_timestamp));
+  slim->total_size_of_kevents = row.total_size_of_kevents;
+  *next_record = slim;
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_compact_reader_close(kpdecode_compact_reader* reader) {
+  if (reader->file) {
+    fclose(reader->file);
+  }
+  kpdecode_record_pool_free(reader->pool);  // released once its records are
+  free(reader->block);
+  free(reader->tids);
+  free(reader->debugids);
+  free(reader);
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,757 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memcpy
+
+#if defined(_WIN32)
+#include <windows.h>  // CreateThread, SRWLOCK, CONDITION_VARIABLE
+#else
+#include <pthread.h>  // pthread_create, pthread_mutex_t, pthread_cond_t
+#endif
+
+#if defined(KPERFDATA_HAVE_ZSTD)
+#include <zstd.h>  // ZSTD_decompressStream
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+#include <lz4frame.h>  // LZ4F_decompress
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// the formats of a frame
+#define KPERFDATA_FRAME_SKIPPABLE 0
+#define KPERFDATA_FRAME_ZSTD 1
+#define KPERFDATA_FRAME_LZ4 2
+
+#define KPERFDATA_FRAME_CONTENT_SIZE_UNKNOWN UINT64_MAX
+
+// the states of a slot
+#define KPERFDATA_SLOT_FREE 0     // no output, or waiting for a chunk to be recycled
+#define KPERFDATA_SLOT_RUNNING 1  // being decompressed
+#define KPERFDATA_SLOT_DONE 2     // decompressed, or failed
+#define KPERFDATA_SLOT_QUEUED 3   // set as a chunk of the cursor
+
+typedef struct {
+  int format;                                         // KPERFDATA_FRAME_SKIPPABLE, ...
+  const char* bytes;                                  // the compressed frame, inside the file
+  size_t size;
+  uint64_t content_size;                              // KPERFDATA_FRAME_CONTENT_SIZE_UNKNOWN if unknown
+} kpdecode_frame;
+
+// The frame decompressed a piece at a time, when it is too large or of unknown size
+typedef struct {
+  bool active;
+  bool running;                                       // whether a slot is decompressing its next piece
+  bool finished;                                      // the last piece has been decompressed
+  kpdecode_frame frame;
+  size_t pos;                                         // the compressed bytes consumed
+#if defined(KPERFDATA_HAVE_ZSTD)
+  ZSTD_DCtx* zstd;
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  LZ4F_dctx* lz4;
+#endif
+} kpdecode_frame_stream;
+
+typedef struct kpdecode_decompress_slot {
+  kpdecode_decompressor* decompressor;
+  char* bytes;
+  size_t capacity;
+  size_t size;                                        // the bytes decompressed
+  int state;                                          // KPERFDATA_SLOT_FREE, ...
+  uint64_t sequence;                                  // the order of the slot output in the RAW file
+  bool piece;                                         // a piece of the stream, or a whole frame
+  kpdecode_frame frame;                               // the whole frame
+  long ret;
+  bool queued;                                        // waiting for a worker
+  bool working;                                       // being decompressed by a worker
+} kpdecode_decompress_slot;
+
+struct kpdecode_decompressor {
+  const char* bytes;                                  // the compressed RAW file
+  size_t size;
+  size_t next_offset;                                 // the offset of the next frame
+  kpdecode_decompress_slot** slots;                   // may grow while the slots are running
+  uint32_t slot_count;
+  uint64_t next_sequence;                             // of the next slot started
+  uint64_t deliver_sequence;                          // of the next chunk of the cursor
+  kpdecode_frame_stream stream;
+  long ret;                                           // KPERFDATA_RET_FAIL once a frame failed
+
+  // the workers decompressing the slots, started while all of them are busy, up to max_workers.
+  // `lock` guards `slots`, the `queued` and `working` slots and the fields below
+  uint32_t worker_count;
+  uint32_t max_workers;                               // at most one per online processor
+  uint32_t idle_workers;
+  uint32_t queued_count;                              // the slots waiting for a worker
+  bool stopping;
+#if defined(_WIN32)
+  HANDLE* workers;
+  SRWLOCK lock;
+  CONDITION_VARIABLE queued;                          // a slot is queued, or `stopping` is set
+  CONDITION_VARIABLE done;                            // a slot is decompressed
+#else
+  pthread_t* workers;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t done;
+#endif
+};
+
+bool kpdecode_is_compressed(const char* bytes, size_t size) {
+  uint32_t magic;
+  if (size < sizeof(magic)) {
+    return false;
+  }
+  memcpy(&magic, bytes, sizeof(magic));
+  return magic == KPERFDATA_ZSTD_MAGIC || magic == KPERFDATA_LZ4_MAGIC ||
+         (magic & KPERFDATA_SKIPPABLE_MAGIC_MASK) == KPERFDATA_SKIPPABLE_MAGIC;
+}
+
+#if defined(KPERFDATA_HAVE_LZ4)
+// The size of the LZ4 frame at bytes[size] from its block sizes, 0 if it is truncated or invalid
+static size_t kpdecode_lz4_frame_size(const char* bytes, size_t size, uint64_t* content_size) {
+  if (size < 7) {
+    return 0;
+  }
+  uint8_t flags = (uint8_t)bytes[4];
+  if ((flags >> 6) != 1) {
+    return 0;  // version 01 only
+  }
+  size_t pos = 6;  // the magic, FLG and BD
+  *content_size = KPERFDATA_FRAME_CONTENT_SIZE_UNKNOWN;
+  if (flags & 0x08) {
+    if (size < pos + sizeof(uint64_t)) {
+      return 0;
+    }
+    memcpy(content_size, bytes + pos, sizeof(uint64_t));
+    pos += sizeof(uint64_t);
+  }
+  if (flags & 0x01) {
+    pos += sizeof(uint32_t);  // the dictionary ID
+  }
+  pos += 1;  // the header checksum
+  while (true) {
+    uint32_t block_size;
+    if (size < pos || size - pos < sizeof(block_size)) {
+      return 0;
+    }
+    memcpy(&block_size, bytes + pos, sizeof(block_size));
+    pos += sizeof(block_size);
+    if (block_size == 0) {
+      break;  // the end mark
+    }
+    pos += (block_size & 0x7FFFFFFF) + (flags & 0x10 ? sizeof(uint32_t) : 0);
+  }
+  if (flags & 0x04) {
+    pos += sizeof(uint32_t);  // the content checksum
+  }
+  return pos <= size ? pos : 0;
+}
+#endif
+
+// Find the frame at the offset, return false if it is truncated, invalid or of an unsupported
+// format
+static bool kpdecode_decompressor_parse_frame(kpdecode_decompressor* decompressor,
+                                              kpdecode_frame* frame) {
+  const char* bytes = decompressor->bytes + decompressor->next_offset;
+  size_t size = decompressor->size - decompressor->next_offset;
+  uint32_t magic;
+  if (size < sizeof(magic) * 2) {
+    return false;
+  }
+  memcpy(&magic, bytes, sizeof(magic));
+  frame->bytes = bytes;
+  frame->size = 0;
+  frame->content_size = 0;
+  if ((magic & KPERFDATA_SKIPPABLE_MAGIC_MASK) == KPERFDATA_SKIPPABLE_MAGIC) {
+    uint32_t skip_size;
+    memcpy(&skip_size, bytes + sizeof(magic), sizeof(skip_size));
+    frame->format = KPERFDATA_FRAME_SKIPPABLE;
+    frame->size = sizeof(magic) + sizeof(skip_size) + (size_t)skip_size;
+    return frame->size <= size;
+  }
+#if defined(KPERFDATA_HAVE_ZSTD)
+  if (magic == KPERFDATA_ZSTD_MAGIC) {
+    frame->format = KPERFDATA_FRAME_ZSTD;
+    frame->size = ZSTD_findFrameCompressedSize(bytes, size);
+    if (ZSTD_isError(frame->size)) {
+      return false;
+    }
+    unsigned long long content_size = ZSTD_getFrameContentSize(bytes, size);
+    if (content_size == ZSTD_CONTENTSIZE_ERROR) {
+      return false;
+    }
+    frame->content_size = content_size == ZSTD_CONTENTSIZE_UNKNOWN
+                              ? KPERFDATA_FRAME_CONTENT_SIZE_UNKNOWN
+                              : (uint64_t)content_size;
+    return true;
+  }
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  if (magic == KPERFDATA_LZ4_MAGIC) {
+    frame->format = KPERFDATA_FRAME_LZ4;
+    frame->size = kpdecode_lz4_frame_size(bytes, size, &frame->content_size);
+    return frame->size != 0;
+  }
+#endif
+  return false;  // not a frame, or the library was built without its decompressor
+}
+
+// Decompress the whole frame into the slot, its content size is known
+static long kpdecode_slot_decompress_frame(kpdecode_decompress_slot* slot) {
+#if defined(KPERFDATA_HAVE_ZSTD) || defined(KPERFDATA_HAVE_LZ4)
+  const kpdecode_frame* frame = &slot->frame;
+  size_t content_size = (size_t)frame->content_size;
+#else
+  (void)slot;
+#endif
+#if defined(KPERFDATA_HAVE_ZSTD)
+  if (frame->format == KPERFDATA_FRAME_ZSTD) {
+    size_t size = ZSTD_decompress(slot->bytes, content_size, frame->bytes, frame->size);
+    if (ZSTD_isError(size) || size != content_size) {
+      return KPERFDATA_RET_FAIL;
+    }
+    slot->size = size;
+    return KPERFDATA_RET_OK;
+  }
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  if (frame->format == KPERFDATA_FRAME_LZ4) {
+    LZ4F_dctx* lz4 = NULL;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4, LZ4F_VERSION))) {
+      return KPERFDATA_RET_OOM;
+    }
+    size_t dst_size = content_size;
+    size_t src_size = frame->size;
+    size_t ret = LZ4F_decompress(lz4, slot->bytes, &dst_size, frame->bytes, &src_size, NULL);
+    LZ4F_freeDecompressionContext(lz4);
+    if (ret != 0 || dst_size != content_size) {  // 0 once the whole frame is decompressed
+      return KPERFDATA_RET_FAIL;
+    }
+    slot->size = dst_size;
+    return KPERFDATA_RET_OK;
+  }
+#endif
+  return KPERFDATA_RET_FAIL;
+}
+
+// Decompress the next piece of the stream into the slot, up to its capacity
+static long kpdecode_slot_decompress_piece(kpdecode_decompress_slot* slot) {
+#if defined(KPERFDATA_HAVE_ZSTD) || defined(KPERFDATA_HAVE_LZ4)
+  kpdecode_frame_stream* stream = &slot->decompressor->stream;
+  const kpdecode_frame* frame = &stream->frame;
+#else
+  (void)slot;
+#endif
+#if defined(KPERFDATA_HAVE_ZSTD)
+  if (frame->format == KPERFDATA_FRAME_ZSTD) {
+    ZSTD_outBuffer out = {slot->bytes, slot->capacity, 0};
+    ZSTD_inBuffer in = {frame->bytes, frame->size, stream->pos};
+    while (out.pos < out.size) {
+      size_t ret = ZSTD_decompressStream(stream->zstd, &out, &in);
+      if (ZSTD_isError(ret)) {
+        return KPERFDATA_RET_FAIL;
+      }
+      if (ret == 0) {
+        stream->finished = true;  // the end of the frame
+        break;
+      }
+      if (in.pos == in.size && out.pos < out.size) {
+        return KPERFDATA_RET_FAIL;  // the frame is truncated
+      }
+    }
+    stream->pos = in.pos;
+    slot->size = out.pos;
+    return KPERFDATA_RET_OK;
+  }
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  if (frame->format == KPERFDATA_FRAME_LZ4) {
+    size_t out_pos = 0;
+    while (out_pos < slot->capacity) {
+      size_t dst_size = slot->capacity - out_pos;
+      size_t src_size = frame->size - stream->pos;
+      size_t ret = LZ4F_decompress(stream->lz4, slot->bytes + out_pos, &dst_size,
+                                   frame->bytes + stream->pos, &src_size, NULL);
+      if (LZ4F_isError(ret)) {
+        return KPERFDATA_RET_FAIL;
+      }
+      out_pos += dst_size;
+      stream->pos += src_size;
+      if (ret == 0) {
+        stream->finished = true;  // the end of the frame
+        break;
+      }
+      if (dst_size == 0 && src_size == 0) {
+        return KPERFDATA_RET_FAIL;  // the frame is truncated
+      }
+    }
+    slot->size = out_pos;
+    return KPERFDATA_RET_OK;
+  }
+#endif
+  return KPERFDATA_RET_FAIL;
+}
+
+static void kpdecode_slot_decompress(kpdecode_decompress_slot* slot) {
+  slot->size = 0;
+  slot->ret = slot->piece ? kpdecode_slot_decompress_piece(slot)
+                          : kpdecode_slot_decompress_frame(slot);
+}
+
+static void kpdecode_decompressor_worker_main(kpdecode_decompressor* decompressor);
+
+#if defined(_WIN32)
+
+static DWORD WINAPI kpdecode_decompressor_worker_thread(LPVOID arg) {
+  kpdecode_decompressor_worker_main((kpdecode_decompressor*)arg);
+  return 0;
+}
+
+static bool kpdecode_decompressor_init_lock(kpdecode_decompressor* decompressor) {
+  InitializeSRWLock(&decompressor->lock);
+  InitializeConditionVariable(&decompressor->queued);
+  InitializeConditionVariable(&decompressor->done);
+  return true;
+}
+
+static void kpdecode_decompressor_destroy_lock(kpdecode_decompressor* decompressor) {
+  (void)decompressor;  // nothing to release
+}
+
+static void kpdecode_decompressor_lock(kpdecode_decompressor* decompressor) {
+  AcquireSRWLockExclusive(&decompressor->lock);
+}
+
+static void kpdecode_decompressor_unlock(kpdecode_decompressor* decompressor) {
+  ReleaseSRWLockExclusive(&decompressor->lock);
+}
+
+static void kpdecode_decompressor_sleep(kpdecode_decompressor* decompressor,
+                                        CONDITION_VARIABLE* cond) {
+  SleepConditionVariableSRW(cond, &decompressor->lock, INFINITE, 0);
+}
+
+static void kpdecode_decompressor_wake(CONDITION_VARIABLE* cond) {
+  WakeAllConditionVariable(cond);
+}
+
+static bool kpdecode_decompressor_start_worker(kpdecode_decompressor* decompressor) {
+  HANDLE thread =
+      CreateThread(NULL, 0, kpdecode_decompressor_worker_thread, decompressor, 0, NULL);
+  if (thread == NULL) {
+    return false;
+  }
+  decompressor->workers[decompressor->worker_count++] = thread;
+  return true;
+}
+
+static void kpdecode_decompressor_join_workers(kpdecode_decompressor* decompressor) {
+  for (uint32_t i = 0; i < decompressor->worker_count; ++i) {
+    WaitForSingleObject(decompressor->workers[i], INFINITE);
+    CloseHandle(decompressor->workers[i]);
+  }
+}
+
+#else
+
+static void* kpdecode_decompressor_worker_thread(void* arg) {
+  kpdecode_decompressor_worker_main((kpdecode_decompressor*)arg);
+  return NULL;
+}
+
+static bool kpdecode_decompressor_init_lock(kpdecode_decompressor* decompressor) {
+  if (pthread_mutex_init(&decompressor->lock, NULL) != 0) {
+    return false;
+  }
+  if (pthread_cond_init(&decompressor->queued, NULL) != 0) {
+    pthread_mutex_destroy(&decompressor->lock);
+    return false;
+  }
+  if (pthread_cond_init(&decompressor->done, NULL) != 0) {
+    pthread_cond_destroy(&decompressor->queued);
+    pthread_mutex_destroy(&decompressor->lock);
+    return false;
+  }
+  return true;
+}
+
+static void kpdecode_decompressor_destroy_lock(kpdecode_decompressor* decompressor) {
+  pthread_cond_destroy(&decompressor->done);
+  pthread_cond_destroy(&decompressor->queued);
+  pthread_mutex_destroy(&decompressor->lock);
+}
+
+static void kpdecode_decompressor_lock(kpdecode_decompressor* decompressor) {
+  pthread_mutex_lock(&decompressor->lock);
+}
+
+static void kpdecode_decompressor_unlock(kpdecode_decompressor* decompressor) {
+  pthread_mutex_unlock(&decompressor->lock);
+}
+
+static void kpdecode_decompressor_sleep(kpdecode_decompressor* decompressor,
+                                        pthread_cond_t* cond) {
+  pthread_cond_wait(cond, &decompressor->lock);
+}
+
+static void kpdecode_decompressor_wake(pthread_cond_t* cond) {
+  pthread_cond_broadcast(cond);
+}
+
+static bool kpdecode_decompressor_start_worker(kpdecode_decompressor* decompressor) {
+  pthread_t* thread = &decompressor->workers[decompressor->worker_count];
+  if (pthread_create(thread, NULL, kpdecode_decompressor_worker_thread, decompressor) != 0) {
+    return false;
+  }
+  decompressor->worker_count += 1;
+  return true;
+}
+
+static void kpdecode_decompressor_join_workers(kpdecode_decompressor* decompressor) {
+  for (uint32_t i = 0; i < decompressor->worker_count; ++i) {
+    pthread_join(decompressor->workers[i], NULL);
+  }
+}
+
+#endif  // _WIN32
+
+// Decompress the queued slots, the one the cursor needs first, until `stopping`
+static void kpdecode_decompressor_worker_main(kpdecode_decompressor* decompressor) {
+  kpdecode_decompressor_lock(decompressor);
+  while (true) {
+    kpdecode_decompress_slot* next = NULL;
+    for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+      kpdecode_decompress_slot* slot = decompressor->slots[i];
+      if (slot->queued && (next == NULL || slot->sequence < next->sequence)) {
+        next = slot;
+      }
+    }
+    if (next == NULL) {
+      if (decompressor->stopping) {
+        break;
+      }
+      decompressor->idle_workers += 1;
+      kpdecode_decompressor_sleep(decompressor, &decompressor->queued);
+      decompressor->idle_workers -= 1;
+      continue;
+    }
+    next->queued = false;
+    next->working = true;
+    decompressor->queued_count -= 1;
+    kpdecode_decompressor_unlock(decompressor);
+    kpdecode_slot_decompress(next);  // the slot is not touched by anyone else
+    kpdecode_decompressor_lock(decompressor);
+    next->working = false;
+    kpdecode_decompressor_wake(&decompressor->done);
+  }
+  kpdecode_decompressor_unlock(decompressor);
+}
+
+// Hand the slot to a worker, starting one if all of them are busy, or decompress it on the calling
+// thread without any
+static void kpdecode_slot_start(kpdecode_decompress_slot* slot) {
+  kpdecode_decompressor* decompressor = slot->decompressor;
+  slot->state = KPERFDATA_SLOT_RUNNING;
+  kpdecode_decompressor_lock(decompressor);
+  if (decompressor->queued_count >= decompressor->idle_workers &&
+      decompressor->worker_count < decompressor->max_workers &&
+      !kpdecode_decompressor_start_worker(decompressor)) {
+    decompressor->max_workers = decompressor->worker_count;  // do not try again
+  }
+  bool threaded = decompressor->worker_count > 0;
+  if (threaded) {
+    slot->queued = true;
+    decompressor->queued_count += 1;
+    kpdecode_decompressor_wake(&decompressor->queued);
+  }
+  kpdecode_decompressor_unlock(decompressor);
+  if (!threaded) {
+    kpdecode_slot_decompress(slot);
+    slot->state = KPERFDATA_SLOT_DONE;
+  }
+}
+
+static void kpdecode_slot_wait(kpdecode_decompress_slot* slot) {
+  kpdecode_decompressor* decompressor = slot->decompressor;
+  kpdecode_decompressor_lock(decompressor);
+  while (slot->queued || slot->working) {
+    kpdecode_decompressor_sleep(decompressor, &decompressor->done);
+  }
+  kpdecode_decompressor_unlock(decompressor);
+  slot->state = KPERFDATA_SLOT_DONE;
+}
+
+static bool kpdecode_slot_reserve(kpdecode_decompress_slot* slot, size_t capacity) {
+  if (slot->capacity >= capacity) {
+    return true;
+  }
+  char* bytes = realloc(slot->bytes, capacity);
+  if (bytes == NULL) {
+    return false;
+  }
+  slot->bytes = bytes;
+  slot->capacity = capacity;
+  return true;
+}
+
+static kpdecode_decompress_slot* kpdecode_decompressor_free_slot(
+    kpdecode_decompressor* decompressor) {
+  for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+    if (decompressor->slots[i]->state == KPERFDATA_SLOT_FREE) {
+      return decompressor->slots[i];
+    }
+  }
+  return NULL;
+}
+
+static long kpdecode_decompressor_grow(kpdecode_decompressor* decompressor) {
+  kpdecode_decompress_slot* slot = calloc(1, sizeof(kpdecode_decompress_slot));
+  if (slot == NULL) {
+    return KPERFDATA_RET_OOM;
+  }
+  slot->decompressor = decompressor;
+  // the workers walk the slots
+  kpdecode_decompressor_lock(decompressor);
+  kpdecode_decompress_slot** slots = realloc(
+      decompressor->slots, (decompressor->slot_count + 1) * sizeof(kpdecode_decompress_slot*));
+  if (slots != NULL) {
+    decompressor->slots = slots;
+    slots[decompressor->slot_count++] = slot;
+  }
+  kpdecode_decompressor_unlock(decompressor);
+  if (slots == NULL) {
+    free(slot);
+    return KPERFDATA_RET_OOM;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static long kpdecode_frame_stream_begin(kpdecode_frame_stream* stream,
+                                        const kpdecode_frame* frame) {
+  stream->frame = *frame;
+  stream->pos = 0;
+  stream->finished = false;
+  stream->running = false;
+#if defined(KPERFDATA_HAVE_ZSTD)
+  if (frame->format == KPERFDATA_FRAME_ZSTD) {
+    if (stream->zstd == NULL && (stream->zstd = ZSTD_createDCtx()) == NULL) {
+      return KPERFDATA_RET_OOM;
+    }
+    ZSTD_DCtx_reset(stream->zstd, ZSTD_reset_session_only);
+  }
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  if (frame->format == KPERFDATA_FRAME_LZ4) {
+    if (stream->lz4 == NULL &&
+        LZ4F_isError(LZ4F_createDecompressionContext(&stream->lz4, LZ4F_VERSION))) {
+      stream->lz4 = NULL;
+      return KPERFDATA_RET_OOM;
+    }
+    LZ4F_resetDecompressionContext(stream->lz4);
+  }
+#endif
+  stream->active = true;
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_decompressor_start(kpdecode_decompressor* decompressor,
+                                        kpdecode_decompress_slot* slot, bool piece,
+                                        const kpdecode_frame* frame, size_t capacity) {
+  if (!kpdecode_slot_reserve(slot, capacity)) {
+    decompressor->ret = KPERFDATA_RET_OOM;
+    return;
+  }
+  slot->piece = piece;
+  if (!piece) {
+    slot->frame = *frame;
+  }
+  slot->sequence = decompressor->next_sequence++;
+  kpdecode_slot_start(slot);
+}
+
+// Start decompressing the next frames, or the next piece of the stream, into the free slots
+static void kpdecode_decompressor_schedule(kpdecode_decompressor* decompressor) {
+  kpdecode_frame_stream* stream = &decompressor->stream;
+  while (decompressor->ret == KPERFDATA_RET_OK) {
+    if (stream->active) {
+      // the pieces of the stream depend on each other, and the next frames wait for its end
+      kpdecode_decompress_slot* slot = NULL;
+      if (stream->running || (slot = kpdecode_decompressor_free_slot(decompressor)) == NULL) {
+        return;
+      }
+      stream->running = true;
+      kpdecode_decompressor_start(decompressor, slot, true, NULL,
+                                  KPERFDATA_DECOMPRESS_CHUNK_SIZE);
+      continue;
+    }
+    if (decompressor->next_offset >= decompressor->size) {
+      return;
+    }
+    kpdecode_decompress_slot* slot = kpdecode_decompressor_free_slot(decompressor);
+    if (slot == NULL) {
+      return;
+    }
+    kpdecode_frame frame;
+    if (!kpdecode_decompressor_parse_frame(decompressor, &frame)) {
+      decompressor->ret = KPERFDATA_RET_FAIL;
+      return;
+    }
+    decompressor->next_offset += frame.size;
+    if (frame.format == KPERFDATA_FRAME_SKIPPABLE || frame.content_size == 0) {
+      continue;
+    }
+    if (frame.content_size <= KPERFDATA_DECOMPRESS_FRAME_SIZE) {
+      kpdecode_decompressor_start(decompressor, slot, false, &frame, (size_t)frame.content_size);
+    } else {
+      decompressor->ret = kpdecode_frame_stream_begin(stream, &frame);
+    }
+  }
+}
+
+kpdecode_decompressor* kpdecode_decompressor_create(const char* bytes, size_t size,
+                                                    uint32_t slot_count) {
+  kpdecode_decompressor* decompressor = calloc(1, sizeof(kpdecode_decompressor));
+  if (decompressor == NULL) {
+    return NULL;
+  }
+  if (!kpdecode_decompressor_init_lock(decompressor)) {
+    free(decompressor);
+    return NULL;
+  }
+  decompressor->bytes = bytes;
+  decompressor->size = size;
+  int cpus = kpdecode_online_cpus();  // -1 if unknown
+  decompressor->max_workers = cpus > 0 && (uint32_t)cpus < slot_count ? (uint32_t)cpus : slot_count;
+  if (decompressor->max_workers == 0) {
+    decompressor->max_workers = 1;
+  }
+  decompressor->workers = calloc(decompressor->max_workers, sizeof(*decompressor->workers));
+  if (decompressor->workers == NULL) {
+    kpdecode_decompressor_free(decompressor, NULL);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    if (kpdecode_decompressor_grow(decompressor) != KPERFDATA_RET_OK) {
+      kpdecode_decompressor_free(decompressor, NULL);
+      return NULL;
+    }
+  }
+  kpdecode_decompressor_schedule(decompressor);
+  return decompressor;
+}
+
+const char* kpdecode_decompressor_next(kpdecode_decompressor* decompressor, size_t* size) {
+  kpdecode_frame_stream* stream = &decompressor->stream;
+  while (true) {
+    kpdecode_decompressor_schedule(decompressor);
+    kpdecode_decompress_slot* next = NULL;
+    bool pending = false;
+    for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+      kpdecode_decompress_slot* slot = decompressor->slots[i];
+      if (slot->state == KPERFDATA_SLOT_RUNNING || slot->state == KPERFDATA_SLOT_DONE) {
+        pending = true;
+        if (slot->sequence == decompressor->deliver_sequence) {
+          next = slot;
+        }
+      }
+    }
+    if (next == NULL) {
+      if (decompressor->ret != KPERFDATA_RET_OK ||
+          (!pending && !stream->active && decompressor->next_offset >= decompressor->size)) {
+        return NULL;  // a frame failed, or the end of the file
+      }
+      if (pending) {
+        decompressor->ret = KPERFDATA_RET_FAIL;  // the slots are started in order, unreachable
+        return NULL;
+      }
+      // every slot is still a chunk of the cursor, decompress the next bytes into a new one
+      decompressor->ret = kpdecode_decompressor_grow(decompressor);
+      continue;
+    }
+
+    if (next->state == KPERFDATA_SLOT_RUNNING) {
+      kpdecode_slot_wait(next);
+    }
+    if (next->piece) {
+      stream->running = false;
+      stream->active = next->ret == KPERFDATA_RET_OK && !stream->finished;
+    }
+    if (next->ret != KPERFDATA_RET_OK) {
+      decompressor->ret = next->ret;
+      return NULL;
+    }
+    decompressor->deliver_sequence += 1;
+    if (next->size == 0) {
+      next->state = KPERFDATA_SLOT_FREE;  // the stream ended at the end of the previous piece
+      continue;
+    }
+    next->state = KPERFDATA_SLOT_QUEUED;
+    kpdecode_decompressor_schedule(decompressor);  // the next piece, while this one is decoded
+    *size = next->size;
+    return next->bytes;
+  }
+}
+
+void kpdecode_decompressor_release(kpdecode_decompressor* decompressor, const char* bytes) {
+  for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+    if (decompressor->slots[i]->bytes == bytes) {
+      decompressor->slots[i]->state = KPERFDATA_SLOT_FREE;
+      return;
+    }
+  }
+}
+
+long kpdecode_decompressor_status(const kpdecode_decompressor* decompressor) {
+  return decompressor->ret;
+}
+
+void kpdecode_decompressor_free(kpdecode_decompressor* decompressor, kpdecode_cursor* cursor) {
+  for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+    kpdecode_decompress_slot* slot = decompressor->slots[i];
+    if (slot->state == KPERFDATA_SLOT_QUEUED && cursor != NULL) {
+      kpdecode_cursor_dropchunk(cursor, slot->bytes);
+    }
+    if (slot->state == KPERFDATA_SLOT_RUNNING) {
+      kpdecode_slot_wait(slot);
+    }
+  }
+  kpdecode_decompressor_lock(decompressor);
+  decompressor->stopping = true;
+  kpdecode_decompressor_wake(&decompressor->queued);
+  kpdecode_decompressor_unlock(decompressor);
+  kpdecode_decompressor_join_workers(decompressor);
+  kpdecode_decompressor_destroy_lock(decompressor);
+  free(decompressor->workers);
+  for (uint32_t i = 0; i < decompressor->slot_count; ++i) {
+    free(decompressor->slots[i]->bytes);
+    free(decompressor->slots[i]);
+  }
+  free(decompressor->slots);
+#if defined(KPERFDATA_HAVE_ZSTD)
+  ZSTD_freeDCtx(decompressor->stream.zstd);
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  LZ4F_freeDecompressionContext(decompressor->stream.lz4);
+#endif
+  free(decompressor);
+}
+
+KPERFDATA_END_CPP_NAMESPACE
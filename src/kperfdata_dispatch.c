@@ -0,0 +1,159 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc, free, realloc
+#include <string.h>  // memcpy
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// The kevents that start and end the samples, handled only by the built-in handlers
+static const uint32_t kpdecode_reserved_debugids[] = {
+    KPERFDATA_TRACE_LOST_EVENTS,
+    KPERFDATA_PERF_GEN_EVENT_START,
+    KPERFDATA_PERF_GEN_EVENT_END,
+};
+
+const kpdecode_dispatch_entry* kpdecode_dispatch_lookup(const kpdecode_dispatch* dispatch,
+                                                        uint32_t debugid) {
+  const kpdecode_dispatch_slot* slots = dispatch->classes[KPERFDATA_DEBUGID_CLASS(debugid)];
+  if (slots == NULL) {
+    return NULL;
+  }
+  const kpdecode_dispatch_slot* slot = &slots[KPERFDATA_DEBUGID_SUBCLASS(debugid)];
+  for (uint32_t i = slot->count; i-- > 0;) {
+    if ((debugid & slot->entries[i].debugid_mask) == slot->entries[i].debugid) {
+      return &slot->entries[i];
+    }
+  }
+  return NULL;
+}
+
+kpdecode_dispatch* kpdecode_dispatch_copy(const kpdecode_dispatch* from) {
+  kpdecode_dispatch* dispatch = calloc(1, sizeof(kpdecode_dispatch));
+  if (dispatch == NULL) {
+    return NULL;
+  }
+  for (uint32_t class_index = 0; class_index < 256; ++class_index) {
+    const kpdecode_dispatch_slot* from_slots = from->classes[class_index];
+    if (from_slots == NULL) {
+      continue;
+    }
+    kpdecode_dispatch_slot* slots = calloc(256, sizeof(kpdecode_dispatch_slot));
+    if (slots == NULL) {
+      kpdecode_dispatch_free(dispatch);
+      return NULL;
+    }
+    dispatch->classes[class_index] = slots;
+    for (uint32_t subclass = 0; subclass < 256; ++subclass) {
+      uint32_t count = from_slots[subclass].count;
+      if (count == 0) {
+        continue;
+      }
+      kpdecode_dispatch_entry* entries = malloc(sizeof(kpdecode_dispatch_entry) * count);
+      if (entries == NULL) {
+        kpdecode_dispatch_free(dispatch);
+        return NULL;
+      }
+      memcpy(entries, from_slots[subclass].entries, sizeof(kpdecode_dispatch_entry) * count);
+      slots[subclass].entries = entries;
+      slots[subclass].count = count;
+    }
+  }
+  return dispatch;
+}
+
+void kpdecode_dispatch_free(kpdecode_dispatch* dispatch) {
+  if (dispatch == NULL) {
+    return;
+  }
+  for (uint32_t class_index = 0; class_index < 256; ++class_index) {
+    const kpdecode_dispatch_slot* slots = dispatch->classes[class_index];
+    if (slots == NULL) {
+      continue;
+    }
+    for (uint32_t subclass = 0; subclass < 256; ++subclass) {
+      free((void*)slots[subclass].entries);
+    }
+    free((void*)slots);
+  }
+  free(dispatch);
+}
+
+long kpdecode_cursor_add_kevent_handler(kpdecode_cursor* cursor, uint32_t debugid_mask,
+                                        uint32_t debugid, kpdecode_kevent_handler handler,
+                                        void* context) {
+  if (handler == NULL ||
+      (debugid_mask & KPERFDATA_DEBUGID_CLASS_MASK) != KPERFDATA_DEBUGID_CLASS_MASK) {
+    return KPERFDATA_RET_FAIL;
+  }
+  // the sample kevents are scanned without the handlers by the parallel decoding and the index
+  for (size_t i = 0; i < sizeof(kpdecode_reserved_debugids) / sizeof(uint32_t); ++i) {
+    if ((kpdecode_reserved_debugids[i] & debugid_mask) == (debugid & debugid_mask)) {
+      return KPERFDATA_RET_FAIL;
+    }
+  }
+  if (cursor->dispatch == NULL) {
+    cursor->dispatch = kpdecode_dispatch_copy(&kpdecode_builtin_dispatch);
+    if (cursor->dispatch == NULL) {
+      return KPERFDATA_RET_OOM;
+    }
+  }
+  kpdecode_dispatch* dispatch = cursor->dispatch;
+  uint32_t class_index = KPERFDATA_DEBUGID_CLASS(debugid);
+  // the tables of the cursor are its own, not the built-in ones
+  kpdecode_dispatch_slot* slots = (kpdecode_dispatch_slot*)dispatch->classes[class_index];
+  if (slots == NULL) {
+    slots = calloc(256, sizeof(kpdecode_dispatch_slot));
+    if (slots == NULL) {
+      return KPERFDATA_RET_OOM;
+    }
+    dispatch->classes[class_index] = slots;
+  }
+
+  // a class mask covers all the subclasses of the class
+  uint32_t first = KPERFDATA_DEBUGID_SUBCLASS(debugid);
+  uint32_t last = first;
+  if ((debugid_mask & KPERFDATA_DEBUGID_SUBCLASS_MASK) != KPERFDATA_DEBUGID_SUBCLASS_MASK) {
+    first = 0;
+    last = 255;
+  }
+
+  // grow all the slots first, so that the handler is added to all of them or to none
+  for (uint32_t subclass = first; subclass <= last; ++subclass) {
+    kpdecode_dispatch_entry* entries =
+        realloc((void*)slots[subclass].entries,
+                sizeof(kpdecode_dispatch_entry) * (slots[subclass].count + 1));
+    if (entries == NULL) {
+      return KPERFDATA_RET_OOM;
+    }
+    slots[subclass].entries = entries;
+  }
+  kpdecode_dispatch_entry entry = {debugid_mask, debugid & debugid_mask, handler, context};
+  for (uint32_t subclass = first; subclass <= last; ++subclass) {
+    ((kpdecode_dispatch_entry*)slots[subclass].entries)[slots[subclass].count] = entry;
+    slots[subclass].count += 1;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_cursor_clear_kevent_handlers(kpdecode_cursor* cursor) {
+  kpdecode_dispatch_free(cursor->dispatch);
+  cursor->dispatch = NULL;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
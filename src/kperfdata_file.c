@@ -0,0 +1,202 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#if defined(_WIN32)
+#include <windows.h>  // CreateFileMappingA, MapViewOfFile
+#else
+#include <fcntl.h>  // open
+#include <sys/mman.h>  // mmap, madvise
+#include <sys/stat.h>  // fstat
+#include <unistd.h>  // close
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+#if defined(_WIN32)
+
+static long kpdecode_map_file(kpdecode_cursor* cursor, const char* path, int flags) {
+  (void)flags;  // large pages require SeLockMemoryPrivilege and can not back a file mapping
+  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    return KPERFDATA_RET_FAIL;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+    CloseHandle(file);
+    return KPERFDATA_RET_FAIL;
+  }
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(file);  // the mapping keeps a reference to the file
+  if (mapping == NULL) {
+    return KPERFDATA_RET_FAIL;
+  }
+  void* map = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (map == NULL) {
+    CloseHandle(mapping);
+    return KPERFDATA_RET_FAIL;
+  }
+  cursor->file_map = map;
+  cursor->file_map_size = size.QuadPart;
+  cursor->file_map_handle = mapping;
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_unmap_file(kpdecode_cursor* cursor) {
+  UnmapViewOfFile(cursor->file_map);
+  CloseHandle((HANDLE)cursor->file_map_handle);
+}
+
+#else
+
+static long kpdecode_map_file(kpdecode_cursor* cursor, const char* path, int flags) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return KPERFDATA_RET_FAIL;
+  }
+  struct stat filestats;
+  if (fstat(fd, &filestats) != 0 || filestats.st_size == 0) {
+    close(fd);
+    return KPERFDATA_RET_FAIL;
+  }
+  size_t size = (size_t)filestats.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);  // the mapping keeps a reference to the file
+  if (map == MAP_FAILED) {
+    return KPERFDATA_RET_FAIL;
+  }
+
+  // the kd_bufs are read once from the beginning to the end, let the kernel read ahead
+  // aggressively and drop the pages behind us. These are only hints, ignore the failures.
+  madvise(map, size, MADV_SEQUENTIAL);
+  madvise(map, size < KPERFDATA_FILE_WILLNEED_SIZE ? size : KPERFDATA_FILE_WILLNEED_SIZE,
+          MADV_WILLNEED);
+#if defined(MADV_HUGEPAGE)
+  if (flags & KPERFDATA_OPEN_FILE_HUGEPAGES) {
+    madvise(map, size, MADV_HUGEPAGE);  // needs CONFIG_READ_ONLY_THP_FOR_FS for file mappings
+  }
+#else
+  (void)flags;
+#endif
+
+  cursor->file_map = map;
+  cursor->file_map_size = size;
+  cursor->file_map_handle = NULL;
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_unmap_file(kpdecode_cursor* cursor) {
+  munmap(cursor->file_map, cursor->file_map_size);
+}
+
+#endif
+
+bool kpdecode_cursor_read_ahead(kpdecode_cursor* cursor) {
+  if (cursor->source == NULL && cursor->decompressor == NULL) {
+    return false;
+  }
+  char* consumed;
+  while ((consumed = kpdecode_cursor_pop_owned_chunk(cursor)) != NULL) {
+    if (cursor->source != NULL) {
+      kpdecode_file_source_release(cursor->source, consumed);
+    } else {
+      kpdecode_decompressor_release(cursor->decompressor, consumed);
+    }
+  }
+  size_t size = 0;
+  const char* bytes;
+  long status;
+  if (cursor->source != NULL) {
+    bytes = kpdecode_file_source_next(cursor->source, &size);
+    status = kpdecode_file_source_status(cursor->source);
+  } else {
+    bytes = kpdecode_decompressor_next(cursor->decompressor, &size);
+    status = kpdecode_decompressor_status(cursor->decompressor);
+  }
+  if (bytes == NULL) {
+    if (status == KPERFDATA_RET_OK) {
+      kpdecode_cursor_finish(cursor);  // the end of the file
+    }
+    return false;
+  }
+  return kpdecode_cursor_set_owned_chunk(cursor, bytes, size) == KPERFDATA_RET_OK;
+}
+
+long kpdecode_cursor_open_file(kpdecode_cursor* cursor, const char* path, int flags) {
+  if (cursor->buffer != NULL || cursor->file_map != NULL || cursor->source != NULL ||
+      cursor->decompressor != NULL) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (flags & KPERFDATA_OPEN_FILE_READ_AHEAD) {
+    cursor->source = kpdecode_file_source_open(path, KPERFDATA_READ_AHEAD_BUFFERS,
+                                               KPERFDATA_READ_AHEAD_BUFFER_SIZE, flags);
+    if (cursor->source == NULL) {
+      return KPERFDATA_RET_FAIL;
+    }
+    if (!kpdecode_cursor_read_ahead(cursor)) {  // wait for the first buffer, as a mapped file
+      kpdecode_cursor_close_file(cursor);
+      return KPERFDATA_RET_FAIL;
+    }
+    if (!kpdecode_is_compressed(cursor->buffer, cursor->buffer_size)) {
+      return KPERFDATA_RET_OK;
+    }
+    kpdecode_cursor_close_file(cursor);  // the compressed frames are decompressed from a mapping
+  }
+  if (kpdecode_map_file(cursor, path, flags) != KPERFDATA_RET_OK) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (kpdecode_is_compressed((const char*)cursor->file_map, cursor->file_map_size)) {
+    // a frame decompressed on each cpu, while one more is decoded
+    int slot_count = kpdecode_online_cpus() + 1;
+    if (slot_count < 2) {
+      slot_count = 2;
+    } else if (slot_count > KPERFDATA_DECOMPRESS_MAX_SLOTS) {
+      slot_count = KPERFDATA_DECOMPRESS_MAX_SLOTS;
+    }
+    cursor->decompressor = kpdecode_decompressor_create(
+        (const char*)cursor->file_map, cursor->file_map_size, (uint32_t)slot_count);
+    if (cursor->decompressor == NULL || !kpdecode_cursor_read_ahead(cursor)) {
+      kpdecode_cursor_close_file(cursor);
+      return KPERFDATA_RET_FAIL;
+    }
+    return KPERFDATA_RET_OK;
+  }
+  return kpdecode_cursor_set_owned_chunk(cursor, (const char*)cursor->file_map,
+                                         cursor->file_map_size);
+}
+
+void kpdecode_cursor_close_file(kpdecode_cursor* cursor) {
+  if (cursor->source != NULL) {
+    kpdecode_file_source_close(cursor->source, cursor);
+    cursor->source = NULL;
+  }
+  if (cursor->decompressor != NULL) {
+    kpdecode_decompressor_free(cursor->decompressor, cursor);
+    cursor->decompressor = NULL;
+  }
+  if (cursor->file_map == NULL) {
+    return;
+  }
+  kpdecode_cursor_dropchunk(cursor, (const char*)cursor->file_map);
+  kpdecode_unmap_file(cursor);
+  cursor->file_map = NULL;
+  cursor->file_map_size = 0;
+  cursor->file_map_handle = NULL;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
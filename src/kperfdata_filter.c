@@ -0,0 +1,134 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KPERFDATA_SCAN_X86 1
+#include <emmintrin.h>  // SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define KPERFDATA_SCAN_AVX2 1
+#include <immintrin.h>  // AVX2
+#endif
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+bool kpdecode_debugid_filter_match(const uint32_t* masks, const uint32_t* values,
+                                   uint32_t filter_count, uint32_t debugid) {
+  for (uint32_t f = 0; f < filter_count; ++f) {
+    if ((debugid & masks[f]) == values[f]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t kpdecode_scan_debugids_scalar(const kd_buf_64* kevents, size_t count,
+                                            const uint32_t* masks, const uint32_t* values,
+                                            uint32_t filter_count, int match) {
+  for (size_t i = 0; i < count; ++i) {
+    bool matched = kpdecode_debugid_filter_match(masks, values, filter_count, kevents[i].debugid);
+    if (matched == (match != 0)) {
+      return i;
+    }
+  }
+  return count;
+}
+
+#if defined(KPERFDATA_SCAN_X86)
+
+static size_t kpdecode_scan_debugids_sse2(const kd_buf_64* kevents, size_t count,
+                                          const uint32_t* masks, const uint32_t* values,
+                                          uint32_t filter_count, int match) {
+  const int wanted = match ? 0 : 0xf;  // the movemask bits of the kevents to skip over
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i debugids = _mm_setr_epi32((int)kevents[i].debugid, (int)kevents[i + 1].debugid,
+                                      (int)kevents[i + 2].debugid, (int)kevents[i + 3].debugid);
+    __m128i matched = _mm_setzero_si128();
+    for (uint32_t f = 0; f < filter_count; ++f) {
+      __m128i masked = _mm_and_si128(debugids, _mm_set1_epi32((int)masks[f]));
+      matched = _mm_or_si128(matched, _mm_cmpeq_epi32(masked, _mm_set1_epi32((int)values[f])));
+    }
+    int bits = _mm_movemask_ps(_mm_castsi128_ps(matched));
+    if (bits != wanted) {
+      break;  // found in this group, locate it below
+    }
+  }
+  return i + kpdecode_scan_debugids_scalar(kevents + i, count - i, masks, values, filter_count,
+                                           match);
+}
+
+#endif  // KPERFDATA_SCAN_X86
+
+#if defined(KPERFDATA_SCAN_AVX2)
+
+__attribute__((target("avx2"))) static size_t kpdecode_scan_debugids_avx2(
+    const kd_buf_64* kevents, size_t count, const uint32_t* masks, const uint32_t* values,
+    uint32_t filter_count, int match) {
+  // the debugid of 8 consecutive kd_buf_64, in units of 4 bytes
+  const __m256i index = _mm256_setr_epi32(0, 16, 32, 48, 64, 80, 96, 112);
+  const int wanted = match ? 0 : 0xff;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i debugids = _mm256_i32gather_epi32((const int*)&kevents[i].debugid, index, 4);
+    __m256i matched = _mm256_setzero_si256();
+    for (uint32_t f = 0; f < filter_count; ++f) {
+      __m256i masked = _mm256_and_si256(debugids, _mm256_set1_epi32((int)masks[f]));
+      matched =
+          _mm256_or_si256(matched, _mm256_cmpeq_epi32(masked, _mm256_set1_epi32((int)values[f])));
+    }
+    int bits = _mm256_movemask_ps(_mm256_castsi256_ps(matched));
+    if (bits != wanted) {
+      break;
+    }
+  }
+  return i + kpdecode_scan_debugids_scalar(kevents + i, count - i, masks, values, filter_count,
+                                           match);
+}
+
+#endif  // KPERFDATA_SCAN_AVX2
+
+kpdecode_scan_fn kpdecode_scan_debugids_kernel(int kernel) {
+  switch (kernel) {
+    case KPERFDATA_KERNEL_SCALAR:
+      return kpdecode_scan_debugids_scalar;
+#if defined(KPERFDATA_SCAN_X86)
+    case KPERFDATA_KERNEL_SSE2:
+      return kpdecode_scan_debugids_sse2;
+#endif
+#if defined(KPERFDATA_SCAN_AVX2)
+    case KPERFDATA_KERNEL_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? kpdecode_scan_debugids_avx2 : NULL;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+kpdecode_scan_fn kpdecode_select_scan_debugids(void) {
+  for (int kernel = KPERFDATA_KERNEL_AVX2; kernel > KPERFDATA_KERNEL_SCALAR; --kernel) {
+    kpdecode_scan_fn scan = kpdecode_scan_debugids_kernel(kernel);
+    if (scan != NULL) {
+      return scan;
+    }
+  }
+  return kpdecode_scan_debugids_scalar;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,326 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stddef.h>  // offsetof
+#include <stdio.h>  // fopen, fread, fwrite
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcmp, memcpy
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+/*
+ * The time index of a RAW file, in the byte order of the host:
+ *
+ * kpdecode_index_header
+ * kpdecode_index_checkpoint[checkpoint_count], each one followed by its cpu_kevent_count[] and
+ * cpu_timestamp[] up to the cpu_count of the header
+ */
+typedef struct {
+  uint32_t magic;                                          // KPERFDATA_INDEX_MAGIC
+  uint32_t version;                                        // KPERFDATA_INDEX_VERSION
+  char raw_header[KPERFDATA_SIZEOF_RAW_HEADER_V1];         // identifies the RAW file
+  uint64_t interval;                                       // kd_bufs between two checkpoints
+  uint64_t kd_buf_count;
+  uint32_t size_of_kd_buf;
+  uint32_t cpu_count;                                      // the max cpuid + 1
+  uint32_t debugid_filter_masks[KPERFDATA_MAX_DEBUGID_FILTERS];
+  uint32_t debugid_filter_values[KPERFDATA_MAX_DEBUGID_FILTERS];
+  uint32_t debugid_filter_count;
+  uint32_t checkpoint_count;
+} kpdecode_index_header;
+
+// The state of the cursor before a kd_buf, and the timestamps of the kd_bufs up to the next
+// checkpoint
+typedef struct {
+  uint64_t kd_buf_index;
+  uint64_t min_timestamp;
+  uint64_t max_timestamp;                                  // 0 if all the kd_bufs are filtered out
+  uint64_t pending[KPERFDATA_MAX_CPUS / 64];               // the cpus with a pending sample
+  uint64_t kevent_count;                                   // cursor.kevent_count, not wrapped
+  uint32_t unknown_cc8;                                    // cursor.unknown_cc8
+  uint32_t unused;                                         // 0
+  uint64_t cpu_kevent_count[KPERFDATA_MAX_CPUS];           // cursor.cpus[].unknown_ac8
+  uint64_t cpu_timestamp[KPERFDATA_MAX_CPUS];              // cursor.cpus[].unknown_8c8
+} kpdecode_index_checkpoint;
+
+#define KPERFDATA_INDEX_CHECKPOINT_SIZE offsetof(kpdecode_index_checkpoint, cpu_kevent_count)
+
+// Step the state of the cursor over a kevent, as kpdecode_cursor_decode_records() does
+static void kpdecode_index_step(kpdecode_index_checkpoint* state, const kd_buf* kevent,
+                                uint32_t* cpu_count) {
+  uint32_t cpuid = kevent->cpuid;
+  if (cpuid >= KPERFDATA_MAX_CPUS) {
+    return;
+  }
+  if (cpuid >= *cpu_count) {
+    *cpu_count = cpuid + 1;
+  }
+  if (kpdecode_kevent_counted(kevent)) {
+    uint64_t kevent_count_pre_cpu = state->cpu_kevent_count[cpuid] + 1;
+    state->cpu_kevent_count[cpuid] = kevent_count_pre_cpu;
+    if (kevent_count_pre_cpu > state->unknown_cc8) {
+      state->unknown_cc8 = (uint32_t)kevent_count_pre_cpu;
+    }
+  }
+  state->cpu_timestamp[cpuid] = kevent->timestamp;
+  int event = kpdecode_sample_event(kevent->debugid);
+  if (event == KPERFDATA_SAMPLE_EVENT_START) {
+    state->pending[cpuid / 64] |= 1ULL << (cpuid % 64);
+  } else if (event != KPERFDATA_SAMPLE_EVENT_NONE) {
+    state->pending[cpuid / 64] &= ~(1ULL << (cpuid % 64));
+  }
+}
+
+// Scan the kd_bufs of each checkpoint with a cursor of its own, as kpdecode_cursor_decode_parallel
+// does, since the cursor of the RAW file stops decoding on each record.
+static long kpdecode_index_scan(kpdecode_cursor* reader, const char* kd_bufs,
+                                uint64_t kd_bufs_size, kpdecode_index_checkpoint* checkpoints,
+                                uint64_t checkpoint_count, uint64_t interval,
+                                uint32_t* cpu_count) {
+  kpdecode_index_checkpoint state;
+  memset(&state, 0, sizeof(state));
+  for (uint64_t i = 0; i < checkpoint_count; ++i) {
+    kpdecode_cursor* scanner = kpdecode_cursor_create_shard(reader, i == 0);
+    if (!scanner) {
+      return KPERFDATA_RET_OOM;
+    }
+    state.kd_buf_index = i * interval;
+    state.min_timestamp = UINT64_MAX;
+    state.max_timestamp = 0;
+    kpdecode_index_checkpoint* checkpoint = &checkpoints[i];
+    *checkpoint = state;
+
+    const char* bytes = kd_bufs + state.kd_buf_index * reader->size_of_kd_buf;
+    // the last checkpoint also gets the truncated kd_buf at the end, if any
+    uint64_t size = i + 1 == checkpoint_count ? (uint64_t)(kd_bufs + kd_bufs_size - bytes)
+                                              : interval * reader->size_of_kd_buf;
+    if (kpdecode_cursor_setchunk(scanner, bytes, size) != KPERFDATA_RET_OK) {
+      kpdecode_cursor_free(scanner);
+      return KPERFDATA_RET_OOM;
+    }
+    const kd_buf* kevents = NULL;
+    size_t count = 0;
+    long ret;
+    while ((ret = kpdecode_cursor_next_kevents(scanner, &kevents, SIZE_MAX, &count)) ==
+           KPERFDATA_RET_OK) {
+      for (size_t j = 0; j < count; ++j) {
+        uint64_t timestamp = kevents[j].timestamp;
+        if (timestamp < checkpoint->min_timestamp) {
+          checkpoint->min_timestamp = timestamp;
+        }
+        if (timestamp > checkpoint->max_timestamp) {
+          checkpoint->max_timestamp = timestamp;
+        }
+        kpdecode_index_step(&state, &kevents[j], cpu_count);
+      }
+    }
+    state.kevent_count += scanner->kevent_count;
+    kpdecode_cursor_free(scanner);
+    if (ret != KPERFDATA_RET_NOT_READY) {
+      return ret;  // not the end of the checkpoint
+    }
+    if (checkpoint->min_timestamp > checkpoint->max_timestamp) {
+      checkpoint->min_timestamp = 0;  // no kevent
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static bool kpdecode_index_write_checkpoint(FILE* file, const kpdecode_index_checkpoint* checkpoint,
+                                            uint32_t cpu_count) {
+  return fwrite(checkpoint, KPERFDATA_INDEX_CHECKPOINT_SIZE, 1, file) == 1 &&
+         fwrite(checkpoint->cpu_kevent_count, sizeof(uint64_t), cpu_count, file) == cpu_count &&
+         fwrite(checkpoint->cpu_timestamp, sizeof(uint64_t), cpu_count, file) == cpu_count;
+}
+
+static bool kpdecode_index_read_checkpoint(FILE* file, kpdecode_index_checkpoint* checkpoint,
+                                           uint32_t cpu_count) {
+  memset(checkpoint, 0, sizeof(*checkpoint));
+  return fread(checkpoint, KPERFDATA_INDEX_CHECKPOINT_SIZE, 1, file) == 1 &&
+         fread(checkpoint->cpu_kevent_count, sizeof(uint64_t), cpu_count, file) == cpu_count &&
+         fread(checkpoint->cpu_timestamp, sizeof(uint64_t), cpu_count, file) == cpu_count;
+}
+
+long kpdecode_cursor_write_index(kpdecode_cursor* cursor, const char* index_path,
+                                 uint64_t interval) {
+  if (interval == 0) {
+    interval = KPERFDATA_INDEX_INTERVAL;
+  }
+  if (cursor->state != KPERFDATA_STATE_HEADER_NOT_DECODED || cursor->buffer == NULL ||
+      cursor->chunk_queue_head != NULL || cursor->buffer_size < KPERFDATA_SIZEOF_RAW_HEADER_V1) {
+    return KPERFDATA_RET_FAIL;
+  }
+
+  // the cursor is left as is, a reader of the same RAW file decodes the header instead
+  kpdecode_cursor* reader = kpdecode_cursor_create();
+  if (!reader) {
+    return KPERFDATA_RET_OOM;
+  }
+  if (kpdecode_cursor_setchunk(reader, cursor->buffer, cursor->buffer_size) != KPERFDATA_RET_OK) {
+    kpdecode_cursor_free(reader);
+    return KPERFDATA_RET_OOM;
+  }
+  for (uint32_t i = 0; i < cursor->debugid_filter_count; ++i) {
+    kpdecode_cursor_add_debugid_filter(reader, cursor->debugid_filter_masks[i],
+                                       cursor->debugid_filter_values[i]);
+  }
+  const char* kd_bufs = NULL;
+  uint64_t kd_bufs_size = 0;
+  long ret = kpdecode_cursor_take_kd_bufs(reader, &kd_bufs, &kd_bufs_size);
+  if (ret != KPERFDATA_RET_OK) {
+    kpdecode_cursor_free(reader);
+    return ret;
+  }
+
+  kpdecode_index_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = KPERFDATA_INDEX_MAGIC;
+  header.version = KPERFDATA_INDEX_VERSION;
+  memcpy(header.raw_header, cursor->buffer, sizeof(header.raw_header));
+  header.interval = interval;
+  header.kd_buf_count = kd_bufs_size / reader->size_of_kd_buf;
+  header.size_of_kd_buf = reader->size_of_kd_buf;
+  memcpy(header.debugid_filter_masks, cursor->debugid_filter_masks,
+         sizeof(header.debugid_filter_masks));
+  memcpy(header.debugid_filter_values, cursor->debugid_filter_values,
+         sizeof(header.debugid_filter_values));
+  header.debugid_filter_count = cursor->debugid_filter_count;
+  uint64_t checkpoint_count = (header.kd_buf_count + interval - 1) / interval;
+  if (checkpoint_count == 0) {
+    checkpoint_count = 1;
+  }
+  if (checkpoint_count > UINT32_MAX) {
+    kpdecode_cursor_free(reader);
+    return KPERFDATA_RET_FAIL;
+  }
+  header.checkpoint_count = (uint32_t)checkpoint_count;
+
+  kpdecode_index_checkpoint* checkpoints = calloc(checkpoint_count, sizeof(*checkpoints));
+  if (!checkpoints) {
+    kpdecode_cursor_free(reader);
+    return KPERFDATA_RET_OOM;
+  }
+  ret = kpdecode_index_scan(reader, kd_bufs, kd_bufs_size, checkpoints, checkpoint_count,
+                            interval, &header.cpu_count);
+  kpdecode_cursor_free(reader);
+  if (ret != KPERFDATA_RET_OK) {
+    free(checkpoints);
+    return ret;
+  }
+
+  FILE* file = fopen(index_path, "wb");
+  if (!file) {
+    free(checkpoints);
+    return KPERFDATA_RET_FAIL;
+  }
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+  for (uint64_t i = 0; written && i < checkpoint_count; ++i) {
+    written = kpdecode_index_write_checkpoint(file, &checkpoints[i], header.cpu_count);
+  }
+  free(checkpoints);
+  if (fclose(file) != 0 || !written) {
+    remove(index_path);
+    return KPERFDATA_RET_FAIL;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+// Check that the index has been written for the RAW file and the debugid filters of the cursor
+static bool kpdecode_index_matches(const kpdecode_index_header* header,
+                                   const kpdecode_cursor* cursor) {
+  if (header->magic != KPERFDATA_INDEX_MAGIC || header->version != KPERFDATA_INDEX_VERSION ||
+      header->cpu_count > KPERFDATA_MAX_CPUS || header->interval == 0) {
+    return false;
+  }
+  if (cursor->buffer == NULL || cursor->buffer_size < sizeof(header->raw_header) ||
+      memcmp(cursor->buffer, header->raw_header, sizeof(header->raw_header)) != 0) {
+    return false;
+  }
+  if (header->debugid_filter_count != cursor->debugid_filter_count) {
+    return false;
+  }
+  for (uint32_t i = 0; i < cursor->debugid_filter_count; ++i) {
+    if (header->debugid_filter_masks[i] != cursor->debugid_filter_masks[i] ||
+        header->debugid_filter_values[i] != cursor->debugid_filter_values[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Find the first checkpoint with kd_bufs at `timestamp` or later, or the last one
+static long kpdecode_index_find(FILE* file, const kpdecode_index_header* header,
+                                uint64_t timestamp, kpdecode_index_checkpoint* checkpoint) {
+  for (uint32_t i = 0; i < header->checkpoint_count; ++i) {
+    if (!kpdecode_index_read_checkpoint(file, checkpoint, header->cpu_count)) {
+      return KPERFDATA_RET_FAIL;  // truncated
+    }
+    if (checkpoint->max_timestamp >= timestamp) {
+      break;
+    }
+  }
+  return header->checkpoint_count != 0 ? KPERFDATA_RET_OK : KPERFDATA_RET_FAIL;
+}
+
+long kpdecode_cursor_seek_time(kpdecode_cursor* cursor, const char* index_path,
+                               uint64_t timestamp) {
+  if (cursor->state != KPERFDATA_STATE_HEADER_NOT_DECODED || cursor->kevent_count != 0) {
+    return KPERFDATA_RET_FAIL;
+  }
+  FILE* file = fopen(index_path, "rb");
+  if (!file) {
+    return KPERFDATA_RET_FAIL;
+  }
+  kpdecode_index_header header;
+  kpdecode_index_checkpoint checkpoint;
+  long ret = KPERFDATA_RET_FAIL;
+  if (fread(&header, sizeof(header), 1, file) == 1 && kpdecode_index_matches(&header, cursor)) {
+    ret = kpdecode_index_find(file, &header, timestamp, &checkpoint);
+  }
+  fclose(file);
+  if (ret != KPERFDATA_RET_OK || checkpoint.kd_buf_index == 0) {
+    return ret;  // nothing to skip at the first checkpoint
+  }
+
+  // the samples started before the checkpoint are never returned, a placeholder stands for them
+  // until their END or LOST
+  kpdecode_record* pending = calloc(1, sizeof(kpdecode_record));
+  if (!pending || kpdecode_cursor_reserve_cpus(cursor, header.cpu_count) != KPERFDATA_RET_OK) {
+    free(pending);
+    return KPERFDATA_RET_OOM;
+  }
+  ret = kpdecode_cursor_seek_kd_buf(cursor, checkpoint.kd_buf_index);
+  if (ret != KPERFDATA_RET_OK) {
+    free(pending);
+    return ret;
+  }
+  cursor->seek_pending = pending;
+  cursor->kevent_count = (uint32_t)checkpoint.kevent_count;  // wraps as in the decoding
+  cursor->unknown_cc8 = checkpoint.unknown_cc8;
+  for (uint32_t cpuid = 0; cpuid < header.cpu_count; ++cpuid) {
+    kpdecode_cpu* cpu = &cursor->cpus[cpuid];
+    cpu->unknown_ac8 = checkpoint.cpu_kevent_count[cpuid];
+    cpu->unknown_8c8 = checkpoint.cpu_timestamp[cpuid];
+    if (checkpoint.pending[cpuid / 64] & (1ULL << (cpuid % 64))) {
+      cpu->unknown_c8 = pending;
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
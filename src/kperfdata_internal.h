@@ -0,0 +1,521 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef KPERFDATA_SRC_KPERFDATA_INTERNAL_H_
+#define KPERFDATA_SRC_KPERFDATA_INTERNAL_H_
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdbool.h>  // bool
+
+KPERFDATA_START_CPP_NAMESPACE
+
+typedef struct {
+  uint32_t debugid_mask;
+  uint32_t debugid;  // masked
+  kpdecode_kevent_handler handler;
+  void* context;
+} kpdecode_dispatch_entry;
+
+// The handlers of a class/subclass, the last one added first. The tables of the cursor are owned by
+// it and only read through const pointers, as the built-in ones
+typedef struct {
+  const kpdecode_dispatch_entry* entries;
+  uint32_t count;
+} kpdecode_dispatch_slot;
+
+struct kpdecode_dispatch {
+  const kpdecode_dispatch_slot* classes[256];  // the subclasses of a class, NULL without handlers
+};
+
+// the built-in kevent handlers, used while no handler is added to the cursor
+extern const kpdecode_dispatch kpdecode_builtin_dispatch;
+
+// the kevents which start or complete the pending sample of a cpu, cursor.cpus[].unknown_c8
+#define KPERFDATA_SAMPLE_EVENT_NONE 0
+#define KPERFDATA_SAMPLE_EVENT_START 1
+#define KPERFDATA_SAMPLE_EVENT_END 2
+#define KPERFDATA_SAMPLE_EVENT_LOST 3
+
+/**
+ * Get how a kevent changes the pending sample of its cpu, as the built-in handlers do. The scans
+ * stepping the per-cpu state without the handlers, the parallel decoding and the index, share it
+ * with kpdecode_cursor_decode_records() so that they can not drift apart.
+ *
+ * @param debugid the debugid of the kevent
+ * @return KPERFDATA_SAMPLE_EVENT_*
+ */
+int kpdecode_sample_event(uint32_t debugid);
+
+/**
+ * Whether a kevent is counted in the kevents of its cpu, cursor.cpus[].unknown_ac8
+ *
+ * @param kevent the kevent
+ * @return true if counted
+ */
+bool kpdecode_kevent_counted(const kd_buf* kevent);
+
+/**
+ * Allocate a record from the pool, its fixed fields are cleared
+ *
+ * @param pool the pool
+ * @return the record, to release by kpdecode_record_free(), NULL on OOM
+ */
+kpdecode_record* kpdecode_record_pool_alloc(kpdecode_record_pool* pool);
+
+/**
+ * Set a buffer of the file opened by the cursor as a chunk, as kpdecode_cursor_setchunk(). It is
+ * never returned by kpdecode_cursor_popchunk() or kpdecode_cursor_clearchunk().
+ *
+ * @param cursor the cursor
+ * @param bytes chunk buffer
+ * @param size size of buffer
+ * @return ret: 0 for success, 2 for OOM when the chunk can not be queued
+ */
+long kpdecode_cursor_set_owned_chunk(kpdecode_cursor* cursor, const char* bytes, size_t size);
+
+/**
+ * Pop the oldest chunk set by kpdecode_cursor_set_owned_chunk() which has been fully decoded
+ *
+ * @param cursor the cursor
+ * @return the pointer of the chunk, to recycle, or NULL
+ */
+char* kpdecode_cursor_pop_owned_chunk(kpdecode_cursor* cursor);
+
+/**
+ * Drop a chunk from the chunks of the cursor, wherever it is, without returning it to the caller
+ *
+ * @param cursor the cursor
+ * @param bytes the chunk buffer
+ */
+void kpdecode_cursor_dropchunk(kpdecode_cursor* cursor, const char* bytes);
+
+/**
+ * Decode the kevents of the cursor until the first pending record is ready
+ *
+ * @param cursor the cursor
+ * @return ret: 0 for success, KPERFDATA_RET_SAMPLE_PENDING if a sample starts while another one is
+ * pending on the same cpu, otherwise for failure
+ */
+long kpdecode_cursor_decode_records(kpdecode_cursor* cursor);
+
+/**
+ * Complete the pending sample of a cpu, as on PERF_GEN_EVENT_END or TRACE_LOST_EVENTS
+ *
+ * @param cursor the cursor
+ * @param cpuid the cpu
+ * @param lost whether the sample is incomplete because of lost events
+ */
+void kpdecode_cursor_complete_sample(kpdecode_cursor* cursor, uint32_t cpuid, bool lost);
+
+/**
+ * The built-in kevent handler of PERF_CALLSTACK, see kpdecode_kevent_handler
+ *
+ * Assembles the callstacks of the sample pending on the cpu, `record` is not used.
+ */
+long kpdecode_cursor_decode_callstack(kpdecode_cursor* cursor, kpdecode_cpu* cpu,
+                                      kpdecode_record* record, const kd_buf* kevent,
+                                      void* context);
+
+/**
+ * Find the kevent handler of a debugid
+ *
+ * @param dispatch the handlers
+ * @param debugid the debugid
+ * @return the handler, NULL if none
+ */
+const kpdecode_dispatch_entry* kpdecode_dispatch_lookup(const kpdecode_dispatch* dispatch,
+                                                        uint32_t debugid);
+
+/**
+ * Move all the pending records of `from`, ready or not, to the end of the pending records of the
+ * cursor
+ *
+ * @param cursor the cursor
+ * @param from the cursor to move the records from
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_cursor_move_records(kpdecode_cursor* cursor, kpdecode_cursor* from);
+
+/**
+ * Get the first pending record of the cursor, ready or not
+ *
+ * @param cursor the cursor, full records only
+ * @return the record, NULL if no record is pending
+ */
+kpdecode_record* kpdecode_cursor_first_record(kpdecode_cursor* cursor);
+
+/**
+ * Remove the first pending record of the cursor, ready or not
+ *
+ * @param cursor the cursor, full records only, with at least one pending record
+ * @return the record
+ */
+kpdecode_record* kpdecode_cursor_shift_record(kpdecode_cursor* cursor);
+
+/**
+ * Count and release the pending records at the head of the cursor, up to the first sample still
+ * pending. The other records do not count, and are not referred to by the per-cpu state.
+ *
+ * @param aggregate the aggregate
+ * @param cursor the cursor, full records only
+ * @param drained the number of records released, may be NULL
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_aggregate_drain(kpdecode_aggregate* aggregate, kpdecode_cursor* cursor,
+                              size_t* drained);
+
+/**
+ * Decode the kd_buf[] of the cursor in parallel, see kpdecode_cursor_decode_parallel()
+ *
+ * @param cursor the cursor
+ * @param thread_count the number of threads, 0 for the number of online cpus
+ * @param aggregate NULL to keep all the records on the cursor, otherwise each shard counts its
+ * records into its own aggregate as soon as they are complete, and those are merged into it. Only
+ * the records never completed by their shard are kept on the cursor.
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_cursor_decode_shards(kpdecode_cursor* cursor, int thread_count,
+                                   kpdecode_aggregate* aggregate);
+
+/**
+ * Decode the header of the only chunk of the cursor, and consume the chunk
+ *
+ * The threadmap is left to be replayed by a shard, see kpdecode_cursor_create_shard().
+ *
+ * @param cursor the cursor, with a whole RAW file as its only chunk
+ * @param kd_bufs the kd_buf[] of the RAW file
+ * @param kd_bufs_size size of the kd_buf[] in bytes
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_cursor_take_kd_bufs(kpdecode_cursor* cursor, const char** kd_bufs,
+                                  uint64_t* kd_bufs_size);
+
+/**
+ * Make room for the per-cpu state of `cpu_count` cpus, the new ones are zeroed
+ *
+ * @param cursor the cursor
+ * @param cpu_count the number of cpus, up to KPERFDATA_MAX_CPUS
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_cursor_reserve_cpus(kpdecode_cursor* cursor, uint32_t cpu_count);
+
+/**
+ * Decode the header of the cursor, and skip the threadmap and the kd_bufs before `kd_buf_index`
+ *
+ * @param cursor the cursor, with nothing decoded yet
+ * @param kd_buf_index the index of the next kd_buf to decode
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_cursor_seek_kd_buf(kpdecode_cursor* cursor, uint64_t kd_buf_index);
+
+/**
+ * Create a cursor decoding a part of the kd_buf[] of a cursor whose header is decoded
+ *
+ * @param cursor the cursor
+ * @param replay_threadmap whether the shard starts with the threadmap of the cursor
+ * @return the shard, with the same options and debugid filters as the cursor
+ */
+kpdecode_cursor* kpdecode_cursor_create_shard(const kpdecode_cursor* cursor, bool replay_threadmap);
+
+/**
+ * Copy the kevent handlers of a cursor
+ *
+ * @param dispatch the handlers
+ * @return the copy, to release by kpdecode_dispatch_free(), NULL on OOM
+ */
+kpdecode_dispatch* kpdecode_dispatch_copy(const kpdecode_dispatch* dispatch);
+
+/**
+ * Free the kevent handlers of a cursor
+ *
+ * @param dispatch the handlers, may be NULL
+ */
+void kpdecode_dispatch_free(kpdecode_dispatch* dispatch);
+
+/**
+ * Create a buffer merging the per-cpu runs of records by timestamp
+ *
+ * @param window the max timestamp difference between a record and a record decoded before it
+ * @return the reorder buffer
+ */
+kpdecode_reorder* kpdecode_reorder_create(uint64_t window);
+
+/**
+ * Free a reorder buffer, its records must have been popped
+ *
+ * @param reorder the reorder buffer
+ */
+void kpdecode_reorder_free(kpdecode_reorder* reorder);
+
+/**
+ * Get the number of records in the reorder buffer
+ *
+ * @param reorder the reorder buffer
+ * @return the number of records
+ */
+size_t kpdecode_reorder_count(const kpdecode_reorder* reorder);
+
+/**
+ * Push a ready record to the run of its cpu
+ *
+ * @param reorder the reorder buffer
+ * @param slot the record
+ * @param timestamp the timestamp of the record
+ * @param cpuid the cpu of the record
+ * @return ret: 0 for success, otherwise for failure
+ */
+long kpdecode_reorder_push(kpdecode_reorder* reorder, kpdecode_record_slot slot,
+                           uint64_t timestamp, uint32_t cpuid);
+
+/**
+ * Pop the oldest record, once it is out of the window or the buffer is over
+ * KPERFDATA_REORDER_MAX_RECORDS records
+ *
+ * @param reorder the reorder buffer
+ * @param drain pop the oldest record regardless of the window, no more records will be pushed
+ * @param slot the record
+ * @return true if a record is popped
+ */
+bool kpdecode_reorder_pop(kpdecode_reorder* reorder, bool drain, kpdecode_record_slot* slot);
+
+/**
+ * Hash the valid entries of a kd_threadmap[] by thread ID, the last entry of a thread wins
+ *
+ * @param threadmap the kd_threadmap_32[] or kd_threadmap_64[]
+ * @param size_of_kd_threadmap the size of an entry
+ * @param thread_count the number of entries
+ * @return the threadmap, NULL on OOM
+ */
+kpdecode_threadmap* kpdecode_threadmap_create(const char* threadmap, uint32_t size_of_kd_threadmap,
+                                              uint32_t thread_count);
+
+/**
+ * Free a threadmap
+ *
+ * @param threadmap the threadmap, may be NULL
+ */
+void kpdecode_threadmap_free(kpdecode_threadmap* threadmap);
+
+/**
+ * Get the number of threads in the threadmap, a thread of several entries counts once
+ *
+ * @param threadmap the threadmap
+ * @return the number of threads
+ */
+uint32_t kpdecode_threadmap_valid_count(const kpdecode_threadmap* threadmap);
+
+/**
+ * Get the number of valid entries hashed into the threadmap, duplicates included, as many as the
+ * records of the kd_threadmap[]
+ *
+ * @param threadmap the threadmap
+ * @return the number of valid entries
+ */
+uint32_t kpdecode_threadmap_entry_count(const kpdecode_threadmap* threadmap);
+
+/**
+ * Look up a thread in the threadmap
+ *
+ * @param threadmap the threadmap
+ * @param tid the thread ID
+ * @return the thread, NULL if not found
+ */
+const kpdecode_thread* kpdecode_threadmap_lookup(const kpdecode_threadmap* threadmap,
+                                                 uint64_t tid);
+
+// the instruction sets of the SIMD kernels
+#define KPERFDATA_KERNEL_SCALAR 0
+#define KPERFDATA_KERNEL_SSE2 1
+#define KPERFDATA_KERNEL_AVX2 2
+
+typedef void (*kpdecode_widen_fn)(kd_buf_64* dst, const kd_buf_32* src, size_t count);
+
+/**
+ * Widen kd_buf_32[count] to kd_buf_64[count], splitting the cpuid out of the timestamp
+ *
+ * @param dst the kd_buf_64 array
+ * @param src the kd_buf_32 array, may be unaligned
+ * @param count the number of kd_buf
+ */
+void kpdecode_widen_kd_buf_32_scalar(kd_buf_64* dst, const kd_buf_32* src, size_t count);
+
+/**
+ * Choose the fastest kd_buf_32 widening kernel the running CPU supports
+ *
+ * @return the AVX2 or SSE2 kernel on x86-64, kpdecode_widen_kd_buf_32_scalar() otherwise
+ */
+kpdecode_widen_fn kpdecode_select_widen_kd_buf_32(void);
+
+/**
+ * Get the kd_buf_32 widening kernel of an instruction set, so that the tests can check each kernel
+ * against the scalar one
+ *
+ * @param kernel KPERFDATA_KERNEL_*
+ * @return the kernel, NULL if it is not built or the running CPU does not support it
+ */
+kpdecode_widen_fn kpdecode_widen_kd_buf_32_kernel(int kernel);
+
+typedef size_t (*kpdecode_scan_fn)(const kd_buf_64* kevents, size_t count, const uint32_t* masks,
+                                   const uint32_t* values, uint32_t filter_count, int match);
+
+/**
+ * Check a debugid against the debugid filters
+ *
+ * @param masks the masks of the filters
+ * @param values the values of the filters
+ * @param filter_count the number of filters
+ * @param debugid the debugid
+ * @return true if `(debugid & masks[i]) == values[i]` for any filter
+ */
+bool kpdecode_debugid_filter_match(const uint32_t* masks, const uint32_t* values,
+                                   uint32_t filter_count, uint32_t debugid);
+
+/**
+ * Choose the fastest debugid scanning kernel the running CPU supports
+ *
+ * The kernel returns the index of the first kevent of kevents[count] whose match against the
+ * filters equals `match`, or `count` if there is none.
+ *
+ * @return the AVX2 or SSE2 kernel on x86-64, a scalar loop otherwise
+ */
+kpdecode_scan_fn kpdecode_select_scan_debugids(void);
+
+/**
+ * Get the debugid scanning kernel of an instruction set, so that the tests can check each kernel
+ * against the scalar one
+ *
+ * @param kernel KPERFDATA_KERNEL_*
+ * @return the kernel, NULL if it is not built or the running CPU does not support it
+ */
+kpdecode_scan_fn kpdecode_scan_debugids_kernel(int kernel);
+
+/**
+ * Get the number of online processors
+ *
+ * @return the number of processors
+ */
+int kpdecode_online_cpus(void);
+
+/**
+ * Open a RAW file and start reading its first buffers
+ *
+ * @param path path of the RAW file
+ * @param buffer_count the number of buffers read ahead
+ * @param buffer_size the size of each buffer, rounded up to a multiple of the page size
+ * @param flags 0 or KPERFDATA_OPEN_FILE_NO_IO_URING
+ * @return the file source, NULL for failure
+ */
+kpdecode_file_source* kpdecode_file_source_open(const char* path, uint32_t buffer_count,
+                                                size_t buffer_size, int flags);
+
+/**
+ * Wait for the next buffer of the file, in file order
+ *
+ * @param source the file source
+ * @param size the bytes of the buffer
+ * @return the buffer, to set as a chunk of the cursor, NULL at the end of the file or on failure
+ */
+const char* kpdecode_file_source_next(kpdecode_file_source* source, size_t* size);
+
+/**
+ * Recycle a buffer which has been decoded, to read the next bytes of the file into it
+ *
+ * @param source the file source
+ * @param bytes the buffer, returned by kpdecode_file_source_next()
+ */
+void kpdecode_file_source_release(kpdecode_file_source* source, const char* bytes);
+
+/**
+ * Get the status of the reads
+ *
+ * @param source the file source
+ * @return ret: 0 for success, otherwise a read has failed and the file is not read any further
+ */
+long kpdecode_file_source_status(const kpdecode_file_source* source);
+
+/**
+ * Close the file, once the reads in flight are complete, and release the buffers
+ *
+ * @param source the file source
+ * @param cursor the cursor to drop the buffers from, or NULL
+ */
+void kpdecode_file_source_close(kpdecode_file_source* source, kpdecode_cursor* cursor);
+
+/**
+ * Check whether a RAW file starts with a zstd, LZ4 or skippable frame
+ *
+ * @param bytes the beginning of the file
+ * @param size the size of bytes
+ * @return true if the file is compressed
+ */
+bool kpdecode_is_compressed(const char* bytes, size_t size);
+
+/**
+ * Start decompressing the first frames of a compressed RAW file
+ *
+ * @param bytes the compressed file, valid until kpdecode_decompressor_free()
+ * @param size the size of the file
+ * @param slot_count the number of frames, or pieces of a frame, decompressed ahead
+ * @return the decompressor, NULL on OOM
+ */
+kpdecode_decompressor* kpdecode_decompressor_create(const char* bytes, size_t size,
+                                                    uint32_t slot_count);
+
+/**
+ * Wait for the next decompressed bytes of the file, in order
+ *
+ * @param decompressor the decompressor
+ * @param size the decompressed bytes
+ * @return the buffer, to set as a chunk of the cursor, NULL at the end of the file or on failure
+ */
+const char* kpdecode_decompressor_next(kpdecode_decompressor* decompressor, size_t* size);
+
+/**
+ * Recycle a buffer which has been decoded, to decompress the next frames into it
+ *
+ * @param decompressor the decompressor
+ * @param bytes the buffer, returned by kpdecode_decompressor_next()
+ */
+void kpdecode_decompressor_release(kpdecode_decompressor* decompressor, const char* bytes);
+
+/**
+ * Get the status of the decompression
+ *
+ * @param decompressor the decompressor
+ * @return ret: 0 for success, otherwise a frame is invalid, truncated or of a format the library
+ * was built without, and the file is not decompressed any further
+ */
+long kpdecode_decompressor_status(const kpdecode_decompressor* decompressor);
+
+/**
+ * Release the decompressor, once the frames being decompressed are complete
+ *
+ * @param decompressor the decompressor
+ * @param cursor the cursor to drop the buffers from, or NULL
+ */
+void kpdecode_decompressor_free(kpdecode_decompressor* decompressor, kpdecode_cursor* cursor);
+
+/**
+ * Set the next buffer of the read-ahead or compressed file as a chunk of the cursor, after
+ * recycling the chunks decoded
+ *
+ * @param cursor the cursor
+ * @return true if a chunk was set, false without such a file or at its end
+ */
+bool kpdecode_cursor_read_ahead(kpdecode_cursor* cursor);
+
+KPERFDATA_END_CPP_NAMESPACE
+
+#endif  // KPERFDATA_SRC_KPERFDATA_INTERNAL_H_
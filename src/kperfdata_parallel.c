@@ -0,0 +1,466 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdbool.h>  // bool
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcpy
+
+#if defined(_WIN32)
+#include <windows.h>  // CreateThread, GetSystemInfo
+#else
+#include <pthread.h>  // pthread_create
+#include <unistd.h>  // sysconf
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// The callstack kevents a shard decoder hands to the stand-in of the sample a previous shard left
+// pending on a cpu, up to the first END or LOST of the cpu. They are applied to the sample once the
+// previous shards are decoded.
+typedef struct {
+  kd_buf* kevents;
+  size_t count;
+  size_t capacity;
+} kpdecode_shard_callstacks;
+
+// A part of the kd_buf[], decoded by one thread.
+//
+// Decoding a kevent only depends on the kevents before it through the per-cpu state of the cursor.
+// The first pass summarizes how each shard changes that state, so that the decoder of each shard
+// can start from the exact state the serial decoding would have at its first kevent.
+typedef struct kpdecode_shard {
+  kpdecode_cursor* cursor;                            // the cursor being decoded in parallel
+  const char* bytes;                                  // the kd_buf[] of this shard
+  uint64_t size;
+  bool replay_threadmap;                              // the first shard starts with the threadmap
+  void (*run)(struct kpdecode_shard* shard);
+  long ret;
+
+  // the first pass
+  uint64_t kevent_count;                              // cursor.kevent_count
+  uint32_t cpu_count;                                 // the max cpuid + 1
+  uint64_t cpu_kevent_count[KPERFDATA_MAX_CPUS];      // cursor.cpus[].unknown_ac8
+  uint64_t cpu_timestamp[KPERFDATA_MAX_CPUS];         // cursor.cpus[].unknown_8c8
+  uint8_t cpu_seen[KPERFDATA_MAX_CPUS];               // whether cpu_timestamp is set
+  uint8_t cpu_last_sample_event[KPERFDATA_MAX_CPUS];  // KPERFDATA_SAMPLE_EVENT_*
+  uint8_t cpu_first_sample_end[KPERFDATA_MAX_CPUS];   // the first END or LOST
+
+  // the second pass
+  kpdecode_cursor* decoder;
+  kpdecode_cursor* records;                           // the records decoded, ready or not
+  kpdecode_record* pending;                           // stands for a sample of a previous shard
+  kpdecode_shard_callstacks callstacks[KPERFDATA_MAX_CPUS];  // given to the stand-in
+  kpdecode_aggregate* aggregate;                      // counts the records instead of keeping them
+} kpdecode_shard;
+
+static void kpdecode_shard_scan_kevent(kpdecode_shard* shard, const kd_buf* kevent) {
+  uint32_t cpuid = kevent->cpuid;
+  if (cpuid >= KPERFDATA_MAX_CPUS) {
+    return;
+  }
+  if (cpuid >= shard->cpu_count) {
+    shard->cpu_count = cpuid + 1;
+  }
+  if (kpdecode_kevent_counted(kevent)) {
+    shard->cpu_kevent_count[cpuid] += 1;
+  }
+  shard->cpu_timestamp[cpuid] = kevent->timestamp;
+  shard->cpu_seen[cpuid] = 1;
+
+  int event = kpdecode_sample_event(kevent->debugid);
+  if (event == KPERFDATA_SAMPLE_EVENT_NONE) {
+    return;
+  }
+  shard->cpu_last_sample_event[cpuid] = (uint8_t)event;
+  if (event != KPERFDATA_SAMPLE_EVENT_START &&
+      shard->cpu_first_sample_end[cpuid] == KPERFDATA_SAMPLE_EVENT_NONE) {
+    shard->cpu_first_sample_end[cpuid] = (uint8_t)event;
+  }
+}
+
+// The first pass: summarize the per-cpu state changes of the shard
+static void kpdecode_shard_scan(kpdecode_shard* shard) {
+  kpdecode_cursor* scanner = kpdecode_cursor_create_shard(shard->cursor, shard->replay_threadmap);
+  if (!scanner) {
+    shard->ret = KPERFDATA_RET_OOM;
+    return;
+  }
+  if (kpdecode_cursor_setchunk(scanner, shard->bytes, shard->size) != KPERFDATA_RET_OK) {
+    shard->ret = KPERFDATA_RET_OOM;
+    kpdecode_cursor_free(scanner);
+    return;
+  }
+  const kd_buf* kevents = NULL;
+  size_t count = 0;
+  long ret;
+  while ((ret = kpdecode_cursor_next_kevents(scanner, &kevents, SIZE_MAX, &count)) ==
+         KPERFDATA_RET_OK) {
+    for (size_t i = 0; i < count; ++i) {
+      kpdecode_shard_scan_kevent(shard, &kevents[i]);
+    }
+  }
+  if (ret != KPERFDATA_RET_NOT_READY) {
+    shard->ret = ret;  // not the end of the shard
+  }
+  shard->kevent_count = scanner->kevent_count;
+  kpdecode_cursor_free(scanner);
+}
+
+// Decode a callstack kevent, or keep it for the sample of a previous shard
+static long kpdecode_shard_callstack(kpdecode_cursor* decoder, kpdecode_cpu* cpu,
+                                     kpdecode_record* record, const kd_buf* kevent,
+                                     void* context) {
+  kpdecode_shard* shard = (kpdecode_shard*)context;
+  if (cpu->unknown_c8 != shard->pending) {
+    return kpdecode_cursor_decode_callstack(decoder, cpu, record, kevent, NULL);
+  }
+  kpdecode_shard_callstacks* callstacks = &shard->callstacks[kevent->cpuid];
+  if (callstacks->count == callstacks->capacity) {
+    size_t capacity = callstacks->capacity ? callstacks->capacity * 2 : 16;
+    kd_buf* kevents = realloc(callstacks->kevents, sizeof(kd_buf) * capacity);
+    if (!kevents) {
+      return KPERFDATA_RET_OOM;
+    }
+    callstacks->kevents = kevents;
+    callstacks->capacity = capacity;
+  }
+  callstacks->kevents[callstacks->count++] = *kevent;
+  return KPERFDATA_RET_OK;
+}
+
+// The second pass: decode the records of the shard
+static void kpdecode_shard_decode(kpdecode_shard* shard) {
+  if (kpdecode_cursor_setchunk(shard->decoder, shard->bytes, shard->size) != KPERFDATA_RET_OK) {
+    shard->ret = KPERFDATA_RET_OOM;
+    return;
+  }
+  while (true) {
+    long ret = kpdecode_cursor_decode_records(shard->decoder);
+    if (ret != KPERFDATA_RET_OK && ret != KPERFDATA_RET_SAMPLE_PENDING) {
+      shard->ret = ret;
+      return;
+    }
+    // the records are moved out as soon as they are created, so the decoder only stops on the
+    // ready ones, or at the end of the shard
+    bool decoded = shard->decoder->kpdecode_record_count != 0;
+    if (kpdecode_cursor_move_records(shard->records, shard->decoder) != KPERFDATA_RET_OK) {
+      shard->ret = KPERFDATA_RET_OOM;
+      return;
+    }
+    if (shard->aggregate) {
+      long drain_ret = kpdecode_aggregate_drain(shard->aggregate, shard->records, NULL);
+      if (drain_ret != KPERFDATA_RET_OK) {
+        shard->ret = drain_ret;
+        return;
+      }
+    }
+    if (ret == KPERFDATA_RET_OK && !decoded) {
+      return;
+    }
+  }
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI kpdecode_shard_main(LPVOID arg) {
+  kpdecode_shard* shard = (kpdecode_shard*)arg;
+  shard->run(shard);
+  return 0;
+}
+
+int kpdecode_online_cpus(void) {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return (int)info.dwNumberOfProcessors;
+}
+
+// Run the shards in parallel, the first one on the calling thread
+static void kpdecode_run_shards(kpdecode_shard* shards, size_t shard_count,
+                                void (*run)(kpdecode_shard* shard)) {
+  HANDLE* threads = calloc(shard_count, sizeof(HANDLE));
+  for (size_t i = 0; i < shard_count; ++i) {
+    shards[i].run = run;
+    if (i != 0 && threads) {
+      threads[i] = CreateThread(NULL, 0, kpdecode_shard_main, &shards[i], 0, NULL);
+    }
+  }
+  for (size_t i = 0; i < shard_count; ++i) {
+    if (!threads || !threads[i]) {
+      run(&shards[i]);  // the first shard, or no thread for this one
+    }
+  }
+  for (size_t i = 1; threads && i < shard_count; ++i) {
+    if (threads[i]) {
+      WaitForSingleObject(threads[i], INFINITE);
+      CloseHandle(threads[i]);
+    }
+  }
+  free(threads);
+}
+
+#else
+
+static void* kpdecode_shard_main(void* arg) {
+  kpdecode_shard* shard = (kpdecode_shard*)arg;
+  shard->run(shard);
+  return NULL;
+}
+
+int kpdecode_online_cpus(void) {
+  return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+// Run the shards in parallel, the first one on the calling thread
+static void kpdecode_run_shards(kpdecode_shard* shards, size_t shard_count,
+                                void (*run)(kpdecode_shard* shard)) {
+  pthread_t* threads = calloc(shard_count, sizeof(pthread_t));
+  bool* started = calloc(shard_count, sizeof(bool));
+  for (size_t i = 0; i < shard_count; ++i) {
+    shards[i].run = run;
+    if (i != 0 && threads && started) {
+      started[i] = pthread_create(&threads[i], NULL, kpdecode_shard_main, &shards[i]) == 0;
+    }
+  }
+  for (size_t i = 0; i < shard_count; ++i) {
+    if (!started || !started[i]) {
+      run(&shards[i]);  // the first shard, or no thread for this one
+    }
+  }
+  for (size_t i = 1; started && i < shard_count; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+  free(started);
+  free(threads);
+}
+
+#endif  // _WIN32
+
+static long kpdecode_shards_ret(const kpdecode_shard* shards, size_t shard_count) {
+  for (size_t i = 0; i < shard_count; ++i) {
+    if (shards[i].ret != KPERFDATA_RET_OK) {
+      return shards[i].ret;
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+// Create the decoder of each shard, starting from the per-cpu state left by the previous shards
+static long kpdecode_shards_seed(kpdecode_cursor* cursor, kpdecode_shard* shards,
+                                 size_t shard_count, bool aggregate) {
+  uint32_t cpu_count = cursor->cpu_count;
+  for (size_t i = 0; i < shard_count; ++i) {
+    if (shards[i].cpu_count > cpu_count) {
+      cpu_count = shards[i].cpu_count;
+    }
+  }
+  if (kpdecode_cursor_reserve_cpus(cursor, cpu_count) != KPERFDATA_RET_OK) {
+    return KPERFDATA_RET_OOM;
+  }
+  bool pending[KPERFDATA_MAX_CPUS];
+  for (uint32_t cpuid = 0; cpuid < cpu_count; ++cpuid) {
+    pending[cpuid] = cursor->cpus[cpuid].unknown_c8 != NULL;
+  }
+  for (size_t i = 0; i < shard_count; ++i) {
+    kpdecode_shard* shard = &shards[i];
+    shard->decoder = kpdecode_cursor_create_shard(cursor, shard->replay_threadmap);
+    shard->records = kpdecode_cursor_create();
+    shard->pending = calloc(1, sizeof(kpdecode_record));
+    shard->aggregate = aggregate ? kpdecode_aggregate_create() : NULL;
+    if (!shard->decoder || !shard->records || !shard->pending ||
+        (aggregate && !shard->aggregate) ||
+        kpdecode_cursor_reserve_cpus(shard->decoder, cpu_count) != KPERFDATA_RET_OK) {
+      return KPERFDATA_RET_OOM;
+    }
+    kpdecode_cursor* decoder = shard->decoder;
+    // keep the callstack kevents of the stand-in, where the built-in handler decodes them
+    const uint32_t callstack_debugids[] = {KPERFDATA_PERF_CS_KHDR, KPERFDATA_PERF_CS_UHDR,
+                                           KPERFDATA_PERF_CS_KDATA, KPERFDATA_PERF_CS_UDATA};
+    for (size_t j = 0; j < sizeof(callstack_debugids) / sizeof(uint32_t); ++j) {
+      const kpdecode_dispatch* dispatch =
+          decoder->dispatch != NULL ? decoder->dispatch : &kpdecode_builtin_dispatch;
+      const kpdecode_dispatch_entry* entry =
+          kpdecode_dispatch_lookup(dispatch, callstack_debugids[j]);
+      if (entry != NULL && entry->handler == kpdecode_cursor_decode_callstack &&
+          kpdecode_cursor_add_kevent_handler(decoder, KPERFDATA_DEBUGID_MASK,
+                                             callstack_debugids[j], kpdecode_shard_callstack,
+                                             shard) != KPERFDATA_RET_OK) {
+        return KPERFDATA_RET_OOM;
+      }
+    }
+    decoder->kevent_count = cursor->kevent_count;
+    decoder->unknown_cc8 = cursor->unknown_cc8;
+    for (uint32_t cpuid = 0; cpuid < cpu_count; ++cpuid) {
+      decoder->cpus[cpuid].unknown_ac8 = cursor->cpus[cpuid].unknown_ac8;
+      decoder->cpus[cpuid].unknown_8c8 = cursor->cpus[cpuid].unknown_8c8;
+      // the sample belongs to a previous shard, which completes it
+      decoder->cpus[cpuid].unknown_c8 = pending[cpuid] ? shard->pending : NULL;
+    }
+
+    // step the state of the cursor over the shard
+    cursor->kevent_count += shard->kevent_count;
+    for (uint32_t cpuid = 0; cpuid < cpu_count; ++cpuid) {
+      kpdecode_cpu* cpu = &cursor->cpus[cpuid];
+      uint64_t kevent_count_pre_cpu = cpu->unknown_ac8 + shard->cpu_kevent_count[cpuid];
+      cpu->unknown_ac8 = kevent_count_pre_cpu;
+      if (kevent_count_pre_cpu > cursor->unknown_cc8) {
+        cursor->unknown_cc8 = (uint32_t)kevent_count_pre_cpu;
+      }
+      if (shard->cpu_seen[cpuid]) {
+        cpu->unknown_8c8 = shard->cpu_timestamp[cpuid];
+      }
+      uint8_t event = shard->cpu_last_sample_event[cpuid];
+      if (event == KPERFDATA_SAMPLE_EVENT_START) {
+        pending[cpuid] = true;
+      } else if (event != KPERFDATA_SAMPLE_EVENT_NONE) {
+        pending[cpuid] = false;
+      }
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+// Complete the samples left pending at the end of each shard, with the callstack kevents kept by
+// the stand-ins of the following shards, up to the first END or LOST of their cpu
+static void kpdecode_shards_complete(kpdecode_shard* shards, size_t shard_count) {
+  for (size_t i = 0; i < shard_count; ++i) {
+    kpdecode_cursor* decoder = shards[i].decoder;
+    for (uint32_t cpuid = 0; cpuid < decoder->cpu_count; ++cpuid) {
+      kpdecode_record* record = decoder->cpus[cpuid].unknown_c8;
+      if (record == NULL || record == shards[i].pending) {
+        continue;
+      }
+      kpdecode_cpu* cpu = &decoder->cpus[cpuid];
+      for (size_t j = i + 1; j < shard_count; ++j) {
+        const kpdecode_shard_callstacks* callstacks = &shards[j].callstacks[cpuid];
+        for (size_t k = 0; k < callstacks->count; ++k) {
+          kpdecode_cursor_decode_callstack(decoder, cpu, NULL, &callstacks->kevents[k], NULL);
+        }
+        uint8_t event = shards[j].cpu_first_sample_end[cpuid];
+        if (event != KPERFDATA_SAMPLE_EVENT_NONE) {
+          kpdecode_cursor_complete_sample(decoder, cpuid, event == KPERFDATA_SAMPLE_EVENT_LOST);
+          break;
+        }
+      }
+    }
+  }
+}
+
+long kpdecode_cursor_decode_shards(kpdecode_cursor* cursor, int thread_count,
+                                   kpdecode_aggregate* aggregate) {
+  if (cursor->slim_records) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (thread_count <= 0) {
+    thread_count = kpdecode_online_cpus();
+  }
+  const char* kd_bufs = NULL;
+  uint64_t kd_bufs_size = 0;
+  long ret = kpdecode_cursor_take_kd_bufs(cursor, &kd_bufs, &kd_bufs_size);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
+
+  uint64_t kd_buf_count = kd_bufs_size / cursor->size_of_kd_buf;
+  uint64_t shard_count = kd_buf_count / KPERFDATA_PARALLEL_MIN_KD_BUFS;
+  if (shard_count > (uint64_t)thread_count) {
+    shard_count = thread_count;
+  }
+  if (shard_count == 0) {
+    shard_count = 1;
+  }
+  kpdecode_shard* shards = calloc(shard_count, sizeof(kpdecode_shard));
+  if (!shards) {
+    return KPERFDATA_RET_OOM;
+  }
+  for (uint64_t i = 0; i < shard_count; ++i) {
+    kpdecode_shard* shard = &shards[i];
+    uint64_t begin = kd_buf_count * i / shard_count;
+    uint64_t end = kd_buf_count * (i + 1) / shard_count;
+    shard->cursor = cursor;
+    shard->bytes = kd_bufs + begin * cursor->size_of_kd_buf;
+    // the last shard also gets the truncated kd_buf at the end, if any
+    shard->size = i + 1 == shard_count ? (uint64_t)(kd_bufs + kd_bufs_size - shard->bytes)
+                                       : (end - begin) * cursor->size_of_kd_buf;
+    shard->replay_threadmap = i == 0;
+  }
+
+  kpdecode_run_shards(shards, shard_count, kpdecode_shard_scan);
+  ret = kpdecode_shards_ret(shards, shard_count);
+  if (ret == KPERFDATA_RET_OK) {
+    ret = kpdecode_shards_seed(cursor, shards, shard_count, aggregate != NULL);
+  }
+  cursor->threadmap_decoded = true;  // replayed by the first shard
+  if (ret == KPERFDATA_RET_OK) {
+    kpdecode_run_shards(shards, shard_count, kpdecode_shard_decode);
+    ret = kpdecode_shards_ret(shards, shard_count);
+  }
+  if (ret == KPERFDATA_RET_OK) {
+    kpdecode_shards_complete(shards, shard_count);
+    for (uint64_t i = 0; i < shard_count && ret == KPERFDATA_RET_OK; ++i) {
+      // the samples completed by the following shards are counted now
+      if (aggregate) {
+        ret = kpdecode_aggregate_drain(shards[i].aggregate, shards[i].records, NULL);
+        if (ret == KPERFDATA_RET_OK) {
+          ret = kpdecode_aggregate_merge(aggregate, shards[i].aggregate);
+        }
+      }
+      if (ret == KPERFDATA_RET_OK) {
+        ret = kpdecode_cursor_move_records(cursor, shards[i].records);
+      }
+    }
+  }
+  // the samples never completed are still pending on the cursor
+  for (uint64_t i = 0; i < shard_count && ret == KPERFDATA_RET_OK; ++i) {
+    kpdecode_cursor* decoder = shards[i].decoder;
+    for (uint32_t cpuid = 0; cpuid < decoder->cpu_count && cpuid < cursor->cpu_count; ++cpuid) {
+      kpdecode_record* record = decoder->cpus[cpuid].unknown_c8;
+      if (record != NULL && record != shards[i].pending) {
+        cursor->cpus[cpuid].unknown_c8 = record;
+        cursor->cpus[cpuid].kcallstack_left = decoder->cpus[cpuid].kcallstack_left;
+        cursor->cpus[cpuid].ucallstack_left = decoder->cpus[cpuid].ucallstack_left;
+      }
+    }
+  }
+
+  for (uint64_t i = 0; i < shard_count; ++i) {
+    if (shards[i].decoder) {
+      kpdecode_cursor_free(shards[i].decoder);
+    }
+    if (shards[i].records) {
+      kpdecode_cursor_free(shards[i].records);
+    }
+    free(shards[i].pending);
+    for (uint32_t cpuid = 0; cpuid < KPERFDATA_MAX_CPUS; ++cpuid) {
+      free(shards[i].callstacks[cpuid].kevents);
+    }
+    if (shards[i].aggregate) {
+      kpdecode_aggregate_free(shards[i].aggregate);
+    }
+  }
+  free(shards);
+  kpdecode_cursor_finish(cursor);  // the whole RAW file is decoded
+  return ret;
+}
+
+long kpdecode_cursor_decode_parallel(kpdecode_cursor* cursor, int thread_count) {
+  return kpdecode_cursor_decode_shards(cursor, thread_count, NULL);
+}
+
+KPERFDATA_END_CPP_NAMESPACE
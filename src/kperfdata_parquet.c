@@ -0,0 +1,974 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata_parquet.h"
+
+#include <stdbool.h>  // bool
+#include <stdio.h>  // fopen
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcpy
+
+#if defined(_WIN32)
+#include <windows.h>  // CreateThread
+#else
+#include <pthread.h>  // pthread_create
+#endif
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// parquet.thrift, the values are stored in little endian like the kd_buf[]
+#define KPERFDATA_PARQUET_MAGIC "PAR1"
+#define KPERFDATA_PARQUET_INT32 1
+#define KPERFDATA_PARQUET_INT64 2
+#define KPERFDATA_PARQUET_REQUIRED 0
+#define KPERFDATA_PARQUET_REPEATED 2
+#define KPERFDATA_PARQUET_CONVERTED_LIST 3
+#define KPERFDATA_PARQUET_PLAIN 0
+#define KPERFDATA_PARQUET_RLE 3
+#define KPERFDATA_PARQUET_DELTA_BINARY_PACKED 5
+#define KPERFDATA_PARQUET_RLE_DICTIONARY 8
+#define KPERFDATA_PARQUET_DATA_PAGE 0
+#define KPERFDATA_PARQUET_DICTIONARY_PAGE 2
+
+// the types of the Thrift compact protocol
+#define KPERFDATA_THRIFT_I32 5
+#define KPERFDATA_THRIFT_I64 6
+#define KPERFDATA_THRIFT_BINARY 8
+#define KPERFDATA_THRIFT_LIST 9
+#define KPERFDATA_THRIFT_STRUCT 12
+#define KPERFDATA_THRIFT_MAX_DEPTH 8
+
+// DELTA_BINARY_PACKED: blocks of 128 deltas, in 4 miniblocks of 32
+#define KPERFDATA_PARQUET_DELTA_BLOCK 128
+#define KPERFDATA_PARQUET_DELTA_MINIBLOCKS 4
+#define KPERFDATA_PARQUET_DELTA_MINIBLOCK 32
+
+// the value counts of the pages are i32, and the dictionary slots of a row group are 2 per record
+#define KPERFDATA_PARQUET_MAX_ROW_GROUP_SIZE 0x40000000
+
+#define KPERFDATA_PARQUET_COLUMN_COUNT 11
+#define KPERFDATA_PARQUET_UCALLSTACK 9
+#define KPERFDATA_PARQUET_KCALLSTACK 10
+
+typedef struct {
+  const char* name;
+  int type;
+  int encoding;                                       // of the values of the data page
+} kpdecode_parquet_column;
+
+// the leaf columns, in the order of the schema
+static const kpdecode_parquet_column kpdecode_parquet_columns[KPERFDATA_PARQUET_COLUMN_COUNT] = {
+    {"timestamp", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_DELTA_BINARY_PACKED},
+    {"tid", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"cpuid", KPERFDATA_PARQUET_INT32, KPERFDATA_PARQUET_PLAIN},
+    {"debugid", KPERFDATA_PARQUET_INT32, KPERFDATA_PARQUET_RLE_DICTIONARY},
+    {"flags", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"arg1", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"arg2", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"arg3", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"arg4", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"ucallstack", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+    {"kcallstack", KPERFDATA_PARQUET_INT64, KPERFDATA_PARQUET_PLAIN},
+};
+
+// A growable byte buffer
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+  bool oom;
+} kpdecode_bytes;
+
+// The records of a row group
+typedef struct {
+  size_t count;
+  uint64_t* timestamps;
+  uint64_t* tids;
+  uint32_t* cpuids;
+  uint32_t* debugids;
+  uint64_t* flags;
+  uint64_t* args[4];
+  uint32_t* nframes[2];                               // ucallstack, kcallstack
+  uint64_t* frames[2];
+  size_t frame_count[2];
+  size_t frames_capacity[2];
+} kpdecode_parquet_rows;
+
+typedef struct {
+  uint64_t dictionary_page_offset;                    // 0 without dictionary
+  uint64_t data_page_offset;
+  uint64_t size;
+  uint64_t value_count;                               // with the empty callstacks
+} kpdecode_parquet_chunk;
+
+typedef struct {
+  kpdecode_parquet_chunk chunks[KPERFDATA_PARQUET_COLUMN_COUNT];
+  uint64_t row_count;
+  uint64_t size;
+} kpdecode_parquet_row_group;
+
+struct kpdecode_parquet_writer {
+  FILE* file;
+  uint64_t offset;                                    // the end of the file
+  size_t row_group_size;
+  uint64_t row_count;
+  kpdecode_parquet_rows rows[2];                      // one is filled while the other is encoded
+  int filling;                                        // the index of the rows being filled
+  long ret;                                           // of the last row group encoded
+
+  // the encoding thread, the only one to touch the fields below while it runs
+  bool encoding;
+#if defined(_WIN32)
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+  kpdecode_parquet_row_group* row_groups;
+  size_t row_group_count;
+  size_t row_group_capacity;
+  kpdecode_bytes page;
+  kpdecode_bytes header;
+};
+
+static bool kpdecode_bytes_reserve(kpdecode_bytes* bytes, size_t size) {
+  if (bytes->oom) {
+    return false;
+  }
+  if (bytes->capacity - bytes->size >= size) {
+    return true;
+  }
+  size_t capacity = bytes->capacity ? bytes->capacity : 4096;
+  while (capacity - bytes->size < size) {
+    capacity *= 2;
+  }
+  uint8_t* data = realloc(bytes->data, capacity);
+  if (!data) {
+    bytes->oom = true;
+    return false;
+  }
+  bytes->data = data;
+  bytes->capacity = capacity;
+  return true;
+}
+
+static void kpdecode_bytes_append(kpdecode_bytes* bytes, const void* data, size_t size) {
+  if (size != 0 && kpdecode_bytes_reserve(bytes, size)) {
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+  }
+}
+
+static void kpdecode_bytes_put(kpdecode_bytes* bytes, uint8_t byte) {
+  if (kpdecode_bytes_reserve(bytes, 1)) {
+    bytes->data[bytes->size++] = byte;
+  }
+}
+
+static void kpdecode_bytes_varint(kpdecode_bytes* bytes, uint64_t value) {
+  while (value >= 0x80) {
+    kpdecode_bytes_put(bytes, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  kpdecode_bytes_put(bytes, (uint8_t)value);
+}
+
+static void kpdecode_bytes_zigzag(kpdecode_bytes* bytes, int64_t value) {
+  uint64_t bits = (uint64_t)value;
+  kpdecode_bytes_varint(bytes, (bits << 1) ^ (0 - (bits >> 63)));
+}
+
+static void kpdecode_bytes_le32(kpdecode_bytes* bytes, uint32_t value) {
+  uint8_t le[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                   (uint8_t)(value >> 24)};
+  kpdecode_bytes_append(bytes, le, sizeof(le));
+}
+
+// The Thrift compact protocol, the field IDs of a struct are delta encoded
+typedef struct {
+  kpdecode_bytes* out;
+  int16_t last_field[KPERFDATA_THRIFT_MAX_DEPTH];
+  int depth;
+} kpdecode_thrift;
+
+static void kpdecode_thrift_field(kpdecode_thrift* thrift, uint8_t type, int16_t id) {
+  int delta = id - thrift->last_field[thrift->depth];
+  if (delta > 0 && delta <= 15) {
+    kpdecode_bytes_put(thrift->out, (uint8_t)(delta << 4) | type);
+  } else {
+    kpdecode_bytes_put(thrift->out, type);
+    kpdecode_bytes_zigzag(thrift->out, id);
+  }
+  thrift->last_field[thrift->depth] = id;
+}
+
+static void kpdecode_thrift_struct_begin(kpdecode_thrift* thrift) {
+  thrift->last_field[++thrift->depth] = 0;
+}
+
+static void kpdecode_thrift_struct_end(kpdecode_thrift* thrift) {
+  kpdecode_bytes_put(thrift->out, 0);  // STOP
+  thrift->depth -= 1;
+}
+
+static void kpdecode_thrift_list_begin(kpdecode_thrift* thrift, uint8_t type, uint32_t size) {
+  if (size < 15) {
+    kpdecode_bytes_put(thrift->out, (uint8_t)(size << 4) | type);
+  } else {
+    kpdecode_bytes_put(thrift->out, 0xf0 | type);
+    kpdecode_bytes_varint(thrift->out, size);
+  }
+}
+
+static void kpdecode_thrift_binary(kpdecode_thrift* thrift, const char* value) {
+  size_t size = strlen(value);
+  kpdecode_bytes_varint(thrift->out, size);
+  kpdecode_bytes_append(thrift->out, value, size);
+}
+
+static void kpdecode_thrift_i32(kpdecode_thrift* thrift, int16_t id, int32_t value) {
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_I32, id);
+  kpdecode_bytes_zigzag(thrift->out, value);
+}
+
+static void kpdecode_thrift_i64(kpdecode_thrift* thrift, int16_t id, int64_t value) {
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_I64, id);
+  kpdecode_bytes_zigzag(thrift->out, value);
+}
+
+static void kpdecode_thrift_string(kpdecode_thrift* thrift, int16_t id, const char* value) {
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_BINARY, id);
+  kpdecode_thrift_binary(thrift, value);
+}
+
+// Packs values LSB first, as both the RLE/bit-packed hybrid and DELTA_BINARY_PACKED do
+typedef struct {
+  kpdecode_bytes* out;
+  uint32_t byte;
+  int bit_count;
+} kpdecode_bit_packer;
+
+static void kpdecode_bit_packer_put(kpdecode_bit_packer* packer, uint64_t value, int width) {
+  while (width > 0) {
+    int take = 8 - packer->bit_count < width ? 8 - packer->bit_count : width;
+    packer->byte |= (uint32_t)(value & ((1u << take) - 1)) << packer->bit_count;
+    value >>= take;
+    width -= take;
+    packer->bit_count += take;
+    if (packer->bit_count == 8) {
+      kpdecode_bytes_put(packer->out, (uint8_t)packer->byte);
+      packer->byte = 0;
+      packer->bit_count = 0;
+    }
+  }
+}
+
+static void kpdecode_bit_packer_flush(kpdecode_bit_packer* packer) {
+  if (packer->bit_count != 0) {
+    kpdecode_bytes_put(packer->out, (uint8_t)packer->byte);
+    packer->byte = 0;
+    packer->bit_count = 0;
+  }
+}
+
+static int kpdecode_bit_width(uint64_t value) {
+  int width = 0;
+  while (value) {
+    width += 1;
+    value >>= 1;
+  }
+  return width;
+}
+
+// A bit-packed run of the RLE/bit-packed hybrid, padded to groups of 8 values
+static void kpdecode_parquet_put_bit_packed(kpdecode_bytes* out, const uint32_t* values,
+                                            size_t count, int width) {
+  if (count == 0) {
+    return;
+  }
+  size_t group_count = (count + 7) / 8;
+  kpdecode_bytes_varint(out, (group_count << 1) | 1);
+  kpdecode_bit_packer packer = {out, 0, 0};
+  for (size_t i = 0; i < group_count * 8; ++i) {
+    kpdecode_bit_packer_put(&packer, i < count ? values[i] : 0, width);
+  }
+  kpdecode_bit_packer_flush(&packer);
+}
+
+// The RLE/bit-packed hybrid, the runs of 8 or more values are RLE runs
+static void kpdecode_parquet_put_hybrid(kpdecode_bytes* out, const uint32_t* values, size_t count,
+                                        int width) {
+  size_t literal = 0;  // the first value not written yet
+  size_t i = 0;
+  while (i < count) {
+    size_t run = 1;
+    while (i + run < count && values[i + run] == values[i]) {
+      run += 1;
+    }
+    // a bit-packed run can only be followed by another run at a multiple of 8 values
+    if (run < 8 || (i - literal) % 8 != 0) {
+      i += 1;
+      continue;
+    }
+    kpdecode_parquet_put_bit_packed(out, values + literal, i - literal, width);
+    kpdecode_bytes_varint(out, run << 1);
+    for (int j = 0; j < (width + 7) / 8; ++j) {
+      kpdecode_bytes_put(out, (uint8_t)(values[i] >> (8 * j)));
+    }
+    i += run;
+    literal = i;
+  }
+  kpdecode_parquet_put_bit_packed(out, values + literal, count - literal, width);
+}
+
+// DELTA_BINARY_PACKED, the timestamps mostly grow by small steps
+static void kpdecode_parquet_put_delta(kpdecode_bytes* out, const uint64_t* values, size_t count) {
+  kpdecode_bytes_varint(out, KPERFDATA_PARQUET_DELTA_BLOCK);
+  kpdecode_bytes_varint(out, KPERFDATA_PARQUET_DELTA_MINIBLOCKS);
+  kpdecode_bytes_varint(out, count);
+  kpdecode_bytes_zigzag(out, count ? (int64_t)values[0] : 0);
+  for (size_t first = 1; first < count; first += KPERFDATA_PARQUET_DELTA_BLOCK) {
+    size_t n = count - first < KPERFDATA_PARQUET_DELTA_BLOCK ? count - first
+                                                             : KPERFDATA_PARQUET_DELTA_BLOCK;
+    uint64_t deltas[KPERFDATA_PARQUET_DELTA_BLOCK];
+    int64_t min_delta = INT64_MAX;
+    for (size_t i = 0; i < n; ++i) {
+      deltas[i] = values[first + i] - values[first + i - 1];
+      if ((int64_t)deltas[i] < min_delta) {
+        min_delta = (int64_t)deltas[i];
+      }
+    }
+    kpdecode_bytes_zigzag(out, min_delta);
+    int widths[KPERFDATA_PARQUET_DELTA_MINIBLOCKS] = {0};
+    for (size_t i = 0; i < n; ++i) {
+      deltas[i] -= (uint64_t)min_delta;
+      int width = kpdecode_bit_width(deltas[i]);
+      if (width > widths[i / KPERFDATA_PARQUET_DELTA_MINIBLOCK]) {
+        widths[i / KPERFDATA_PARQUET_DELTA_MINIBLOCK] = width;
+      }
+    }
+    for (int m = 0; m < KPERFDATA_PARQUET_DELTA_MINIBLOCKS; ++m) {
+      kpdecode_bytes_put(out, (uint8_t)widths[m]);
+    }
+    // the last miniblock with deltas is padded, the ones after it are not written
+    kpdecode_bit_packer packer = {out, 0, 0};
+    for (size_t i = 0; i < KPERFDATA_PARQUET_DELTA_BLOCK; ++i) {
+      if (i % KPERFDATA_PARQUET_DELTA_MINIBLOCK == 0 && i >= n) {
+        break;
+      }
+      kpdecode_bit_packer_put(&packer, i < n ? deltas[i] : 0,
+                              widths[i / KPERFDATA_PARQUET_DELTA_MINIBLOCK]);
+    }
+    kpdecode_bit_packer_flush(&packer);
+  }
+}
+
+static void kpdecode_parquet_put_page_header(kpdecode_bytes* out, int page_type, size_t size,
+                                             size_t value_count, int encoding) {
+  kpdecode_thrift thrift = {out, {0}, 0};
+  kpdecode_thrift_struct_begin(&thrift);  // PageHeader
+  kpdecode_thrift_i32(&thrift, 1, page_type);
+  kpdecode_thrift_i32(&thrift, 2, (int32_t)size);  // uncompressed_page_size
+  kpdecode_thrift_i32(&thrift, 3, (int32_t)size);  // compressed_page_size
+  if (page_type == KPERFDATA_PARQUET_DATA_PAGE) {
+    kpdecode_thrift_field(&thrift, KPERFDATA_THRIFT_STRUCT, 5);  // DataPageHeader
+    kpdecode_thrift_struct_begin(&thrift);
+    kpdecode_thrift_i32(&thrift, 1, (int32_t)value_count);
+    kpdecode_thrift_i32(&thrift, 2, encoding);
+    kpdecode_thrift_i32(&thrift, 3, KPERFDATA_PARQUET_RLE);  // definition_level_encoding
+    kpdecode_thrift_i32(&thrift, 4, KPERFDATA_PARQUET_RLE);  // repetition_level_encoding
+    kpdecode_thrift_struct_end(&thrift);
+  } else {
+    kpdecode_thrift_field(&thrift, KPERFDATA_THRIFT_STRUCT, 7);  // DictionaryPageHeader
+    kpdecode_thrift_struct_begin(&thrift);
+    kpdecode_thrift_i32(&thrift, 1, (int32_t)value_count);
+    kpdecode_thrift_i32(&thrift, 2, encoding);
+    kpdecode_thrift_struct_end(&thrift);
+  }
+  kpdecode_thrift_struct_end(&thrift);
+}
+
+// Write the page in writer.page after its header, at the end of the file
+static long kpdecode_parquet_write_page(kpdecode_parquet_writer* writer, int page_type,
+                                        size_t value_count, int encoding) {
+  writer->header.size = 0;
+  kpdecode_parquet_put_page_header(&writer->header, page_type, writer->page.size, value_count,
+                                   encoding);
+  if (writer->header.oom || writer->page.oom) {
+    return KPERFDATA_RET_OOM;
+  }
+  if (writer->page.size > INT32_MAX) {
+    return KPERFDATA_RET_FAIL;  // the page sizes are i32
+  }
+  if (fwrite(writer->header.data, 1, writer->header.size, writer->file) != writer->header.size ||
+      fwrite(writer->page.data, 1, writer->page.size, writer->file) != writer->page.size) {
+    return KPERFDATA_RET_FAIL;
+  }
+  writer->offset += writer->header.size + writer->page.size;
+  return KPERFDATA_RET_OK;
+}
+
+// The debugids as indices into a dictionary page of the distinct debugids of the row group
+static long kpdecode_parquet_write_debugids(kpdecode_parquet_writer* writer,
+                                            const kpdecode_parquet_rows* rows,
+                                            kpdecode_parquet_chunk* chunk) {
+  uint32_t slot_count = 16;
+  while (slot_count < 2 * rows->count) {
+    slot_count <<= 1;
+  }
+  uint32_t* slots = malloc(sizeof(uint32_t) * slot_count);  // an index + 1, 0 for empty
+  uint32_t* dictionary = malloc(sizeof(uint32_t) * rows->count);
+  uint32_t* indices = malloc(sizeof(uint32_t) * rows->count);
+  if (!slots || !dictionary || !indices) {
+    free(slots);
+    free(dictionary);
+    free(indices);
+    return KPERFDATA_RET_OOM;
+  }
+  memset(slots, 0, sizeof(uint32_t) * slot_count);
+  uint32_t dictionary_count = 0;
+  for (size_t i = 0; i < rows->count; ++i) {
+    uint32_t debugid = rows->debugids[i];
+    uint32_t slot = (uint32_t)((debugid * 0x9e3779b97f4a7c15ULL) >> 32) & (slot_count - 1);
+    while (slots[slot] != 0 && dictionary[slots[slot] - 1] != debugid) {
+      slot = (slot + 1) & (slot_count - 1);
+    }
+    if (slots[slot] == 0) {
+      dictionary[dictionary_count++] = debugid;
+      slots[slot] = dictionary_count;
+    }
+    indices[i] = slots[slot] - 1;
+  }
+
+  chunk->dictionary_page_offset = writer->offset;
+  writer->page.size = 0;
+  kpdecode_bytes_append(&writer->page, dictionary, sizeof(uint32_t) * dictionary_count);
+  long ret = kpdecode_parquet_write_page(writer, KPERFDATA_PARQUET_DICTIONARY_PAGE,
+                                         dictionary_count, KPERFDATA_PARQUET_PLAIN);
+  if (ret == KPERFDATA_RET_OK) {
+    int width = kpdecode_bit_width(dictionary_count - 1);
+    if (width == 0) {
+      width = 1;
+    }
+    chunk->data_page_offset = writer->offset;
+    writer->page.size = 0;
+    kpdecode_bytes_put(&writer->page, (uint8_t)width);
+    kpdecode_parquet_put_hybrid(&writer->page, indices, rows->count, width);
+    ret = kpdecode_parquet_write_page(writer, KPERFDATA_PARQUET_DATA_PAGE, rows->count,
+                                      KPERFDATA_PARQUET_RLE_DICTIONARY);
+  }
+  free(slots);
+  free(dictionary);
+  free(indices);
+  return ret;
+}
+
+// A callstack as a list, an empty one is a single entry with the definition level 0
+static long kpdecode_parquet_write_callstacks(kpdecode_parquet_writer* writer,
+                                              const kpdecode_parquet_rows* rows, int k,
+                                              kpdecode_parquet_chunk* chunk) {
+  size_t level_count = 0;
+  for (size_t i = 0; i < rows->count; ++i) {
+    level_count += rows->nframes[k][i] ? rows->nframes[k][i] : 1;
+  }
+  uint32_t* repetition_levels = malloc(sizeof(uint32_t) * (level_count + 1));
+  uint32_t* definition_levels = malloc(sizeof(uint32_t) * (level_count + 1));
+  if (!repetition_levels || !definition_levels) {
+    free(repetition_levels);
+    free(definition_levels);
+    return KPERFDATA_RET_OOM;
+  }
+  size_t level = 0;
+  for (size_t i = 0; i < rows->count; ++i) {
+    uint32_t nframes = rows->nframes[k][i];
+    repetition_levels[level] = 0;
+    definition_levels[level] = nframes ? 1 : 0;
+    level += 1;
+    for (uint32_t j = 1; j < nframes; ++j) {
+      repetition_levels[level] = 1;
+      definition_levels[level] = 1;
+      level += 1;
+    }
+  }
+
+  // the levels are prefixed by their size in a data page v1
+  writer->page.size = 0;
+  uint32_t* levels[2] = {repetition_levels, definition_levels};
+  for (int l = 0; l < 2; ++l) {
+    size_t size_offset = writer->page.size;
+    kpdecode_bytes_le32(&writer->page, 0);
+    kpdecode_parquet_put_hybrid(&writer->page, levels[l], level_count, 1);
+    if (!writer->page.oom) {
+      uint32_t size = (uint32_t)(writer->page.size - size_offset - 4);
+      uint8_t le[4] = {(uint8_t)size, (uint8_t)(size >> 8), (uint8_t)(size >> 16),
+                       (uint8_t)(size >> 24)};
+      memcpy(writer->page.data + size_offset, le, sizeof(le));
+    }
+  }
+  kpdecode_bytes_append(&writer->page, rows->frames[k], sizeof(uint64_t) * rows->frame_count[k]);
+  free(repetition_levels);
+  free(definition_levels);
+
+  chunk->data_page_offset = writer->offset;
+  chunk->value_count = level_count;
+  return kpdecode_parquet_write_page(writer, KPERFDATA_PARQUET_DATA_PAGE, level_count,
+                                     KPERFDATA_PARQUET_PLAIN);
+}
+
+static long kpdecode_parquet_write_column(kpdecode_parquet_writer* writer,
+                                          const kpdecode_parquet_rows* rows, int column,
+                                          kpdecode_parquet_chunk* chunk) {
+  uint64_t start = writer->offset;
+  chunk->value_count = rows->count;
+  long ret = KPERFDATA_RET_OK;
+  if (column == KPERFDATA_PARQUET_UCALLSTACK || column == KPERFDATA_PARQUET_KCALLSTACK) {
+    ret = kpdecode_parquet_write_callstacks(writer, rows, column - KPERFDATA_PARQUET_UCALLSTACK,
+                                            chunk);
+  } else if (column == 3) {
+    ret = kpdecode_parquet_write_debugids(writer, rows, chunk);
+  } else {
+    writer->page.size = 0;
+    switch (column) {
+      case 0:
+        kpdecode_parquet_put_delta(&writer->page, rows->timestamps, rows->count);
+        break;
+      case 1:
+        kpdecode_bytes_append(&writer->page, rows->tids, sizeof(uint64_t) * rows->count);
+        break;
+      case 2:
+        kpdecode_bytes_append(&writer->page, rows->cpuids, sizeof(uint32_t) * rows->count);
+        break;
+      case 4:
+        kpdecode_bytes_append(&writer->page, rows->flags, sizeof(uint64_t) * rows->count);
+        break;
+      default:
+        kpdecode_bytes_append(&writer->page, rows->args[column - 5],
+                              sizeof(uint64_t) * rows->count);
+        break;
+    }
+    chunk->data_page_offset = writer->offset;
+    ret = kpdecode_parquet_write_page(writer, KPERFDATA_PARQUET_DATA_PAGE, rows->count,
+                                      kpdecode_parquet_columns[column].encoding);
+  }
+  chunk->size = writer->offset - start;
+  return ret;
+}
+
+static long kpdecode_parquet_write_row_group(kpdecode_parquet_writer* writer,
+                                             const kpdecode_parquet_rows* rows) {
+  if (writer->row_group_count == writer->row_group_capacity) {
+    size_t capacity = writer->row_group_capacity ? writer->row_group_capacity * 2 : 16;
+    kpdecode_parquet_row_group* row_groups =
+        realloc(writer->row_groups, sizeof(kpdecode_parquet_row_group) * capacity);
+    if (!row_groups) {
+      return KPERFDATA_RET_OOM;
+    }
+    writer->row_groups = row_groups;
+    writer->row_group_capacity = capacity;
+  }
+  kpdecode_parquet_row_group* row_group = &writer->row_groups[writer->row_group_count];
+  memset(row_group, 0, sizeof(kpdecode_parquet_row_group));
+  row_group->row_count = rows->count;
+  for (int column = 0; column < KPERFDATA_PARQUET_COLUMN_COUNT; ++column) {
+    long ret = kpdecode_parquet_write_column(writer, rows, column, &row_group->chunks[column]);
+    if (ret != KPERFDATA_RET_OK) {
+      return ret;
+    }
+    row_group->size += row_group->chunks[column].size;
+  }
+  writer->row_group_count += 1;
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_parquet_put_schema(kpdecode_thrift* thrift) {
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_LIST, 2);
+  kpdecode_thrift_list_begin(thrift, KPERFDATA_THRIFT_STRUCT, 1 + 9 + 2 * 3);
+  kpdecode_thrift_struct_begin(thrift);  // the root
+  kpdecode_thrift_string(thrift, 4, "kperfdata_record");
+  kpdecode_thrift_i32(thrift, 5, KPERFDATA_PARQUET_COLUMN_COUNT);
+  kpdecode_thrift_struct_end(thrift);
+  for (int column = 0; column < KPERFDATA_PARQUET_COLUMN_COUNT; ++column) {
+    const kpdecode_parquet_column* desc = &kpdecode_parquet_columns[column];
+    if (column == KPERFDATA_PARQUET_UCALLSTACK || column == KPERFDATA_PARQUET_KCALLSTACK) {
+      kpdecode_thrift_struct_begin(thrift);
+      kpdecode_thrift_i32(thrift, 3, KPERFDATA_PARQUET_REQUIRED);
+      kpdecode_thrift_string(thrift, 4, desc->name);
+      kpdecode_thrift_i32(thrift, 5, 1);
+      kpdecode_thrift_i32(thrift, 6, KPERFDATA_PARQUET_CONVERTED_LIST);
+      kpdecode_thrift_struct_end(thrift);
+      kpdecode_thrift_struct_begin(thrift);
+      kpdecode_thrift_i32(thrift, 3, KPERFDATA_PARQUET_REPEATED);
+      kpdecode_thrift_string(thrift, 4, "list");
+      kpdecode_thrift_i32(thrift, 5, 1);
+      kpdecode_thrift_struct_end(thrift);
+    }
+    kpdecode_thrift_struct_begin(thrift);
+    kpdecode_thrift_i32(thrift, 1, desc->type);
+    kpdecode_thrift_i32(thrift, 3, KPERFDATA_PARQUET_REQUIRED);
+    kpdecode_thrift_string(thrift, 4, column >= KPERFDATA_PARQUET_UCALLSTACK ? "element"
+                                                                             : desc->name);
+    kpdecode_thrift_struct_end(thrift);
+  }
+}
+
+static void kpdecode_parquet_put_column_meta_data(kpdecode_thrift* thrift, int column,
+                                                  const kpdecode_parquet_chunk* chunk) {
+  const kpdecode_parquet_column* desc = &kpdecode_parquet_columns[column];
+  bool callstack = column >= KPERFDATA_PARQUET_UCALLSTACK;
+  kpdecode_thrift_struct_begin(thrift);
+  kpdecode_thrift_i32(thrift, 1, desc->type);
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_LIST, 2);  // encodings
+  if (chunk->dictionary_page_offset) {
+    kpdecode_thrift_list_begin(thrift, KPERFDATA_THRIFT_I32, 2);
+    kpdecode_bytes_zigzag(thrift->out, KPERFDATA_PARQUET_PLAIN);
+  } else {
+    kpdecode_thrift_list_begin(thrift, KPERFDATA_THRIFT_I32, callstack ? 2 : 1);
+    if (callstack) {
+      kpdecode_bytes_zigzag(thrift->out, KPERFDATA_PARQUET_RLE);
+    }
+  }
+  kpdecode_bytes_zigzag(thrift->out, desc->encoding);
+  kpdecode_thrift_field(thrift, KPERFDATA_THRIFT_LIST, 3);  // path_in_schema
+  kpdecode_thrift_list_begin(thrift, KPERFDATA_THRIFT_BINARY, callstack ? 3 : 1);
+  kpdecode_thrift_binary(thrift, desc->name);
+  if (callstack) {
+    kpdecode_thrift_binary(thrift, "list");
+    kpdecode_thrift_binary(thrift, "element");
+  }
+  kpdecode_thrift_i32(thrift, 4, 0);  // codec, UNCOMPRESSED
+  kpdecode_thrift_i64(thrift, 5, (int64_t)chunk->value_count);
+  kpdecode_thrift_i64(thrift, 6, (int64_t)chunk->size);
+  kpdecode_thrift_i64(thrift, 7, (int64_t)chunk->size);
+  kpdecode_thrift_i64(thrift, 9, (int64_t)chunk->data_page_offset);
+  if (chunk->dictionary_page_offset) {
+    kpdecode_thrift_i64(thrift, 11, (int64_t)chunk->dictionary_page_offset);
+  }
+  kpdecode_thrift_struct_end(thrift);
+}
+
+// The FileMetaData, its size and the magic
+static long kpdecode_parquet_write_footer(kpdecode_parquet_writer* writer) {
+  kpdecode_bytes* out = &writer->page;
+  out->size = 0;
+  kpdecode_thrift thrift = {out, {0}, 0};
+  kpdecode_thrift_struct_begin(&thrift);
+  kpdecode_thrift_i32(&thrift, 1, 1);  // version
+  kpdecode_parquet_put_schema(&thrift);
+  kpdecode_thrift_i64(&thrift, 3, (int64_t)writer->row_count);
+  kpdecode_thrift_field(&thrift, KPERFDATA_THRIFT_LIST, 4);
+  kpdecode_thrift_list_begin(&thrift, KPERFDATA_THRIFT_STRUCT, (uint32_t)writer->row_group_count);
+  for (size_t i = 0; i < writer->row_group_count; ++i) {
+    const kpdecode_parquet_row_group* row_group = &writer->row_groups[i];
+    kpdecode_thrift_struct_begin(&thrift);
+    kpdecode_thrift_field(&thrift, KPERFDATA_THRIFT_LIST, 1);
+    kpdecode_thrift_list_begin(&thrift, KPERFDATA_THRIFT_STRUCT, KPERFDATA_PARQUET_COLUMN_COUNT);
+    for (int column = 0; column < KPERFDATA_PARQUET_COLUMN_COUNT; ++column) {
+      const kpdecode_parquet_chunk* chunk = &row_group->chunks[column];
+      kpdecode_thrift_struct_begin(&thrift);  // ColumnChunk
+      kpdecode_thrift_i64(&thrift, 2, (int64_t)(chunk->dictionary_page_offset
+                                                    ? chunk->dictionary_page_offset
+                                                    : chunk->data_page_offset));
+      kpdecode_thrift_field(&thrift, KPERFDATA_THRIFT_STRUCT, 3);
+      kpdecode_parquet_put_column_meta_data(&thrift, column, chunk);
+      kpdecode_thrift_struct_end(&thrift);
+    }
+    kpdecode_thrift_i64(&thrift, 2, (int64_t)row_group->size);
+    kpdecode_thrift_i64(&thrift, 3, (int64_t)row_group->row_count);
+    kpdecode_thrift_struct_end(&thrift);
+  }
+  kpdecode_thrift_string(&thrift, 6, "libkperfdata");  // created_by
+  kpdecode_thrift_struct_end(&thrift);
+  uint32_t size = (uint32_t)out->size;
+  kpdecode_bytes_le32(out, size);
+  kpdecode_bytes_append(out, KPERFDATA_PARQUET_MAGIC, 4);
+  if (out->oom) {
+    return KPERFDATA_RET_OOM;
+  }
+  if (fwrite(out->data, 1, out->size, writer->file) != out->size) {
+    return KPERFDATA_RET_FAIL;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_parquet_encode(kpdecode_parquet_writer* writer) {
+  writer->ret = kpdecode_parquet_write_row_group(writer, &writer->rows[writer->filling ^ 1]);
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI kpdecode_parquet_encode_main(LPVOID arg) {
+  kpdecode_parquet_encode((kpdecode_parquet_writer*)arg);
+  return 0;
+}
+
+static void kpdecode_parquet_start_encoding(kpdecode_parquet_writer* writer) {
+  writer->thread = CreateThread(NULL, 0, kpdecode_parquet_encode_main, writer, 0, NULL);
+  writer->encoding = writer->thread != NULL;
+  if (!writer->encoding) {
+    kpdecode_parquet_encode(writer);  // no thread, on the calling thread
+  }
+}
+
+static void kpdecode_parquet_wait_encoding(kpdecode_parquet_writer* writer) {
+  if (writer->encoding) {
+    WaitForSingleObject(writer->thread, INFINITE);
+    CloseHandle(writer->thread);
+    writer->encoding = false;
+  }
+}
+
+#else
+
+static void* kpdecode_parquet_encode_main(void* arg) {
+  kpdecode_parquet_encode((kpdecode_parquet_writer*)arg);
+  return NULL;
+}
+
+static void kpdecode_parquet_start_encoding(kpdecode_parquet_writer* writer) {
+  writer->encoding = pthread_create(&writer->thread, NULL, kpdecode_parquet_encode_main,
+                                    writer) == 0;
+  if (!writer->encoding) {
+    kpdecode_parquet_encode(writer);  // no thread, on the calling thread
+  }
+}
+
+static void kpdecode_parquet_wait_encoding(kpdecode_parquet_writer* writer) {
+  if (writer->encoding) {
+    pthread_join(writer->thread, NULL);
+    writer->encoding = false;
+  }
+}
+
+#endif  // _WIN32
+
+// Hand the rows filled to the encoding thread, once the previous row group is written
+static long kpdecode_parquet_writer_flush(kpdecode_parquet_writer* writer) {
+  kpdecode_parquet_wait_encoding(writer);
+  if (writer->ret != KPERFDATA_RET_OK) {
+    return writer->ret;
+  }
+  writer->row_count += writer->rows[writer->filling].count;
+  writer->filling ^= 1;
+  kpdecode_parquet_rows* rows = &writer->rows[writer->filling];
+  rows->count = 0;
+  rows->frame_count[0] = 0;
+  rows->frame_count[1] = 0;
+  kpdecode_parquet_start_encoding(writer);
+  return KPERFDATA_RET_OK;
+}
+
+static bool kpdecode_parquet_rows_create(kpdecode_parquet_rows* rows, size_t capacity) {
+  rows->timestamps = malloc(sizeof(uint64_t) * capacity);
+  rows->tids = malloc(sizeof(uint64_t) * capacity);
+  rows->cpuids = malloc(sizeof(uint32_t) * capacity);
+  rows->debugids = malloc(sizeof(uint32_t) * capacity);
+  rows->flags = malloc(sizeof(uint64_t) * capacity);
+  bool allocated = rows->timestamps && rows->tids && rows->cpuids && rows->debugids && rows->flags;
+  for (int i = 0; i < 4; ++i) {
+    rows->args[i] = malloc(sizeof(uint64_t) * capacity);
+    allocated = allocated && rows->args[i];
+  }
+  for (int k = 0; k < 2; ++k) {
+    rows->nframes[k] = malloc(sizeof(uint32_t) * capacity);
+    allocated = allocated && rows->nframes[k];
+  }
+  return allocated;
+}
+
+static void kpdecode_parquet_rows_free(kpdecode_parquet_rows* rows) {
+  free(rows->timestamps);
+  free(rows->tids);
+  free(rows->cpuids);
+  free(rows->debugids);
+  free(rows->flags);
+  for (int i = 0; i < 4; ++i) {
+    free(rows->args[i]);
+  }
+  for (int k = 0; k < 2; ++k) {
+    free(rows->nframes[k]);
+    free(rows->frames[k]);
+  }
+}
+
+static void kpdecode_parquet_writer_free(kpdecode_parquet_writer* writer) {
+  if (writer->file) {
+    fclose(writer->file);
+  }
+  kpdecode_parquet_rows_free(&writer->rows[0]);
+  kpdecode_parquet_rows_free(&writer->rows[1]);
+  free(writer->row_groups);
+  free(writer->page.data);
+  free(writer->header.data);
+  free(writer);
+}
+
+kpdecode_parquet_writer* kpdecode_parquet_writer_create(const char* path, size_t row_group_size) {
+  kpdecode_parquet_writer* writer = calloc(1, sizeof(kpdecode_parquet_writer));
+  if (!writer) {
+    return NULL;
+  }
+  writer->row_group_size = row_group_size ? row_group_size : KPERFDATA_PARQUET_ROW_GROUP_SIZE;
+  if (writer->row_group_size > KPERFDATA_PARQUET_MAX_ROW_GROUP_SIZE) {
+    writer->row_group_size = KPERFDATA_PARQUET_MAX_ROW_GROUP_SIZE;
+  }
+  if (!kpdecode_parquet_rows_create(&writer->rows[0], writer->row_group_size) ||
+      !kpdecode_parquet_rows_create(&writer->rows[1], writer->row_group_size)) {
+    kpdecode_parquet_writer_free(writer);
+    return NULL;
+  }
+  writer->file = fopen(path, "wb");
+  if (!writer->file || fwrite(KPERFDATA_PARQUET_MAGIC, 1, 4, writer->file) != 4) {
+    kpdecode_parquet_writer_free(writer);
+    return NULL;
+  }
+  writer->offset = 4;
+  return writer;
+}
+
+// Append the frames of the rows [first, first + count) of a callstack column
+static bool kpdecode_parquet_rows_append_frames(kpdecode_parquet_rows* rows, int k,
+                                                const uint32_t* offsets, const uint64_t* frames,
+                                                size_t first, size_t count) {
+  uint32_t* nframes = rows->nframes[k] + rows->count;
+  if (!offsets || !frames) {
+    memset(nframes, 0, sizeof(uint32_t) * count);
+    return true;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    nframes[i] = offsets[first + i + 1] - offsets[first + i];
+  }
+  size_t frame_count = offsets[first + count] - offsets[first];
+  if (rows->frames_capacity[k] - rows->frame_count[k] < frame_count) {
+    size_t capacity = rows->frames_capacity[k] ? rows->frames_capacity[k] : 4096;
+    while (capacity - rows->frame_count[k] < frame_count) {
+      capacity *= 2;
+    }
+    uint64_t* grown = realloc(rows->frames[k], sizeof(uint64_t) * capacity);
+    if (!grown) {
+      return false;
+    }
+    rows->frames[k] = grown;
+    rows->frames_capacity[k] = capacity;
+  }
+  memcpy(rows->frames[k] + rows->frame_count[k], frames + offsets[first],
+         sizeof(uint64_t) * frame_count);
+  rows->frame_count[k] += frame_count;
+  return true;
+}
+
+static void kpdecode_parquet_copy_column(void* to, const void* from, size_t size_of_value,
+                                         size_t first, size_t count) {
+  if (from) {
+    memcpy(to, (const char*)from + size_of_value * first, size_of_value * count);
+  } else {
+    memset(to, 0, size_of_value * count);
+  }
+}
+
+long kpdecode_parquet_writer_write_columns(kpdecode_parquet_writer* writer,
+                                           const kpdecode_columns* columns) {
+  size_t first = 0;
+  while (first < columns->count) {
+    kpdecode_parquet_rows* rows = &writer->rows[writer->filling];
+    if (rows->count == writer->row_group_size) {
+      long ret = kpdecode_parquet_writer_flush(writer);
+      if (ret != KPERFDATA_RET_OK) {
+        return ret;
+      }
+      continue;
+    }
+    size_t count = columns->count - first;
+    if (count > writer->row_group_size - rows->count) {
+      count = writer->row_group_size - rows->count;
+    }
+    size_t i = rows->count;
+    if (!kpdecode_parquet_rows_append_frames(rows, 0, columns->ucallstack_offsets,
+                                             columns->ucallstack_frames, first, count) ||
+        !kpdecode_parquet_rows_append_frames(rows, 1, columns->kcallstack_offsets,
+                                             columns->kcallstack_frames, first, count)) {
+      return KPERFDATA_RET_OOM;
+    }
+    kpdecode_parquet_copy_column(rows->timestamps + i, columns->timestamps, 8, first, count);
+    kpdecode_parquet_copy_column(rows->tids + i, columns->tids, 8, first, count);
+    kpdecode_parquet_copy_column(rows->cpuids + i, columns->cpuids, 4, first, count);
+    kpdecode_parquet_copy_column(rows->debugids + i, columns->debugids, 4, first, count);
+    kpdecode_parquet_copy_column(rows->flags + i, columns->flags, 8, first, count);
+    for (int j = 0; j < 4; ++j) {
+      kpdecode_parquet_copy_column(rows->args[j] + i, columns->args[j], 8, first, count);
+    }
+    rows->count += count;
+    first += count;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_parquet_writer_close(kpdecode_parquet_writer* writer, uint64_t* row_count) {
+  long ret = KPERFDATA_RET_OK;
+  if (writer->rows[writer->filling].count != 0) {
+    ret = kpdecode_parquet_writer_flush(writer);
+  }
+  kpdecode_parquet_wait_encoding(writer);
+  if (ret == KPERFDATA_RET_OK) {
+    ret = writer->ret;
+  }
+  if (ret == KPERFDATA_RET_OK) {
+    ret = kpdecode_parquet_write_footer(writer);
+  }
+  if (fclose(writer->file) != 0 && ret == KPERFDATA_RET_OK) {
+    ret = KPERFDATA_RET_FAIL;
+  }
+  writer->file = NULL;
+  if (row_count) {
+    *row_count = writer->row_count;
+  }
+  kpdecode_parquet_writer_free(writer);
+  return ret;
+}
+
+long kpdecode_cursor_write_parquet(kpdecode_cursor* cursor, const char* path,
+                                   size_t row_group_size, uint64_t* row_count) {
+  kpdecode_parquet_writer* writer = kpdecode_parquet_writer_create(path, row_group_size);
+  if (!writer) {
+    return KPERFDATA_RET_FAIL;
+  }
+  // a record has up to 256 frames in each callstack, the ones that do not fit are carried
+  kpdecode_columns* columns =
+      kpdecode_columns_create(KPERFDATA_PARQUET_BLOCK_SIZE, KPERFDATA_PARQUET_BLOCK_SIZE * 16);
+  if (!columns) {
+    kpdecode_parquet_writer_close(writer, NULL);
+    return KPERFDATA_RET_OOM;
+  }
+  long ret = KPERFDATA_RET_OK;
+  bool finished = false;
+  while (ret == KPERFDATA_RET_OK) {
+    long next = kpdecode_cursor_next_columns(cursor, columns);
+    if (next == KPERFDATA_RET_OK) {
+      ret = kpdecode_parquet_writer_write_columns(writer, columns);  // overlaps the encoding
+    } else if (next == KPERFDATA_RET_NOT_READY && !finished) {
+      kpdecode_cursor_finish(cursor);  // drain the reorder window
+      finished = true;
+    } else {
+      if (next != KPERFDATA_RET_NOT_READY) {
+        ret = next;  // not a truncated file reported as a success
+      } else if (!cursor->header_decoded) {
+        ret = KPERFDATA_RET_FAIL;  // not a RAW file, or its header is truncated
+      }
+      break;
+    }
+  }
+  kpdecode_columns_free(columns);
+  long close_ret = kpdecode_parquet_writer_close(writer, row_count);
+  return ret != KPERFDATA_RET_OK ? ret : close_ret;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,372 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc, free
+
+#if defined(_WIN32)
+#include <windows.h>  // CreateThread, InterlockedCompareExchange64, SwitchToThread
+#else
+#include <pthread.h>  // pthread_create
+#include <sched.h>  // sched_yield
+#include <time.h>  // nanosleep
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+#if defined(_MSC_VER)
+
+static uint64_t kpdecode_load_acquire(volatile uint64_t* ptr) {
+  return (uint64_t)InterlockedCompareExchange64((volatile LONG64*)ptr, 0, 0);
+}
+
+static void kpdecode_store_release(volatile uint64_t* ptr, uint64_t value) {
+  InterlockedExchange64((volatile LONG64*)ptr, (LONG64)value);
+}
+
+static bool kpdecode_compare_exchange(volatile uint64_t* ptr, uint64_t* expected,
+                                      uint64_t desired) {
+  uint64_t previous = (uint64_t)InterlockedCompareExchange64((volatile LONG64*)ptr,
+                                                             (LONG64)desired, (LONG64)*expected);
+  if (previous == *expected) {
+    return true;
+  }
+  *expected = previous;
+  return false;
+}
+
+#else
+
+static uint64_t kpdecode_load_acquire(uint64_t* ptr) {
+  return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static void kpdecode_store_release(uint64_t* ptr, uint64_t value) {
+  __atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
+static bool kpdecode_compare_exchange(uint64_t* ptr, uint64_t* expected, uint64_t desired) {
+  return __atomic_compare_exchange_n(ptr, expected, desired, false, __ATOMIC_RELAXED,
+                                     __ATOMIC_RELAXED);
+}
+
+#endif  // _MSC_VER
+
+typedef struct {
+  uint64_t sequence;                                  // the position the cell is ready for
+  kpdecode_record* record;
+} kpdecode_ring_cell;
+
+// A bounded MPMC queue of records (D. Vyukov), the cells are claimed by their position. With a
+// single producer or a single consumer, its side claims the cells without compare-and-swap, so that
+// every operation of the side completes in a bounded number of steps.
+typedef struct {
+  kpdecode_ring_cell* cells;
+  uint64_t mask;
+  bool single_producer;
+  bool single_consumer;
+  char padding0[KPERFDATA_CACHE_LINE_SIZE];
+  uint64_t enqueue_pos;
+  char padding1[KPERFDATA_CACHE_LINE_SIZE];
+  uint64_t dequeue_pos;
+  char padding2[KPERFDATA_CACHE_LINE_SIZE];
+} kpdecode_ring;
+
+struct kpdecode_pipeline {
+  kpdecode_cursor* cursor;
+  kpdecode_ring records;                              // from the decoding thread to the consumers
+  kpdecode_ring released;                             // from the consumers to the decoding thread
+  uint64_t finished;                                  // 0/1, all the records have been pushed
+  uint64_t stopping;                                  // 0/1, see kpdecode_pipeline_stop()
+  long ret;                                           // of the decoding, read once it's finished
+#if defined(_WIN32)
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+};
+
+static bool kpdecode_ring_init(kpdecode_ring* ring, size_t capacity, bool single_producer,
+                               bool single_consumer) {
+  ring->cells = calloc(capacity, sizeof(kpdecode_ring_cell));
+  if (ring->cells == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < capacity; ++i) {
+    ring->cells[i].sequence = i;
+  }
+  ring->mask = capacity - 1;
+  ring->single_producer = single_producer;
+  ring->single_consumer = single_consumer;
+  ring->enqueue_pos = 0;
+  ring->dequeue_pos = 0;
+  return true;
+}
+
+// Claim the cell at the position of `pos`, return false if it's not ready for `pos` yet
+static bool kpdecode_ring_claim(kpdecode_ring* ring, uint64_t* pos, uint64_t offset, bool single,
+                                kpdecode_ring_cell** claimed) {
+  uint64_t current = kpdecode_load_acquire(pos);
+  while (true) {
+    kpdecode_ring_cell* cell = &ring->cells[current & ring->mask];
+    int64_t diff = (int64_t)(kpdecode_load_acquire(&cell->sequence) - (current + offset));
+    if (diff < 0) {
+      return false;  // full when pushing, empty when popping
+    }
+    if (diff == 0) {
+      if (single) {
+        kpdecode_store_release(pos, current + 1);
+        *claimed = cell;
+        return true;
+      }
+      if (kpdecode_compare_exchange(pos, &current, current + 1)) {
+        *claimed = cell;
+        return true;
+      }
+    } else {
+      current = kpdecode_load_acquire(pos);  // another thread claimed it first
+    }
+  }
+}
+
+static bool kpdecode_ring_push(kpdecode_ring* ring, kpdecode_record* record) {
+  kpdecode_ring_cell* cell;
+  if (!kpdecode_ring_claim(ring, &ring->enqueue_pos, 0, ring->single_producer, &cell)) {
+    return false;
+  }
+  uint64_t sequence = kpdecode_load_acquire(&cell->sequence);
+  cell->record = record;
+  kpdecode_store_release(&cell->sequence, sequence + 1);
+  return true;
+}
+
+static bool kpdecode_ring_pop(kpdecode_ring* ring, kpdecode_record** record) {
+  kpdecode_ring_cell* cell;
+  if (!kpdecode_ring_claim(ring, &ring->dequeue_pos, 1, ring->single_consumer, &cell)) {
+    return false;
+  }
+  uint64_t sequence = kpdecode_load_acquire(&cell->sequence);
+  *record = cell->record;
+  kpdecode_store_release(&cell->sequence, sequence + ring->mask);  // ready for the next lap
+  return true;
+}
+
+// Wait a little longer each time, without giving up the cpu at first
+static void kpdecode_backoff(uint32_t* spins) {
+  *spins += 1;
+  if (*spins < KPERFDATA_PIPELINE_SPINS) {
+    return;
+  }
+#if defined(_WIN32)
+  if (*spins < KPERFDATA_PIPELINE_SPINS * 2) {
+    SwitchToThread();
+  } else {
+    Sleep(1);
+  }
+#else
+  if (*spins < KPERFDATA_PIPELINE_SPINS * 2) {
+    sched_yield();
+  } else {
+    struct timespec pause = {0, 100000};  // 100us
+    nanosleep(&pause, NULL);
+  }
+#endif
+}
+
+// Release the records returned by the consumers, on the decoding thread which owns their pool
+static bool kpdecode_pipeline_recycle(kpdecode_pipeline* pipeline) {
+  bool recycled = false;
+  kpdecode_record* record;
+  while (kpdecode_ring_pop(&pipeline->released, &record)) {
+    kpdecode_record_free(record);
+    recycled = true;
+  }
+  return recycled;
+}
+
+static void kpdecode_pipeline_decode(kpdecode_pipeline* pipeline) {
+  kpdecode_cursor* cursor = pipeline->cursor;
+  kpdecode_record* batch[KPERFDATA_PIPELINE_BATCH_SIZE];
+  long ret = KPERFDATA_RET_OK;
+  while (!kpdecode_load_acquire(&pipeline->stopping)) {
+    kpdecode_pipeline_recycle(pipeline);
+    size_t count = 0;
+    ret = kpdecode_cursor_next_records(cursor, batch, KPERFDATA_PIPELINE_BATCH_SIZE, &count);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret == KPERFDATA_RET_NOT_READY && !cursor->input_finished) {
+      kpdecode_cursor_finish(cursor);  // the cursor holds all of its input
+      continue;
+    }
+    if (ret != KPERFDATA_RET_OK) {
+      break;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      uint32_t spins = 0;
+      while (!kpdecode_ring_push(&pipeline->records, batch[i])) {
+        if (kpdecode_load_acquire(&pipeline->stopping)) {
+          for (; i < count; ++i) {
+            kpdecode_record_free(batch[i]);
+          }
+          break;
+        }
+        if (kpdecode_pipeline_recycle(pipeline)) {
+          spins = 0;
+        }
+        kpdecode_backoff(&spins);
+      }
+    }
+  }
+  pipeline->ret = ret == KPERFDATA_RET_NOT_READY ? KPERFDATA_RET_OK : ret;
+  kpdecode_store_release(&pipeline->finished, 1);
+
+  // the records are still returned until the pipeline is stopped
+  uint32_t spins = 0;
+  while (!kpdecode_load_acquire(&pipeline->stopping)) {
+    if (kpdecode_pipeline_recycle(pipeline)) {
+      spins = 0;
+    }
+    kpdecode_backoff(&spins);
+  }
+}
+
+#if defined(_WIN32)
+
+static DWORD WINAPI kpdecode_pipeline_main(LPVOID arg) {
+  kpdecode_pipeline_decode((kpdecode_pipeline*)arg);
+  return 0;
+}
+
+static bool kpdecode_pipeline_start_thread(kpdecode_pipeline* pipeline) {
+  pipeline->thread = CreateThread(NULL, 0, kpdecode_pipeline_main, pipeline, 0, NULL);
+  return pipeline->thread != NULL;
+}
+
+static void kpdecode_pipeline_join_thread(kpdecode_pipeline* pipeline) {
+  WaitForSingleObject(pipeline->thread, INFINITE);
+  CloseHandle(pipeline->thread);
+}
+
+#else
+
+static void* kpdecode_pipeline_main(void* arg) {
+  kpdecode_pipeline_decode((kpdecode_pipeline*)arg);
+  return NULL;
+}
+
+static bool kpdecode_pipeline_start_thread(kpdecode_pipeline* pipeline) {
+  return pthread_create(&pipeline->thread, NULL, kpdecode_pipeline_main, pipeline) == 0;
+}
+
+static void kpdecode_pipeline_join_thread(kpdecode_pipeline* pipeline) {
+  pthread_join(pipeline->thread, NULL);
+}
+
+#endif  // _WIN32
+
+static void kpdecode_pipeline_release_memory(kpdecode_pipeline* pipeline) {
+  free(pipeline->records.cells);
+  free(pipeline->released.cells);
+  free(pipeline);
+}
+
+kpdecode_pipeline* kpdecode_pipeline_start(kpdecode_cursor* cursor, size_t capacity, int flags) {
+  if (cursor->slim_records) {
+    return NULL;
+  }
+  if (capacity == 0) {
+    capacity = KPERFDATA_PIPELINE_CAPACITY;
+  }
+  size_t ring_capacity = 2;
+  while (ring_capacity < capacity) {
+    ring_capacity *= 2;
+  }
+  kpdecode_pipeline* pipeline = calloc(1, sizeof(kpdecode_pipeline));
+  if (pipeline == NULL) {
+    return NULL;
+  }
+  pipeline->cursor = cursor;
+  bool single_consumer = (flags & KPERFDATA_PIPELINE_SINGLE_CONSUMER) != 0;
+  // the records held by the consumers can all be returned at once
+  if (!kpdecode_ring_init(&pipeline->records, ring_capacity, true, single_consumer) ||
+      !kpdecode_ring_init(&pipeline->released, ring_capacity * 2, single_consumer, true) ||
+      !kpdecode_pipeline_start_thread(pipeline)) {
+    kpdecode_pipeline_release_memory(pipeline);
+    return NULL;
+  }
+  return pipeline;
+}
+
+long kpdecode_pipeline_pop(kpdecode_pipeline* pipeline, kpdecode_record** record, int wait) {
+  uint32_t spins = 0;
+  while (true) {
+    if (kpdecode_ring_pop(&pipeline->records, record)) {
+      return KPERFDATA_RET_OK;
+    }
+    if (kpdecode_load_acquire(&pipeline->finished)) {
+      // the last records were pushed before `finished` was set
+      return kpdecode_ring_pop(&pipeline->records, record) ? KPERFDATA_RET_OK : KPERFDATA_RET_FAIL;
+    }
+    if (!wait) {
+      return KPERFDATA_RET_NOT_READY;
+    }
+    kpdecode_backoff(&spins);
+  }
+}
+
+long kpdecode_pipeline_pop_records(kpdecode_pipeline* pipeline, kpdecode_record** records,
+                                   size_t max_records, size_t* record_count, int wait) {
+  *record_count = 0;
+  if (max_records == 0) {
+    return KPERFDATA_RET_OK;
+  }
+  long ret = kpdecode_pipeline_pop(pipeline, &records[0], wait);
+  if (ret != KPERFDATA_RET_OK) {
+    return ret;
+  }
+  size_t count = 1;
+  while (count < max_records && kpdecode_ring_pop(&pipeline->records, &records[count])) {
+    ++count;
+  }
+  *record_count = count;
+  return KPERFDATA_RET_OK;
+}
+
+void kpdecode_pipeline_release(kpdecode_pipeline* pipeline, kpdecode_record* record) {
+  uint32_t spins = 0;
+  while (!kpdecode_ring_push(&pipeline->released, record)) {
+    kpdecode_backoff(&spins);  // until the decoding thread recycles the records
+  }
+}
+
+long kpdecode_pipeline_stop(kpdecode_pipeline* pipeline) {
+  kpdecode_store_release(&pipeline->stopping, 1);
+  kpdecode_pipeline_join_thread(pipeline);
+
+  // the calling thread owns the cursor and its pool again
+  kpdecode_pipeline_recycle(pipeline);
+  kpdecode_record* record;
+  while (kpdecode_ring_pop(&pipeline->records, &record)) {
+    kpdecode_record_free(record);
+  }
+  long ret = pipeline->ret;
+  kpdecode_pipeline_release_memory(pipeline);
+  return ret;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
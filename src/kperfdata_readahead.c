@@ -0,0 +1,700 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc, free
+#include <string.h>  // memset
+
+#if defined(_WIN32)
+#include <malloc.h>  // _aligned_malloc
+#include <windows.h>  // CreateFileA, ReadFile, CreateThread, SRWLOCK, CONDITION_VARIABLE
+#else
+#include <errno.h>  // EINTR
+#include <fcntl.h>  // open
+#include <pthread.h>  // pthread_create, pthread_mutex_t, pthread_cond_t
+#include <sys/stat.h>  // fstat
+#include <unistd.h>  // pread, sysconf
+#if defined(KPERFDATA_HAVE_IO_URING)
+#include <linux/io_uring.h>  // io_uring_params, io_uring_sqe, io_uring_cqe
+#include <sys/mman.h>  // mmap
+#include <sys/syscall.h>  // __NR_io_uring_setup, __NR_io_uring_enter
+#include <sys/uio.h>  // iovec
+#endif
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// the states of a read-ahead buffer
+#define KPERFDATA_READ_AHEAD_FREE 0     // nothing to read, or waiting for a chunk to be recycled
+#define KPERFDATA_READ_AHEAD_READING 1  // the read is in flight
+#define KPERFDATA_READ_AHEAD_READ 2     // the read is complete, or failed
+#define KPERFDATA_READ_AHEAD_QUEUED 3   // set as a chunk of the cursor
+
+typedef struct kpdecode_read_buffer {
+  kpdecode_file_source* source;
+  char* bytes;                                        // page aligned, buffer_size bytes
+  uint64_t offset;                                    // the offset in the file
+  size_t size;                                        // the bytes to read, less at the end of the file
+  size_t done;                                        // the bytes read so far
+  int state;                                          // KPERFDATA_READ_AHEAD_FREE, ...
+  long ret;                                           // of the read
+  bool queued;                                        // waiting for, or read by, the reading thread
+#if defined(KPERFDATA_HAVE_IO_URING)
+  struct iovec iov;
+  bool uring;                                         // whether the read is submitted to the ring
+#endif
+} kpdecode_read_buffer;
+
+#if defined(KPERFDATA_HAVE_IO_URING)
+typedef struct {
+  int fd;
+  unsigned entries;                                   // the reads in flight, at most
+  void* sq_ring;
+  size_t sq_ring_size;
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe* cqes;
+} kpdecode_uring;
+#endif
+
+struct kpdecode_file_source {
+#if defined(_WIN32)
+  HANDLE file;
+#else
+  int fd;
+#endif
+  uint64_t file_size;
+  uint64_t read_offset;                               // the offset of the next read
+  uint64_t next_offset;                               // the offset of the next chunk of the cursor
+  size_t buffer_size;                                 // a multiple of the page size
+  kpdecode_read_buffer** buffers;                     // may grow while the reads are in flight
+  uint32_t buffer_count;
+  long ret;                                           // KPERFDATA_RET_FAIL once a read failed
+#if defined(KPERFDATA_HAVE_IO_URING)
+  bool uring_enabled;
+  kpdecode_uring uring;
+#endif
+
+  // the reading thread of the buffers not read by io_uring, started by the first of them. `lock`
+  // guards `buffers`, the `queued` buffers and `stopping`
+  bool reader_started;
+  bool reader_failed;                                 // no thread, read on the calling thread
+  bool stopping;
+#if defined(_WIN32)
+  HANDLE reader;
+  SRWLOCK lock;
+  CONDITION_VARIABLE queued;                          // a buffer is queued, or `stopping` is set
+  CONDITION_VARIABLE read;                            // a queued buffer is read
+#else
+  pthread_t reader;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t read;
+#endif
+};
+
+#if defined(_WIN32)
+
+static size_t kpdecode_page_size() {
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwPageSize;
+}
+
+static char* kpdecode_page_alloc(size_t size) {
+  return _aligned_malloc(size, kpdecode_page_size());
+}
+
+static void kpdecode_page_free(char* bytes) {
+  _aligned_free(bytes);
+}
+
+// Read the rest of the buffer from its offset, on the calling thread
+static long kpdecode_read_buffer_fill(kpdecode_read_buffer* buffer) {
+  while (buffer->done < buffer->size) {
+    uint64_t offset = buffer->offset + buffer->done;
+    size_t size = buffer->size - buffer->done;
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD count = 0;
+    if (!ReadFile(buffer->source->file, buffer->bytes + buffer->done,
+                  size < 0x40000000 ? (DWORD)size : 0x40000000, &count, &overlapped) ||
+        count == 0) {
+      return KPERFDATA_RET_FAIL;
+    }
+    buffer->done += count;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_file_source_reader_main(kpdecode_file_source* source);
+
+static DWORD WINAPI kpdecode_file_source_reader_thread(LPVOID arg) {
+  kpdecode_file_source_reader_main((kpdecode_file_source*)arg);
+  return 0;
+}
+
+static bool kpdecode_file_source_init_lock(kpdecode_file_source* source) {
+  InitializeSRWLock(&source->lock);
+  InitializeConditionVariable(&source->queued);
+  InitializeConditionVariable(&source->read);
+  return true;
+}
+
+static void kpdecode_file_source_destroy_lock(kpdecode_file_source* source) {
+  (void)source;  // nothing to release
+}
+
+static void kpdecode_file_source_lock(kpdecode_file_source* source) {
+  AcquireSRWLockExclusive(&source->lock);
+}
+
+static void kpdecode_file_source_unlock(kpdecode_file_source* source) {
+  ReleaseSRWLockExclusive(&source->lock);
+}
+
+static void kpdecode_file_source_sleep(kpdecode_file_source* source, CONDITION_VARIABLE* cond) {
+  SleepConditionVariableSRW(cond, &source->lock, INFINITE, 0);
+}
+
+static void kpdecode_file_source_wake(CONDITION_VARIABLE* cond) {
+  WakeAllConditionVariable(cond);
+}
+
+static bool kpdecode_file_source_start_reader(kpdecode_file_source* source) {
+  source->reader = CreateThread(NULL, 0, kpdecode_file_source_reader_thread, source, 0, NULL);
+  return source->reader != NULL;
+}
+
+static void kpdecode_file_source_join_reader(kpdecode_file_source* source) {
+  WaitForSingleObject(source->reader, INFINITE);
+  CloseHandle(source->reader);
+}
+
+static bool kpdecode_file_source_open_file(kpdecode_file_source* source, const char* path) {
+  source->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (source->file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(source->file, &size) || size.QuadPart == 0) {
+    CloseHandle(source->file);
+    return false;
+  }
+  source->file_size = size.QuadPart;
+  return true;
+}
+
+static void kpdecode_file_source_close_file(kpdecode_file_source* source) {
+  CloseHandle(source->file);
+}
+
+#else
+
+static size_t kpdecode_page_size() {
+  return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static char* kpdecode_page_alloc(size_t size) {
+  void* bytes = NULL;
+  if (posix_memalign(&bytes, kpdecode_page_size(), size) != 0) {
+    return NULL;
+  }
+  return bytes;
+}
+
+static void kpdecode_page_free(char* bytes) {
+  free(bytes);
+}
+
+// Read the rest of the buffer from its offset, on the calling thread
+static long kpdecode_read_buffer_fill(kpdecode_read_buffer* buffer) {
+  while (buffer->done < buffer->size) {
+    ssize_t count = pread(buffer->source->fd, buffer->bytes + buffer->done,
+                          buffer->size - buffer->done, (off_t)(buffer->offset + buffer->done));
+    if (count < 0 && errno == EINTR) {
+      continue;
+    }
+    if (count <= 0) {
+      return KPERFDATA_RET_FAIL;  // an I/O error, or the file was truncated
+    }
+    buffer->done += (size_t)count;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+static void kpdecode_file_source_reader_main(kpdecode_file_source* source);
+
+static void* kpdecode_file_source_reader_thread(void* arg) {
+  kpdecode_file_source_reader_main((kpdecode_file_source*)arg);
+  return NULL;
+}
+
+static bool kpdecode_file_source_init_lock(kpdecode_file_source* source) {
+  if (pthread_mutex_init(&source->lock, NULL) != 0) {
+    return false;
+  }
+  if (pthread_cond_init(&source->queued, NULL) != 0) {
+    pthread_mutex_destroy(&source->lock);
+    return false;
+  }
+  if (pthread_cond_init(&source->read, NULL) != 0) {
+    pthread_cond_destroy(&source->queued);
+    pthread_mutex_destroy(&source->lock);
+    return false;
+  }
+  return true;
+}
+
+static void kpdecode_file_source_destroy_lock(kpdecode_file_source* source) {
+  pthread_cond_destroy(&source->read);
+  pthread_cond_destroy(&source->queued);
+  pthread_mutex_destroy(&source->lock);
+}
+
+static void kpdecode_file_source_lock(kpdecode_file_source* source) {
+  pthread_mutex_lock(&source->lock);
+}
+
+static void kpdecode_file_source_unlock(kpdecode_file_source* source) {
+  pthread_mutex_unlock(&source->lock);
+}
+
+static void kpdecode_file_source_sleep(kpdecode_file_source* source, pthread_cond_t* cond) {
+  pthread_cond_wait(cond, &source->lock);
+}
+
+static void kpdecode_file_source_wake(pthread_cond_t* cond) {
+  pthread_cond_broadcast(cond);
+}
+
+static bool kpdecode_file_source_start_reader(kpdecode_file_source* source) {
+  return pthread_create(&source->reader, NULL, kpdecode_file_source_reader_thread, source) == 0;
+}
+
+static void kpdecode_file_source_join_reader(kpdecode_file_source* source) {
+  pthread_join(source->reader, NULL);
+}
+
+static bool kpdecode_file_source_open_file(kpdecode_file_source* source, const char* path) {
+  source->fd = open(path, O_RDONLY);
+  if (source->fd < 0) {
+    return false;
+  }
+  struct stat filestats;
+  if (fstat(source->fd, &filestats) != 0 || filestats.st_size == 0) {
+    close(source->fd);
+    return false;
+  }
+  source->file_size = (uint64_t)filestats.st_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(source->fd, 0, 0, POSIX_FADV_SEQUENTIAL);  // only a hint
+#endif
+  return true;
+}
+
+static void kpdecode_file_source_close_file(kpdecode_file_source* source) {
+  close(source->fd);
+}
+
+#endif  // _WIN32
+
+#if defined(KPERFDATA_HAVE_IO_URING)
+
+// io_uring without liburing: the rings are mapped from the io_uring fd, the kernel consumes the
+// submission queue up to its tail, and we consume the completion queue up to its tail
+static bool kpdecode_uring_setup(kpdecode_uring* uring, uint32_t entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (fd < 0) {
+    return false;  // ENOSYS, or disabled by the kernel.io_uring_disabled sysctl or seccomp
+  }
+  uring->fd = fd;
+  uring->entries = params.sq_entries;  // the completion queue holds at least as many
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+  uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     fd, IORING_OFF_SQES);
+  if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+    if (uring->sq_ring != MAP_FAILED) {
+      munmap(uring->sq_ring, uring->sq_ring_size);
+    }
+    if (uring->cq_ring != MAP_FAILED) {
+      munmap(uring->cq_ring, uring->cq_ring_size);
+    }
+    if (uring->sqes != MAP_FAILED) {
+      munmap(uring->sqes, uring->sqes_size);
+    }
+    close(fd);
+    return false;
+  }
+  char* sq_ring = (char*)uring->sq_ring;
+  char* cq_ring = (char*)uring->cq_ring;
+  uring->sq_tail = (unsigned*)(sq_ring + params.sq_off.tail);
+  uring->sq_mask = *(unsigned*)(sq_ring + params.sq_off.ring_mask);
+  uring->sq_array = (unsigned*)(sq_ring + params.sq_off.array);
+  uring->cq_head = (unsigned*)(cq_ring + params.cq_off.head);
+  uring->cq_tail = (unsigned*)(cq_ring + params.cq_off.tail);
+  uring->cq_mask = *(unsigned*)(cq_ring + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)(cq_ring + params.cq_off.cqes);
+  return true;
+}
+
+static void kpdecode_uring_destroy(kpdecode_uring* uring) {
+  munmap(uring->sqes, uring->sqes_size);
+  munmap(uring->cq_ring, uring->cq_ring_size);
+  munmap(uring->sq_ring, uring->sq_ring_size);
+  close(uring->fd);
+}
+
+// Submit the read of the rest of the buffer, its index is the user data of the completion
+static bool kpdecode_uring_submit(kpdecode_file_source* source, uint32_t index) {
+  kpdecode_uring* uring = &source->uring;
+  kpdecode_read_buffer* buffer = source->buffers[index];
+  buffer->iov.iov_base = buffer->bytes + buffer->done;
+  buffer->iov.iov_len = buffer->size - buffer->done;
+
+  unsigned tail = *uring->sq_tail;  // only written by us
+  unsigned slot = tail & uring->sq_mask;
+  struct io_uring_sqe* sqe = &uring->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;  // IORING_OP_READ needs Linux 5.6
+  sqe->fd = source->fd;
+  sqe->off = buffer->offset + buffer->done;
+  sqe->addr = (uint64_t)(uintptr_t)&buffer->iov;
+  sqe->len = 1;
+  sqe->user_data = index;
+  uring->sq_array[slot] = slot;
+  __atomic_store_n(uring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  while (true) {
+    long ret = syscall(__NR_io_uring_enter, uring->fd, 1, 0, 0, NULL, 0);
+    if (ret >= 0) {
+      return true;
+    }
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+}
+
+// Wait for at least one completion, then handle all of them
+static bool kpdecode_uring_wait(kpdecode_file_source* source) {
+  kpdecode_uring* uring = &source->uring;
+  if (syscall(__NR_io_uring_enter, uring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+      errno != EINTR) {
+    return false;
+  }
+  unsigned head = *uring->cq_head;  // only written by us
+  while (head != __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe = &uring->cqes[head & uring->cq_mask];
+    uint32_t index = (uint32_t)cqe->user_data;
+    int32_t res = cqe->res;
+    __atomic_store_n(uring->cq_head, ++head, __ATOMIC_RELEASE);
+
+    kpdecode_read_buffer* buffer = source->buffers[index];
+    if (res == -EINTR || res == -EAGAIN) {
+      res = 0;  // retried below
+    } else if (res <= 0) {
+      buffer->ret = KPERFDATA_RET_FAIL;  // an I/O error, or the file was truncated
+      buffer->state = KPERFDATA_READ_AHEAD_READ;
+      continue;
+    }
+    buffer->done += (size_t)res;
+    if (buffer->done < buffer->size) {
+      if (!kpdecode_uring_submit(source, index)) {  // a short read
+        buffer->ret = KPERFDATA_RET_FAIL;
+        buffer->state = KPERFDATA_READ_AHEAD_READ;
+      }
+      continue;
+    }
+    buffer->ret = KPERFDATA_RET_OK;
+    buffer->state = KPERFDATA_READ_AHEAD_READ;
+  }
+  return true;
+}
+
+#endif  // KPERFDATA_HAVE_IO_URING
+
+// Read the queued buffers one at a time, the one the cursor needs first, until `stopping`
+static void kpdecode_file_source_reader_main(kpdecode_file_source* source) {
+  kpdecode_file_source_lock(source);
+  while (true) {
+    kpdecode_read_buffer* next = NULL;
+    for (uint32_t i = 0; i < source->buffer_count; ++i) {
+      kpdecode_read_buffer* buffer = source->buffers[i];
+      if (buffer->queued && (next == NULL || buffer->offset < next->offset)) {
+        next = buffer;
+      }
+    }
+    if (next == NULL) {
+      if (source->stopping) {
+        break;
+      }
+      kpdecode_file_source_sleep(source, &source->queued);
+      continue;
+    }
+    kpdecode_file_source_unlock(source);
+    long ret = kpdecode_read_buffer_fill(next);  // the buffer is not touched by anyone else
+    kpdecode_file_source_lock(source);
+    next->ret = ret;
+    next->queued = false;
+    kpdecode_file_source_wake(&source->read);
+  }
+  kpdecode_file_source_unlock(source);
+}
+
+// Hand the read of the buffer to the reading thread, or read it on the calling thread without one
+static void kpdecode_read_buffer_start(kpdecode_file_source* source,
+                                       kpdecode_read_buffer* buffer) {
+  if (!source->reader_started && !source->reader_failed) {
+    source->reader_started = kpdecode_file_source_start_reader(source);
+    source->reader_failed = !source->reader_started;
+  }
+  if (source->reader_failed) {
+    buffer->ret = kpdecode_read_buffer_fill(buffer);
+    buffer->state = KPERFDATA_READ_AHEAD_READ;
+    return;
+  }
+  kpdecode_file_source_lock(source);
+  buffer->queued = true;
+  kpdecode_file_source_wake(&source->queued);
+  kpdecode_file_source_unlock(source);
+}
+
+static void kpdecode_read_buffer_wait(kpdecode_file_source* source,
+                                      kpdecode_read_buffer* buffer) {
+  kpdecode_file_source_lock(source);
+  while (buffer->queued) {
+    kpdecode_file_source_sleep(source, &source->read);
+  }
+  kpdecode_file_source_unlock(source);
+  buffer->state = KPERFDATA_READ_AHEAD_READ;
+}
+
+// Start reading the next bytes of the file into a free buffer, if any are left
+static void kpdecode_file_source_submit(kpdecode_file_source* source, uint32_t index) {
+  kpdecode_read_buffer* buffer = source->buffers[index];
+  if (source->read_offset >= source->file_size) {
+    buffer->state = KPERFDATA_READ_AHEAD_FREE;
+    return;
+  }
+  uint64_t remaining = source->file_size - source->read_offset;
+  buffer->offset = source->read_offset;
+  buffer->size = remaining < source->buffer_size ? (size_t)remaining : source->buffer_size;
+  buffer->done = 0;
+  buffer->ret = KPERFDATA_RET_OK;
+  buffer->state = KPERFDATA_READ_AHEAD_READING;
+  source->read_offset += buffer->size;
+#if defined(KPERFDATA_HAVE_IO_URING)
+  // the buffers added by kpdecode_file_source_grow() past the entries of the ring are read by
+  // threads, more reads in flight could overflow the completion queue and fail with EBUSY
+  buffer->uring = source->uring_enabled && index < source->uring.entries;
+  if (buffer->uring) {
+    if (!kpdecode_uring_submit(source, index)) {
+      buffer->ret = KPERFDATA_RET_FAIL;
+      buffer->state = KPERFDATA_READ_AHEAD_READ;
+    }
+    return;
+  }
+#endif
+  kpdecode_read_buffer_start(source, buffer);
+}
+
+// Wait for the read of the buffer to complete
+static void kpdecode_file_source_wait(kpdecode_file_source* source, kpdecode_read_buffer* buffer) {
+#if defined(KPERFDATA_HAVE_IO_URING)
+  if (buffer->uring) {
+    while (buffer->state == KPERFDATA_READ_AHEAD_READING) {
+      if (!kpdecode_uring_wait(source)) {
+        // the read may still complete into the buffer, it is only released by closing the ring
+        buffer->ret = KPERFDATA_RET_FAIL;
+        source->ret = KPERFDATA_RET_FAIL;
+        return;
+      }
+    }
+    return;
+  }
+#endif
+  if (buffer->state == KPERFDATA_READ_AHEAD_READING) {
+    kpdecode_read_buffer_wait(source, buffer);
+  }
+}
+
+// Add a buffer to the ring, when the cursor holds all of them, e.g. for a large kd_threadmap[]
+static long kpdecode_file_source_grow(kpdecode_file_source* source) {
+  kpdecode_read_buffer* buffer = calloc(1, sizeof(kpdecode_read_buffer));
+  if (buffer == NULL) {
+    return KPERFDATA_RET_OOM;
+  }
+  buffer->bytes = kpdecode_page_alloc(source->buffer_size);
+  if (buffer->bytes == NULL) {
+    free(buffer);
+    return KPERFDATA_RET_OOM;
+  }
+  buffer->source = source;
+  // the reading thread walks the buffers
+  kpdecode_file_source_lock(source);
+  kpdecode_read_buffer** buffers =
+      realloc(source->buffers, (source->buffer_count + 1) * sizeof(kpdecode_read_buffer*));
+  if (buffers != NULL) {
+    source->buffers = buffers;
+    buffers[source->buffer_count++] = buffer;
+  }
+  kpdecode_file_source_unlock(source);
+  if (buffers == NULL) {
+    kpdecode_page_free(buffer->bytes);
+    free(buffer);
+    return KPERFDATA_RET_OOM;
+  }
+  return KPERFDATA_RET_OK;
+}
+
+kpdecode_file_source* kpdecode_file_source_open(const char* path, uint32_t buffer_count,
+                                                size_t buffer_size, int flags) {
+  kpdecode_file_source* source = calloc(1, sizeof(kpdecode_file_source));
+  if (source == NULL) {
+    return NULL;
+  }
+  if (!kpdecode_file_source_init_lock(source)) {
+    free(source);
+    return NULL;
+  }
+  if (!kpdecode_file_source_open_file(source, path)) {
+    kpdecode_file_source_destroy_lock(source);
+    free(source);
+    return NULL;
+  }
+  size_t page_size = kpdecode_page_size();
+  source->buffer_size = (buffer_size + page_size - 1) / page_size * page_size;
+#if defined(KPERFDATA_HAVE_IO_URING)
+  source->uring_enabled = !(flags & KPERFDATA_OPEN_FILE_NO_IO_URING) &&
+                          kpdecode_uring_setup(&source->uring, buffer_count);
+#else
+  (void)flags;
+#endif
+  for (uint32_t i = 0; i < buffer_count; ++i) {
+    if (kpdecode_file_source_grow(source) != KPERFDATA_RET_OK) {
+      kpdecode_file_source_close(source, NULL);
+      return NULL;
+    }
+  }
+  for (uint32_t i = 0; i < buffer_count; ++i) {
+    kpdecode_file_source_submit(source, i);
+  }
+  return source;
+}
+
+const char* kpdecode_file_source_next(kpdecode_file_source* source, size_t* size) {
+  if (source->ret != KPERFDATA_RET_OK || source->next_offset >= source->file_size) {
+    return NULL;
+  }
+  kpdecode_read_buffer* next = NULL;
+  for (uint32_t i = 0; i < source->buffer_count && next == NULL; ++i) {
+    kpdecode_read_buffer* buffer = source->buffers[i];
+    if ((buffer->state == KPERFDATA_READ_AHEAD_READING ||
+         buffer->state == KPERFDATA_READ_AHEAD_READ) &&
+        buffer->offset == source->next_offset) {
+      next = buffer;
+    }
+  }
+  if (next == NULL) {
+    // every buffer is still a chunk of the cursor, read the next bytes into a new one
+    uint32_t index = source->buffer_count;
+    long ret = kpdecode_file_source_grow(source);
+    if (ret != KPERFDATA_RET_OK) {
+      source->ret = ret;
+      return NULL;
+    }
+    kpdecode_file_source_submit(source, index);
+    next = source->buffers[index];
+  }
+  kpdecode_file_source_wait(source, next);
+  if (next->ret != KPERFDATA_RET_OK) {
+    source->ret = KPERFDATA_RET_FAIL;
+    return NULL;
+  }
+  next->state = KPERFDATA_READ_AHEAD_QUEUED;
+  source->next_offset += next->size;
+  *size = next->size;
+  return next->bytes;
+}
+
+void kpdecode_file_source_release(kpdecode_file_source* source, const char* bytes) {
+  for (uint32_t i = 0; i < source->buffer_count; ++i) {
+    if (source->buffers[i]->bytes == bytes) {
+      kpdecode_file_source_submit(source, i);
+      return;
+    }
+  }
+}
+
+long kpdecode_file_source_status(const kpdecode_file_source* source) {
+  return source->ret;
+}
+
+void kpdecode_file_source_close(kpdecode_file_source* source, kpdecode_cursor* cursor) {
+  for (uint32_t i = 0; i < source->buffer_count; ++i) {
+    kpdecode_read_buffer* buffer = source->buffers[i];
+    if (buffer->state == KPERFDATA_READ_AHEAD_QUEUED && cursor != NULL) {
+      kpdecode_cursor_dropchunk(cursor, buffer->bytes);
+    }
+    kpdecode_file_source_wait(source, buffer);  // the reads in flight write into the buffers
+  }
+  if (source->reader_started) {
+    kpdecode_file_source_lock(source);
+    source->stopping = true;
+    kpdecode_file_source_wake(&source->queued);
+    kpdecode_file_source_unlock(source);
+    kpdecode_file_source_join_reader(source);
+  }
+#if defined(KPERFDATA_HAVE_IO_URING)
+  if (source->uring_enabled) {
+    kpdecode_uring_destroy(&source->uring);
+  }
+#endif
+  for (uint32_t i = 0; i < source->buffer_count; ++i) {
+    kpdecode_read_buffer* buffer = source->buffers[i];
+    if (buffer->state == KPERFDATA_READ_AHEAD_READING) {
+      continue;  // waiting failed, the kernel may still write into it, leak it
+    }
+    kpdecode_page_free(buffer->bytes);
+    free(buffer);
+  }
+  free(source->buffers);
+  kpdecode_file_source_close_file(source);
+  kpdecode_file_source_destroy_lock(source);
+  free(source);
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,198 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdbool.h>  // bool
+#include <stdlib.h>  // calloc
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+typedef struct {
+  kpdecode_record_slot slot;
+  uint64_t timestamp;
+  uint64_t sequence;  // keeps the decoding order of the records with the same timestamp
+} kpdecode_reorder_entry;
+
+// The records of one cpu, in decoding order, which is the timestamp order on a cpu
+typedef struct {
+  kpdecode_reorder_entry* entries;                    // power-of-two ring
+  uint32_t head;
+  uint32_t count;
+  uint32_t mask;
+} kpdecode_reorder_run;
+
+#define KPERFDATA_REORDER_RUN_COUNT (KPERFDATA_MAX_CPUS + 1)  // the last one for an invalid cpuid
+
+struct kpdecode_reorder {
+  uint64_t window;
+  uint64_t newest_timestamp;                          // the newest timestamp pushed so far
+  uint64_t sequence;
+  size_t count;
+  kpdecode_reorder_run runs[KPERFDATA_REORDER_RUN_COUNT];
+  uint32_t heap[KPERFDATA_REORDER_RUN_COUNT];         // the non-empty runs, by their first record
+  uint32_t heap_size;
+};
+
+kpdecode_reorder* kpdecode_reorder_create(uint64_t window) {
+  kpdecode_reorder* reorder = calloc(1, sizeof(kpdecode_reorder));
+  if (reorder) {
+    reorder->window = window;
+  }
+  return reorder;
+}
+
+void kpdecode_reorder_free(kpdecode_reorder* reorder) {
+  for (uint32_t i = 0; i < KPERFDATA_REORDER_RUN_COUNT; ++i) {
+    free(reorder->runs[i].entries);
+  }
+  free(reorder);
+}
+
+size_t kpdecode_reorder_count(const kpdecode_reorder* reorder) {
+  return reorder->count;
+}
+
+static const kpdecode_reorder_entry* kpdecode_reorder_first(const kpdecode_reorder* reorder,
+                                                            uint32_t run_index) {
+  const kpdecode_reorder_run* run = &reorder->runs[run_index];
+  return &run->entries[run->head];
+}
+
+static bool kpdecode_reorder_less(const kpdecode_reorder* reorder, uint32_t a, uint32_t b) {
+  const kpdecode_reorder_entry* entry_a = kpdecode_reorder_first(reorder, a);
+  const kpdecode_reorder_entry* entry_b = kpdecode_reorder_first(reorder, b);
+  if (entry_a->timestamp != entry_b->timestamp) {
+    return entry_a->timestamp < entry_b->timestamp;
+  }
+  return entry_a->sequence < entry_b->sequence;
+}
+
+static void kpdecode_reorder_sift_up(kpdecode_reorder* reorder, uint32_t i) {
+  uint32_t* heap = reorder->heap;
+  while (i > 0) {
+    uint32_t parent = (i - 1) / 2;
+    if (!kpdecode_reorder_less(reorder, heap[i], heap[parent])) {
+      break;
+    }
+    uint32_t run_index = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = run_index;
+    i = parent;
+  }
+}
+
+static void kpdecode_reorder_sift_down(kpdecode_reorder* reorder, uint32_t i) {
+  uint32_t* heap = reorder->heap;
+  while (true) {
+    uint32_t smallest = i;
+    uint32_t left = 2 * i + 1;
+    uint32_t right = left + 1;
+    if (left < reorder->heap_size && kpdecode_reorder_less(reorder, heap[left], heap[smallest])) {
+      smallest = left;
+    }
+    if (right < reorder->heap_size && kpdecode_reorder_less(reorder, heap[right], heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == i) {
+      break;
+    }
+    uint32_t run_index = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = run_index;
+    i = smallest;
+  }
+}
+
+long kpdecode_reorder_push(kpdecode_reorder* reorder, kpdecode_record_slot slot,
+                           uint64_t timestamp, uint32_t cpuid) {
+  uint32_t run_index = cpuid < KPERFDATA_MAX_CPUS ? cpuid : KPERFDATA_MAX_CPUS;
+  kpdecode_reorder_run* run = &reorder->runs[run_index];
+  uint32_t capacity = run->entries ? run->mask + 1 : 0;
+  if (run->count == capacity) {
+    uint32_t new_capacity = capacity ? capacity * 2 : KPERFDATA_REORDER_RUN_SIZE;
+    kpdecode_reorder_entry* entries = malloc(sizeof(kpdecode_reorder_entry) * new_capacity);
+    if (!entries) {
+      return KPERFDATA_RET_OOM;
+    }
+    for (uint32_t i = 0; i < run->count; ++i) {
+      entries[i] = run->entries[(run->head + i) & run->mask];
+    }
+    free(run->entries);
+    run->entries = entries;
+    run->head = 0;
+    run->mask = new_capacity - 1;
+  }
+  // a record older than the last one of its cpu, which is rare, is moved back in place
+  uint32_t i = run->count;
+  while (i > 0) {
+    kpdecode_reorder_entry* previous = &run->entries[(run->head + i - 1) & run->mask];
+    if (previous->timestamp <= timestamp) {
+      break;
+    }
+    run->entries[(run->head + i) & run->mask] = *previous;
+    --i;
+  }
+  kpdecode_reorder_entry* entry = &run->entries[(run->head + i) & run->mask];
+  entry->slot = slot;
+  entry->timestamp = timestamp;
+  entry->sequence = reorder->sequence++;
+  run->count += 1;
+  reorder->count += 1;
+  if (timestamp > reorder->newest_timestamp) {
+    reorder->newest_timestamp = timestamp;
+  }
+  if (run->count == 1) {
+    reorder->heap[reorder->heap_size] = run_index;
+    kpdecode_reorder_sift_up(reorder, reorder->heap_size++);
+  } else if (i == 0) {
+    // the first record of the run changed
+    for (uint32_t heap_index = 0; heap_index < reorder->heap_size; ++heap_index) {
+      if (reorder->heap[heap_index] == run_index) {
+        kpdecode_reorder_sift_up(reorder, heap_index);
+        break;
+      }
+    }
+  }
+  return KPERFDATA_RET_OK;
+}
+
+bool kpdecode_reorder_pop(kpdecode_reorder* reorder, bool drain, kpdecode_record_slot* slot) {
+  if (reorder->heap_size == 0) {
+    return false;
+  }
+  uint32_t run_index = reorder->heap[0];
+  const kpdecode_reorder_entry* entry = kpdecode_reorder_first(reorder, run_index);
+  // a record older than the window can no longer be preceded by a record to come
+  bool out_of_window = reorder->newest_timestamp >= reorder->window &&
+                       entry->timestamp <= reorder->newest_timestamp - reorder->window;
+  if (!drain && !out_of_window && reorder->count <= KPERFDATA_REORDER_MAX_RECORDS) {
+    return false;
+  }
+  *slot = entry->slot;
+
+  kpdecode_reorder_run* run = &reorder->runs[run_index];
+  run->head = (run->head + 1) & run->mask;
+  run->count -= 1;
+  reorder->count -= 1;
+  if (run->count == 0) {
+    reorder->heap[0] = reorder->heap[--reorder->heap_size];
+  }
+  kpdecode_reorder_sift_down(reorder, 0);
+  return true;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
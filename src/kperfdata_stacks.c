@@ -0,0 +1,204 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcmp
+
+KPERFDATA_START_CPP_NAMESPACE
+
+typedef struct {
+  const unsigned long long* frames;                   // in the frames arena, never moved
+  uint32_t nframes;
+  uint32_t hash;
+} kpdecode_stack;
+
+// A chunk of the frames arena
+typedef struct kpdecode_stack_chunk {
+  struct kpdecode_stack_chunk* next;
+  size_t used;                                        // frames
+  unsigned long long frames[KPERFDATA_STACK_CHUNK_FRAMES];
+} kpdecode_stack_chunk;
+
+// The unique stacks by ID - 1, hashed by an open addressing table with linear probing, at most
+// half full. The slots hold a stack ID, 0 for empty.
+struct kpdecode_stack_table {
+  kpdecode_stack* stacks;
+  uint32_t count;
+  uint32_t capacity;
+  uint32_t* slots;
+  uint32_t mask;                                      // the number of slots - 1, a power of two
+  kpdecode_stack_chunk* chunks;                       // the current chunk first
+  uint32_t max_stacks;                                // 0 for no limit
+};
+
+static uint32_t kpdecode_stack_hash(const unsigned long long* frames, uint32_t nframes) {
+  uint64_t hash = nframes;
+  for (uint32_t i = 0; i < nframes; ++i) {
+    hash = (hash ^ frames[i]) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 29;
+  }
+  return (uint32_t)(hash >> 32);
+}
+
+kpdecode_stack_table* kpdecode_stack_table_create(void) {
+  kpdecode_stack_table* table = calloc(1, sizeof(kpdecode_stack_table));
+  if (!table) {
+    return NULL;
+  }
+  table->slots = calloc(1024, sizeof(uint32_t));
+  if (!table->slots) {
+    free(table);
+    return NULL;
+  }
+  table->mask = 1024 - 1;
+  return table;
+}
+
+void kpdecode_stack_table_free(kpdecode_stack_table* table) {
+  if (!table) {
+    return;
+  }
+  while (table->chunks) {
+    kpdecode_stack_chunk* next = table->chunks->next;
+    free(table->chunks);
+    table->chunks = next;
+  }
+  free(table->stacks);
+  free(table->slots);
+  free(table);
+}
+
+static long kpdecode_stack_table_grow(kpdecode_stack_table* table) {
+  uint32_t slot_count = 2 * (table->mask + 1);
+  uint32_t* slots = calloc(slot_count, sizeof(uint32_t));
+  if (!slots) {
+    return KPERFDATA_RET_OOM;
+  }
+  for (uint32_t id = 1; id <= table->count; ++id) {
+    uint32_t slot = table->stacks[id - 1].hash & (slot_count - 1);
+    while (slots[slot] != 0) {
+      slot = (slot + 1) & (slot_count - 1);
+    }
+    slots[slot] = id;
+  }
+  free(table->slots);
+  table->slots = slots;
+  table->mask = slot_count - 1;
+  return KPERFDATA_RET_OK;
+}
+
+// Copy the frames of a new stack into the arena
+static const unsigned long long* kpdecode_stack_table_store(kpdecode_stack_table* table,
+                                                            const unsigned long long* frames,
+                                                            uint32_t nframes) {
+  kpdecode_stack_chunk* chunk = table->chunks;
+  if (!chunk || KPERFDATA_STACK_CHUNK_FRAMES - chunk->used < nframes) {
+    chunk = malloc(sizeof(kpdecode_stack_chunk));
+    if (!chunk) {
+      return NULL;
+    }
+    chunk->next = table->chunks;
+    chunk->used = 0;
+    table->chunks = chunk;
+  }
+  unsigned long long* stored = chunk->frames + chunk->used;
+  memcpy(stored, frames, sizeof(unsigned long long) * nframes);
+  chunk->used += nframes;
+  return stored;
+}
+
+long kpdecode_stack_table_intern(kpdecode_stack_table* table, const unsigned long long* frames,
+                                 uint32_t nframes, uint32_t* stack_id) {
+  *stack_id = 0;
+  if (nframes == 0) {
+    return KPERFDATA_RET_OK;
+  }
+  if (nframes > KPERFDATA_STACK_CHUNK_FRAMES) {
+    return KPERFDATA_RET_FAIL;
+  }
+  uint32_t hash = kpdecode_stack_hash(frames, nframes);
+  uint32_t slot = hash & table->mask;
+  for (uint32_t id; (id = table->slots[slot]) != 0; slot = (slot + 1) & table->mask) {
+    const kpdecode_stack* stack = &table->stacks[id - 1];
+    if (stack->hash == hash && stack->nframes == nframes &&
+        memcmp(stack->frames, frames, sizeof(unsigned long long) * nframes) == 0) {
+      *stack_id = id;
+      return KPERFDATA_RET_OK;
+    }
+  }
+
+  if (table->count == UINT32_MAX - 1) {
+    return KPERFDATA_RET_FAIL;
+  }
+  if (table->max_stacks != 0 && table->count >= table->max_stacks) {
+    return KPERFDATA_RET_OOM;
+  }
+  if ((uint64_t)table->count + 2 > (uint64_t)table->mask + 1) {
+    return KPERFDATA_RET_OOM;  // the slots could not grow, the last empty one ends the probes
+  }
+  if (table->count == table->capacity) {
+    uint32_t capacity = table->capacity ? 2 * table->capacity : 256;
+    kpdecode_stack* stacks = realloc(table->stacks, sizeof(kpdecode_stack) * capacity);
+    if (!stacks) {
+      return KPERFDATA_RET_OOM;
+    }
+    table->stacks = stacks;
+    table->capacity = capacity;
+  }
+  const unsigned long long* stored = kpdecode_stack_table_store(table, frames, nframes);
+  if (!stored) {
+    return KPERFDATA_RET_OOM;
+  }
+  kpdecode_stack* stack = &table->stacks[table->count++];
+  stack->frames = stored;
+  stack->nframes = nframes;
+  stack->hash = hash;
+  table->slots[slot] = table->count;
+  *stack_id = table->count;
+  if (2 * (uint64_t)table->count > table->mask + 1) {
+    kpdecode_stack_table_grow(table);  // on OOM, retried by the next new stack
+  }
+  return KPERFDATA_RET_OK;
+}
+
+long kpdecode_stack_table_get(const kpdecode_stack_table* table, uint32_t stack_id,
+                              const unsigned long long** frames, uint32_t* nframes) {
+  if (stack_id == 0) {
+    *frames = NULL;
+    *nframes = 0;
+    return KPERFDATA_RET_OK;
+  }
+  if (stack_id > table->count) {
+    return KPERFDATA_RET_FAIL;
+  }
+  *frames = table->stacks[stack_id - 1].frames;
+  *nframes = table->stacks[stack_id - 1].nframes;
+  return KPERFDATA_RET_OK;
+}
+
+uint32_t kpdecode_stack_table_count(const kpdecode_stack_table* table) {
+  return table->count;
+}
+
+void kpdecode_stack_table_set_max_stacks(kpdecode_stack_table* table, uint32_t max_stacks) {
+  table->max_stacks = max_stacks;
+}
+
+kpdecode_stack_table* kpdecode_cursor_get_stack_table(kpdecode_cursor* cursor) {
+  return cursor->stacks;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
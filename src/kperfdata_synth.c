@@ -0,0 +1,312 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata_synth.h"
+
+#include <stdbool.h>  // bool
+#include <stdio.h>  // fopen, snprintf
+#include <stdlib.h>  // calloc
+#include <string.h>  // memset, strncpy
+
+KPERFDATA_START_CPP_NAMESPACE
+
+#define KPERFDATA_SYNTH_BLOCK_KD_BUFS 4096
+#define KPERFDATA_SYNTH_FIRST_TID 0x100000
+#define KPERFDATA_SYNTH_FIRST_PID 100
+#define KPERFDATA_SYNTH_THREADS_PRE_PROCESS 4
+
+// the kevents of the synthetic trace
+#define KPERFDATA_SYNTH_SCHED_EVENT KPERFDATA_DEBUGID(1, 0x40, 0, 0)  // MACH_SCHED
+#define KPERFDATA_SYNTH_PERF_EVENT KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 1, 1, 0)  // PERF_TI_DATA
+
+typedef struct {
+  uint64_t timestamp;
+  uint64_t tid;                                       // the thread being sampled
+  uint32_t sample_kevents;                            // the kperf kevents left, UINT32_MAX: idle
+  uint32_t callstack_kevent;                          // the next kevent of the callstacks
+} kpdecode_synth_cpu;
+
+struct kpdecode_synth {
+  kpdecode_synth_options options;
+  size_t header_size;
+  size_t size_of_kd_buf;
+  uint64_t kd_buf_index;                              // the next kd_buf to write
+  uint64_t rng;
+  uint32_t sample_start_ppm;                          // the odds to start a sample on an idle cpu
+  uint32_t callstack_kevents;                         // the kevents of the callstacks of a sample
+  kpdecode_synth_cpu cpus[KPERFDATA_MAX_CPUS];
+};
+
+void kpdecode_synth_default_options(kpdecode_synth_options* options) {
+  memset(options, 0, sizeof(kpdecode_synth_options));
+  options->version = 2;
+  options->is64bit = 1;
+  options->thread_count = 256;
+  options->cpu_count = 8;
+  options->kd_buf_count = 1024 * 1024;
+  options->sample_percent = 50;
+  options->sample_kevents = 6;
+  options->seed = 1;
+}
+
+// xorshift64*
+static uint64_t kpdecode_synth_random(kpdecode_synth* synth) {
+  synth->rng ^= synth->rng >> 12;
+  synth->rng ^= synth->rng << 25;
+  synth->rng ^= synth->rng >> 27;
+  return synth->rng * 0x2545f4914f6cdd1dULL;
+}
+
+kpdecode_synth* kpdecode_synth_create(const kpdecode_synth_options* options) {
+  if ((options->version != 1 && options->version != 2) || options->thread_count == 0 ||
+      options->thread_count > INT32_MAX || options->cpu_count == 0 ||
+      options->cpu_count > KPERFDATA_MAX_CPUS || options->sample_percent > 100) {
+    return NULL;
+  }
+  kpdecode_synth* synth = calloc(1, sizeof(kpdecode_synth));
+  if (!synth) {
+    return NULL;
+  }
+  synth->options = *options;
+  bool is64bit = options->version == 1 || options->is64bit;
+  synth->options.is64bit = is64bit;
+  size_t raw_header_size =
+      options->version == 1 ? KPERFDATA_SIZEOF_RAW_HEADER_V1 : KPERFDATA_SIZEOF_RAW_HEADER_V2;
+  size_t size_of_kd_threadmap = is64bit ? sizeof(kd_threadmap_64) : sizeof(kd_threadmap_32);
+  synth->header_size =
+      KPERFDATA_PAGE_ALIGN(raw_header_size + size_of_kd_threadmap * options->thread_count);
+  synth->size_of_kd_buf = is64bit ? sizeof(kd_buf_64) : sizeof(kd_buf_32);
+  synth->rng = options->seed * 0x9e3779b97f4a7c15ULL + 1;
+
+  // a header and a data kevent per 4 frames, for the kernel and the user callstacks
+  if (options->callstack_frames != 0) {
+    synth->callstack_kevents = 2 * (1 + (options->callstack_frames + 3) / 4);
+  }
+
+  // a sample is k = callstack_kevents + sample_kevents + 2 kevents, so that about sample_percent
+  // of the kevents are part of one: p * k / (p * k + 1 - p) = sample_percent / 100
+  double f = options->sample_percent / 100.0;
+  double k = synth->callstack_kevents + options->sample_kevents + 2.0;
+  synth->sample_start_ppm = (uint32_t)(1000000.0 * f / (k * (1.0 - f) + f));
+  for (uint32_t cpuid = 0; cpuid < options->cpu_count; ++cpuid) {
+    synth->cpus[cpuid].timestamp = 1000000000ULL + cpuid;
+    synth->cpus[cpuid].sample_kevents = UINT32_MAX;
+  }
+  return synth;
+}
+
+void kpdecode_synth_free(kpdecode_synth* synth) {
+  free(synth);
+}
+
+size_t kpdecode_synth_header_size(const kpdecode_synth* synth) {
+  return synth->header_size;
+}
+
+uint64_t kpdecode_synth_file_size(const kpdecode_synth* synth) {
+  return synth->header_size + synth->size_of_kd_buf * synth->options.kd_buf_count;
+}
+
+static uint64_t kpdecode_synth_tid(uint32_t i) {
+  return KPERFDATA_SYNTH_FIRST_TID + i;
+}
+
+static int kpdecode_synth_pid(uint32_t i) {
+  return KPERFDATA_SYNTH_FIRST_PID + i / KPERFDATA_SYNTH_THREADS_PRE_PROCESS;
+}
+
+void kpdecode_synth_write_header(const kpdecode_synth* synth, char* buffer) {
+  const kpdecode_synth_options* options = &synth->options;
+  memset(buffer, 0, synth->header_size);
+  char* threadmap;
+  if (options->version == 1) {
+    RAW_header_v1* header = (RAW_header_v1*)buffer;
+    header->version_no = KPERFDATA_RAW_VERSION1;
+    header->thread_count = (int)options->thread_count;
+    threadmap = buffer + KPERFDATA_SIZEOF_RAW_HEADER_V1;
+  } else {
+    RAW_header_v2* header = (RAW_header_v2*)buffer;
+    header->version_no = KPERFDATA_RAW_VERSION2;
+    header->thread_count = (int)options->thread_count;
+    header->flags = options->is64bit ? KPERFDATA_IS_64BIT : 0;
+    header->frequency = 24000000;
+    threadmap = buffer + KPERFDATA_SIZEOF_RAW_HEADER_V2;
+  }
+  for (uint32_t i = 0; i < options->thread_count; ++i) {
+    char command[24];
+    snprintf(command, sizeof(command), "synth%u",
+             (unsigned)(i / KPERFDATA_SYNTH_THREADS_PRE_PROCESS));
+    if (options->is64bit) {
+      kd_threadmap_64* entry = (kd_threadmap_64*)threadmap + i;
+      entry->thread = kpdecode_synth_tid(i);
+      entry->valid = kpdecode_synth_pid(i);
+      strncpy(entry->command, command, sizeof(entry->command));  // padded with NUL
+    } else {
+      kd_threadmap_32* entry = (kd_threadmap_32*)threadmap + i;
+      entry->thread = (uint32_t)kpdecode_synth_tid(i);
+      entry->valid = kpdecode_synth_pid(i);
+      strncpy(entry->command, command, sizeof(entry->command));  // padded with NUL
+    }
+  }
+}
+
+// The next kevent of the callstacks of the sample, the kernel one then the user one
+static void kpdecode_synth_callstack(const kpdecode_synth* synth, kpdecode_synth_cpu* cpu,
+                                     kd_buf_64* kevent) {
+  uint32_t nframes = synth->options.callstack_frames;
+  uint32_t half = synth->callstack_kevents / 2;
+  bool user = cpu->callstack_kevent >= half;
+  uint32_t index = cpu->callstack_kevent - (user ? half : 0);
+  kevent->arg5 = cpu->tid;
+  if (index == 0) {
+    kevent->debugid = user ? KPERFDATA_PERF_CS_UHDR : KPERFDATA_PERF_CS_KHDR;
+    kevent->arg1 = 0x1;  // CALLSTACK_VALID
+    kevent->arg2 = nframes;
+  } else {
+    kevent->debugid = user ? KPERFDATA_PERF_CS_UDATA : KPERFDATA_PERF_CS_KDATA;
+    uint64_t frames[4] = {0, 0, 0, 0};  // the last kevent is padded with zeros
+    for (uint32_t i = 0; i < 4 && (index - 1) * 4 + i < nframes; ++i) {
+      uint32_t frame = (index - 1) * 4 + i;
+      frames[i] = user ? KPERFDATA_SYNTH_USER_FRAME(cpu->tid, frame)
+                       : KPERFDATA_SYNTH_KERNEL_FRAME(cpu->tid, frame);
+    }
+    kevent->arg1 = frames[0];
+    kevent->arg2 = frames[1];
+    kevent->arg3 = frames[2];
+    kevent->arg4 = frames[3];
+  }
+  cpu->callstack_kevent += 1;
+}
+
+// Step a random cpu by one kevent
+static void kpdecode_synth_next(kpdecode_synth* synth, kd_buf_64* kevent) {
+  const kpdecode_synth_options* options = &synth->options;
+  uint64_t random = kpdecode_synth_random(synth);
+  uint32_t cpuid = (uint32_t)(random % options->cpu_count);
+  kpdecode_synth_cpu* cpu = &synth->cpus[cpuid];
+  cpu->timestamp += 1 + ((random >> 16) & 0x3ff);
+
+  memset(kevent, 0, sizeof(kd_buf_64));
+  kevent->timestamp = cpu->timestamp;
+  kevent->cpuid = cpuid;
+  uint64_t tid = kpdecode_synth_tid((uint32_t)((random >> 32) % options->thread_count));
+  if (cpu->sample_kevents == UINT32_MAX) {
+    if ((uint32_t)((random >> 26) % 1000000) < synth->sample_start_ppm) {
+      kevent->debugid = KPERFDATA_PERF_GEN_EVENT_START;
+      kevent->arg1 = 0x2;  // sample_what
+      kevent->arg2 = 1;  // actionid
+      kevent->arg5 = tid;
+      cpu->tid = tid;
+      cpu->sample_kevents = options->sample_kevents;
+      cpu->callstack_kevent = 0;
+    } else {
+      kevent->debugid = KPERFDATA_SYNTH_SCHED_EVENT;
+      kevent->arg1 = tid;
+      kevent->arg5 = tid;
+    }
+  } else if (cpu->callstack_kevent < synth->callstack_kevents) {
+    kpdecode_synth_callstack(synth, cpu, kevent);
+  } else if (cpu->sample_kevents == 0) {
+    kevent->debugid = KPERFDATA_PERF_GEN_EVENT_END;
+    kevent->arg1 = 0x2;
+    kevent->arg5 = cpu->tid;
+    cpu->sample_kevents = UINT32_MAX;
+  } else {
+    kevent->debugid = KPERFDATA_SYNTH_PERF_EVENT;
+    kevent->arg1 = cpu->sample_kevents;
+    kevent->arg2 = random;
+    kevent->arg5 = cpu->tid;
+    cpu->sample_kevents -= 1;
+  }
+}
+
+size_t kpdecode_synth_write_kd_bufs(kpdecode_synth* synth, char* buffer, size_t max_kd_bufs) {
+  uint64_t left = synth->options.kd_buf_count - synth->kd_buf_index;
+  size_t count = left < max_kd_bufs ? (size_t)left : max_kd_bufs;
+  for (size_t i = 0; i < count; ++i) {
+    kd_buf_64 kevent;
+    kpdecode_synth_next(synth, &kevent);
+    if (synth->options.is64bit) {
+      memcpy(buffer + i * sizeof(kd_buf_64), &kevent, sizeof(kd_buf_64));
+    } else {
+      kd_buf_32 narrow;
+      narrow.timestamp = (kevent.timestamp & KPERFDATA_TIMESTAMP_MASK) |
+                         ((uint64_t)kevent.cpuid << KPERFDATA_CPU_SHIFT);
+      narrow.arg1 = (uint32_t)kevent.arg1;
+      narrow.arg2 = (uint32_t)kevent.arg2;
+      narrow.arg3 = (uint32_t)kevent.arg3;
+      narrow.arg4 = (uint32_t)kevent.arg4;
+      narrow.arg5 = (uint32_t)kevent.arg5;
+      narrow.debugid = kevent.debugid;
+      memcpy(buffer + i * sizeof(kd_buf_32), &narrow, sizeof(kd_buf_32));
+    }
+  }
+  synth->kd_buf_index += count;
+  return count;
+}
+
+char* kpdecode_synth_generate(const kpdecode_synth_options* options, size_t* size) {
+  kpdecode_synth* synth = kpdecode_synth_create(options);
+  if (!synth) {
+    return NULL;
+  }
+  uint64_t file_size = kpdecode_synth_file_size(synth);
+  char* buffer = file_size <= SIZE_MAX ? malloc((size_t)file_size) : NULL;
+  if (buffer) {
+    kpdecode_synth_write_header(synth, buffer);
+    kpdecode_synth_write_kd_bufs(synth, buffer + synth->header_size, options->kd_buf_count);
+    *size = (size_t)file_size;
+  }
+  kpdecode_synth_free(synth);
+  return buffer;
+}
+
+long kpdecode_synth_write_file(const kpdecode_synth_options* options, const char* path) {
+  kpdecode_synth* synth = kpdecode_synth_create(options);
+  if (!synth) {
+    return KPERFDATA_RET_FAIL;
+  }
+  size_t buffer_size = synth->header_size > KPERFDATA_SYNTH_BLOCK_KD_BUFS * sizeof(kd_buf_64)
+                           ? synth->header_size
+                           : KPERFDATA_SYNTH_BLOCK_KD_BUFS * sizeof(kd_buf_64);
+  char* buffer = malloc(buffer_size);
+  FILE* file = buffer ? fopen(path, "wb") : NULL;
+  if (!file) {
+    free(buffer);
+    kpdecode_synth_free(synth);
+    return buffer ? KPERFDATA_RET_FAIL : KPERFDATA_RET_OOM;
+  }
+  long ret = KPERFDATA_RET_OK;
+  kpdecode_synth_write_header(synth, buffer);
+  if (fwrite(buffer, 1, synth->header_size, file) != synth->header_size) {
+    ret = KPERFDATA_RET_FAIL;
+  }
+  while (ret == KPERFDATA_RET_OK) {
+    size_t count = kpdecode_synth_write_kd_bufs(synth, buffer, KPERFDATA_SYNTH_BLOCK_KD_BUFS);
+    if (count == 0) {
+      break;
+    }
+    if (fwrite(buffer, synth->size_of_kd_buf, count, file) != count) {
+      ret = KPERFDATA_RET_FAIL;
+    }
+  }
+  if (fclose(file) != 0) {
+    ret = KPERFDATA_RET_FAIL;
+  }
+  free(buffer);
+  kpdecode_synth_free(synth);
+  return ret;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
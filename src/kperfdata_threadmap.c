@@ -0,0 +1,123 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#include <stdlib.h>  // calloc
+#include <string.h>  // memcpy
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+// An open addressing table with linear probing, at most half full. The slots with pid 0 are empty,
+// as the invalid entries of the kd_threadmap[] are not hashed.
+struct kpdecode_threadmap {
+  kpdecode_thread* slots;
+  uint32_t mask;                                      // the number of slots - 1, a power of two
+  uint32_t valid_count;                               // the slots used, one per thread
+  uint32_t entry_count;                               // the valid entries, duplicates included
+};
+
+// Fibonacci hashing, the thread IDs are mostly sequential
+static uint32_t kpdecode_threadmap_slot(const kpdecode_threadmap* threadmap, uint64_t tid) {
+  return (uint32_t)((tid * 0x9e3779b97f4a7c15ULL) >> 32) & threadmap->mask;
+}
+
+static void kpdecode_threadmap_insert(kpdecode_threadmap* threadmap, uint64_t tid, int pid,
+                                      const char* command) {
+  uint32_t i = kpdecode_threadmap_slot(threadmap, tid);
+  while (threadmap->slots[i].pid != 0 && threadmap->slots[i].tid != tid) {
+    i = (i + 1) & threadmap->mask;
+  }
+  kpdecode_thread* thread = &threadmap->slots[i];
+  if (thread->pid == 0) {
+    threadmap->valid_count += 1;  // not a duplicate of a thread already inserted
+  }
+  thread->tid = tid;
+  thread->pid = pid;
+  memcpy(thread->command, command, sizeof(thread->command));
+  threadmap->entry_count += 1;
+}
+
+kpdecode_threadmap* kpdecode_threadmap_create(const char* threadmap_ptr,
+                                              uint32_t size_of_kd_threadmap,
+                                              uint32_t thread_count) {
+  kpdecode_threadmap* threadmap = calloc(1, sizeof(kpdecode_threadmap));
+  if (!threadmap) {
+    return NULL;
+  }
+  uint32_t slot_count = 16;
+  while (slot_count < 2 * (uint64_t)thread_count && slot_count < 0x80000000u) {
+    slot_count <<= 1;
+  }
+  threadmap->slots = calloc(slot_count, sizeof(kpdecode_thread));
+  if (!threadmap->slots) {
+    free(threadmap);
+    return NULL;
+  }
+  threadmap->mask = slot_count - 1;
+
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    const char* entry = threadmap_ptr + (size_t)i * size_of_kd_threadmap;
+    if (size_of_kd_threadmap == sizeof(kd_threadmap_32)) {
+      const kd_threadmap_32* thread = (const kd_threadmap_32*)entry;
+      if (thread->valid) {
+        kpdecode_threadmap_insert(threadmap, thread->thread, thread->valid, thread->command);
+      }
+    } else {
+      const kd_threadmap_64* thread = (const kd_threadmap_64*)entry;
+      if (thread->valid) {
+        kpdecode_threadmap_insert(threadmap, thread->thread, thread->valid, thread->command);
+      }
+    }
+  }
+  return threadmap;
+}
+
+void kpdecode_threadmap_free(kpdecode_threadmap* threadmap) {
+  if (threadmap) {
+    free(threadmap->slots);
+    free(threadmap);
+  }
+}
+
+uint32_t kpdecode_threadmap_valid_count(const kpdecode_threadmap* threadmap) {
+  return threadmap->valid_count;
+}
+
+uint32_t kpdecode_threadmap_entry_count(const kpdecode_threadmap* threadmap) {
+  return threadmap->entry_count;
+}
+
+const kpdecode_thread* kpdecode_threadmap_lookup(const kpdecode_threadmap* threadmap,
+                                                 uint64_t tid) {
+  uint32_t i = kpdecode_threadmap_slot(threadmap, tid);
+  while (threadmap->slots[i].pid != 0) {
+    if (threadmap->slots[i].tid == tid) {
+      return &threadmap->slots[i];
+    }
+    i = (i + 1) & threadmap->mask;
+  }
+  return NULL;
+}
+
+const kpdecode_thread* kpdecode_cursor_lookup_thread(kpdecode_cursor* cursor, uint64_t tid) {
+  if (cursor->threadmap == NULL) {
+    return NULL;
+  }
+  return kpdecode_threadmap_lookup(cursor->threadmap, tid);
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -0,0 +1,127 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "kperfdata/kperfdata.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define KPERFDATA_WIDEN_X86 1
+#include <emmintrin.h>  // SSE2
+#if defined(__GNUC__) || defined(__clang__)
+#define KPERFDATA_WIDEN_AVX2 1
+#include <immintrin.h>  // AVX2
+#endif
+#endif
+
+#include "kperfdata_internal.h"
+
+KPERFDATA_START_CPP_NAMESPACE
+
+void kpdecode_widen_kd_buf_32_scalar(kd_buf_64* dst, const kd_buf_32* src, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    const kd_buf_32* kd_buf = &src[i];
+    kd_buf_64* kevent = &dst[i];
+    kevent->timestamp = kd_buf->timestamp & KPERFDATA_TIMESTAMP_MASK;
+    kevent->arg1 = (uint64_t)kd_buf->arg1;
+    kevent->arg2 = (uint64_t)kd_buf->arg2;
+    kevent->arg3 = (uint64_t)kd_buf->arg3;
+    kevent->arg4 = (uint64_t)kd_buf->arg4;
+    kevent->arg5 = (uint64_t)kd_buf->arg5;
+    kevent->debugid = kd_buf->debugid;
+    kevent->cpuid = (uint32_t)((kd_buf->timestamp & KPERFDATA_CPU_MASK) >> KPERFDATA_CPU_SHIFT);
+    kevent->unused = 0;
+  }
+}
+
+#if defined(KPERFDATA_WIDEN_X86)
+
+// clang-format off
+// kd_buf_32 (dwords):  | ts.lo | ts.hi | arg1 | arg2 | arg3 | arg4 | arg5 | debugid |
+// kd_buf_64 (dwords):  | ts.lo | ts.hi & 0x00ffffff | arg1 | 0 | arg2 | 0 | arg3 | 0 |
+//                      | arg4 | 0 | arg5 | 0 | debugid | ts.hi >> 24 (cpuid) | 0 | 0 |
+// clang-format on
+
+static void kpdecode_widen_kd_buf_32_sse2(kd_buf_64* dst, const kd_buf_32* src, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i timestamp_mask = _mm_set1_epi64x((long long)KPERFDATA_TIMESTAMP_MASK);
+  for (size_t i = 0; i < count; ++i) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)&src[i]);  // ts, arg1, arg2
+    __m128i hi = _mm_loadu_si128((const __m128i*)&src[i] + 1);  // arg3, arg4, arg5, debugid
+    __m128i arg12 = _mm_unpackhi_epi32(lo, zero);  // arg1, arg2
+    __m128i arg34 = _mm_unpacklo_epi32(hi, zero);  // arg3, arg4
+    __m128i arg5_debugid = _mm_unpackhi_epi32(hi, zero);  // arg5, debugid
+    __m128i cpuid = _mm_srli_epi64(lo, KPERFDATA_CPU_SHIFT);  // cpuid
+    __m128i debugid = _mm_srli_si128(hi, 12);  // debugid
+    __m128i* out = (__m128i*)&dst[i];
+    _mm_storeu_si128(out, _mm_unpacklo_epi64(_mm_and_si128(lo, timestamp_mask), arg12));
+    _mm_storeu_si128(out + 1, _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(arg12),
+                                                              _mm_castsi128_pd(arg34), 1)));
+    _mm_storeu_si128(out + 2, _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(arg34),
+                                                              _mm_castsi128_pd(arg5_debugid), 1)));
+    _mm_storeu_si128(out + 3, _mm_unpacklo_epi32(debugid, cpuid));
+  }
+}
+
+#endif  // KPERFDATA_WIDEN_X86
+
+#if defined(KPERFDATA_WIDEN_AVX2)
+
+__attribute__((target("avx2"))) static void kpdecode_widen_kd_buf_32_avx2(
+    kd_buf_64* dst, const kd_buf_32* src, size_t count) {
+  const __m256i lo_index = _mm256_setr_epi32(0, 1, 2, 0, 3, 0, 4, 0);
+  const __m256i lo_mask = _mm256_setr_epi32(-1, 0x00ffffff, -1, 0, -1, 0, -1, 0);
+  const __m256i hi_index = _mm256_setr_epi32(5, 0, 6, 0, 7, 1, 0, 0);
+  const __m256i hi_shift = _mm256_setr_epi32(0, 0, 0, 0, 0, KPERFDATA_CPU_SHIFT - 32, 0, 0);
+  const __m256i hi_mask = _mm256_setr_epi32(-1, 0, -1, 0, -1, -1, 0, 0);
+  for (size_t i = 0; i < count; ++i) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)&src[i]);
+    __m256i lo = _mm256_and_si256(_mm256_permutevar8x32_epi32(v, lo_index), lo_mask);
+    __m256i hi = _mm256_permutevar8x32_epi32(v, hi_index);
+    hi = _mm256_and_si256(_mm256_srlv_epi32(hi, hi_shift), hi_mask);
+    __m256i* out = (__m256i*)&dst[i];
+    _mm256_storeu_si256(out, lo);
+    _mm256_storeu_si256(out + 1, hi);
+  }
+}
+
+#endif  // KPERFDATA_WIDEN_AVX2
+
+kpdecode_widen_fn kpdecode_widen_kd_buf_32_kernel(int kernel) {
+  switch (kernel) {
+    case KPERFDATA_KERNEL_SCALAR:
+      return kpdecode_widen_kd_buf_32_scalar;
+#if defined(KPERFDATA_WIDEN_X86)
+    case KPERFDATA_KERNEL_SSE2:
+      return kpdecode_widen_kd_buf_32_sse2;  // SSE2 is part of x86-64
+#endif
+#if defined(KPERFDATA_WIDEN_AVX2)
+    case KPERFDATA_KERNEL_AVX2:
+      __builtin_cpu_init();
+      return __builtin_cpu_supports("avx2") ? kpdecode_widen_kd_buf_32_avx2 : NULL;
+#endif
+    default:
+      return NULL;
+  }
+}
+
+kpdecode_widen_fn kpdecode_select_widen_kd_buf_32(void) {
+  for (int kernel = KPERFDATA_KERNEL_AVX2; kernel > KPERFDATA_KERNEL_SCALAR; --kernel) {
+    kpdecode_widen_fn widen = kpdecode_widen_kd_buf_32_kernel(kernel);
+    if (widen != NULL) {
+      return widen;
+    }
+  }
+  return kpdecode_widen_kd_buf_32_scalar;
+}
+
+KPERFDATA_END_CPP_NAMESPACE
@@ -1,10 +1,32 @@
 #include "kperfdata/kperfdata.h"
+#include "kperfdata/kperfdata_parquet.h"
+#include "kperfdata/kperfdata_synth.h"
+#include "../src/kperfdata_internal.h"
 
 #include <gtest/gtest.h>
 
+#if defined(KPERFDATA_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+#include <lz4frame.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
+
 using namespace kperfdata;
 
+#ifndef TEST_DIR
 #define TEST_DIR "../../test/data/"
+#endif
 #define READ_CONTENT_FROM_FILE(filename)                                   \
   do {                                                                     \
     FILE* f = fopen(TEST_DIR filename, "rb");                              \
@@ -69,4 +91,3107 @@ TEST(kperfdata, Decode) {
 
   kpdecode_cursor_clearchunk(cursor);
   kpdecode_cursor_free(cursor);
+  free(buffer);
+}
+
+TEST(kperfdata, SamplesAndThreadmap) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // option 1: each valid threadmap entry is returned once, as a kevent with its thread ID
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  ret = kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(ret, kOk);
+  unsigned long long last_tid = 0;
+  int threadmap_count = 0;
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    if (record->timestamp == 0 && record->kd_buf.debugid == KPERFDATA_DEBUGID(7, 1, 2, 0)) {
+      ASSERT_TRUE(threadmap_count == 0 || record->tid != last_tid);  // not the same entry again
+      last_tid = record->tid;
+      threadmap_count += 1;
+    }
+    kpdecode_record_free(record);
+  }
+  ASSERT_TRUE(threadmap_count > 1);
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+
+  // option 0: the samples are returned once their PERF_GEN_EVENT_END completes them
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 0);
+  ret = kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(ret, kOk);
+  int sample_count = 0;
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    ASSERT_TRUE(record->ready);
+    sample_count += (record->flags & 0x0000000000002000) != 0;
+    kpdecode_record_free(record);
+  }
+  ASSERT_TRUE(sample_count > 0);
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+
+  free(buffer);
+}
+
+TEST(kperfdata, RecordPool) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  kpdecode_record_pool* pool = kpdecode_record_pool_create(0);
+  ASSERT_TRUE(pool != NULL);
+
+  // two cursors share one pool
+  int record_counts[2] = {0, 0};
+  for (int i = 0; i < 2; ++i) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    ret = kpdecode_cursor_set_record_pool(cursor, pool);
+    ASSERT_EQ(ret, kOk);
+
+    kpdecode_cursor_set_option(cursor, 1, 0);
+    ret = kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    ASSERT_EQ(ret, kOk);
+
+    while (true) {
+      kpdecode_record* record = NULL;
+      kpdecode_cursor_next_record(cursor, &record);
+      if (record == NULL) {
+        break;
+      }
+      ASSERT_EQ(record->pool, pool);
+      kpdecode_record_free(record);
+      record_counts[i] += 1;
+    }
+
+    kpdecode_cursor_clearchunk(cursor);
+    kpdecode_cursor_free(cursor);
+  }
+  ASSERT_TRUE(record_counts[0] > 0);
+  ASSERT_EQ(record_counts[0], record_counts[1]);
+
+  ASSERT_TRUE(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_HITS) > 0);
+  ASSERT_TRUE(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_MISSES) > 0);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+
+  kpdecode_record_pool_free(pool);
+  free(buffer);
+}
+
+TEST(kperfdata, SlimRecords) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // decode the full records as the reference
+  std::vector<std::pair<uint64_t, uint64_t>> expected;  // (timestamp, tid)
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 0);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    expected.push_back(std::make_pair(record->timestamp, record->tid));
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 0);
+  ret = kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+  ASSERT_EQ(ret, 0);
+  ret = kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(ret, kOk);
+
+  kpdecode_record* record = NULL;
+  ASSERT_NE(kpdecode_cursor_next_record(cursor, &record), kOk);
+
+  size_t record_count = 0;
+  while (true) {
+    kpdecode_slim_record* slim_record = NULL;
+    kpdecode_cursor_next_slim_record(cursor, &slim_record);
+    if (slim_record == NULL) {
+      break;
+    }
+    ASSERT_TRUE(record_count < expected.size());
+    ASSERT_EQ(slim_record->timestamp, expected[record_count].first);
+    ASSERT_EQ(slim_record->tid, expected[record_count].second);
+    kpdecode_slim_record_free(slim_record);
+    record_count += 1;
+  }
+  ASSERT_EQ(record_count, expected.size());
+
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+  free(buffer);
+}
+
+TEST(kperfdata, StreamingChunks) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // decode the whole buffer as the reference
+  std::vector<std::pair<uint64_t, uint32_t>> expected;  // (timestamp, debugid)
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    expected.push_back(std::make_pair(record->timestamp, record->kd_buf.debugid));
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  // feed the same bytes in chunks of odd sizes, so that the header, the threadmap and the kd_bufs
+  // straddle the chunks
+  const size_t chunk_sizes[] = {3, 100, 4093, 7, 65, 64, 1, 20000, 129};
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+
+  size_t offset = 0;
+  size_t record_count = 0;
+  size_t chunk_count = 0;
+  size_t released_chunk_count = 0;
+  while (true) {
+    if (offset < buffer_size) {
+      size_t chunk_size = chunk_sizes[chunk_count % (sizeof(chunk_sizes) / sizeof(size_t))];
+      if (chunk_size > buffer_size - offset) {
+        chunk_size = buffer_size - offset;
+      }
+      // each chunk is a separate copy, released as soon as it has been decoded
+      char* chunk = (char*)malloc(chunk_size);
+      memcpy(chunk, buffer + offset, chunk_size);
+      ret = kpdecode_cursor_setchunk(cursor, chunk, chunk_size);
+      ASSERT_EQ(ret, kOk);
+      offset += chunk_size;
+      chunk_count += 1;
+    }
+
+    while (true) {
+      kpdecode_record* record = NULL;
+      ret = kpdecode_cursor_next_record(cursor, &record);
+      if (record == NULL) {
+        break;
+      }
+      ASSERT_EQ(ret, kOk);
+      ASSERT_TRUE(record_count < expected.size());
+      ASSERT_EQ(record->timestamp, expected[record_count].first);
+      ASSERT_EQ(record->kd_buf.debugid, expected[record_count].second);
+      kpdecode_record_free(record);
+      record_count += 1;
+    }
+
+    char* consumed_chunk = NULL;
+    while ((consumed_chunk = kpdecode_cursor_popchunk(cursor)) != NULL) {
+      free(consumed_chunk);
+      released_chunk_count += 1;
+    }
+    if (offset == buffer_size && ret == KPERFDATA_RET_NOT_READY) {
+      break;
+    }
+  }
+  ASSERT_EQ(record_count, expected.size());
+  ASSERT_EQ(released_chunk_count, chunk_count);
+
+  kpdecode_cursor_free(cursor);
+  free(buffer);
+}
+
+TEST(kperfdata, OpenFile) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ret = kpdecode_cursor_open_file(cursor, TEST_DIR "not_exists.bin", 0);
+  ASSERT_NE(ret, kOk);
+
+  kpdecode_cursor_set_option(cursor, 1, 0);
+  ret = kpdecode_cursor_open_file(cursor, TEST_DIR "coreprofilesessiontap.bin",
+                                  KPERFDATA_OPEN_FILE_HUGEPAGES);
+  ASSERT_EQ(ret, kOk);
+  ret = kpdecode_cursor_open_file(cursor, TEST_DIR "coreprofilesessiontap.bin", 0);
+  ASSERT_NE(ret, kOk);  // already opened
+  ASSERT_TRUE(kpdecode_cursor_clearchunk(cursor) == NULL);  // the mapping belongs to the cursor
+
+  int record_count = 0;
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    kpdecode_record_free(record);
+    record_count += 1;
+  }
+  ASSERT_TRUE(record_count > 0);
+  ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);  // fully decoded, but not to be freed
+  ASSERT_TRUE(kpdecode_cursor_clearchunk(cursor) == NULL);
+
+  kpdecode_cursor_close_file(cursor);
+  kpdecode_cursor_free(cursor);
+
+  // the buffers read ahead are not returned either
+  for (int flags : {0, KPERFDATA_OPEN_FILE_READ_AHEAD}) {
+    for (bool close_file : {true, false}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      ret = kpdecode_cursor_open_file(cursor, TEST_DIR "coreprofilesessiontap.bin", flags);
+      ASSERT_EQ(ret, kOk);
+      int count = 0;
+      while (true) {
+        kpdecode_record* record = NULL;
+        kpdecode_cursor_next_record(cursor, &record);
+        if (record == NULL) {
+          break;
+        }
+        kpdecode_record_free(record);
+        count += 1;
+        ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);
+      }
+      ASSERT_EQ(count, record_count);
+      ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);
+      if (close_file) {
+        kpdecode_cursor_close_file(cursor);
+      }
+      kpdecode_cursor_free(cursor);  // closes the file otherwise
+    }
+  }
+
+  // the chunks set by the caller are still returned
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ASSERT_EQ(kpdecode_cursor_setchunk(cursor, buffer, buffer_size), kOk);
+  ASSERT_EQ(kpdecode_cursor_clearchunk(cursor), buffer);
+  free(buffer);
+  kpdecode_cursor_free(cursor);
+}
+
+TEST(kperfdata, NextRecords) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // decode one by one as the reference
+  std::vector<uint64_t> expected;  // timestamp
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  while (true) {
+    kpdecode_record* record = NULL;
+    kpdecode_cursor_next_record(cursor, &record);
+    if (record == NULL) {
+      break;
+    }
+    expected.push_back(record->timestamp);
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_clearchunk(cursor);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  for (int slim = 0; slim < 2; ++slim) {
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+
+    size_t record_count = 0;
+    while (true) {
+      constexpr size_t kBatchSize = 100;
+      size_t count = 0;
+      long ret;
+      if (slim) {
+        kpdecode_slim_record* records[kBatchSize];
+        ret = kpdecode_cursor_next_slim_records(cursor, records, kBatchSize, &count);
+        for (size_t i = 0; i < count; ++i) {
+          ASSERT_EQ(records[i]->timestamp, expected[record_count + i]);
+          kpdecode_slim_record_free(records[i]);
+        }
+      } else {
+        kpdecode_record* records[kBatchSize];
+        ret = kpdecode_cursor_next_records(cursor, records, kBatchSize, &count);
+        for (size_t i = 0; i < count; ++i) {
+          ASSERT_EQ(records[i]->timestamp, expected[record_count + i]);
+          kpdecode_record_free(records[i]);
+        }
+      }
+      if (count == 0) {
+        ASSERT_NE(ret, kOk);
+        break;
+      }
+      ASSERT_EQ(ret, kOk);
+      record_count += count;
+    }
+    ASSERT_EQ(record_count, expected.size());
+
+    kpdecode_cursor_clearchunk(cursor);
+    kpdecode_cursor_free(cursor);
+  }
+  free(buffer);
+}
+
+TEST(kperfdata, NextKevents) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // one by one as the reference
+  std::vector<uint32_t> expected;  // debugid
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  const kd_buf* kevent = NULL;
+  while (kpdecode_cursor_next_kevent(cursor, &kevent) == kOk) {
+    expected.push_back(kevent->debugid);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  size_t kevent_count = 0;
+  size_t max_run = 0;
+  while (true) {
+    const kd_buf* kevents = NULL;
+    size_t count = 0;
+    ret = kpdecode_cursor_next_kevents(cursor, &kevents, 4096, &count);
+    if (ret != kOk) {
+      break;
+    }
+    ASSERT_TRUE(count > 0 && count <= 4096);
+    for (size_t i = 0; i < count; ++i) {
+      ASSERT_EQ(kevents[i].debugid, expected[kevent_count + i]);
+    }
+    kevent_count += count;
+    max_run = count > max_run ? count : max_run;
+  }
+  ASSERT_EQ(kevent_count, expected.size());
+  ASSERT_EQ(max_run, 4096u);
+
+  kpdecode_cursor_free(cursor);
+  free(buffer);
+}
+
+TEST(kperfdata, Widen32BitKevents) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // the 64-bit kevents as the reference
+  std::vector<kd_buf_64> expected;
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  const kd_buf* kevent = NULL;
+  while (kpdecode_cursor_next_kevent(cursor, &kevent) == kOk) {
+    expected.push_back(*kevent);
+  }
+  kpdecode_cursor_free(cursor);
+
+  // narrow the 64-bit trace to a 32-bit trace
+  const RAW_header_v2* header64 = (const RAW_header_v2*)buffer;
+  ASSERT_EQ(header64->flags & KPERFDATA_IS_64BIT, (uint32_t)KPERFDATA_IS_64BIT);
+  int thread_count = header64->thread_count;
+  size_t threadmap64_size = KPERFDATA_SIZEOF_RAW_HEADER_V2 + thread_count * sizeof(kd_threadmap_64);
+  size_t kd_buf_count = (buffer_size - KPERFDATA_PAGE_ALIGN(threadmap64_size)) / sizeof(kd_buf_64);
+  size_t threadmap32_size = KPERFDATA_SIZEOF_RAW_HEADER_V2 + thread_count * sizeof(kd_threadmap_32);
+  size_t kd_buf32_offset = KPERFDATA_PAGE_ALIGN(threadmap32_size);
+  std::vector<char> trace(kd_buf32_offset + kd_buf_count * sizeof(kd_buf_32));
+  memcpy(trace.data(), buffer, KPERFDATA_SIZEOF_RAW_HEADER_V2);
+  ((RAW_header_v2*)trace.data())->flags &= ~KPERFDATA_IS_64BIT;
+  const kd_threadmap_64* threadmap64 =
+      (const kd_threadmap_64*)(buffer + KPERFDATA_SIZEOF_RAW_HEADER_V2);
+  kd_threadmap_32* threadmap32 = (kd_threadmap_32*)(trace.data() + KPERFDATA_SIZEOF_RAW_HEADER_V2);
+  for (int i = 0; i < thread_count; ++i) {
+    threadmap32[i].thread = (uint32_t)threadmap64[i].thread;
+    threadmap32[i].valid = threadmap64[i].valid;
+    memcpy(threadmap32[i].command, threadmap64[i].command, sizeof(threadmap32[i].command));
+  }
+  const kd_buf_64* kd_buf64 = (const kd_buf_64*)(buffer + KPERFDATA_PAGE_ALIGN(threadmap64_size));
+  kd_buf_32* kd_buf32 = (kd_buf_32*)(trace.data() + kd_buf32_offset);
+  for (size_t i = 0; i < kd_buf_count; ++i) {
+    kd_buf32[i].timestamp = (kd_buf64[i].timestamp & KPERFDATA_TIMESTAMP_MASK) |
+                            ((uint64_t)kd_buf64[i].cpuid << KPERFDATA_CPU_SHIFT);
+    kd_buf32[i].arg1 = (uint32_t)kd_buf64[i].arg1;
+    kd_buf32[i].arg2 = (uint32_t)kd_buf64[i].arg2;
+    kd_buf32[i].arg3 = (uint32_t)kd_buf64[i].arg3;
+    kd_buf32[i].arg4 = (uint32_t)kd_buf64[i].arg4;
+    kd_buf32[i].arg5 = (uint32_t)kd_buf64[i].arg5;
+    kd_buf32[i].debugid = kd_buf64[i].debugid;
+  }
+
+  // feed the 32-bit trace in chunks of odd sizes, so that the kd_buf_32 straddle the chunks
+  const size_t chunk_sizes[] = {4099, 31, 100000, 33, 65};
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  size_t offset = 0;
+  size_t chunk_count = 0;
+  size_t kevent_count = 0;
+  size_t max_run = 0;
+  while (true) {
+    if (offset < trace.size()) {
+      size_t chunk_size = chunk_sizes[chunk_count % (sizeof(chunk_sizes) / sizeof(size_t))];
+      if (chunk_size > trace.size() - offset) {
+        chunk_size = trace.size() - offset;
+      }
+      ASSERT_EQ(kpdecode_cursor_setchunk(cursor, trace.data() + offset, chunk_size), kOk);
+      offset += chunk_size;
+      chunk_count += 1;
+    }
+    const kd_buf* kevents = NULL;
+    size_t count = 0;
+    long ret;
+    while ((ret = kpdecode_cursor_next_kevents(cursor, &kevents, 1024, &count)) == kOk) {
+      for (size_t i = 0; i < count; ++i) {
+        ASSERT_TRUE(kevent_count < expected.size());
+        const kd_buf_64& want = expected[kevent_count];
+        ASSERT_EQ(kevents[i].timestamp, want.timestamp & KPERFDATA_TIMESTAMP_MASK);
+        ASSERT_EQ(kevents[i].cpuid, want.cpuid);
+        ASSERT_EQ(kevents[i].debugid, want.debugid);
+        if (want.debugid == KPERFDATA_DEBUGID(7, 1, 2, 0)) {
+          // a threadmap entry, the command is not truncated
+          ASSERT_EQ(memcmp(&kevents[i].arg1, &want.arg1, 4 * sizeof(uint64_t)), 0);
+        } else {
+          ASSERT_EQ(kevents[i].arg1, (uint32_t)want.arg1);
+          ASSERT_EQ(kevents[i].arg2, (uint32_t)want.arg2);
+          ASSERT_EQ(kevents[i].arg3, (uint32_t)want.arg3);
+          ASSERT_EQ(kevents[i].arg4, (uint32_t)want.arg4);
+        }
+        ASSERT_EQ(kevents[i].arg5, (uint32_t)want.arg5);
+        kevent_count += 1;
+      }
+      max_run = count > max_run ? count : max_run;
+    }
+    while (kpdecode_cursor_popchunk(cursor) != NULL) {
+    }
+    if (offset == trace.size() && ret == KPERFDATA_RET_NOT_READY) {
+      break;
+    }
+  }
+  ASSERT_EQ(kevent_count, expected.size());
+  ASSERT_EQ(max_run, (size_t)KPERFDATA_WIDEN_BLOCK_SIZE);
+
+  kpdecode_cursor_free(cursor);
+  free(buffer);
+}
+
+// a fixed xorshift64 sequence, the kernel tests do not depend on the fixtures
+static uint64_t NextTestBits(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+TEST(kperfdata, WidenKernels) {
+  kpdecode_widen_fn scalar = kpdecode_widen_kd_buf_32_kernel(KPERFDATA_KERNEL_SCALAR);
+  ASSERT_TRUE(scalar != NULL);
+  ASSERT_TRUE(kpdecode_widen_kd_buf_32_kernel(-1) == NULL);
+
+  // random kd_buf_32, so that the cpuid bits of the timestamps are set, the first one all ones
+  constexpr size_t kMaxCount = 67;
+  uint64_t state = 0x9e3779b97f4a7c15ull;
+  std::vector<char> bytes(1 + kMaxCount * sizeof(kd_buf_32));
+  for (size_t i = 0; i < bytes.size(); ++i) {
+    bytes[i] = (char)NextTestBits(&state);
+  }
+  memset(bytes.data() + 1, 0xff, sizeof(kd_buf_32));
+  const kd_buf_32* src = (const kd_buf_32*)(bytes.data() + 1);  // unaligned, as in a chunk
+
+  for (int kernel = KPERFDATA_KERNEL_SSE2; kernel <= KPERFDATA_KERNEL_AVX2; ++kernel) {
+    kpdecode_widen_fn widen = kpdecode_widen_kd_buf_32_kernel(kernel);
+    if (widen == NULL) {
+      continue;  // not built or not supported by this CPU
+    }
+    for (size_t count = 0; count <= kMaxCount; ++count) {
+      // one more kd_buf_64 than widened, which must be left alone
+      std::vector<kd_buf_64> expected(count + 1);
+      std::vector<kd_buf_64> actual(count + 1);
+      memset(expected.data(), 0xa5, expected.size() * sizeof(kd_buf_64));
+      memset(actual.data(), 0xa5, actual.size() * sizeof(kd_buf_64));
+      scalar(expected.data(), src, count);
+      widen(actual.data(), src, count);
+      ASSERT_EQ(memcmp(expected.data(), actual.data(), actual.size() * sizeof(kd_buf_64)), 0)
+          << "kernel " << kernel << ", count " << count;
+    }
+  }
+
+  // the scalar kernel itself against the layout of kd_buf_32
+  kd_buf_64 kevent;
+  scalar(&kevent, src, 1);
+  ASSERT_EQ(kevent.timestamp, KPERFDATA_TIMESTAMP_MASK);
+  ASSERT_EQ(kevent.cpuid, (uint32_t)(KPERFDATA_CPU_MASK >> KPERFDATA_CPU_SHIFT));
+  ASSERT_EQ(kevent.arg5, (uint64_t)UINT32_MAX);
+  ASSERT_EQ(kevent.debugid, UINT32_MAX);
+  ASSERT_EQ(kevent.unused, 0u);
+}
+
+TEST(kperfdata, ScanKernels) {
+  kpdecode_scan_fn scalar = kpdecode_scan_debugids_kernel(KPERFDATA_KERNEL_SCALAR);
+  ASSERT_TRUE(scalar != NULL);
+  ASSERT_TRUE(kpdecode_scan_debugids_kernel(-1) == NULL);
+
+  // DBG_MACH/DBG_MACH_SCHED and DBG_PERF/PERF_CS
+  const uint32_t masks[] = {0xffff0000, 0xffffff00};
+  const uint32_t values[] = {KPERFDATA_DEBUGID(1, 0x40, 0, 0), KPERFDATA_DEBUGID(37, 10, 0, 0)};
+  const uint32_t matching[] = {KPERFDATA_DEBUGID(1, 0x40, 1, 0), KPERFDATA_DEBUGID(1, 0x40, 9, 2),
+                               KPERFDATA_DEBUGID(37, 10, 0, 1)};
+  const uint32_t other[] = {KPERFDATA_DEBUGID(1, 0x41, 1, 0), KPERFDATA_DEBUGID(37, 11, 0, 0),
+                            KPERFDATA_DEBUGID(7, 1, 2, 0)};
+
+  constexpr size_t kMaxCount = 35;
+  uint64_t state = 0x2545f4914f6cdd1dull;
+  std::vector<std::vector<bool>> patterns;
+  patterns.push_back(std::vector<bool>(kMaxCount, false));  // no match
+  patterns.push_back(std::vector<bool>(kMaxCount, true));   // all match
+  for (size_t p = 0; p < 8; ++p) {
+    std::vector<bool> pattern(kMaxCount);
+    for (size_t i = 0; i < kMaxCount; ++i) {
+      pattern[i] = NextTestBits(&state) % (p + 2) == 0;
+    }
+    patterns.push_back(pattern);
+  }
+  for (size_t i = 0; i < kMaxCount; ++i) {
+    // a single matching or not matching kevent at every position, in the vectors and the tails
+    std::vector<bool> pattern(kMaxCount, false);
+    pattern[i] = true;
+    patterns.push_back(pattern);
+    patterns.push_back(std::vector<bool>(kMaxCount, true));
+    patterns.back()[i] = false;
+  }
+
+  for (int kernel = KPERFDATA_KERNEL_SSE2; kernel <= KPERFDATA_KERNEL_AVX2; ++kernel) {
+    kpdecode_scan_fn scan = kpdecode_scan_debugids_kernel(kernel);
+    if (scan == NULL) {
+      continue;  // not built or not supported by this CPU
+    }
+    for (const std::vector<bool>& pattern : patterns) {
+      std::vector<kd_buf_64> kevents(kMaxCount);
+      for (size_t i = 0; i < kMaxCount; ++i) {
+        memset(&kevents[i], 0, sizeof(kd_buf_64));
+        uint64_t bits = NextTestBits(&state);
+        kevents[i].debugid = pattern[i] ? matching[bits % 3] : other[bits % 3];
+        kevents[i].cpuid = (uint32_t)(bits >> 32);  // next to the debugid, must not be read
+      }
+      for (size_t count = 0; count <= kMaxCount; ++count) {
+        for (int match = 0; match <= 1; ++match) {
+          for (uint32_t filter_count = 0; filter_count <= 2; ++filter_count) {
+            size_t expected = scalar(kevents.data(), count, masks, values, filter_count, match);
+            ASSERT_EQ(scan(kevents.data(), count, masks, values, filter_count, match), expected)
+                << "kernel " << kernel << ", count " << count << ", match " << match
+                << ", filter_count " << filter_count;
+          }
+        }
+      }
+    }
+  }
+
+  // the scalar kernel itself
+  std::vector<kd_buf_64> kevents(5);
+  memset(kevents.data(), 0, kevents.size() * sizeof(kd_buf_64));
+  for (size_t i = 0; i < kevents.size(); ++i) {
+    kevents[i].debugid = other[i % 3];
+  }
+  kevents[3].debugid = matching[0];
+  ASSERT_EQ(scalar(kevents.data(), kevents.size(), masks, values, 2, 1), 3u);
+  ASSERT_EQ(scalar(kevents.data(), kevents.size(), masks, values, 2, 0), 0u);
+  ASSERT_EQ(scalar(kevents.data(), 3, masks, values, 2, 1), 3u);
+}
+
+TEST(kperfdata, DebugidFilter) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // filter the kevents one by one as the reference
+  std::vector<uint32_t> expected;  // debugid
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  const kd_buf* kevent = NULL;
+  size_t total_kevent_count = 0;
+  while (kpdecode_cursor_next_kevent(cursor, &kevent) == kOk) {
+    if ((kevent->debugid & KPERFDATA_DEBUGID_CLASS_MASK) == (KPERFDATA_DBG_PERF << 24) ||
+        kevent->debugid == KPERFDATA_TRACE_LOST_EVENTS) {
+      expected.push_back(kevent->debugid);
+    }
+    total_kevent_count += 1;
+  }
+  long decoded_size = kpdecode_cursor_get_stats(cursor, 0);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0 && expected.size() < total_kevent_count);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ret = kpdecode_cursor_add_debugid_filter(
+      cursor, KPERFDATA_DEBUGID_CLASS_MASK, KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0));
+  ASSERT_EQ(ret, kOk);
+  ret = kpdecode_cursor_add_debugid_filter(cursor, KPERFDATA_DEBUGID_MASK,
+                                           KPERFDATA_TRACE_LOST_EVENTS);
+  ASSERT_EQ(ret, kOk);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  size_t kevent_count = 0;
+  while (true) {
+    const kd_buf* kevents = NULL;
+    size_t count = 0;
+    ret = kpdecode_cursor_next_kevents(cursor, &kevents, 4096, &count);
+    if (ret != kOk) {
+      break;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      ASSERT_TRUE(kevent_count < expected.size());
+      ASSERT_EQ(kevents[i].debugid, expected[kevent_count]);
+      kevent_count += 1;
+    }
+  }
+  ASSERT_EQ(kevent_count, expected.size());
+  // the skipped kevents are still counted as decoded
+  ASSERT_EQ(kpdecode_cursor_get_stats(cursor, 0), decoded_size);
+  kpdecode_cursor_free(cursor);
+
+  // the kperf samples do not depend on the other classes
+  size_t record_count = 0;
+  for (int filtered = 0; filtered < 2; ++filtered) {
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    if (filtered) {
+      for (int i = 0; i < KPERFDATA_MAX_DEBUGID_FILTERS; ++i) {
+        ret = kpdecode_cursor_add_debugid_filter(
+            cursor, KPERFDATA_DEBUGID_CLASS_MASK, KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0));
+        ASSERT_EQ(ret, kOk);
+      }
+      ret = kpdecode_cursor_add_debugid_filter(cursor, KPERFDATA_DEBUGID_MASK, 0);
+      ASSERT_EQ(ret, KPERFDATA_RET_FAIL);
+    }
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    size_t count = 0;
+    kpdecode_record* record = NULL;
+    while (kpdecode_cursor_next_record(cursor, &record) == kOk && record != NULL) {
+      kpdecode_record_free(record);
+      count += 1;
+    }
+    kpdecode_cursor_free(cursor);
+    if (filtered) {
+      ASSERT_EQ(count, record_count);
+    } else {
+      record_count = count;
+    }
+  }
+  ASSERT_TRUE(record_count > 0);
+
+  free(buffer);
+}
+
+struct RecordSummary {
+  uint64_t flags;
+  uint64_t timestamp;
+  uint64_t tid;
+  uint32_t cpuid;
+  uint32_t debugid;
+  uint64_t total_size_of_kevents;
+  uint64_t previous_timestamp;
+  bool operator==(const RecordSummary& other) const {
+    return flags == other.flags && timestamp == other.timestamp && tid == other.tid &&
+           cpuid == other.cpuid && debugid == other.debugid &&
+           total_size_of_kevents == other.total_size_of_kevents &&
+           previous_timestamp == other.previous_timestamp;
+  }
+};
+
+static std::vector<RecordSummary> DecodeRecordSummaries(kpdecode_cursor* cursor) {
+  std::vector<RecordSummary> summaries;
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;  // a sample starts while another one is pending
+    }
+    if (ret != 0 || record == NULL) {
+      break;
+    }
+    summaries.push_back({record->flags, record->timestamp, record->tid, (uint32_t)record->cpuid,
+                         record->kd_buf.debugid, record->total_size_of_kevents,
+                         record->unknown_field20.unknown_field1});
+    kpdecode_record_free(record);
+  }
+  return summaries;
+}
+
+// Fail as on OOM once `*context` kevents have been decoded
+static long FailKevent(kpdecode_cursor*, kpdecode_cpu*, kpdecode_record*, const kd_buf*,
+                       void* context) {
+  return --*static_cast<std::atomic<int>*>(context) == 0 ? KPERFDATA_RET_OOM : 0;
+}
+
+TEST(kperfdata, ParallelDecode) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  for (int option = 0; option < 3; ++option) {
+    // option 2: option 0 with a debugid filter
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, option == 1);
+    if (option == 2) {
+      kpdecode_cursor_add_debugid_filter(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                         KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0));
+    }
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(expected.size() > 0);
+
+    for (int thread_count : {1, 2, 3, 5, 16, 0}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, option == 1);
+      if (option == 2) {
+        kpdecode_cursor_add_debugid_filter(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                           KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0));
+      }
+      kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+      ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, thread_count), kOk);
+      ASSERT_EQ(kpdecode_cursor_popchunk(cursor), buffer);  // the whole chunk is consumed
+      std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+      ASSERT_EQ(records.size(), expected.size()) << "option=" << option
+                                                 << " thread_count=" << thread_count;
+      for (size_t i = 0; i < records.size(); ++i) {
+        ASSERT_TRUE(records[i] == expected[i]) << "option=" << option
+                                               << " thread_count=" << thread_count << " i=" << i;
+      }
+      kpdecode_cursor_free(cursor);
+    }
+  }
+
+  // slim records are not supported
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, 2), KPERFDATA_RET_FAIL);
+  kpdecode_cursor_free(cursor);
+
+  // an OOM of a shard is returned, not taken for a sample starting while another one is pending
+  for (int thread_count : {1, 3}) {
+    std::atomic<int> countdown(100);
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    ASSERT_EQ(kpdecode_cursor_add_kevent_handler(
+                  cursor, KPERFDATA_DEBUGID_SUBCLASS_MASK,
+                  KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, KPERFDATA_PERF_CALLSTACK, 0, 0),
+                  FailKevent, &countdown),
+              kOk);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, thread_count), KPERFDATA_RET_OOM)
+        << "thread_count=" << thread_count;
+    kpdecode_cursor_free(cursor);
+  }
+
+  free(buffer);
+}
+
+TEST(kperfdata, TimeOrdered) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // regroup the kd_bufs by cpu, as the kernel buffers are, so that the records are decoded cpu by
+  // cpu, each cpu in timestamp order
+  const RAW_header_v2* header = (const RAW_header_v2*)buffer;
+  size_t kd_buf_offset = KPERFDATA_PAGE_ALIGN(KPERFDATA_SIZEOF_RAW_HEADER_V2 +
+                                              header->thread_count * sizeof(kd_threadmap_64));
+  std::vector<char> trace(buffer, buffer + buffer_size);
+  kd_buf_64* kd_bufs = (kd_buf_64*)(trace.data() + kd_buf_offset);
+  size_t kd_buf_count = (buffer_size - kd_buf_offset) / sizeof(kd_buf_64);
+  std::stable_sort(kd_bufs, kd_bufs + kd_buf_count, [](const kd_buf_64& a, const kd_buf_64& b) {
+    return a.cpuid < b.cpuid;
+  });
+
+  for (int slim = 0; slim < 2; ++slim) {
+    // the records in decoding order as the reference
+    std::vector<std::pair<uint64_t, uint32_t>> expected;  // (timestamp, debugid)
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_setchunk(cursor, trace.data(), trace.size());
+    kpdecode_record* record = NULL;
+    while (kpdecode_cursor_next_record(cursor, &record) == kOk && record != NULL) {
+      expected.push_back(std::make_pair(record->timestamp, record->kd_buf.debugid));
+      kpdecode_record_free(record);
+    }
+    kpdecode_cursor_free(cursor);
+    ASSERT_FALSE(std::is_sorted(expected.begin(), expected.end(),
+                                [](const std::pair<uint64_t, uint32_t>& a,
+                                   const std::pair<uint64_t, uint32_t>& b) {
+                                  return a.first < b.first;
+                                }));
+    std::vector<std::pair<uint64_t, uint32_t>> sorted = expected;
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<uint64_t, uint32_t>& a,
+                        const std::pair<uint64_t, uint32_t>& b) { return a.first < b.first; });
+
+    // a window covering the whole trace: sorted once finished
+    for (long window : {(long)1 << 62, (long)1000}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, 1);
+      kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+      ASSERT_EQ(kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_REORDER_WINDOW, window), 0);
+      kpdecode_cursor_setchunk(cursor, trace.data(), trace.size());
+      std::vector<std::pair<uint64_t, uint32_t>> records;
+      bool finished = false;
+      while (true) {
+        long ret;
+        if (slim) {
+          kpdecode_slim_record* slim_records[64];
+          size_t count = 0;
+          ret = kpdecode_cursor_next_slim_records(cursor, slim_records, 64, &count);
+          for (size_t i = 0; i < count; ++i) {
+            records.push_back(std::make_pair(slim_records[i]->timestamp, slim_records[i]->debugid));
+            kpdecode_slim_record_free(slim_records[i]);
+          }
+        } else {
+          kpdecode_record* full_record = NULL;
+          ret = kpdecode_cursor_next_record(cursor, &full_record);
+          if (ret == kOk) {
+            records.push_back(std::make_pair(full_record->timestamp, full_record->kd_buf.debugid));
+            kpdecode_record_free(full_record);
+          }
+        }
+        if (ret == KPERFDATA_RET_NOT_READY) {
+          if (finished) {
+            break;
+          }
+          // the chunk is decoded, the buffered records wait for the end of the input
+          kpdecode_cursor_finish(cursor);
+          finished = true;
+        } else {
+          ASSERT_EQ(ret, kOk);
+        }
+      }
+      ASSERT_EQ(records.size(), expected.size());
+      if (window > 1000) {
+        ASSERT_TRUE(records == sorted);
+      } else {
+        std::vector<std::pair<uint64_t, uint32_t>> records_sorted = records;
+        std::stable_sort(records_sorted.begin(), records_sorted.end());
+        std::vector<std::pair<uint64_t, uint32_t>> expected_sorted = expected;
+        std::stable_sort(expected_sorted.begin(), expected_sorted.end());
+        ASSERT_TRUE(records_sorted == expected_sorted);
+      }
+      // the window can be changed once no record is buffered
+      ASSERT_EQ(kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_REORDER_WINDOW, 0), window);
+      kpdecode_cursor_free(cursor);
+    }
+  }
+
+  free(buffer);
+}
+
+TEST(kperfdata, SeekTime) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+  std::string index_path = testing::TempDir() + "coreprofilesessiontap.index";
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_write_index(cursor, index_path.c_str(), 1024), kOk);
+  kpdecode_cursor_free(cursor);
+
+  for (int option = 0; option < 2; ++option) {
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, option);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(expected.size() > 0);
+
+    std::vector<uint64_t> timestamps;
+    for (const RecordSummary& summary : expected) {
+      timestamps.push_back(summary.timestamp);
+    }
+    std::sort(timestamps.begin(), timestamps.end());
+    uint64_t timestamp = timestamps[timestamps.size() / 2];
+    expected.erase(std::remove_if(expected.begin(), expected.end(),
+                                  [timestamp](const RecordSummary& summary) {
+                                    return summary.timestamp < timestamp;
+                                  }),
+                   expected.end());
+
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, option);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    ASSERT_EQ(kpdecode_cursor_seek_time(cursor, index_path.c_str(), timestamp), kOk);
+    std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(records.size() < timestamps.size());  // the beginning is skipped
+    records.erase(std::remove_if(records.begin(), records.end(),
+                                 [timestamp](const RecordSummary& summary) {
+                                   return summary.timestamp < timestamp;
+                                 }),
+                  records.end());
+    ASSERT_EQ(records.size(), expected.size()) << "option=" << option;
+    for (size_t i = 0; i < records.size(); ++i) {
+      ASSERT_TRUE(records[i] == expected[i]) << "option=" << option << " i=" << i;
+    }
+  }
+
+  // the index only matches the debugid filters it has been written with
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_add_debugid_filter(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                     KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, 0, 0));
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_seek_time(cursor, index_path.c_str(), 0), KPERFDATA_RET_FAIL);
+  kpdecode_cursor_free(cursor);
+
+  // nor an index of another version
+  FILE* index_file = fopen(index_path.c_str(), "r+b");
+  ASSERT_TRUE(index_file != NULL);
+  const uint32_t old_version = KPERFDATA_INDEX_VERSION - 1;
+  ASSERT_EQ(fseek(index_file, sizeof(uint32_t), SEEK_SET), 0);  // after the magic
+  ASSERT_EQ(fwrite(&old_version, sizeof(old_version), 1, index_file), 1u);
+  fclose(index_file);
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_seek_time(cursor, index_path.c_str(), 0), KPERFDATA_RET_FAIL);
+  kpdecode_cursor_free(cursor);
+  remove(index_path.c_str());
+
+  free(buffer);
+}
+
+TEST(kperfdata, Threadmap) {
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+  constexpr uint32_t kThreadmapDebugid = KPERFDATA_DEBUGID(7, 1, 2, 0);
+
+  // the kd_threadmap[] replayed as records, as the reference
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  ASSERT_TRUE(kpdecode_cursor_lookup_thread(cursor, 1) == NULL);  // no header yet
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  std::vector<RecordSummary> expected;
+  std::map<uint64_t, std::string> commands;
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != 0 || record == NULL) {
+      break;
+    }
+    if (record->kd_buf.debugid == kThreadmapDebugid) {
+      commands[record->tid] = std::string((const char*)record->kd_buf.args,
+                                          strnlen((const char*)record->kd_buf.args, 20));
+    } else {
+      expected.push_back({record->flags, record->timestamp, record->tid, (uint32_t)record->cpuid,
+                          record->kd_buf.debugid, record->total_size_of_kevents,
+                          record->unknown_field20.unknown_field1});
+    }
+    kpdecode_record_free(record);
+  }
+  ASSERT_TRUE(commands.size() > 0);
+  for (const auto& command : commands) {
+    const kpdecode_thread* thread = kpdecode_cursor_lookup_thread(cursor, command.first);
+    ASSERT_TRUE(thread != NULL) << command.first;
+    ASSERT_EQ(thread->tid, command.first);
+    ASSERT_NE(thread->pid, 0);
+    ASSERT_EQ(std::string(thread->command, strnlen(thread->command, 20)), command.second);
+  }
+  ASSERT_TRUE(kpdecode_cursor_lookup_thread(cursor, UINT64_MAX) == NULL);
+  kpdecode_cursor_free(cursor);
+
+  // the same records without the kd_threadmap[], with the task names filled in
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SKIP_THREADMAP, 1);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_TASK_NAMES, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  std::vector<RecordSummary> records;
+  size_t named = 0;
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != 0 || record == NULL) {
+      break;
+    }
+    auto command = commands.find(record->tid);
+    std::string task_name(record->task_info._field1.task_name,
+                          strnlen(record->task_info._field1.task_name, 20));
+    if (command != commands.end()) {
+      ASSERT_EQ(task_name, command->second);
+      named += 1;
+    } else {
+      ASSERT_EQ(task_name, "");
+    }
+    records.push_back({record->flags, record->timestamp, record->tid, (uint32_t)record->cpuid,
+                       record->kd_buf.debugid, record->total_size_of_kevents,
+                       record->unknown_field20.unknown_field1});
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(named > 0);
+  ASSERT_EQ(records.size(), expected.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_TRUE(records[i] == expected[i]) << "i=" << i;
+  }
+
+  free(buffer);
+}
+
+TEST(kperfdata, ThreadmapDuplicates) {
+  // a thread listed twice, the last entry wins and the thread counts once
+  kd_threadmap_64 entries[4];
+  memset(entries, 0, sizeof(entries));
+  entries[0] = {101, 7, "first"};
+  entries[1] = {102, 8, "other"};
+  entries[2] = {103, 0, "invalid"};
+  entries[3] = {101, 9, "second"};
+  kpdecode_threadmap* threadmap =
+      kpdecode_threadmap_create((const char*)entries, sizeof(kd_threadmap_64), 4);
+  ASSERT_TRUE(threadmap != NULL);
+  ASSERT_EQ(kpdecode_threadmap_valid_count(threadmap), 2u);
+  ASSERT_EQ(kpdecode_threadmap_entry_count(threadmap), 3u);
+  const kpdecode_thread* thread = kpdecode_threadmap_lookup(threadmap, 101);
+  ASSERT_TRUE(thread != NULL);
+  ASSERT_EQ(thread->pid, 9);
+  ASSERT_STREQ(thread->command, "second");
+  ASSERT_TRUE(kpdecode_threadmap_lookup(threadmap, 102) != NULL);
+  ASSERT_TRUE(kpdecode_threadmap_lookup(threadmap, 103) == NULL);
+  kpdecode_threadmap_free(threadmap);
+}
+
+TEST(kperfdata, HighCpuIds) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // move the kevents to the cpus 255, 254, ..., as on a machine with 256 cpus
+  const RAW_header_v2* header = (const RAW_header_v2*)buffer;
+  size_t kd_buf_offset = KPERFDATA_PAGE_ALIGN(KPERFDATA_SIZEOF_RAW_HEADER_V2 +
+                                              header->thread_count * sizeof(kd_threadmap_64));
+  std::vector<char> trace(buffer, buffer + buffer_size);
+  kd_buf_64* kd_bufs = (kd_buf_64*)(trace.data() + kd_buf_offset);
+  size_t kd_buf_count = (buffer_size - kd_buf_offset) / sizeof(kd_buf_64);
+  uint32_t max_cpuid = 0;
+  for (size_t i = 0; i < kd_buf_count; ++i) {
+    max_cpuid = std::max(max_cpuid, kd_bufs[i].cpuid);
+    kd_bufs[i].cpuid = KPERFDATA_MAX_CPUS - 1 - kd_bufs[i].cpuid;
+  }
+  ASSERT_TRUE(max_cpuid < 64);
+
+  for (int option = 0; option < 2; ++option) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, option);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SKIP_THREADMAP, 1);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+    // the per-cpu state is sized from the trace
+    ASSERT_GT(cursor->cpu_count, max_cpuid);
+    ASSERT_LE(cursor->cpu_count, 2 * (max_cpuid + 1));
+    ASSERT_EQ((uintptr_t)cursor->cpus % KPERFDATA_CACHE_LINE_SIZE, 0u);
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(expected.size() > 0);
+    for (RecordSummary& summary : expected) {
+      summary.cpuid = KPERFDATA_MAX_CPUS - 1 - summary.cpuid;
+    }
+
+    for (int thread_count : {-1, 4}) {
+      // -1: serial decoding
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, option);
+      kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SKIP_THREADMAP, 1);
+      kpdecode_cursor_setchunk(cursor, trace.data(), trace.size());
+      if (thread_count > 0) {
+        ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, thread_count), kOk);
+      }
+      std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+      ASSERT_EQ(cursor->cpu_count, (uint32_t)KPERFDATA_MAX_CPUS);
+      kpdecode_cursor_free(cursor);
+      ASSERT_EQ(records.size(), expected.size()) << "option=" << option;
+      for (size_t i = 0; i < records.size(); ++i) {
+        ASSERT_TRUE(records[i] == expected[i]) << "option=" << option << " i=" << i;
+      }
+    }
+  }
+
+  free(buffer);
+}
+
+TEST(kperfdata, Columns) {
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  struct Row {
+    uint64_t timestamp, tid, flags;
+    uint32_t cpuid, debugid;
+    uint64_t args[4];
+    std::vector<uint64_t> uframes, kframes;
+    bool operator==(const Row& other) const {
+      return timestamp == other.timestamp && tid == other.tid && flags == other.flags &&
+             cpuid == other.cpuid && debugid == other.debugid &&
+             std::equal(args, args + 4, other.args) && uframes == other.uframes &&
+             kframes == other.kframes;
+    }
+  };
+
+  // the records one at a time, as the reference
+  std::vector<Row> expected;
+  size_t max_nframes = 0;
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != 0 || record == NULL) {
+      break;
+    }
+    Row row = {record->timestamp, record->tid, record->flags, (uint32_t)record->cpuid,
+               record->kd_buf.debugid, {}, {}, {}};
+    std::copy(record->kd_buf.args, record->kd_buf.args + 4, row.args);
+    row.uframes.assign(record->ucallstack.frames,
+                       record->ucallstack.frames + record->ucallstack.nframes);
+    row.kframes.assign(record->kcallstack.frames,
+                       record->kcallstack.frames + record->kcallstack.nframes);
+    max_nframes = std::max({max_nframes, row.uframes.size(), row.kframes.size()});
+    expected.push_back(row);
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  for (int slim = 0; slim < 2; ++slim) {
+    // the records span several blocks, those whose frames do not fit are carried to the next one
+    kpdecode_columns* columns = kpdecode_columns_create(100, max_nframes + 8);
+    ASSERT_TRUE(columns != NULL);
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    std::vector<Row> rows;
+    while (kpdecode_cursor_next_columns(cursor, columns) == 0) {
+      ASSERT_TRUE(columns->count > 0 && columns->count <= columns->capacity);
+      for (size_t i = 0; i < columns->count; ++i) {
+        Row row = {columns->timestamps[i], columns->tids[i], columns->flags[i],
+                   columns->cpuids[i], columns->debugids[i], {}, {}, {}};
+        for (int j = 0; j < 4; ++j) {
+          row.args[j] = columns->args[j][i];
+        }
+        row.uframes.assign(columns->ucallstack_frames + columns->ucallstack_offsets[i],
+                           columns->ucallstack_frames + columns->ucallstack_offsets[i + 1]);
+        row.kframes.assign(columns->kcallstack_frames + columns->kcallstack_offsets[i],
+                           columns->kcallstack_frames + columns->kcallstack_offsets[i + 1]);
+        rows.push_back(row);
+      }
+    }
+    kpdecode_columns_free(columns);
+    kpdecode_cursor_free(cursor);
+    ASSERT_EQ(rows.size(), expected.size()) << "slim=" << slim;
+    for (size_t i = 0; i < rows.size(); ++i) {
+      ASSERT_TRUE(rows[i] == expected[i]) << "slim=" << slim << " i=" << i;
+    }
+  }
+
+  // the records whose frames would never fit are dropped, the next blocks go on
+  ASSERT_TRUE(max_nframes > 1);
+  size_t frames_capacity = max_nframes - 1;
+  std::vector<Row> fitting;
+  for (const Row& row : expected) {
+    if (row.uframes.size() <= frames_capacity && row.kframes.size() <= frames_capacity) {
+      fitting.push_back(row);
+    }
+  }
+  kpdecode_columns* small_columns = kpdecode_columns_create(100, frames_capacity);
+  ASSERT_TRUE(small_columns != NULL);
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  size_t row_count = 0;
+  size_t dropped = 0;
+  long ret;
+  while ((ret = kpdecode_cursor_next_columns(cursor, small_columns)) == 0 ||
+         ret == KPERFDATA_RET_TOO_LARGE) {
+    if (ret == KPERFDATA_RET_TOO_LARGE) {
+      dropped += 1;
+      continue;
+    }
+    for (size_t i = 0; i < small_columns->count; ++i, ++row_count) {
+      ASSERT_TRUE(row_count < fitting.size());
+      ASSERT_EQ(small_columns->timestamps[i], fitting[row_count].timestamp);
+      ASSERT_EQ(small_columns->debugids[i], fitting[row_count].debugid);
+    }
+  }
+  kpdecode_columns_free(small_columns);
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(row_count, fitting.size());
+  ASSERT_EQ(dropped, expected.size() - fitting.size());
+  ASSERT_TRUE(dropped > 0);
+
+  // the raw kevents into the columns of the caller, only the timestamps and the debugids
+  std::vector<std::pair<uint64_t, uint32_t>> expected_kevents;
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  const kd_buf* kevents = NULL;
+  size_t count = 0;
+  while (kpdecode_cursor_next_kevents(cursor, &kevents, SIZE_MAX, &count) == 0) {
+    for (size_t i = 0; i < count; ++i) {
+      expected_kevents.push_back(std::make_pair(kevents[i].timestamp, kevents[i].debugid));
+    }
+  }
+  kpdecode_cursor_free(cursor);
+
+  std::vector<uint64_t> timestamps(1000);
+  std::vector<uint32_t> debugids(1000);
+  kpdecode_columns columns;
+  memset(&columns, 0, sizeof(columns));
+  columns.capacity = timestamps.size();
+  columns.timestamps = timestamps.data();
+  columns.debugids = debugids.data();
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  std::vector<std::pair<uint64_t, uint32_t>> kevent_rows;
+  while (kpdecode_cursor_next_kevent_columns(cursor, &columns) == 0) {
+    for (size_t i = 0; i < columns.count; ++i) {
+      kevent_rows.push_back(std::make_pair(timestamps[i], debugids[i]));
+    }
+  }
+  kpdecode_columns_free(&columns);
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kevent_rows.size(), expected_kevents.size());
+  ASSERT_TRUE(kevent_rows == expected_kevents);
+
+  // the columns of the records, reused for kevents: no flags and no callstacks are left over
+  kpdecode_columns* reused = kpdecode_columns_create(100, 1000);
+  ASSERT_TRUE(reused != NULL);
+  memset(reused->flags, 0xff, sizeof(uint64_t) * reused->capacity);
+  memset(reused->ucallstack_offsets, 0xff, sizeof(uint32_t) * (reused->capacity + 1));
+  memset(reused->kcallstack_offsets, 0xff, sizeof(uint32_t) * (reused->capacity + 1));
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_next_kevent_columns(cursor, reused), 0);
+  ASSERT_EQ(reused->count, reused->capacity);
+  for (size_t i = 0; i < reused->count; ++i) {
+    ASSERT_EQ(reused->flags[i], 0u);
+    ASSERT_EQ(reused->ucallstack_offsets[i + 1], 0u);
+    ASSERT_EQ(reused->kcallstack_offsets[i + 1], 0u);
+  }
+  ASSERT_EQ(reused->ucallstack_offsets[0], 0u);
+  ASSERT_EQ(reused->ucallstack_frame_count, 0u);
+  kpdecode_columns_free(reused);
+  kpdecode_cursor_free(cursor);
+
+  free(buffer);
+}
+
+// A value of the Thrift compact protocol, enough for the FileMetaData and the PageHeader
+struct ThriftValue {
+  int64_t i = 0;
+  std::string s;
+  std::vector<ThriftValue> list;
+  std::map<int16_t, ThriftValue> fields;
+  const ThriftValue& operator[](int16_t id) const {  // 0 for a missing field
+    static const ThriftValue missing;
+    auto it = fields.find(id);
+    return it != fields.end() ? it->second : missing;
+  }
+};
+
+struct ByteReader {
+  const uint8_t* p;
+  const uint8_t* end;
+  bool ok;
+  uint8_t Byte() {
+    if (p == end) {
+      ok = false;
+      return 0;
+    }
+    return *p++;
+  }
+  uint64_t Varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = Byte();
+      value |= (uint64_t)(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        break;
+      }
+    }
+    return value;
+  }
+  int64_t Zigzag() {
+    uint64_t value = Varint();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+  }
+};
+
+// Values packed LSB first, from a byte boundary
+struct BitReader {
+  ByteReader* in;
+  uint32_t byte;
+  int bit_count;
+  uint64_t Get(int width) {
+    uint64_t value = 0;
+    for (int i = 0; i < width; ++i) {
+      if (bit_count == 0) {
+        byte = in->Byte();
+        bit_count = 8;
+      }
+      value |= (uint64_t)(byte & 1) << i;
+      byte >>= 1;
+      bit_count -= 1;
+    }
+    return value;
+  }
+};
+
+static ThriftValue ReadThrift(ByteReader* in, int type);
+
+static ThriftValue ReadThriftStruct(ByteReader* in) {
+  ThriftValue value;
+  int16_t last_field = 0;
+  while (in->ok) {
+    uint8_t header = in->Byte();
+    if (header == 0) {
+      break;  // STOP
+    }
+    int16_t field = header >> 4 ? (int16_t)(last_field + (header >> 4)) : (int16_t)in->Zigzag();
+    value.fields[field] = ReadThrift(in, header & 0xf);
+    last_field = field;
+  }
+  return value;
+}
+
+static ThriftValue ReadThrift(ByteReader* in, int type) {
+  ThriftValue value;
+  switch (type) {
+    case 1:  // BOOLEAN_TRUE
+      value.i = 1;
+      break;
+    case 2:  // BOOLEAN_FALSE
+      break;
+    case 3:  // BYTE
+      value.i = (int8_t)in->Byte();
+      break;
+    case 4:  // I16
+    case 5:  // I32
+    case 6:  // I64
+      value.i = in->Zigzag();
+      break;
+    case 8: {  // BINARY
+      uint64_t size = in->Varint();
+      if (size > (uint64_t)(in->end - in->p)) {
+        in->ok = false;
+        break;
+      }
+      value.s.assign((const char*)in->p, (size_t)size);
+      in->p += size;
+      break;
+    }
+    case 9: {  // LIST
+      uint8_t header = in->Byte();
+      uint64_t size = header >> 4 == 15 ? in->Varint() : header >> 4;
+      for (uint64_t i = 0; i < size && in->ok; ++i) {
+        value.list.push_back(ReadThrift(in, header & 0xf));
+      }
+      break;
+    }
+    case 12:  // STRUCT
+      value = ReadThriftStruct(in);
+      break;
+    default:
+      in->ok = false;
+      break;
+  }
+  return value;
+}
+
+static std::vector<uint64_t> DecodeDeltaBinaryPacked(ByteReader* in) {
+  uint64_t block_size = in->Varint();
+  uint64_t miniblock_count = in->Varint();
+  uint64_t count = in->Varint();
+  uint64_t value = (uint64_t)in->Zigzag();
+  std::vector<uint64_t> values;
+  if (count != 0) {
+    values.push_back(value);
+  }
+  if (miniblock_count == 0 || block_size % miniblock_count != 0) {
+    in->ok = false;
+    return values;
+  }
+  while (values.size() < count && in->ok) {
+    uint64_t min_delta = (uint64_t)in->Zigzag();
+    std::vector<int> widths(miniblock_count);
+    for (uint64_t m = 0; m < miniblock_count; ++m) {
+      widths[m] = in->Byte();
+    }
+    for (uint64_t m = 0; m < miniblock_count && values.size() < count; ++m) {
+      BitReader bits = {in, 0, 0};
+      for (uint64_t i = 0; i < block_size / miniblock_count; ++i) {
+        uint64_t delta = bits.Get(widths[m]) + min_delta;
+        if (values.size() < count) {
+          value += delta;
+          values.push_back(value);
+        }
+      }
+    }
+  }
+  return values;
+}
+
+static std::vector<uint32_t> DecodeHybrid(ByteReader* in, int width, size_t count) {
+  std::vector<uint32_t> values;
+  while (values.size() < count && in->ok) {
+    uint64_t header = in->Varint();
+    if (header & 1) {  // bit-packed groups of 8
+      BitReader bits = {in, 0, 0};
+      for (uint64_t i = 0; i < (header >> 1) * 8; ++i) {
+        uint32_t value = (uint32_t)bits.Get(width);
+        if (values.size() < count) {
+          values.push_back(value);
+        }
+      }
+    } else {  // a run of one value
+      uint32_t value = 0;
+      for (int j = 0; j < (width + 7) / 8; ++j) {
+        value |= (uint32_t)in->Byte() << (8 * j);
+      }
+      values.insert(values.end(), std::min<size_t>(header >> 1, count - values.size()), value);
+    }
+  }
+  return values;
+}
+
+struct ParquetFile {
+  int64_t row_count = 0;
+  std::vector<int64_t> row_group_rows;
+  std::vector<uint64_t> timestamps;                   // of all the row groups
+  std::vector<uint32_t> debugids;
+};
+
+// Read the page header at `offset`, `page` is set to the bytes of the page
+static void ReadParquetPage(const std::vector<char>& bytes, int64_t offset, ThriftValue* header,
+                            ByteReader* page) {
+  ASSERT_TRUE(offset >= 4 && (uint64_t)offset < bytes.size());
+  const uint8_t* data = (const uint8_t*)bytes.data();
+  ByteReader in = {data + offset, data + bytes.size(), true};
+  *header = ReadThriftStruct(&in);
+  ASSERT_TRUE(in.ok);
+  int64_t size = (*header)[3].i;  // compressed_page_size
+  ASSERT_EQ((*header)[2].i, size);  // uncompressed
+  ASSERT_TRUE(size >= 0 && size <= in.end - in.p);
+  *page = {in.p, in.p + size, true};
+}
+
+// Parse the footer, and decode the timestamp (DELTA_BINARY_PACKED) and debugid (RLE_DICTIONARY)
+// columns of every row group
+static void ReadParquetFile(const std::string& path, ParquetFile* file) {
+  FILE* f = fopen(path.c_str(), "rb");
+  ASSERT_TRUE(f != NULL);
+  std::vector<char> bytes;
+  char chunk[4096];
+  size_t size = 0;
+  while ((size = fread(chunk, 1, sizeof(chunk), f)) != 0) {
+    bytes.insert(bytes.end(), chunk, chunk + size);
+  }
+  fclose(f);
+  ASSERT_TRUE(bytes.size() > 12);
+  ASSERT_EQ(memcmp(bytes.data(), "PAR1", 4), 0);
+  ASSERT_EQ(memcmp(bytes.data() + bytes.size() - 4, "PAR1", 4), 0);
+  uint32_t footer_size = 0;
+  memcpy(&footer_size, bytes.data() + bytes.size() - 8, sizeof(footer_size));
+  ASSERT_TRUE(footer_size > 0 && footer_size < bytes.size() - 12);
+
+  const uint8_t* footer = (const uint8_t*)bytes.data() + bytes.size() - 8 - footer_size;
+  ByteReader in = {footer, footer + footer_size, true};
+  ThriftValue meta = ReadThriftStruct(&in);
+  ASSERT_TRUE(in.ok);
+  ASSERT_TRUE(in.p == in.end);
+  file->row_count = meta[3].i;
+  for (const ThriftValue& row_group : meta[4].list) {
+    int64_t rows = row_group[3].i;
+    file->row_group_rows.push_back(rows);
+    const std::vector<ThriftValue>& columns = row_group[1].list;
+    ASSERT_EQ(columns.size(), 11);
+
+    const ThriftValue& timestamp = columns[0][3];  // ColumnMetaData
+    ASSERT_EQ(timestamp[3].list.size(), 1);
+    ASSERT_EQ(timestamp[3].list[0].s, "timestamp");
+    ASSERT_EQ(timestamp[5].i, rows);
+    ThriftValue header;
+    ByteReader page;
+    ReadParquetPage(bytes, timestamp[9].i, &header, &page);
+    ASSERT_EQ(header[1].i, 0);  // DATA_PAGE
+    ASSERT_EQ(header[5][1].i, rows);
+    ASSERT_EQ(header[5][2].i, 5);  // DELTA_BINARY_PACKED
+    std::vector<uint64_t> timestamps = DecodeDeltaBinaryPacked(&page);
+    ASSERT_TRUE(page.ok);
+    ASSERT_EQ(timestamps.size(), rows);
+    file->timestamps.insert(file->timestamps.end(), timestamps.begin(), timestamps.end());
+
+    const ThriftValue& debugid = columns[3][3];
+    ASSERT_EQ(debugid[3].list[0].s, "debugid");
+    ASSERT_EQ(debugid[5].i, rows);
+    ASSERT_NE(debugid[11].i, 0);
+    ReadParquetPage(bytes, debugid[11].i, &header, &page);
+    ASSERT_EQ(header[1].i, 2);  // DICTIONARY_PAGE
+    int64_t dictionary_count = header[7][1].i;
+    ASSERT_EQ(page.end - page.p, dictionary_count * (int64_t)sizeof(uint32_t));
+    std::vector<uint32_t> dictionary(dictionary_count);
+    memcpy(dictionary.data(), page.p, sizeof(uint32_t) * dictionary.size());
+    ReadParquetPage(bytes, debugid[9].i, &header, &page);
+    ASSERT_EQ(header[1].i, 0);
+    ASSERT_EQ(header[5][1].i, rows);
+    ASSERT_EQ(header[5][2].i, 8);  // RLE_DICTIONARY
+    int width = page.Byte();
+    std::vector<uint32_t> indices = DecodeHybrid(&page, width, (size_t)rows);
+    ASSERT_TRUE(page.ok);
+    ASSERT_EQ(indices.size(), rows);
+    for (uint32_t index : indices) {
+      ASSERT_TRUE(index < dictionary.size());
+      file->debugids.push_back(dictionary[index]);
+    }
+  }
+  int64_t row_count = 0;
+  for (int64_t rows : file->row_group_rows) {
+    row_count += rows;
+  }
+  ASSERT_EQ(row_count, file->row_count);
+}
+
+// Check the row groups of the file, and its timestamps and debugids against the records
+static void CheckParquetFile(const std::string& path, size_t row_group_size,
+                             const std::vector<uint64_t>& timestamps,
+                             const std::vector<uint32_t>& debugids) {
+  ParquetFile file;
+  ASSERT_NO_FATAL_FAILURE(ReadParquetFile(path, &file));
+  ASSERT_EQ(file.row_count, timestamps.size());
+  ASSERT_EQ(file.row_group_rows.size(), (timestamps.size() + row_group_size - 1) / row_group_size);
+  for (size_t i = 0; i + 1 < file.row_group_rows.size(); ++i) {
+    ASSERT_EQ(file.row_group_rows[i], row_group_size);
+  }
+  ASSERT_TRUE(file.timestamps == timestamps);
+  ASSERT_TRUE(file.debugids == debugids);
+}
+
+TEST(kperfdata, Parquet) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  std::vector<uint64_t> expected_timestamps;
+  std::vector<uint32_t> expected_debugids;
+  for (const RecordSummary& summary : DecodeRecordSummaries(cursor)) {
+    expected_timestamps.push_back(summary.timestamp);
+    expected_debugids.push_back(summary.debugid);
+  }
+  kpdecode_cursor_free(cursor);
+  size_t expected = expected_timestamps.size();
+  ASSERT_TRUE(expected > 0);
+
+  // several row groups, the last one partial, each encoded while the next one is filled
+  std::string path = testing::TempDir() + "coreprofilesessiontap.parquet";
+  for (size_t row_group_size : {(size_t)1000, (size_t)0}) {
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    uint64_t row_count = 0;
+    ASSERT_EQ(kpdecode_cursor_write_parquet(cursor, path.c_str(), row_group_size, &row_count),
+              kOk);
+    kpdecode_cursor_free(cursor);
+    ASSERT_EQ(row_count, expected) << "row_group_size=" << row_group_size;
+    CheckParquetFile(path, row_group_size ? row_group_size : KPERFDATA_PARQUET_ROW_GROUP_SIZE,
+                     expected_timestamps, expected_debugids);
+  }
+
+  // callstacks of all sizes, from the columns of the caller
+  const size_t kRows = 300;
+  std::vector<uint64_t> timestamps(kRows);
+  std::vector<uint32_t> debugids(kRows);
+  std::vector<uint32_t> offsets(kRows + 1);
+  std::vector<uint64_t> frames;
+  for (size_t i = 0; i < kRows; ++i) {
+    timestamps[i] = i % 7 == 0 ? timestamps[i ? i - 1 : 0] - 3 : 1000 + i * i;
+    debugids[i] = KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF, 0, i % 5, 0);
+    for (size_t j = 0; j < i % 13; ++j) {
+      frames.push_back(0xfffffff000000000ULL + i * 16 + j);
+    }
+    offsets[i + 1] = (uint32_t)frames.size();
+  }
+  kpdecode_columns columns;
+  memset(&columns, 0, sizeof(columns));
+  columns.capacity = kRows;
+  columns.count = kRows;
+  columns.timestamps = timestamps.data();
+  columns.debugids = debugids.data();
+  columns.ucallstack_offsets = offsets.data();
+  columns.ucallstack_frames = frames.data();
+  kpdecode_parquet_writer* writer = kpdecode_parquet_writer_create(path.c_str(), 128);
+  ASSERT_TRUE(writer != NULL);
+  ASSERT_EQ(kpdecode_parquet_writer_write_columns(writer, &columns), kOk);
+  ASSERT_EQ(kpdecode_parquet_writer_write_columns(writer, &columns), kOk);
+  uint64_t row_count = 0;
+  ASSERT_EQ(kpdecode_parquet_writer_close(writer, &row_count), kOk);
+  ASSERT_EQ(row_count, 2 * kRows);
+  std::vector<uint64_t> written_timestamps(timestamps);
+  written_timestamps.insert(written_timestamps.end(), timestamps.begin(), timestamps.end());
+  std::vector<uint32_t> written_debugids(debugids);
+  written_debugids.insert(written_debugids.end(), debugids.begin(), debugids.end());
+  CheckParquetFile(path, 128, written_timestamps, written_debugids);
+
+  ASSERT_TRUE(kpdecode_parquet_writer_create(TEST_DIR "not_exists/out.parquet", 0) == NULL);
+
+  // a corrupt trace, or a failure of the decoding, is not reported as a success
+  std::vector<char> corrupt(buffer, buffer + buffer_size);
+  memset(corrupt.data(), 0x55, sizeof(uint32_t));  // the version of the header
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, corrupt.data(), corrupt.size());
+  ASSERT_NE(kpdecode_cursor_write_parquet(cursor, path.c_str(), 0, NULL), kOk);
+  kpdecode_cursor_free(cursor);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  std::atomic<int> countdown(100);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                               KPERFDATA_DEBUGID(1, 0, 0, 0), FailKevent,
+                                               &countdown),
+            kOk);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  ASSERT_EQ(kpdecode_cursor_write_parquet(cursor, path.c_str(), 0, NULL), KPERFDATA_RET_OOM);
+  kpdecode_cursor_free(cursor);
+
+  remove(path.c_str());
+  free(buffer);
+}
+
+TEST(kperfdata, CompactRecords) {
+  constexpr long kOk = 0;
+  constexpr long kEnd = KPERFDATA_RET_NOT_READY;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  std::string path = testing::TempDir() + "coreprofilesessiontap.kprc";
+  std::vector<kpdecode_record*> expected;
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  kpdecode_compact_writer* writer = kpdecode_compact_writer_create(path.c_str());
+  ASSERT_TRUE(writer != NULL);
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != kOk || record == NULL) {
+      break;
+    }
+    ASSERT_EQ(kpdecode_compact_writer_write_record(writer, record), kOk);
+    expected.push_back(record);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_compact_writer_close(writer), kOk);
+  ASSERT_TRUE(expected.size() > KPERFDATA_COMPACT_BLOCK_RECORDS);  // several blocks
+
+  struct stat filestats;
+  ASSERT_EQ(stat(path.c_str(), &filestats), 0);
+  ASSERT_TRUE((size_t)filestats.st_size < expected.size() * sizeof(kpdecode_record) / 10);
+
+  // the full records
+  kpdecode_compact_reader* reader = kpdecode_compact_reader_open(path.c_str());
+  ASSERT_TRUE(reader != NULL);
+  std::vector<kpdecode_record*> records;
+  kpdecode_record* record = NULL;
+  long ret = kOk;
+  while ((ret = kpdecode_compact_reader_next_record(reader, &record)) == kOk) {
+    records.push_back(record);
+  }
+  ASSERT_EQ(ret, kEnd);
+  kpdecode_compact_reader_close(reader);  // the records outlive the reader
+  ASSERT_EQ(records.size(), expected.size());
+  size_t begin = offsetof(kpdecode_record, pmc_config);
+  size_t pointer = offsetof(kpdecode_record, unknown_field19.unknown_field2);
+  size_t end = offsetof(kpdecode_record, ready);
+  for (size_t i = 0; i < records.size(); ++i) {
+    const kpdecode_record* a = records[i];
+    const kpdecode_record* b = expected[i];
+    ASSERT_EQ(memcmp(a, b, offsetof(kpdecode_record, ucallstack.frames)), 0) << "i=" << i;
+    ASSERT_EQ(memcmp(a->ucallstack.frames, b->ucallstack.frames, 8 * b->ucallstack.nframes), 0);
+    ASSERT_EQ(memcmp(&a->kcallstack, &b->kcallstack, 8 + 8 * b->kcallstack.nframes), 0);
+    ASSERT_EQ(a->pmc_counters.counterc, b->pmc_counters.counterc);
+    ASSERT_EQ(memcmp((const char*)a + begin, (const char*)b + begin, pointer - begin), 0);
+    ASSERT_EQ(memcmp((const char*)a + pointer + 8, (const char*)b + pointer + 8, end - pointer - 8),
+              0);
+    ASSERT_EQ(a->total_size_of_kevents, b->total_size_of_kevents);
+    ASSERT_EQ(a->ready, 1u);
+  }
+  for (kpdecode_record* r : records) {
+    kpdecode_record_free(r);
+  }
+
+  // the slim view
+  reader = kpdecode_compact_reader_open(path.c_str());
+  ASSERT_TRUE(reader != NULL);
+  const kpdecode_slim_record* slim = NULL;
+  size_t count = 0;
+  while ((ret = kpdecode_compact_reader_next_slim_record(reader, &slim)) == kOk) {
+    const kpdecode_record* b = expected[count++];
+    ASSERT_EQ(slim->timestamp, b->timestamp);
+    ASSERT_EQ(slim->tid, b->tid);
+    ASSERT_EQ(slim->debugid, b->kd_buf.debugid);
+    ASSERT_EQ(slim->flags, b->flags);
+    ASSERT_EQ(slim->pid, b->kperf_thread_info.kpthi_pid);
+    ASSERT_EQ(slim->actionid, b->kperf_sample_args.actionid);
+    ASSERT_EQ(slim->last_timestamp, b->unknown_field20.unknown_field1);
+    ASSERT_EQ(slim->ucallstack_nframes, b->ucallstack.nframes);
+  }
+  ASSERT_EQ(ret, kEnd);
+  ASSERT_EQ(count, expected.size());
+  kpdecode_compact_reader_close(reader);
+  for (kpdecode_record* r : expected) {
+    kpdecode_record_free(r);
+  }
+
+  // slim records in, slim records out
+  std::vector<kpdecode_slim_record> expected_slim;
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  writer = kpdecode_compact_writer_create(path.c_str());
+  ASSERT_TRUE(writer != NULL);
+  while (true) {
+    kpdecode_slim_record* record = NULL;
+    ret = kpdecode_cursor_next_slim_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != kOk || record == NULL) {
+      break;
+    }
+    ASSERT_EQ(kpdecode_compact_writer_write_slim_record(writer, record), kOk);
+    expected_slim.push_back(*record);
+    kpdecode_slim_record_free(record);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_compact_writer_close(writer), kOk);
+  reader = kpdecode_compact_reader_open(path.c_str());
+  ASSERT_TRUE(reader != NULL);
+  count = 0;
+  while ((ret = kpdecode_compact_reader_next_slim_record(reader, &slim)) == kOk) {
+    const kpdecode_slim_record& b = expected_slim[count++];
+    ASSERT_EQ(memcmp(slim, &b, offsetof(kpdecode_slim_record, ucallstack_frames)), 0);
+    ASSERT_EQ(slim->pmc_counterc, b.pmc_counterc);
+    ASSERT_EQ(slim->last_timestamp, b.last_timestamp);
+    ASSERT_EQ(slim->total_size_of_kevents, b.total_size_of_kevents);
+  }
+  ASSERT_EQ(ret, kEnd);
+  ASSERT_EQ(count, expected_slim.size());
+  kpdecode_compact_reader_close(reader);
+
+  ASSERT_TRUE(kpdecode_compact_reader_open(TEST_DIR "coreprofilesessiontap.bin") == NULL);
+
+  remove(path.c_str());
+  free(buffer);
+}
+
+TEST(kperfdata, InternStacks) {
+  constexpr long kOk = 0;
+  long ret = 0;
+
+  // equal callstacks share one stack ID and one copy of the frames
+  kpdecode_stack_table* table = kpdecode_stack_table_create();
+  ASSERT_TRUE(table != NULL);
+  std::vector<std::vector<unsigned long long>> stacks;
+  for (unsigned long long i = 0; i < 5000; ++i) {
+    std::vector<unsigned long long> frames;
+    for (unsigned long long j = 0; j <= i % 40; ++j) {
+      frames.push_back(0xfffffe0007000000ULL + i * 0x100 + j);
+    }
+    stacks.push_back(frames);
+  }
+  uint32_t stack_id = 0;
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    ret = kpdecode_stack_table_intern(table, stacks[i].data(), (uint32_t)stacks[i].size(),
+                                      &stack_id);
+    ASSERT_EQ(ret, kOk);
+    ASSERT_EQ(stack_id, i + 1);
+  }
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    std::vector<unsigned long long> frames = stacks[i];
+    ret = kpdecode_stack_table_intern(table, frames.data(), (uint32_t)frames.size(), &stack_id);
+    ASSERT_EQ(ret, kOk);
+    ASSERT_EQ(stack_id, i + 1);
+    const unsigned long long* interned = NULL;
+    uint32_t nframes = 0;
+    ASSERT_EQ(kpdecode_stack_table_get(table, stack_id, &interned, &nframes), kOk);
+    ASSERT_EQ(nframes, frames.size());
+    ASSERT_EQ(memcmp(interned, frames.data(), sizeof(unsigned long long) * nframes), 0);
+  }
+  // a prefix is a different stack
+  ret = kpdecode_stack_table_intern(table, stacks[39].data(), 39, &stack_id);
+  ASSERT_EQ(ret, kOk);
+  ASSERT_EQ(stack_id, stacks.size() + 1);
+  ASSERT_EQ(kpdecode_stack_table_count(table), stacks.size() + 1);
+
+  const unsigned long long* interned = NULL;
+  uint32_t nframes = 1;
+  ASSERT_EQ(kpdecode_stack_table_intern(table, NULL, 0, &stack_id), kOk);
+  ASSERT_EQ(stack_id, 0);
+  ASSERT_EQ(kpdecode_stack_table_get(table, 0, &interned, &nframes), kOk);
+  ASSERT_EQ(nframes, 0);
+  ASSERT_NE(kpdecode_stack_table_get(table, (uint32_t)stacks.size() + 2, &interned, &nframes),
+            kOk);
+  kpdecode_stack_table_free(table);
+
+  // the records of the cursor, full and slim
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+  for (int slim = 0; slim <= 1; ++slim) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    ASSERT_TRUE(kpdecode_cursor_get_stack_table(cursor) == NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+    ASSERT_EQ(kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_INTERN_STACKS, 1), 0);
+    table = kpdecode_cursor_get_stack_table(cursor);
+    ASSERT_TRUE(table != NULL);
+    ASSERT_EQ(kpdecode_cursor_setchunk(cursor, buffer, buffer_size), kOk);
+
+    size_t record_count = 0;
+    while (true) {
+      uint32_t ucallstack_id, kcallstack_id, unframes, knframes;
+      const unsigned long long* uframes;
+      const unsigned long long* kframes;
+      kpdecode_record* record = NULL;
+      kpdecode_slim_record* slim_record = NULL;
+      if (slim) {
+        kpdecode_cursor_next_slim_record(cursor, &slim_record);
+        if (slim_record == NULL) {
+          break;
+        }
+        ucallstack_id = slim_record->ucallstack_id;
+        kcallstack_id = slim_record->kcallstack_id;
+        unframes = slim_record->ucallstack_nframes;
+        knframes = slim_record->kcallstack_nframes;
+        uframes = slim_record->ucallstack_frames;
+        kframes = slim_record->kcallstack_frames;
+      } else {
+        kpdecode_cursor_next_record(cursor, &record);
+        if (record == NULL) {
+          break;
+        }
+        ucallstack_id = record->ucallstack_id;
+        kcallstack_id = record->kcallstack_id;
+        unframes = record->ucallstack.nframes;
+        knframes = record->kcallstack.nframes;
+        uframes = record->ucallstack.frames;
+        kframes = record->kcallstack.frames;
+      }
+      ASSERT_EQ(kpdecode_stack_table_get(table, ucallstack_id, &interned, &nframes), kOk);
+      ASSERT_EQ(nframes, unframes);
+      ASSERT_TRUE(nframes == 0 || memcmp(interned, uframes, sizeof(*interned) * nframes) == 0);
+      ASSERT_EQ(kpdecode_stack_table_get(table, kcallstack_id, &interned, &nframes), kOk);
+      ASSERT_EQ(nframes, knframes);
+      ASSERT_TRUE(nframes == 0 || memcmp(interned, kframes, sizeof(*interned) * nframes) == 0);
+      if (slim) {
+        kpdecode_slim_record_free(slim_record);
+      } else {
+        kpdecode_record_free(record);
+      }
+      record_count += 1;
+    }
+    ASSERT_TRUE(record_count > 0);
+
+    // turning it off keeps the table
+    ASSERT_EQ(kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_INTERN_STACKS, 0), 1);
+    ASSERT_TRUE(kpdecode_cursor_get_stack_table(cursor) == table);
+    kpdecode_cursor_clearchunk(cursor);
+    kpdecode_cursor_free(cursor);
+  }
+
+  // a full table fails the record instead of giving it stack ID 0, the record is kept
+  for (int slim = 0; slim <= 1; ++slim) {
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_INTERN_STACKS, 1);
+    table = kpdecode_cursor_get_stack_table(cursor);
+    kpdecode_stack_table_set_max_stacks(table, 1);
+    ASSERT_EQ(kpdecode_cursor_setchunk(cursor, buffer, buffer_size), kOk);
+    size_t oom_count = 0;
+    size_t record_count = 0;
+    while (true) {
+      uint32_t unframes, knframes, ucallstack_id, kcallstack_id;
+      if (slim) {
+        kpdecode_slim_record* slim_record = NULL;
+        ret = kpdecode_cursor_next_slim_record(cursor, &slim_record);
+        if (ret == kOk) {
+          unframes = slim_record->ucallstack_nframes;
+          knframes = slim_record->kcallstack_nframes;
+          ucallstack_id = slim_record->ucallstack_id;
+          kcallstack_id = slim_record->kcallstack_id;
+          kpdecode_slim_record_free(slim_record);
+        }
+      } else {
+        kpdecode_record* record = NULL;
+        ret = kpdecode_cursor_next_record(cursor, &record);
+        if (ret == kOk) {
+          unframes = record->ucallstack.nframes;
+          knframes = record->kcallstack.nframes;
+          ucallstack_id = record->ucallstack_id;
+          kcallstack_id = record->kcallstack_id;
+          kpdecode_record_free(record);
+        }
+      }
+      if (ret == KPERFDATA_RET_OOM) {
+        oom_count += 1;
+        ASSERT_EQ(kpdecode_stack_table_count(table), oom_count);
+        kpdecode_stack_table_set_max_stacks(table, (uint32_t)oom_count + 1);
+        continue;
+      }
+      if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+        continue;
+      }
+      if (ret != kOk) {
+        break;
+      }
+      ASSERT_EQ(unframes != 0, ucallstack_id != 0) << "slim=" << slim;
+      ASSERT_EQ(knframes != 0, kcallstack_id != 0) << "slim=" << slim;
+      record_count += 1;
+    }
+    ASSERT_TRUE(oom_count > 0) << "slim=" << slim;
+    ASSERT_TRUE(record_count > 0);
+    kpdecode_cursor_clearchunk(cursor);
+    kpdecode_cursor_free(cursor);
+  }
+  free(buffer);
+}
+
+static std::map<uint64_t, uint64_t> AggregateSamples(const kpdecode_aggregate* aggregate,
+                                                     int table) {
+  std::vector<kpdecode_aggregate_entry> entries(kpdecode_aggregate_count(aggregate, table) + 1);
+  size_t count = kpdecode_aggregate_top(aggregate, table, entries.data(), entries.size());
+  std::map<uint64_t, uint64_t> samples;
+  for (size_t i = 0; i < count; ++i) {
+    samples[entries[i].key] = entries[i].samples;
+  }
+  return samples;
+}
+
+typedef std::pair<std::vector<uint64_t>, std::vector<uint64_t>> Callstacks;  // user, kernel
+
+static std::vector<uint64_t> CallstackFrames(const kpdecode_callstack& callstack) {
+  return std::vector<uint64_t>(callstack.frames, callstack.frames + callstack.nframes);
+}
+
+static std::vector<uint64_t> StackTableFrames(const kpdecode_stack_table* table, uint32_t id) {
+  const unsigned long long* frames = NULL;
+  uint32_t nframes = 0;
+  if (id != 0) {
+    kpdecode_stack_table_get(table, id, &frames, &nframes);
+  }
+  return std::vector<uint64_t>(frames, frames + nframes);
+}
+
+TEST(kperfdata, Aggregate) {
+  constexpr long kOk = 0;
+
+  char* buffer = NULL;
+  size_t buffer_size = 0;
+  READ_CONTENT_FROM_FILE("coreprofilesessiontap.bin");
+
+  // count the samples of the records as the reference, with option 0 no record holds them back
+  std::map<uint64_t, uint64_t> expected_threads, expected_cpus;
+  std::map<Callstacks, uint64_t> expected_stacks;
+  uint64_t expected_samples = 0;
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 0);
+  kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != kOk) {
+      break;
+    }
+    ASSERT_TRUE(record->flags & KPERFDATA_RECORD_FLAG_SAMPLE);
+    expected_threads[record->tid] += 1;
+    expected_cpus[record->cpuid] += 1;
+    Callstacks stacks{CallstackFrames(record->ucallstack), CallstackFrames(record->kcallstack)};
+    expected_stacks[stacks] += 1;
+    expected_samples += 1;
+    kpdecode_record_free(record);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected_samples > 0);
+
+  for (int option = 0; option < 2; ++option) {
+    // one thread, several threads, and slim records, which wait for the kevent records of option 1
+    for (int thread_count : {1, 2, 3, 16, 0, -1}) {
+      if (option == 1 && thread_count == -1) {
+        continue;
+      }
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, option);
+      kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, thread_count == -1);
+      kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+      kpdecode_aggregate* aggregate = kpdecode_aggregate_create();
+      ASSERT_TRUE(aggregate != NULL);
+      ASSERT_EQ(
+          kpdecode_cursor_aggregate(cursor, aggregate, thread_count == -1 ? 2 : thread_count), kOk);
+      ASSERT_EQ(AggregateSamples(aggregate, KPERFDATA_AGGREGATE_THREADS), expected_threads)
+          << "option=" << option << " thread_count=" << thread_count;
+      ASSERT_EQ(AggregateSamples(aggregate, KPERFDATA_AGGREGATE_CPUS), expected_cpus);
+      // the same callstacks, under the stack IDs of the aggregate
+      const kpdecode_stack_table* table = kpdecode_aggregate_get_stack_table(aggregate);
+      std::map<Callstacks, uint64_t> stacks;
+      for (const auto& stack : AggregateSamples(aggregate, KPERFDATA_AGGREGATE_STACKS)) {
+        stacks[{StackTableFrames(table, (uint32_t)stack.first),
+                StackTableFrames(table, (uint32_t)(stack.first >> 32))}] += stack.second;
+      }
+      ASSERT_EQ(stacks, expected_stacks) << "option=" << option << " thread_count=" << thread_count;
+
+      // the top entries come first
+      std::vector<kpdecode_aggregate_entry> top(3);
+      size_t count = kpdecode_aggregate_top(aggregate, KPERFDATA_AGGREGATE_THREADS, top.data(),
+                                            top.size());
+      ASSERT_EQ(count, std::min(top.size(), expected_threads.size()));
+      uint64_t max_samples = 0;
+      for (const auto& thread : expected_threads) {
+        max_samples = std::max(max_samples, thread.second);
+      }
+      ASSERT_EQ(top[0].samples, max_samples);
+      for (size_t i = 1; i < count; ++i) {
+        ASSERT_TRUE(top[i - 1].samples >= top[i].samples);
+      }
+      kpdecode_aggregate_free(aggregate);
+      kpdecode_cursor_free(cursor);
+    }
+  }
+
+  // merged aggregates, with callstacks
+  kpdecode_aggregate* aggregates[2] = {kpdecode_aggregate_create(), kpdecode_aggregate_create()};
+  ASSERT_TRUE(aggregates[0] != NULL && aggregates[1] != NULL);
+  for (int i = 0; i < 2; ++i) {
+    kpdecode_slim_record record;
+    memset(&record, 0, sizeof(record));
+    const unsigned long long frames[3][3] = {{1, 2, 3}, {4, 5, 6}, {7, 8, 9}};
+    const unsigned long long counterv[2] = {100, 10};
+    record.flags = KPERFDATA_RECORD_FLAG_SAMPLE;
+    record.pmc_counterc = 2;
+    record.pmc_counterv = counterv;
+    for (int j = 0; j < 3; ++j) {
+      // different callstacks are interned first in each aggregate
+      record.tid = j;
+      record.ucallstack_nframes = 3;
+      record.ucallstack_frames = frames[(i + j) % 3];
+      ASSERT_EQ(kpdecode_aggregate_add_slim_record(aggregates[i], &record), kOk);
+    }
+    record.flags = 0;  // not a sample
+    ASSERT_EQ(kpdecode_aggregate_add_slim_record(aggregates[i], &record), kOk);
+  }
+  ASSERT_EQ(kpdecode_aggregate_merge(aggregates[0], aggregates[1]), kOk);
+  ASSERT_EQ(kpdecode_aggregate_count(aggregates[0], KPERFDATA_AGGREGATE_THREADS), 3);
+  ASSERT_EQ(kpdecode_aggregate_count(aggregates[0], KPERFDATA_AGGREGATE_STACKS), 3);
+  std::vector<kpdecode_aggregate_entry> entries(3);
+  ASSERT_EQ(kpdecode_aggregate_top(aggregates[0], KPERFDATA_AGGREGATE_STACKS, entries.data(), 3),
+            3);
+  const kpdecode_stack_table* stacks = kpdecode_aggregate_get_stack_table(aggregates[0]);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    ASSERT_EQ(entries[i].samples, 2);
+    ASSERT_EQ(entries[i].pmc_counterc, 2);
+    ASSERT_EQ(entries[i].pmc_sums[0], 200);
+    ASSERT_EQ(entries[i].pmc_sums[1], 20);
+    const unsigned long long* frames = NULL;
+    uint32_t nframes = 0;
+    ASSERT_EQ(kpdecode_stack_table_get(stacks, (uint32_t)entries[i].key, &frames, &nframes), kOk);
+    ASSERT_EQ(nframes, 3);
+    ASSERT_EQ(frames[0], 1 + 3 * i);  // same samples, by key
+  }
+  kpdecode_aggregate_free(aggregates[0]);
+  kpdecode_aggregate_free(aggregates[1]);
+
+  // a failure of the decoding is returned instead of an undercount
+  for (int mode = 0; mode < 3; ++mode) {  // 1 thread, 4 threads, slim records
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    if (mode == 2) {
+      kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+    }
+    std::atomic<int> countdown(100);
+    ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                                 KPERFDATA_DEBUGID(1, 0, 0, 0), FailKevent,
+                                                 &countdown),
+              kOk);
+    kpdecode_cursor_setchunk(cursor, buffer, buffer_size);
+    kpdecode_cursor_finish(cursor);
+    kpdecode_aggregate* aggregate = kpdecode_aggregate_create();
+    ASSERT_TRUE(aggregate != NULL);
+    ASSERT_EQ(kpdecode_cursor_aggregate(cursor, aggregate, mode == 1 ? 4 : 1), KPERFDATA_RET_OOM)
+        << "mode=" << mode;
+    kpdecode_aggregate_free(aggregate);
+    kpdecode_cursor_free(cursor);
+  }
+
+  free(buffer);
+}
+
+TEST(kperfdata, SynthTrace) {
+  constexpr long kOk = 0;
+
+  const int versions[][2] = {{2, 1}, {2, 0}, {1, 1}};  // (version, is64bit)
+  for (const auto& version : versions) {
+    kpdecode_synth_options options;
+    kpdecode_synth_default_options(&options);
+    options.version = version[0];
+    options.is64bit = version[1];
+    options.thread_count = 1000;
+    options.kd_buf_count = 100000;
+    options.sample_kevents = 3;
+    size_t size = 0;
+    char* trace = kpdecode_synth_generate(&options, &size);
+    ASSERT_TRUE(trace != NULL);
+    ASSERT_EQ(size, KPERFDATA_PAGE_ALIGN((version[0] == 1 ? KPERFDATA_SIZEOF_RAW_HEADER_V1
+                                                          : KPERFDATA_SIZEOF_RAW_HEADER_V2) +
+                                         (version[1] ? sizeof(kd_threadmap_64)
+                                                     : sizeof(kd_threadmap_32)) *
+                                             options.thread_count) +
+                        (version[1] ? sizeof(kd_buf_64) : sizeof(kd_buf_32)) *
+                            options.kd_buf_count);
+
+    // the same bytes on disk
+    std::string path = testing::TempDir() + "synth.bin";
+    ASSERT_EQ(kpdecode_synth_write_file(&options, path.c_str()), kOk);
+    FILE* file = fopen(path.c_str(), "rb");
+    ASSERT_TRUE(file != NULL);
+    std::vector<char> bytes(size + 1);
+    ASSERT_EQ(fread(bytes.data(), 1, bytes.size(), file), size);
+    fclose(file);
+    remove(path.c_str());
+    ASSERT_EQ(memcmp(bytes.data(), trace, size), 0);
+
+    // the kevents, and one sample record per PERF_GEN_EVENT_START
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SKIP_THREADMAP, 1);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    std::map<uint32_t, uint64_t> last_timestamps;
+    uint64_t kevent_count = 0, start_count = 0;
+    const kd_buf* kevent = NULL;
+    while (kpdecode_cursor_next_kevent(cursor, &kevent) == kOk) {
+      ASSERT_TRUE(kevent->timestamp > last_timestamps[kevent->cpuid]);
+      last_timestamps[kevent->cpuid] = kevent->timestamp;
+      ASSERT_TRUE(kpdecode_cursor_lookup_thread(cursor, kevent->arg5) != NULL);
+      start_count += kevent->debugid == KPERFDATA_PERF_GEN_EVENT_START;
+      kevent_count += 1;
+    }
+    kpdecode_cursor_free(cursor);
+    ASSERT_EQ(kevent_count, options.kd_buf_count);
+    ASSERT_EQ(last_timestamps.size(), options.cpu_count);
+    // about half of the kevents are part of a sample of 5 kevents
+    ASSERT_NEAR((double)start_count * 5 / kevent_count, 0.5, 0.05);
+
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(records.size() <= start_count);
+    ASSERT_TRUE(records.size() + options.cpu_count >= start_count);  // samples cut at the end
+    free(trace);
+  }
+
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.cpu_count = KPERFDATA_MAX_CPUS + 1;
+  ASSERT_TRUE(kpdecode_synth_create(&options) == NULL);
+}
+
+TEST(kperfdata, ReadAhead) {
+  constexpr long kOk = 0;
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ASSERT_NE(kpdecode_cursor_open_file(cursor, TEST_DIR "not_exists.bin",
+                                      KPERFDATA_OPEN_FILE_READ_AHEAD),
+            kOk);
+  kpdecode_cursor_free(cursor);
+
+  // larger than the ring of buffers, and a kd_threadmap[] larger than the ring on the last one
+  const uint32_t thread_counts[][3] = {{2, 1, 256}, {2, 0, 256}, {1, 1, 600000}};
+  for (const auto& trace_options : thread_counts) {
+    kpdecode_synth_options options;
+    kpdecode_synth_default_options(&options);
+    options.version = (int)trace_options[0];
+    options.is64bit = (int)trace_options[1];
+    options.thread_count = trace_options[2];
+    options.kd_buf_count = 600000;
+    std::string path = testing::TempDir() + "read_ahead.bin";
+    ASSERT_EQ(kpdecode_synth_write_file(&options, path.c_str()), kOk);
+    size_t size = 0;
+    char* trace = kpdecode_synth_generate(&options, &size);
+    ASSERT_TRUE(trace != NULL);
+    ASSERT_TRUE(size > KPERFDATA_READ_AHEAD_BUFFERS * KPERFDATA_READ_AHEAD_BUFFER_SIZE);
+
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    kpdecode_cursor_finish(cursor);
+    std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+    kpdecode_cursor_free(cursor);
+    free(trace);
+    ASSERT_TRUE(expected.size() > 0);
+
+    for (int flags : {KPERFDATA_OPEN_FILE_READ_AHEAD,
+                      KPERFDATA_OPEN_FILE_READ_AHEAD | KPERFDATA_OPEN_FILE_NO_IO_URING}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, 1);
+      ASSERT_EQ(kpdecode_cursor_open_file(cursor, path.c_str(), flags), kOk);
+      ASSERT_EQ(kpdecode_cursor_open_file(cursor, path.c_str(), flags), KPERFDATA_RET_FAIL);
+      ASSERT_TRUE(cursor->buffer != NULL);
+      ASSERT_TRUE(cursor->file_map == NULL);
+      std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+      ASSERT_EQ(records.size(), expected.size()) << "flags=" << flags;
+      for (size_t i = 0; i < records.size(); ++i) {
+        ASSERT_TRUE(records[i] == expected[i]) << "flags=" << flags << " i=" << i;
+      }
+      ASSERT_TRUE(cursor->input_finished);
+      kpdecode_cursor_free(cursor);
+
+      // the raw kevents, stopping half way
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      ASSERT_EQ(kpdecode_cursor_open_file(cursor, path.c_str(), flags), kOk);
+      uint64_t kevent_count = 0;
+      const kd_buf* kevents = NULL;
+      size_t count = 0;
+      while (kevent_count < options.kd_buf_count / 2 &&
+             kpdecode_cursor_next_kevents(cursor, &kevents, SIZE_MAX, &count) == kOk) {
+        kevent_count += count;
+      }
+      ASSERT_TRUE(kevent_count >= options.kd_buf_count / 2);
+      kpdecode_cursor_close_file(cursor);
+      ASSERT_TRUE(cursor->source == NULL);
+      ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);  // the buffers were dropped
+      kpdecode_cursor_free(cursor);
+    }
+    remove(path.c_str());
+  }
+}
+
+static void WriteFile(const std::string& path, const std::vector<char>& bytes) {
+  FILE* file = fopen(path.c_str(), "wb");
+  ASSERT_TRUE(file != NULL);
+  ASSERT_EQ(fwrite(bytes.data(), 1, bytes.size(), file), bytes.size());
+  fclose(file);
+}
+
+TEST(kperfdata, CompressedFile) {
+  constexpr long kOk = 0;
+
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.kd_buf_count = 300000;
+  size_t size = 0;
+  char* trace = kpdecode_synth_generate(&options, &size);
+  ASSERT_TRUE(trace != NULL);
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  kpdecode_cursor_finish(cursor);
+  std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  // (name, compressed file)
+  std::vector<std::pair<std::string, std::vector<char>>> files;
+#if defined(KPERFDATA_HAVE_ZSTD) || defined(KPERFDATA_HAVE_LZ4)
+  const size_t part_size = 1024 * 1024;
+#endif
+  std::vector<char> skippable = {0x50, 0x2A, 0x4D, 0x18, 4, 0, 0, 0, 1, 2, 3, 4};
+#if defined(KPERFDATA_HAVE_ZSTD)
+  {
+    // independent frames of known sizes, after skippable frames as written by pzstd
+    std::vector<char> bytes;
+    for (size_t offset = 0; offset < size; offset += part_size) {
+      size_t n = std::min(part_size, size - offset);
+      std::vector<char> frame(ZSTD_compressBound(n));
+      size_t frame_size = ZSTD_compress(frame.data(), frame.size(), trace + offset, n, 1);
+      ASSERT_FALSE(ZSTD_isError(frame_size));
+      bytes.insert(bytes.end(), skippable.begin(), skippable.end());
+      bytes.insert(bytes.end(), frame.data(), frame.data() + frame_size);
+    }
+    files.emplace_back("zstd frames", bytes);
+
+    // a single frame of unknown size, as written by `zstd` from a pipe
+    ZSTD_CCtx* cctx = ZSTD_createCCtx();
+    bytes.assign(ZSTD_compressBound(size), 0);
+    ZSTD_outBuffer out = {bytes.data(), bytes.size(), 0};
+    ZSTD_inBuffer in = {trace, size, 0};
+    ASSERT_FALSE(ZSTD_isError(ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_continue)));
+    ASSERT_EQ(ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_end), 0u);
+    ZSTD_freeCCtx(cctx);
+    ASSERT_EQ(ZSTD_getFrameContentSize(bytes.data(), out.pos), ZSTD_CONTENTSIZE_UNKNOWN);
+    bytes.resize(out.pos);
+    files.emplace_back("zstd stream", bytes);
+  }
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  {
+    LZ4F_preferences_t preferences;
+    memset(&preferences, 0, sizeof(preferences));
+    std::vector<char> bytes;
+    for (size_t offset = 0; offset < size; offset += part_size) {
+      size_t n = std::min(part_size, size - offset);
+      preferences.frameInfo.contentSize = n;
+      preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+      std::vector<char> frame(LZ4F_compressFrameBound(n, &preferences));
+      size_t frame_size =
+          LZ4F_compressFrame(frame.data(), frame.size(), trace + offset, n, &preferences);
+      ASSERT_FALSE(LZ4F_isError(frame_size));
+      bytes.insert(bytes.end(), frame.data(), frame.data() + frame_size);
+    }
+    files.emplace_back("lz4 frames", bytes);
+
+    preferences.frameInfo.contentSize = 0;  // unknown
+    preferences.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+    bytes.assign(LZ4F_compressFrameBound(size, &preferences), 0);
+    size_t frame_size = LZ4F_compressFrame(bytes.data(), bytes.size(), trace, size, &preferences);
+    ASSERT_FALSE(LZ4F_isError(frame_size));
+    bytes.resize(frame_size);
+    files.emplace_back("lz4 stream", bytes);
+  }
+#endif
+  free(trace);
+
+  std::string path = testing::TempDir() + "compressed.bin";
+  for (const auto& file : files) {
+    WriteFile(path, file.second);
+    for (int flags : {0, KPERFDATA_OPEN_FILE_READ_AHEAD}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_set_option(cursor, 1, 1);
+      ASSERT_EQ(kpdecode_cursor_open_file(cursor, path.c_str(), flags), kOk) << file.first;
+      ASSERT_TRUE(cursor->decompressor != NULL);
+      std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+      ASSERT_EQ(records.size(), expected.size()) << file.first;
+      for (size_t i = 0; i < records.size(); ++i) {
+        ASSERT_TRUE(records[i] == expected[i]) << file.first << " i=" << i;
+      }
+      kpdecode_cursor_free(cursor);
+    }
+
+    // truncated
+    std::vector<char> bytes(file.second.begin(), file.second.end() - 100);
+    WriteFile(path, bytes);
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, 1, 1);
+    if (kpdecode_cursor_open_file(cursor, path.c_str(), 0) == kOk) {
+      DecodeRecordSummaries(cursor);
+      ASSERT_FALSE(cursor->input_finished) << file.first;
+    }
+    kpdecode_cursor_free(cursor);
+  }
+
+  // a frame of a format the library was built without, or garbage after a skippable frame
+  std::vector<char> bytes = skippable;
+  bytes.resize(bytes.size() + 4096, 0x55);
+  WriteFile(path, bytes);
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ASSERT_NE(kpdecode_cursor_open_file(cursor, path.c_str(), 0), kOk);
+  ASSERT_TRUE(cursor->decompressor == NULL);
+  kpdecode_cursor_free(cursor);
+  remove(path.c_str());
+}
+
+// The kevents of the cursor as (timestamp, debugid, cpuid, arg1 + ... + arg5)
+static std::vector<std::tuple<uint64_t, uint32_t, uint32_t, uint64_t>> ReadKevents(
+    kpdecode_cursor* cursor) {
+  std::vector<std::tuple<uint64_t, uint32_t, uint32_t, uint64_t>> summaries;
+  const kd_buf* kevents = NULL;
+  size_t count = 0;
+  while (kpdecode_cursor_next_kevents(cursor, &kevents, SIZE_MAX, &count) == 0) {
+    for (size_t i = 0; i < count; ++i) {
+      const kd_buf& kevent = kevents[i];
+      summaries.emplace_back(kevent.timestamp, kevent.debugid, kevent.cpuid,
+                             kevent.arg1 + kevent.arg2 + kevent.arg3 + kevent.arg4 + kevent.arg5);
+    }
+  }
+  return summaries;
+}
+
+// `kperfdata_synth -n 2048 -t 16` compressed by `zstd -19` and `lz4 -9 --content-size`, opened
+// whether or not the library was built with their decompressor
+TEST(kperfdata, CompressedFixtures) {
+  constexpr long kOk = 0;
+
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.kd_buf_count = 2048;
+  options.thread_count = 16;
+  size_t size = 0;
+  char* trace = kpdecode_synth_generate(&options, &size);
+  ASSERT_TRUE(trace != NULL);
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  kpdecode_cursor_finish(cursor);
+  auto expected = ReadKevents(cursor);
+  kpdecode_cursor_free(cursor);
+  free(trace);
+  ASSERT_EQ(expected.size(), options.kd_buf_count + options.thread_count);  // and the threadmap
+
+#if defined(KPERFDATA_HAVE_ZSTD)
+  const bool have_zstd = true;
+#else
+  const bool have_zstd = false;
+#endif
+#if defined(KPERFDATA_HAVE_LZ4)
+  const bool have_lz4 = true;
+#else
+  const bool have_lz4 = false;
+#endif
+  for (const auto& fixture : {std::make_pair(TEST_DIR "synth.bin.zst", have_zstd),
+                              std::make_pair(TEST_DIR "synth.bin.lz4", have_lz4)}) {
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    long ret = kpdecode_cursor_open_file(cursor, fixture.first, 0);
+    if (!fixture.second) {
+      ASSERT_NE(ret, kOk) << fixture.first;  // a format the library was built without
+      kpdecode_cursor_free(cursor);
+      continue;
+    }
+    ASSERT_EQ(ret, kOk) << fixture.first;
+    ASSERT_TRUE(ReadKevents(cursor) == expected) << fixture.first;
+    ASSERT_TRUE(cursor->input_finished) << fixture.first;
+    kpdecode_cursor_free(cursor);
+  }
+}
+
+TEST(kperfdata, Pipeline) {
+  constexpr long kOk = 0;
+
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.thread_count = 256;
+  options.kd_buf_count = 200000;
+  size_t size = 0;
+  char* trace = kpdecode_synth_generate(&options, &size);
+  ASSERT_TRUE(trace != NULL);
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  kpdecode_cursor_finish(cursor);
+  std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  auto summarize = [](const kpdecode_record* record) -> RecordSummary {
+    return {record->flags, record->timestamp, record->tid, (uint32_t)record->cpuid,
+            record->kd_buf.debugid, record->total_size_of_kevents,
+            record->unknown_field20.unknown_field1};
+  };
+
+  // the records are returned to the pool of the cursor by the decoding thread
+  kpdecode_record_pool* pool = kpdecode_record_pool_create(0);
+  ASSERT_TRUE(pool != NULL);
+
+  // a single consumer gets the records in order
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ASSERT_EQ(kpdecode_cursor_set_record_pool(cursor, pool), kOk);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  kpdecode_pipeline* pipeline =
+      kpdecode_pipeline_start(cursor, 64, KPERFDATA_PIPELINE_SINGLE_CONSUMER);
+  ASSERT_TRUE(pipeline != NULL);
+  std::vector<RecordSummary> records;
+  kpdecode_record* batch[32];
+  size_t count = 0;
+  while (kpdecode_pipeline_pop_records(pipeline, batch, 32, &count, 1) == kOk) {
+    ASSERT_TRUE(count > 0 && count <= 32);
+    for (size_t i = 0; i < count; ++i) {
+      records.push_back(summarize(batch[i]));
+      kpdecode_pipeline_release(pipeline, batch[i]);
+    }
+  }
+  ASSERT_EQ(kpdecode_pipeline_stop(pipeline), kOk);
+  ASSERT_EQ(records.size(), expected.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_TRUE(records[i] == expected[i]) << "i=" << i;
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+
+  // several consumers get every record once
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  ASSERT_EQ(kpdecode_cursor_set_record_pool(cursor, pool), kOk);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  pipeline = kpdecode_pipeline_start(cursor, 0, 0);
+  ASSERT_TRUE(pipeline != NULL);
+  std::vector<std::vector<RecordSummary>> consumed(4);
+  std::vector<std::thread> consumers;
+  for (auto& summaries : consumed) {
+    consumers.emplace_back([pipeline, &summaries, &summarize]() {
+      kpdecode_record* record = NULL;
+      while (true) {
+        long ret = kpdecode_pipeline_pop(pipeline, &record, 0);
+        if (ret == KPERFDATA_RET_NOT_READY) {
+          std::this_thread::yield();
+          continue;
+        }
+        if (ret != KPERFDATA_RET_OK) {
+          break;
+        }
+        summaries.push_back(summarize(record));
+        kpdecode_pipeline_release(pipeline, record);
+      }
+    });
+  }
+  for (auto& consumer : consumers) {
+    consumer.join();
+  }
+  ASSERT_EQ(kpdecode_pipeline_stop(pipeline), kOk);
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+  records.clear();
+  for (const auto& summaries : consumed) {
+    records.insert(records.end(), summaries.begin(), summaries.end());
+  }
+  auto less = [](const RecordSummary& a, const RecordSummary& b) {
+    return std::make_pair(std::make_pair(a.timestamp, a.tid), a.total_size_of_kevents) <
+           std::make_pair(std::make_pair(b.timestamp, b.tid), b.total_size_of_kevents);
+  };
+  std::sort(records.begin(), records.end(), less);
+  std::sort(expected.begin(), expected.end(), less);
+  ASSERT_EQ(records.size(), expected.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_TRUE(records[i] == expected[i]) << "i=" << i;
+  }
+
+  // stopped early, with records in the ring and some still held by the consumer
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  ASSERT_EQ(kpdecode_cursor_set_record_pool(cursor, pool), kOk);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  pipeline = kpdecode_pipeline_start(cursor, 16, KPERFDATA_PIPELINE_SINGLE_CONSUMER);
+  ASSERT_TRUE(pipeline != NULL);
+  ASSERT_EQ(kpdecode_pipeline_pop_records(pipeline, batch, 32, &count, 1), kOk);
+  kpdecode_pipeline_release(pipeline, batch[0]);
+  ASSERT_EQ(kpdecode_pipeline_stop(pipeline), kOk);
+  for (size_t i = 1; i < count; ++i) {
+    kpdecode_record_free(batch[i]);
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+
+  // a failure of the decoding is returned by kpdecode_pipeline_stop()
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, 1, 1);
+  ASSERT_EQ(kpdecode_cursor_set_record_pool(cursor, pool), kOk);
+  std::atomic<int> countdown(20000);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_SUBCLASS_MASK,
+                                               KPERFDATA_DEBUGID(1, 0x40, 0, 0), FailKevent,
+                                               &countdown),
+            kOk);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  pipeline = kpdecode_pipeline_start(cursor, 0, KPERFDATA_PIPELINE_SINGLE_CONSUMER);
+  ASSERT_TRUE(pipeline != NULL);
+  size_t popped = 0;
+  while (kpdecode_pipeline_pop_records(pipeline, batch, 32, &count, 1) == kOk) {
+    for (size_t i = 0; i < count; ++i) {
+      kpdecode_pipeline_release(pipeline, batch[i]);
+    }
+    popped += count;
+  }
+  ASSERT_EQ(kpdecode_pipeline_stop(pipeline), KPERFDATA_RET_OOM);
+  ASSERT_TRUE(popped > 0 && popped < expected.size());
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+
+  // the slim records are views into the chunks of the cursor
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+  ASSERT_TRUE(kpdecode_pipeline_start(cursor, 0, 0) == NULL);
+  kpdecode_cursor_free(cursor);
+
+  ASSERT_TRUE(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_HITS) > 0);
+  kpdecode_record_pool_free(pool);
+  free(trace);
+}
+
+static long CountKevent(kpdecode_cursor* cursor, kpdecode_cpu* cpu, kpdecode_record* record,
+                        const kd_buf* kevent, void* context) {
+  (void)cursor;
+  (void)cpu;
+  static_cast<std::atomic<uint64_t>*>(context)->fetch_add(1);
+  record->flags |= 0x1;
+  record->tid = kevent->arg5;
+  record->ready = true;
+  return 0;
+}
+
+static long IgnoreKevent(kpdecode_cursor*, kpdecode_cpu*, kpdecode_record*, const kd_buf*, void*) {
+  return 0;
+}
+
+TEST(kperfdata, KeventHandlers) {
+  constexpr long kOk = 0;
+  const uint32_t sched_event = KPERFDATA_DEBUGID(1, 0x40, 0, 0);  // the MACH_SCHED of the synth
+
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.thread_count = 64;
+  options.kd_buf_count = 100000;
+  size_t size = 0;
+  char* trace = kpdecode_synth_generate(&options, &size);
+  ASSERT_TRUE(trace != NULL);
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  uint64_t sched_count = 0;
+  const kd_buf* kevents = NULL;
+  size_t count = 0;
+  while (kpdecode_cursor_next_kevents(cursor, &kevents, SIZE_MAX, &count) == kOk) {
+    for (size_t i = 0; i < count; ++i) {
+      sched_count += kevents[i].debugid == sched_event;
+    }
+  }
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(sched_count > 0);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  std::vector<RecordSummary> expected = DecodeRecordSummaries(cursor);
+  kpdecode_cursor_free(cursor);
+  size_t sample_count = expected.size();
+  ASSERT_TRUE(sample_count > 0);
+
+  // the mask must cover the class
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  std::atomic<uint64_t> handled(0);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, 0, sched_event, CountKevent, &handled),
+            KPERFDATA_RET_FAIL);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_MASK, sched_event, NULL,
+                                               NULL),
+            KPERFDATA_RET_FAIL);
+  ASSERT_TRUE(cursor->dispatch == NULL);
+
+  // a new debugid, next to the built-in ones, sequential and parallel
+  for (int thread_count : {-1, 1, 3, 0}) {
+    handled = 0;
+    ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_CODE_MASK, sched_event,
+                                                 CountKevent, &handled),
+              kOk);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    if (thread_count >= 0) {
+      ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, thread_count), kOk);
+    }
+    std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+    ASSERT_EQ(handled.load(), sched_count) << "thread_count=" << thread_count;
+    size_t handled_records = 0;
+    size_t samples = 0;
+    for (const auto& record : records) {
+      handled_records += (record.flags & ~0x0000000000020000ULL) == 0x1;
+      samples += (record.flags & KPERFDATA_RECORD_FLAG_SAMPLE) != 0;
+    }
+    // the records behind a sample never ended are still pending
+    ASSERT_TRUE(handled_records <= sched_count);
+    ASSERT_TRUE(handled_records + cursor->kpdecode_record_count >= sched_count);
+    ASSERT_EQ(samples, sample_count);
+    kpdecode_cursor_free(cursor);
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+  }
+
+  // the last handler added wins, over the built-in one too
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_CLASS_MASK,
+                                               KPERFDATA_DEBUGID(1, 0, 0, 0), CountKevent,
+                                               &handled),
+            kOk);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_MASK, sched_event,
+                                               IgnoreKevent, NULL),
+            kOk);
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_SUBCLASS_MASK,
+                                               KPERFDATA_DEBUGID(KPERFDATA_DBG_PERF,
+                                                                 KPERFDATA_PERF_CALLSTACK, 0, 0),
+                                               IgnoreKevent, NULL),
+            kOk);
+  handled = 0;
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  ASSERT_EQ(DecodeRecordSummaries(cursor).size(), sample_count);
+  ASSERT_EQ(handled.load(), 0u);
+  kpdecode_cursor_clearchunk(cursor);
+
+  // but the kevents delimiting the samples, by debugid or by a wider mask
+  for (uint32_t debugid : {KPERFDATA_PERF_GEN_EVENT_START, KPERFDATA_PERF_GEN_EVENT_END,
+                           KPERFDATA_TRACE_LOST_EVENTS}) {
+    ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_MASK, debugid,
+                                                 IgnoreKevent, NULL),
+              KPERFDATA_RET_FAIL);
+    ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_CLASS_MASK, debugid,
+                                                 IgnoreKevent, NULL),
+              KPERFDATA_RET_FAIL);
+  }
+  ASSERT_EQ(kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_SUBCLASS_MASK,
+                                               KPERFDATA_PERF_GEN_EVENT_START, IgnoreKevent, NULL),
+            KPERFDATA_RET_FAIL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  ASSERT_EQ(DecodeRecordSummaries(cursor).size(), sample_count);
+  kpdecode_cursor_clearchunk(cursor);
+
+  // back to the built-in handlers
+  kpdecode_cursor_clear_kevent_handlers(cursor);
+  ASSERT_TRUE(cursor->dispatch == NULL);
+  kpdecode_cursor_free(cursor);
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_add_kevent_handler(cursor, KPERFDATA_DEBUGID_MASK, sched_event, IgnoreKevent,
+                                     NULL);
+  kpdecode_cursor_clear_kevent_handlers(cursor);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  ASSERT_EQ(DecodeRecordSummaries(cursor).size(), sample_count);
+  kpdecode_cursor_free(cursor);
+
+  // a lost events kevent outside of the samples is returned as a record, not leaked
+  kd_buf_64* kd_bufs = (kd_buf_64*)(trace + size - options.kd_buf_count * sizeof(kd_buf_64));
+  for (uint32_t i = 0; i < options.kd_buf_count; ++i) {
+    if (kd_bufs[i].debugid == sched_event) {
+      kd_bufs[i].debugid = KPERFDATA_TRACE_LOST_EVENTS;
+      break;
+    }
+  }
+  kpdecode_record_pool* pool = kpdecode_record_pool_create(0);
+  ASSERT_TRUE(pool != NULL);
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  ASSERT_EQ(kpdecode_cursor_set_record_pool(cursor, pool), kOk);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  std::vector<RecordSummary> records = DecodeRecordSummaries(cursor);
+  ASSERT_EQ(records.size(), sample_count + 1);
+  ASSERT_EQ(std::count_if(records.begin(), records.end(),
+                          [](const RecordSummary& record) {
+                            return (record.flags & 0x0000000000010003) == 0x0000000000010003;
+                          }),
+            1);
+  kpdecode_cursor_free(cursor);
+  ASSERT_EQ(kpdecode_record_pool_get_stats(pool, KPERFDATA_POOL_STATS_LIVE), 0);
+  kpdecode_record_pool_free(pool);
+
+  free(trace);
+}
+
+TEST(kperfdata, Callstacks) {
+  constexpr long kOk = 0;
+
+  for (uint32_t callstack_frames : {1u, 7u, 8u, 300u}) {
+    kpdecode_synth_options options;
+    kpdecode_synth_default_options(&options);
+    options.thread_count = 64;
+    options.kd_buf_count = 100000;
+    options.callstack_frames = callstack_frames;
+    size_t size = 0;
+    char* trace = kpdecode_synth_generate(&options, &size);
+    ASSERT_TRUE(trace != NULL);
+    uint32_t nframes = std::min(callstack_frames, (uint32_t)KPERFDATA_MAX_CALLSTACK_FRAMES);
+
+    // every sample gets its whole callstacks, the frames past frames[] are dropped
+    kpdecode_cursor* cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    std::vector<Callstacks> expected;
+    while (true) {
+      kpdecode_record* record = NULL;
+      long ret = kpdecode_cursor_next_record(cursor, &record);
+      if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+        continue;
+      }
+      if (ret != kOk) {
+        break;
+      }
+      ASSERT_TRUE(record->flags & KPERFDATA_RECORD_FLAG_SAMPLE);
+      ASSERT_EQ(record->kcallstack.flags, 0x1u);
+      ASSERT_EQ(record->ucallstack.flags, 0x1u);
+      ASSERT_EQ(record->kcallstack.nframes, nframes);
+      ASSERT_EQ(record->ucallstack.nframes, nframes);
+      ASSERT_EQ(record->xcallstack_hdr.callstack_nframes, callstack_frames);
+      for (uint32_t i = 0; i < nframes; ++i) {
+        ASSERT_EQ(record->kcallstack.frames[i], KPERFDATA_SYNTH_KERNEL_FRAME(record->tid, i));
+        ASSERT_EQ(record->ucallstack.frames[i], KPERFDATA_SYNTH_USER_FRAME(record->tid, i));
+      }
+      expected.push_back(
+          {CallstackFrames(record->ucallstack), CallstackFrames(record->kcallstack)});
+      kpdecode_record_free(record);
+    }
+    kpdecode_cursor_free(cursor);
+    ASSERT_TRUE(expected.size() > 0);
+
+    // the samples straddling two shards get the frames decoded by the next shard
+    for (int thread_count : {2, 7}) {
+      cursor = kpdecode_cursor_create();
+      ASSERT_TRUE(cursor != NULL);
+      kpdecode_cursor_setchunk(cursor, trace, size);
+      ASSERT_EQ(kpdecode_cursor_decode_parallel(cursor, thread_count), kOk);
+      std::vector<Callstacks> callstacks;
+      kpdecode_record* record = NULL;
+      while (kpdecode_cursor_next_record(cursor, &record) == kOk && record != NULL) {
+        callstacks.push_back(
+            {CallstackFrames(record->ucallstack), CallstackFrames(record->kcallstack)});
+        kpdecode_record_free(record);
+      }
+      ASSERT_TRUE(callstacks == expected) << "callstack_frames=" << callstack_frames
+                                          << " thread_count=" << thread_count;
+      kpdecode_cursor_free(cursor);
+    }
+
+    // the slim records copy the frames out once the sample is complete
+    cursor = kpdecode_cursor_create();
+    ASSERT_TRUE(cursor != NULL);
+    kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, 1);
+    kpdecode_cursor_setchunk(cursor, trace, size);
+    size_t index = 0;
+    kpdecode_slim_record* slim = NULL;
+    while (kpdecode_cursor_next_slim_record(cursor, &slim) == kOk && slim != NULL) {
+      ASSERT_TRUE(index < expected.size());
+      std::vector<uint64_t> uframes(slim->ucallstack_frames,
+                                    slim->ucallstack_frames + slim->ucallstack_nframes);
+      std::vector<uint64_t> kframes(slim->kcallstack_frames,
+                                    slim->kcallstack_frames + slim->kcallstack_nframes);
+      ASSERT_TRUE(uframes == expected[index].first && kframes == expected[index].second);
+      kpdecode_slim_record_free(slim);
+      index += 1;
+    }
+    ASSERT_EQ(index, expected.size());
+    kpdecode_cursor_free(cursor);
+
+    free(trace);
+  }
+}
+
+// The records and callstacks of the samples decoded from a cursor, until it needs more chunks
+static void DecodeSamples(kpdecode_cursor* cursor, std::vector<RecordSummary>* summaries,
+                          std::vector<Callstacks>* callstacks) {
+  while (true) {
+    kpdecode_record* record = NULL;
+    long ret = kpdecode_cursor_next_record(cursor, &record);
+    if (ret == KPERFDATA_RET_SAMPLE_PENDING) {
+      continue;
+    }
+    if (ret != 0 || record == NULL) {
+      break;
+    }
+    summaries->push_back({record->flags, record->timestamp, record->tid, (uint32_t)record->cpuid,
+                          record->kd_buf.debugid, record->total_size_of_kevents,
+                          record->unknown_field20.unknown_field1});
+    callstacks->push_back(
+        {CallstackFrames(record->ucallstack), CallstackFrames(record->kcallstack)});
+    kpdecode_record_free(record);
+  }
+}
+
+TEST(kperfdata, ChunkLifetime) {
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  options.thread_count = 64;
+  options.kd_buf_count = 100000;
+  options.callstack_frames = 16;
+  size_t size = 0;
+  char* trace = kpdecode_synth_generate(&options, &size);
+  ASSERT_TRUE(trace != NULL);
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  std::vector<RecordSummary> expected;
+  std::vector<Callstacks> expected_callstacks;
+  DecodeSamples(cursor, &expected, &expected_callstacks);
+  kpdecode_cursor_free(cursor);
+  ASSERT_TRUE(expected.size() > 0);
+
+  // the chunks are released as soon as they are popped, while the samples straddling them are
+  // still pending: the samples keep copies of their kevents
+  const size_t chunk_sizes[] = {777, 64, 4093, 1, 12345};
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  std::vector<RecordSummary> records;
+  std::vector<Callstacks> callstacks;
+  size_t offset = 0;
+  for (size_t i = 0; offset < size; ++i) {
+    size_t chunk_size = std::min(chunk_sizes[i % (sizeof(chunk_sizes) / sizeof(size_t))],
+                                 size - offset);
+    char* chunk = (char*)malloc(chunk_size);
+    ASSERT_TRUE(chunk != NULL);
+    memcpy(chunk, trace + offset, chunk_size);
+    ASSERT_EQ(kpdecode_cursor_setchunk(cursor, chunk, chunk_size), 0);
+    offset += chunk_size;
+    DecodeSamples(cursor, &records, &callstacks);
+    char* consumed_chunk = NULL;
+    while ((consumed_chunk = kpdecode_cursor_popchunk(cursor)) != NULL) {
+      free(consumed_chunk);
+    }
+  }
+  ASSERT_TRUE(records == expected);
+  ASSERT_TRUE(callstacks == expected_callstacks);
+  free(kpdecode_cursor_clearchunk(cursor));  // the last chunk, if not fully decoded
+  kpdecode_cursor_free(cursor);
+
+  // the callers which never queue a chunk get it back from kpdecode_cursor_clearchunk() as before,
+  // once, whether it is fully decoded or not
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  records.clear();
+  callstacks.clear();
+  DecodeSamples(cursor, &records, &callstacks);
+  ASSERT_TRUE(records == expected);
+  ASSERT_EQ(kpdecode_cursor_clearchunk(cursor), trace);
+  ASSERT_TRUE(kpdecode_cursor_clearchunk(cursor) == NULL);
+  ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);
+  kpdecode_cursor_free(cursor);
+
+  cursor = kpdecode_cursor_create();
+  ASSERT_TRUE(cursor != NULL);
+  kpdecode_cursor_setchunk(cursor, trace, size);
+  kpdecode_record* record = NULL;
+  ASSERT_EQ(kpdecode_cursor_next_record(cursor, &record), 0);
+  ASSERT_TRUE(record != NULL);
+  kpdecode_record_free(record);
+  ASSERT_EQ(kpdecode_cursor_clearchunk(cursor), trace);
+  ASSERT_TRUE(kpdecode_cursor_clearchunk(cursor) == NULL);
+  ASSERT_TRUE(kpdecode_cursor_popchunk(cursor) == NULL);
+  record = NULL;
+  ASSERT_EQ(kpdecode_cursor_next_record(cursor, &record), KPERFDATA_RET_NOT_READY);
+  ASSERT_TRUE(record == NULL);
+  kpdecode_cursor_free(cursor);
+
+  free(trace);
 }
@@ -0,0 +1,75 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// kperfdata2parquet: convert the records of a RAW file to a Parquet file
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h>  // strtoull
+#include <string.h>  // strcmp
+
+#include "kperfdata/kperfdata.h"
+#include "kperfdata/kperfdata_parquet.h"
+
+static int usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s [-a] [-s] [-r row_group_size] input.bin output.parquet\n"
+          "  -a  all the kevents as records (option 1)\n"
+          "  -s  slim records\n"
+          "  -r  the records of each row group, %d by default\n",
+          program, KPERFDATA_PARQUET_ROW_GROUP_SIZE);
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  int all_kevents = 0;
+  int slim = 0;
+  size_t row_group_size = 0;
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-a") == 0) {
+      all_kevents = 1;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      slim = 1;
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      row_group_size = (size_t)strtoull(argv[++i], NULL, 10);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (argc - i != 2) {
+    return usage(argv[0]);
+  }
+
+  kpdecode_cursor* cursor = kpdecode_cursor_create();
+  if (!cursor) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  kpdecode_cursor_set_option(cursor, 1, all_kevents);
+  kpdecode_cursor_set_option(cursor, KPERFDATA_OPTION_SLIM_RECORDS, slim);
+  if (kpdecode_cursor_open_file(cursor, argv[i], 0) != KPERFDATA_RET_OK) {
+    fprintf(stderr, "can not open %s\n", argv[i]);
+    kpdecode_cursor_free(cursor);
+    return 1;
+  }
+  uint64_t row_count = 0;
+  long ret = kpdecode_cursor_write_parquet(cursor, argv[i + 1], row_group_size, &row_count);
+  kpdecode_cursor_free(cursor);
+  if (ret != KPERFDATA_RET_OK) {
+    fprintf(stderr, "can not write %s: %ld\n", argv[i + 1], ret);
+    return 1;
+  }
+  printf("%llu records written to %s\n", (unsigned long long)row_count, argv[i + 1]);
+  return 0;
+}
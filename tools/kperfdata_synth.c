@@ -0,0 +1,78 @@
+// Copyright 2022 liudingsan
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//    http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// kperfdata_synth: write a synthetic RAW file, of any size, for benchmarks
+
+#include <stdio.h>  // fprintf
+#include <stdlib.h>  // strtoull
+#include <string.h>  // strcmp
+
+#include "kperfdata/kperfdata.h"
+#include "kperfdata/kperfdata_synth.h"
+
+static int usage(const char* program) {
+  fprintf(stderr,
+          "usage: %s [-1] [-32] [-n kd_buf_count] [-t thread_count] [-c cpu_count]\n"
+          "          [-p sample_percent] [-k sample_kevents] [-f callstack_frames] [-s seed]\n"
+          "          output.bin\n"
+          "  -1   a version 1 header, 64-bit\n"
+          "  -32  a version 2 header, 32-bit\n"
+          "  -n   the number of kevents, 1048576 by default, 16777216 per GB in 64-bit\n"
+          "  -t   the number of threads in the kd_threadmap[], 256 by default\n"
+          "  -c   the number of cpus, 8 by default\n"
+          "  -p   the percentage of the kevents in samples, 50 by default\n"
+          "  -k   the kperf kevents of each sample, 6 by default\n"
+          "  -f   the frames of the kernel and user callstacks of each sample, 0 by default\n"
+          "  -s   the seed, 1 by default\n",
+          program);
+  return 2;
+}
+
+int main(int argc, char** argv) {
+  kpdecode_synth_options options;
+  kpdecode_synth_default_options(&options);
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; ++i) {
+    if (strcmp(argv[i], "-1") == 0) {
+      options.version = 1;
+    } else if (strcmp(argv[i], "-32") == 0) {
+      options.version = 2;
+      options.is64bit = 0;
+    } else if (i + 1 < argc && strlen(argv[i]) == 2 && strchr("ntcpkfs", argv[i][1])) {
+      unsigned long long value = strtoull(argv[++i], NULL, 10);
+      switch (argv[i - 1][1]) {
+        case 'n': options.kd_buf_count = value; break;
+        case 't': options.thread_count = (uint32_t)value; break;
+        case 'c': options.cpu_count = (uint32_t)value; break;
+        case 'p': options.sample_percent = (uint32_t)value; break;
+        case 'k': options.sample_kevents = (uint32_t)value; break;
+        case 'f': options.callstack_frames = (uint32_t)value; break;
+        default: options.seed = value; break;
+      }
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (argc - i != 1) {
+    return usage(argv[0]);
+  }
+
+  long ret = kpdecode_synth_write_file(&options, argv[i]);
+  if (ret != KPERFDATA_RET_OK) {
+    fprintf(stderr, "can not write %s: %ld\n", argv[i], ret);
+    return 1;
+  }
+  printf("%llu kevents written to %s\n", (unsigned long long)options.kd_buf_count, argv[i]);
+  return 0;
+}